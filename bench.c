@@ -0,0 +1,1547 @@
+/**
+ * Microbenchmarks für vfs.c.
+ *
+ * Übersetzen mit
+ *
+ *   gcc -std=c99 -O2 -pthread -o bench bench.c
+ *
+ * und dann z.B. mit ./bench lookup aufrufen.
+ */
+#define main vfs_main
+#include "vfs.c"
+#undef main
+
+#include <time.h>
+
+/**
+ * Gibt die bisher vom Prozess verbrauchte CPU-Zeit in Sekunden zurück.
+ */
+double bench_cpu () {
+  struct timespec now;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/**
+ * Gibt die aktuelle Zeit in Sekunden zurück.
+ */
+double bench_now () {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/**
+ * Misst, wie lange ein Nachschlagen eines Dateinamens bei wachsender Anzahl von
+ * Dateien dauert. Die Zeit pro Nachschlagen sollte dabei konstant bleiben.
+ */
+int bench_lookup () {
+  const uint64_t num_lookups = 1000000;
+  uint64_t sizes[] = { 1000, 10000, 100000, 1000000 };
+
+  /* Die Namen werden vorher erzeugt, damit nur die Suche gemessen wird */
+  char (*hits)[32] = malloc(num_lookups * sizeof(*hits));
+  char (*misses)[32] = malloc(num_lookups * sizeof(*misses));
+
+  printf("%10s %16s %16s\n", "Dateien", "ns/Treffer", "ns/Fehlschlag");
+
+  uint64_t j;
+  for (j = 0; j < num_lookups; j++) {
+    sprintf(misses[j], "fehlt-%lu", j);
+  }
+
+  unsigned int i;
+  for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    struct ArchiveInfo* archive_info = archiveinfo_create();
+    archiveinfo_initialize_empty(archive_info, 1, 1);
+
+    for (j = 0; j < sizes[i]; j++) {
+      sprintf(hits[j], "datei-%lu", j);
+      archiveinfo_add_file(archive_info, hits[j], 0, NULL, 0);
+    }
+
+    for (j = 0; j < num_lookups; j++) {
+      sprintf(hits[j], "datei-%lu", (j * 7919) % sizes[i]);
+    }
+
+    uint64_t found = 0;
+    double start = bench_now();
+    for (j = 0; j < num_lookups; j++) {
+      found += archiveinfo_has_file(archive_info, hits[j]);
+    }
+    double hit = (bench_now() - start) / num_lookups * 1e9;
+
+    start = bench_now();
+    for (j = 0; j < num_lookups; j++) {
+      found += archiveinfo_has_file(archive_info, misses[j]);
+    }
+    double miss = (bench_now() - start) / num_lookups * 1e9;
+
+    if (found != num_lookups) {
+      printf("Falsche Anzahl an Treffern: %lu\n", found);
+      return 1;
+    }
+
+    printf("%10lu %16.1f %16.1f\n", sizes[i], hit, miss);
+
+    archiveinfo_free(archive_info);
+  }
+
+  free(hits);
+  free(misses);
+
+  return 0;
+}
+
+/**
+ * Misst, wie lange das Öffnen eines Archivs mit vielen Dateien dauert, wenn
+ * danach nur die freien Bytes abgefragt oder eine einzelne Datei gesucht wird.
+ */
+int bench_open () {
+  uint64_t sizes[] = { 10000, 100000, 1000000 };
+  const char* path = "./bench-open.structure";
+  char name[32];
+
+  printf("%10s %16s %16s\n", "Dateien", "ms/free", "ms/Suche");
+
+  unsigned int i;
+  for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    struct ArchiveInfo* archive_info = archiveinfo_create();
+    archiveinfo_initialize_empty(archive_info, 1, sizes[i]);
+
+    uint64_t j;
+    for (j = 0; j < sizes[i]; j++) {
+      struct Extent extent = { j, 1 };
+
+      sprintf(name, "datei-%lu", j);
+      archiveinfo_add_file(archive_info, name, 1, &extent, 1);
+    }
+
+    FILE* file = fopen(path, "w");
+    archiveinfo_write(archive_info, file);
+    fclose(file);
+    archiveinfo_free(archive_info);
+
+    uint64_t free_blocks = 0;
+    double start = bench_now();
+    file = fopen(path, "r");
+    archive_info = archiveinfo_create();
+    archiveinfo_initialize_from_file(archive_info, file);
+    fclose(file);
+    free_blocks += archiveinfo_num_free_blocks(archive_info);
+    archiveinfo_free(archive_info);
+    double free_time = (bench_now() - start) * 1e3;
+
+    start = bench_now();
+    file = fopen(path, "r");
+    archive_info = archiveinfo_create();
+    archiveinfo_initialize_from_file(archive_info, file);
+    fclose(file);
+    sprintf(name, "datei-%lu", sizes[i] / 2);
+    struct FileInfo* file_info = archiveinfo_get_file(archive_info, name);
+    double lookup_time = (bench_now() - start) * 1e3;
+
+    if (free_blocks != 0 || file_info == NULL || file_info->size != 1) {
+      printf("Das Archiv wurde falsch geladen\n");
+      return 1;
+    }
+
+    archiveinfo_free(archive_info);
+
+    printf("%10lu %16.2f %16.2f\n", sizes[i], free_time, lookup_time);
+  }
+
+  remove(path);
+
+  return 0;
+}
+
+/**
+ * Defragmentiert ein Archiv, in dem die Blöcke der Dateien reihum verteilt
+ * sind und jede zweite Datei gelöscht wurde, und vergleicht die bewegten
+ * Bytes mit dem früheren Tauschen benachbarter Blöcke.
+ */
+int bench_defrag () {
+  const uint64_t blocksize = 4096;
+  const uint64_t blockcount = 16384;
+  const uint64_t num_files = 512;
+  const char* path = "./bench-defrag";
+  char name[32];
+
+  struct Archive* archive = archive_create();
+  archive_initialize_empty(archive, path, blocksize, blockcount);
+
+  uint64_t blocks_per_file = blockcount / 2 / num_files;
+  struct Extent* extents = malloc(blocks_per_file * sizeof(struct Extent));
+
+  uint64_t i;
+  for (i = 0; i < num_files; i++) {
+    uint64_t j;
+    for (j = 0; j < blocks_per_file; j++) {
+      extents[j].start = j * num_files + i;
+      extents[j].length = 1;
+    }
+
+    sprintf(name, "datei-%lu", i);
+    archiveinfo_add_file(archive->archive_info, name, blocks_per_file * blocksize, extents, blocks_per_file);
+  }
+
+  for (i = 0; i < num_files; i += 2) {
+    sprintf(name, "datei-%lu", i);
+    archiveinfo_delete_file(archive->archive_info, name);
+  }
+
+  free(extents);
+
+  struct DefragBudget budget = { 0, 0 };
+  struct DefragReport report;
+  double start = bench_now();
+  int status = archive_defrag(archive, &budget, &report);
+  double seconds = bench_now() - start;
+
+  archive_free(archive);
+
+  sprintf(name, "%s.structure", path);
+  remove(name);
+  sprintf(name, "%s.store", path);
+  remove(name);
+  sprintf(name, "%s.journal", path);
+  remove(name);
+
+  if (status != 0) {
+    printf("Das Defragmentieren ist fehlgeschlagen\n");
+    return 1;
+  }
+
+  printf("%16s %16s %16s\n", "MiB bewegt", "MiB vorher", "Sekunden");
+  printf("%16.1f %16.1f %16.3f\n", report.moved_bytes / 1048576.0, report.swap_bytes / 1048576.0, seconds);
+
+  return 0;
+}
+
+/**
+ * Liest eine Datei wie früher archive_get_file: für jeden Block ein fseek, ein
+ * fread und ein fwrite über stdio.
+ */
+int bench_read_per_block (struct Archive* archive, struct FileInfo* file_info, FILE* output) {
+  uint64_t blocksize = archive->archive_info->blocksize;
+  FILE* store = fopen(archive->store_file, "r");
+  char buffer[blocksize];
+  uint64_t bytes_left = file_info->size;
+  int status = 0;
+
+  uint64_t i;
+  for (i = 0; i < file_info->num_extents && status == 0; i++) {
+    uint64_t j;
+    for (j = 0; j < file_info->extents[i].length && bytes_left > 0 && status == 0; j++) {
+      uint64_t chunk_size = bytes_left > blocksize ? blocksize : bytes_left;
+      bytes_left -= chunk_size;
+
+      fseek(store, (file_info->extents[i].start + j) * blocksize, SEEK_SET);
+
+      if (file_read(buffer, 1, chunk_size, store) != 0 || file_write(buffer, 1, chunk_size, output) != 0) {
+        status = 1;
+      }
+    }
+  }
+
+  fclose(store);
+
+  return status;
+}
+
+/**
+ * Vergleicht den Durchsatz beim Lesen einer zusammenhängenden und einer
+ * fragmentierten Datei von je 128 MiB mit 4 KiB großen Blöcken zwischen dem
+ * früheren Lesen pro Block und archive_read_file mit verschiedenen io_size.
+ * Gemessen wird einmal, nachdem der Store aus dem Page Cache geworfen wurde,
+ * und einmal direkt danach aus dem Cache. Geschrieben wird nach /dev/null.
+ */
+int bench_get () {
+  const uint64_t blocksize = 4096;
+  const uint64_t blocks_per_file = 32768;
+  const char* path = "./bench-get";
+  uint64_t io_sizes[] = { 0, 65536, 1048576, 8388608 };
+  char name[32];
+
+  struct Archive* archive = archive_create();
+  archive_initialize_empty(archive, path, blocksize, 2 * blocks_per_file);
+  archive_open_store(archive);
+
+  struct Extent contiguous = { 0, blocks_per_file };
+  struct Extent* fragmented = malloc(blocks_per_file / 2 * sizeof(struct Extent));
+
+  uint64_t i;
+  for (i = 0; i < blocks_per_file / 2; i++) {
+    fragmented[i].start = blocks_per_file + (i * 7919) % (blocks_per_file / 2) * 2;
+    fragmented[i].length = 2;
+  }
+
+  archiveinfo_add_file(archive->archive_info, "zusammenhaengend", blocks_per_file * blocksize, &contiguous, 1);
+  archiveinfo_add_file(archive->archive_info, "fragmentiert", blocks_per_file * blocksize, fragmented, blocks_per_file / 2);
+  free(fragmented);
+
+  char* data = malloc(DEFRAG_BUFFER_SIZE);
+  memset(data, 'x', DEFRAG_BUFFER_SIZE);
+
+  for (i = 0; i < 2 * blocks_per_file * blocksize; i += DEFRAG_BUFFER_SIZE) {
+    if (pwrite(archive->store_fd, data, DEFRAG_BUFFER_SIZE, i) != DEFRAG_BUFFER_SIZE) {
+      printf("Der Store konnte nicht geschrieben werden\n");
+      return 1;
+    }
+  }
+
+  free(data);
+  fsync(archive->store_fd);
+
+  printf("%18s %12s %12s %12s %12s\n", "MiB/s", "kalt zus.", "kalt frag.", "warm zus.", "warm frag.");
+
+  unsigned int j;
+  for (j = 0; j < sizeof(io_sizes) / sizeof(io_sizes[0]); j++) {
+    double throughput[4];
+    const char* names[] = { "zusammenhaengend", "fragmentiert" };
+
+    unsigned int k;
+    for (k = 0; k < 4; k++) {
+      struct FileInfo* file_info = archiveinfo_get_file(archive->archive_info, names[k % 2]);
+      FILE* output = fopen("/dev/null", "w");
+
+      if (k < 2) {
+        posix_fadvise(archive->store_fd, 0, 0, POSIX_FADV_DONTNEED);
+      }
+
+      archive->io_size = io_sizes[j];
+
+      double start = bench_now();
+      int status = io_sizes[j] == 0 ? bench_read_per_block(archive, file_info, output) : archive_read_file(archive, file_info, output);
+      fflush(output);
+      throughput[k] = file_info->size / 1048576.0 / (bench_now() - start);
+
+      fclose(output);
+
+      if (status != 0) {
+        printf("Das Lesen ist fehlgeschlagen\n");
+        return 1;
+      }
+    }
+
+    if (io_sizes[j] == 0) {
+      sprintf(name, "pro Block");
+    } else {
+      sprintf(name, "io_size %lu KiB", io_sizes[j] / 1024);
+    }
+
+    printf("%18s %12.1f %12.1f %12.1f %12.1f\n", name, throughput[0], throughput[1], throughput[2], throughput[3]);
+  }
+
+  archive_free(archive);
+
+  sprintf(name, "%s.structure", path);
+  remove(name);
+  sprintf(name, "%s.store", path);
+  remove(name);
+  sprintf(name, "%s.journal", path);
+  remove(name);
+
+  return 0;
+}
+
+/**
+ * Schreibt eine Datei wie früher archive_write_file_to_blocks: für jeden Block
+ * ein fread aus der Quelle und ein fseek und fwrite im Store.
+ */
+int bench_write_per_block (struct Archive* archive, FILE* source, uint64_t bytes, struct Extent* extents, uint64_t num_extents) {
+  uint64_t blocksize = archive->archive_info->blocksize;
+  FILE* store = fopen(archive->store_file, "r+");
+  char buffer[blocksize];
+  int status = 0;
+
+  uint64_t i;
+  for (i = 0; i < num_extents && status == 0; i++) {
+    uint64_t j;
+    for (j = 0; j < extents[i].length && status == 0; j++) {
+      uint64_t chunk_size = bytes > blocksize ? blocksize : bytes;
+      bytes -= chunk_size;
+
+      fseek(store, (extents[i].start + j) * blocksize, SEEK_SET);
+
+      if (file_read(buffer, 1, chunk_size, source) != 0 || file_write(buffer, 1, chunk_size, store) != 0) {
+        status = 1;
+      }
+    }
+  }
+
+  if (fflush(store) != 0 || fdatasync(fileno(store)) != 0) {
+    status = 1;
+  }
+
+  fclose(store);
+
+  return status;
+}
+
+/**
+ * Vergleicht den Durchsatz beim Hinzufügen einer Datei mit 128 MiB in 4 KiB
+ * große Blöcke zwischen dem früheren Schreiben pro Block und der Pipeline mit
+ * verschiedenen io_size. Die Quelle wird vorher aus dem Page Cache geworfen,
+ * gemessen wird bis die Daten im Store auf der Platte sind.
+ */
+int bench_add () {
+  const uint64_t blocksize = 4096;
+  const uint64_t num_blocks = 32768;
+  const char* path = "./bench-add";
+  const char* source_path = "./bench-add.source";
+  uint64_t io_sizes[] = { 0, 65536, 1048576, 8388608 };
+  char name[32];
+
+  FILE* source = fopen(source_path, "w");
+  char* data = malloc(DEFRAG_BUFFER_SIZE);
+  memset(data, 'x', DEFRAG_BUFFER_SIZE);
+
+  uint64_t i;
+  for (i = 0; i < num_blocks * blocksize; i += DEFRAG_BUFFER_SIZE) {
+    fwrite(data, 1, DEFRAG_BUFFER_SIZE, source);
+  }
+
+  free(data);
+  fflush(source);
+  fsync(fileno(source));
+  fclose(source);
+
+  struct Archive* archive = archive_create();
+  archive_initialize_empty(archive, path, blocksize, 2 * num_blocks);
+  archive_open_store(archive);
+
+  struct Extent contiguous = { 0, num_blocks };
+  struct Extent* fragmented = malloc(num_blocks / 2 * sizeof(struct Extent));
+
+  for (i = 0; i < num_blocks / 2; i++) {
+    fragmented[i].start = num_blocks + (i * 7919) % (num_blocks / 2) * 2;
+    fragmented[i].length = 2;
+  }
+
+  printf("%18s %12s %12s\n", "MiB/s", "zus.", "frag.");
+
+  unsigned int j;
+  for (j = 0; j < sizeof(io_sizes) / sizeof(io_sizes[0]); j++) {
+    double throughput[2];
+
+    unsigned int k;
+    for (k = 0; k < 2; k++) {
+      struct Extent* extents = k == 0 ? &contiguous : fragmented;
+      uint64_t num_extents = k == 0 ? 1 : num_blocks / 2;
+      int status;
+
+      source = fopen(source_path, "r");
+      posix_fadvise(fileno(source), 0, 0, POSIX_FADV_DONTNEED);
+      archive->io_size = io_sizes[j];
+
+      double start = bench_now();
+
+      if (io_sizes[j] == 0) {
+        status = bench_write_per_block(archive, source, num_blocks * blocksize, extents, num_extents);
+      } else {
+        status = archive_write_file_to_blocks(archive, source, num_blocks * blocksize, extents, num_extents);
+        status == 0 && (status = fdatasync(archive->store_fd));
+      }
+
+      throughput[k] = num_blocks * blocksize / 1048576.0 / (bench_now() - start);
+
+      fclose(source);
+
+      if (status != 0) {
+        printf("Das Schreiben ist fehlgeschlagen\n");
+        return 1;
+      }
+    }
+
+    if (io_sizes[j] == 0) {
+      sprintf(name, "pro Block");
+    } else {
+      sprintf(name, "io_size %lu KiB", io_sizes[j] / 1024);
+    }
+
+    printf("%18s %12.1f %12.1f\n", name, throughput[0], throughput[1]);
+  }
+
+  free(fragmented);
+  archive_free(archive);
+
+  remove(source_path);
+  sprintf(name, "%s.structure", path);
+  remove(name);
+  sprintf(name, "%s.store", path);
+  remove(name);
+  sprintf(name, "%s.journal", path);
+  remove(name);
+
+  return 0;
+}
+
+/**
+ * Vergleicht die CPU-Zeit pro GiB beim Lesen in eine Datei, beim Lesen nach
+ * /dev/null und beim Hinzufügen einer zusammenhängenden Datei mit 256 MiB,
+ * einmal über Puffer und einmal im Kernel kopiert. Alle Daten liegen dabei im
+ * Page Cache.
+ */
+int bench_copy () {
+  const uint64_t blocksize = 4096;
+  const uint64_t num_blocks = 65536;
+  const uint64_t size = num_blocks * blocksize;
+  const char* path = "./bench-copy";
+  const char* file_path = "./bench-copy.file";
+  char name[32];
+
+  struct Archive* archive = archive_create();
+  archive_initialize_empty(archive, path, blocksize, num_blocks);
+
+  struct Extent extent = { 0, num_blocks };
+  archiveinfo_add_file(archive->archive_info, "datei", size, &extent, 1);
+  struct FileInfo* file_info = archiveinfo_get_file(archive->archive_info, "datei");
+
+  FILE* file = fopen(file_path, "w");
+  char* data = malloc(DEFRAG_BUFFER_SIZE);
+  memset(data, 'x', DEFRAG_BUFFER_SIZE);
+
+  uint64_t i;
+  for (i = 0; i < size; i += DEFRAG_BUFFER_SIZE) {
+    fwrite(data, 1, DEFRAG_BUFFER_SIZE, file);
+  }
+
+  free(data);
+  fclose(file);
+
+  printf("%18s %12s %12s %12s\n", "CPU-s/GiB", "get Datei", "get null", "add");
+
+  int zero_copy;
+  for (zero_copy = 0; zero_copy < 2; zero_copy++) {
+    double cpu[3];
+    int status = 0;
+
+    archive->zero_copy = zero_copy;
+
+    unsigned int k;
+    for (k = 0; k < 3; k++) {
+      file = fopen(k == 0 ? "./bench-copy.out" : k == 1 ? "/dev/null" : file_path, k == 2 ? "r" : "w");
+
+      double start = bench_cpu();
+
+      if (k < 2) {
+        status |= archive_read_file(archive, file_info, file);
+      } else {
+        status |= archive_write_file_to_blocks(archive, file, size, &extent, 1);
+      }
+
+      cpu[k] = (bench_cpu() - start) / (size / 1073741824.0);
+
+      fclose(file);
+    }
+
+    if (status != 0) {
+      printf("Das Kopieren ist fehlgeschlagen\n");
+      return 1;
+    }
+
+    printf("%18s %12.3f %12.3f %12.3f\n", zero_copy ? "im Kernel" : "über Puffer", cpu[0], cpu[1], cpu[2]);
+  }
+
+  archive_free(archive);
+
+  remove(file_path);
+  remove("./bench-copy.out");
+  sprintf(name, "%s.structure", path);
+  remove(name);
+  sprintf(name, "%s.store", path);
+  remove(name);
+  sprintf(name, "%s.journal", path);
+  remove(name);
+
+  return 0;
+}
+
+/**
+ * Liest eine Datei mit 64 MiB, deren 4 KiB große Blöcke zufällig im Store
+ * verteilt sind, mit kaltem Page Cache einmal blockierend und dann über
+ * io_uring mit verschiedenen Warteschlangentiefen.
+ */
+int bench_uring () {
+  const uint64_t blocksize = 4096;
+  const uint64_t blockcount = 65536;
+  const uint64_t num_blocks = 16384;
+  const char* path = "./bench-uring";
+  unsigned int depths[] = { 0, 1, 4, 16, 64 };
+  char name[32];
+
+  struct Archive* archive = archive_create();
+  archive_initialize_empty(archive, path, blocksize, blockcount);
+  archive->uring_depth = 0;
+  archive_open_store(archive);
+
+  struct Extent* extents = malloc(num_blocks * sizeof(struct Extent));
+
+  uint64_t i;
+  for (i = 0; i < num_blocks; i++) {
+    extents[i].start = (i * 40503) % blockcount;
+    extents[i].length = 1;
+  }
+
+  archiveinfo_add_file(archive->archive_info, "verteilt", num_blocks * blocksize, extents, num_blocks);
+  free(extents);
+
+  char* data = malloc(DEFRAG_BUFFER_SIZE);
+  memset(data, 'x', DEFRAG_BUFFER_SIZE);
+
+  for (i = 0; i < blockcount * blocksize; i += DEFRAG_BUFFER_SIZE) {
+    if (pwrite(archive->store_fd, data, DEFRAG_BUFFER_SIZE, i) != DEFRAG_BUFFER_SIZE) {
+      printf("Der Store konnte nicht geschrieben werden\n");
+      return 1;
+    }
+  }
+
+  free(data);
+  fsync(archive->store_fd);
+
+  struct FileInfo* file_info = archiveinfo_get_file(archive->archive_info, "verteilt");
+
+  printf("%18s %12s\n", "", "MiB/s");
+
+  unsigned int j;
+  for (j = 0; j < sizeof(depths) / sizeof(depths[0]); j++) {
+    if (archive->uring != NULL) {
+      uring_free(archive->uring);
+      archive->uring = NULL;
+    }
+
+    archive->uring_depth = depths[j];
+    archive_open_store(archive);
+
+    if (depths[j] > 0 && archive->uring == NULL) {
+      printf("io_uring ist nicht verfügbar\n");
+      break;
+    }
+
+    FILE* output = fopen("/dev/null", "w");
+    posix_fadvise(archive->store_fd, 0, 0, POSIX_FADV_DONTNEED);
+
+    double start = bench_now();
+    int status = archive_read_file(archive, file_info, output);
+    double throughput = file_info->size / 1048576.0 / (bench_now() - start);
+
+    fclose(output);
+
+    if (status != 0) {
+      printf("Das Lesen ist fehlgeschlagen\n");
+      return 1;
+    }
+
+    if (depths[j] == 0) {
+      sprintf(name, "blockierend");
+    } else {
+      sprintf(name, "io_uring, Tiefe %u", depths[j]);
+    }
+
+    printf("%18s %12.1f\n", name, throughput);
+  }
+
+  archive_free(archive);
+
+  sprintf(name, "%s.structure", path);
+  remove(name);
+  sprintf(name, "%s.store", path);
+  remove(name);
+  sprintf(name, "%s.journal", path);
+  remove(name);
+
+  return 0;
+}
+
+/**
+ * Extrahiert 5000 Dateien mit je 8 KiB bei kaltem Page Cache einmal wie mit
+ * einem Prozess pro Datei, der jedes Mal die Struktur lädt, und dann mit
+ * extract und verschiedenen Anzahlen von Threads.
+ */
+int bench_extract () {
+  const uint64_t blocksize = 4096;
+  const uint64_t num_files = 5000;
+  const char* path = "./bench-extract";
+  const char* directory = "./bench-extract.d";
+  int threads[] = { 0, 1, 4, 8 };
+  char name[64];
+  char output[128];
+
+  struct Archive* archive = archive_create();
+  archive_initialize_empty(archive, path, blocksize, num_files * 2);
+  archive_open_store(archive);
+
+  char* data = malloc(2 * blocksize);
+  memset(data, 'x', 2 * blocksize);
+
+  uint64_t i;
+  for (i = 0; i < num_files; i++) {
+    struct Extent extent = { i * 2, 2 };
+
+    sprintf(name, "datei-%lu", i);
+    archiveinfo_add_file(archive->archive_info, name, 2 * blocksize, &extent, 1);
+
+    if (pwrite(archive->store_fd, data, 2 * blocksize, i * 2 * blocksize) != (ssize_t)(2 * blocksize)) {
+      printf("Der Store konnte nicht geschrieben werden\n");
+      return 1;
+    }
+  }
+
+  free(data);
+  archive_write_archive_info(archive);
+  archive_free(archive);
+  mkdir(directory, 0777);
+
+  printf("%12s %12s\n", "", "Dateien/s");
+
+  unsigned int j;
+  for (j = 0; j < sizeof(threads) / sizeof(threads[0]); j++) {
+    int status = 0;
+
+    sprintf(name, "%s.store", path);
+    int store_fd = open(name, O_RDONLY);
+    posix_fadvise(store_fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(store_fd);
+
+    double start = bench_now();
+
+    if (threads[j] == 0) {
+      for (i = 0; i < num_files && status == 0; i++) {
+        sprintf(name, "datei-%lu", i);
+        sprintf(output, "%s/%s", directory, name);
+
+        archive = archive_create();
+        status = archive_initialize_from_file(archive, path);
+        status == 0 && (status = archive_get_file(archive, name, output));
+        archive_free(archive);
+      }
+    } else {
+      archive = archive_create();
+      archive->uring_depth = 0;
+      status = archive_initialize_from_file(archive, path);
+      archiveinfo_materialize(archive->archive_info);
+
+      struct ExtractJob* jobs = malloc(num_files * sizeof(struct ExtractJob));
+
+      for (i = 0; i < num_files; i++) {
+        jobs[i].file_info = archiveinfo_file(archive->archive_info, i);
+        jobs[i].name = jobs[i].file_info->name;
+      }
+
+      status == 0 && (status = archive_extract(archive, directory, jobs, num_files, threads[j]));
+
+      for (i = 0; i < num_files && status == 0; i++) {
+        status = jobs[i].status;
+      }
+
+      free(jobs);
+      archive_free(archive);
+    }
+
+    double files_per_second = num_files / (bench_now() - start);
+
+    if (status != 0) {
+      printf("Das Extrahieren ist fehlgeschlagen\n");
+      return 1;
+    }
+
+    if (threads[j] == 0) {
+      sprintf(name, "einzeln");
+    } else {
+      sprintf(name, "%d Threads", threads[j]);
+    }
+
+    printf("%12s %12.0f\n", name, files_per_second);
+  }
+
+  for (i = 0; i < num_files; i++) {
+    sprintf(output, "%s/datei-%lu", directory, i);
+    remove(output);
+  }
+
+  rmdir(directory);
+  sprintf(name, "%s.structure", path);
+  remove(name);
+  sprintf(name, "%s.store", path);
+  remove(name);
+  sprintf(name, "%s.journal", path);
+  remove(name);
+
+  return 0;
+}
+
+/**
+ * Fügt 5000 Dateien mit je 8 KiB einmal wie mit einem Prozess pro Datei
+ * hinzu, der jedes Mal die Struktur lädt und speichert, und dann mit import
+ * und verschiedenen Anzahlen von Threads.
+ */
+int bench_import () {
+  const uint64_t blocksize = 4096;
+  const uint64_t num_files = 5000;
+  const char* path = "./bench-import";
+  const char* directory = "./bench-import.d";
+  int threads[] = { 0, 1, 4 };
+  char name[64];
+  char source[128];
+
+  mkdir(directory, 0777);
+
+  char* data = malloc(2 * blocksize);
+  memset(data, 'x', 2 * blocksize);
+
+  uint64_t i;
+  for (i = 0; i < num_files; i++) {
+    sprintf(source, "%s/datei-%lu", directory, i);
+
+    FILE* file = fopen(source, "w");
+    fwrite(data, 1, 2 * blocksize, file);
+    fclose(file);
+  }
+
+  free(data);
+
+  printf("%12s %12s\n", "", "Dateien/s");
+
+  unsigned int j;
+  for (j = 0; j < sizeof(threads) / sizeof(threads[0]); j++) {
+    struct Archive* archive = archive_create();
+    archive_initialize_empty(archive, path, blocksize, num_files * 2);
+    archive_free(archive);
+
+    int status = 0;
+    double start = bench_now();
+
+    if (threads[j] == 0) {
+      for (i = 0; i < num_files && status == 0; i++) {
+        sprintf(name, "datei-%lu", i);
+        sprintf(source, "%s/%s", directory, name);
+
+        archive = archive_create();
+        status = archive_initialize_from_file(archive, path);
+        status == 0 && (status = archive_add_file(archive, name, source));
+        archive_free(archive);
+      }
+    } else {
+      char* failed;
+
+      archive = archive_create();
+      archive->uring_depth = 0;
+      status = archive_initialize_from_file(archive, path);
+      status == 0 && (status = archive_import(archive, directory, threads[j], &failed));
+      archive_free(archive);
+    }
+
+    double files_per_second = num_files / (bench_now() - start);
+
+    if (status != 0) {
+      printf("Das Hinzufügen ist fehlgeschlagen\n");
+      return 1;
+    }
+
+    if (threads[j] == 0) {
+      sprintf(name, "einzeln");
+    } else {
+      sprintf(name, "%d Threads", threads[j]);
+    }
+
+    printf("%12s %12.0f\n", name, files_per_second);
+
+    sprintf(name, "%s.structure", path);
+    remove(name);
+    sprintf(name, "%s.store", path);
+    remove(name);
+    sprintf(name, "%s.journal", path);
+    remove(name);
+  }
+
+  for (i = 0; i < num_files; i++) {
+    sprintf(source, "%s/datei-%lu", directory, i);
+    remove(source);
+  }
+
+  rmdir(directory);
+
+  return 0;
+}
+
+/**
+ * Spielt auf einem Archiv mit 256 MiB abwechselnd Hinzufügen und Löschen von
+ * meist kleinen, manchmal großen Dateien ab, bis es etwa zu 85 % voll ist,
+ * und zählt mit jeder Strategie, in wie vielen Extents die Dateien landen.
+ */
+int bench_alloc () {
+  const uint64_t blockcount = 65536;
+  const uint64_t num_operations = 100000;
+  int policies[] = { ALLOCATION_FIRST_FIT, ALLOCATION_BEST_FIT, ALLOCATION_NEXT_FIT };
+  const char* policy_names[] = { "first", "best", "next" };
+  char name[32];
+
+  printf("%8s %16s %16s %16s %12s\n", "", "Extents/Datei", "am Stück", "Extents/Add", "µs/Add");
+
+  unsigned int j;
+  for (j = 0; j < sizeof(policies) / sizeof(policies[0]); j++) {
+    struct ArchiveInfo* archive_info = archiveinfo_create();
+    archiveinfo_initialize_empty(archive_info, 4096, blockcount);
+    archive_info->allocation = policies[j];
+
+    uint64_t* live = malloc(num_operations * sizeof(uint64_t));
+    uint64_t num_live = 0;
+    uint64_t num_adds = 0;
+    uint64_t added_extents = 0;
+    double add_time = 0;
+
+    srand(42);
+
+    uint64_t i;
+    for (i = 0; i < num_operations; i++) {
+      int kind = rand() % 20;
+      uint64_t num_blocks = kind < 14 ? 1 + rand() % 16 : kind < 19 ? 16 + rand() % 240 : 256 + rand() % 1792;
+      uint64_t num_free = archiveinfo_num_free_blocks(archive_info);
+
+      if (num_live > 0 && (num_free < num_blocks || (num_free < blockcount * 15 / 100 && rand() % 2 == 0))) {
+        uint64_t victim = rand() % num_live;
+
+        archiveinfo_delete_id(archive_info, live[victim]);
+        live[victim] = live[--num_live];
+      } else if (num_free >= num_blocks) {
+        struct Extent* extents;
+
+        double start = bench_now();
+        uint64_t num_extents = archiveinfo_get_free_extents(archive_info, num_blocks, &extents);
+        sprintf(name, "datei-%lu", i);
+        live[num_live++] = archiveinfo_add_file(archive_info, name, num_blocks * 4096, extents, num_extents);
+        add_time += bench_now() - start;
+
+        free(extents);
+        num_adds++;
+        added_extents += num_extents;
+      }
+    }
+
+    uint64_t num_extents = 0;
+    uint64_t contiguous = 0;
+
+    for (i = 0; i < num_live; i++) {
+      struct FileInfo* file_info = archiveinfo_file(archive_info, live[i]);
+
+      num_extents += file_info->num_extents;
+      contiguous += file_info->num_extents <= 1 ? 1 : 0;
+    }
+
+    printf("%8s %16.2f %15.1f%% %16.2f %12.2f\n", policy_names[j], (double)num_extents / num_live, 100.0 * contiguous / num_live, (double)added_extents / num_adds, add_time * 1e6 / num_adds);
+
+    free(live);
+    archiveinfo_free(archive_info);
+  }
+
+  return 0;
+}
+
+/**
+ * Fügt 64 MiB Quelltext (vfs.c immer wieder hintereinander) einem Archiv
+ * ohne Kompression und einem komprimierten mit 1 bis 8 Threads hinzu und
+ * liest sie wieder. Gemessen werden Durchsatz und belegter Platz.
+ */
+int bench_compress () {
+  const uint64_t blocksize = 4096;
+  const uint64_t size = 64 * 1048576;
+  const char* path = "./bench-compress";
+  const char* source_path = "./bench-compress.source";
+  int threads[] = { 0, 1, 2, 4, 8 };
+  char name[64];
+
+  FILE* text = fopen("vfs.c", "r");
+
+  if (text == NULL) {
+    printf("bench muss im Verzeichnis von vfs.c gestartet werden\n");
+    return 1;
+  }
+
+  long int text_size = file_size(text);
+  char* data = malloc(text_size);
+  file_read(data, 1, text_size, text);
+  fclose(text);
+
+  FILE* source = fopen(source_path, "w");
+  uint64_t i;
+  for (i = 0; i < size; i += text_size) {
+    fwrite(data, 1, size - i < (uint64_t)text_size ? size - i : (uint64_t)text_size, source);
+  }
+
+  free(data);
+  fclose(source);
+
+  printf("%12s %12s %12s %12s\n", "", "add MiB/s", "get MiB/s", "belegt MiB");
+
+  unsigned int j;
+  for (j = 0; j < sizeof(threads) / sizeof(threads[0]); j++) {
+    struct Archive* archive = archive_create();
+    archive->archive_info->compression = threads[j] == 0 ? COMPRESSION_NONE : COMPRESSION_LZ;
+    archive->compress_threads = threads[j];
+    archive->zero_copy = false;
+    archive_initialize_empty(archive, path, blocksize, 2 * size / blocksize);
+
+    double start = bench_now();
+    int status = archive_add_file(archive, "text", source_path);
+    double add_throughput = size / 1048576.0 / (bench_now() - start);
+
+    FILE* output = fopen("/dev/null", "w");
+    start = bench_now();
+    status == 0 && (status = archive_read_file(archive, archiveinfo_get_file(archive->archive_info, "text"), output));
+    double get_throughput = size / 1048576.0 / (bench_now() - start);
+    fclose(output);
+
+    if (status != 0) {
+      printf("Das Hinzufügen oder Lesen ist fehlgeschlagen\n");
+      return 1;
+    }
+
+    if (threads[j] == 0) {
+      sprintf(name, "unkomprimiert");
+    } else {
+      sprintf(name, "%d Threads", threads[j]);
+    }
+
+    printf("%12s %12.1f %12.1f %12.1f\n", name, add_throughput, get_throughput, archive_used_bytes(archive) / 1048576.0);
+
+    archive_free(archive);
+
+    sprintf(name, "%s.structure", path);
+    remove(name);
+    sprintf(name, "%s.store", path);
+    remove(name);
+    sprintf(name, "%s.journal", path);
+    remove(name);
+  }
+
+  remove(source_path);
+
+  return 0;
+}
+
+/**
+ * Fügt acht Versionen einer Datei mit 16 MiB Zufallsdaten hinzu, in denen
+ * jeweils 1% der Blöcke geändert sind, einmal ohne und einmal mit
+ * Deduplizierung. Gemessen werden Durchsatz und belegter Platz, dazu der
+ * Durchsatz von block_hash allein.
+ */
+int bench_dedup () {
+  const uint64_t blocksize = 4096;
+  const uint64_t size = 16 * 1048576;
+  const int num_versions = 8;
+  const char* path = "./bench-dedup";
+  const char* source_path = "./bench-dedup.source";
+  char name[64];
+
+  char* data = malloc(size);
+  uint64_t i;
+  for (i = 0; i < size; i++) {
+    data[i] = rand();
+  }
+
+  uint64_t hash = 0;
+  double start = bench_now();
+
+  for (i = 0; i < size; i += blocksize) {
+    hash ^= block_hash(data + i, blocksize);
+  }
+
+  printf("block_hash: %.0f MiB/s (%lx)\n\n", size / 1048576.0 / (bench_now() - start), hash);
+  printf("%12s %12s %12s %12s\n", "", "add MiB/s", "get MiB/s", "belegt MiB");
+
+  int dedup;
+  for (dedup = 0; dedup <= 1; dedup++) {
+    struct Archive* archive = archive_create();
+    archive->archive_info->dedup = dedup;
+    archive->zero_copy = false;
+    archive_initialize_empty(archive, path, blocksize, 2 * num_versions * size / blocksize);
+
+    int status = 0;
+    double add_time = 0;
+    srand(1);
+
+    int j;
+    for (j = 0; j < num_versions && status == 0; j++) {
+      uint64_t k;
+      for (k = 0; k < size / blocksize / 100; k++) {
+        data[rand() % (size / blocksize) * blocksize] ^= 1;
+      }
+
+      FILE* source = fopen(source_path, "w");
+      fwrite(data, 1, size, source);
+      fclose(source);
+
+      sprintf(name, "version-%d", j);
+      start = bench_now();
+      status = archive_add_file(archive, name, source_path);
+      add_time += bench_now() - start;
+    }
+
+    FILE* output = fopen("/dev/null", "w");
+    start = bench_now();
+    status == 0 && (status = archive_read_file(archive, archiveinfo_get_file(archive->archive_info, name), output));
+    double get_throughput = size / 1048576.0 / (bench_now() - start);
+    fclose(output);
+
+    if (status != 0) {
+      printf("Das Hinzufügen oder Lesen ist fehlgeschlagen\n");
+      return 1;
+    }
+
+    printf("%12s %12.1f %12.1f %12.1f\n", dedup ? "dedup" : "ohne", num_versions * size / 1048576.0 / add_time, get_throughput, archive_used_bytes(archive) / 1048576.0);
+
+    archive_free(archive);
+
+    sprintf(name, "%s.structure", path);
+    remove(name);
+    sprintf(name, "%s.store", path);
+    remove(name);
+    sprintf(name, "%s.journal", path);
+    remove(name);
+  }
+
+  free(data);
+  remove(source_path);
+
+  return 0;
+}
+
+/**
+ * Daten, die bench_stream_writer in die Pipe fd schreibt.
+ */
+struct StreamSource {
+  int fd;
+  const char* data;
+  uint64_t size;
+};
+
+/**
+ * Schreibt die Daten einer StreamSource in ihre Pipe und schließt sie.
+ */
+void* bench_stream_writer (void* argument) {
+  struct StreamSource* source = argument;
+  uint64_t written = 0;
+
+  while (written < source->size) {
+    ssize_t count = write(source->fd, source->data + written, source->size - written);
+
+    if (count <= 0) {
+      break;
+    }
+
+    written += count;
+  }
+
+  close(source->fd);
+
+  return NULL;
+}
+
+/**
+ * Vergleicht das Hinzufügen von 128 MiB aus einer Pipe direkt mit
+ * archive_add_unsized mit dem Umweg über eine temporäre Datei, deren Größe
+ * dann bekannt ist. Gibt auch die Anzahl der Extents der Datei aus.
+ */
+int bench_stream () {
+  const uint64_t blocksize = 4096;
+  const uint64_t size = 128 * 1048576;
+  const char* path = "./bench-stream";
+  const char* spool_path = "./bench-stream.spool";
+  char name[64];
+
+  char* data = malloc(size);
+  uint64_t i;
+  for (i = 0; i < size; i++) {
+    data[i] = rand();
+  }
+
+  printf("%18s %12s %12s\n", "", "MiB/s", "Extents");
+
+  int direct;
+  for (direct = 0; direct <= 1; direct++) {
+    struct Archive* archive = archive_create();
+    archive->zero_copy = false;
+    archive_initialize_empty(archive, path, blocksize, 2 * size / blocksize);
+
+    /* Ein paar kleine Dateien, damit der freie Platz nicht an einem Stück ist */
+    int status = 0;
+    int j;
+    for (j = 0; j < 16 && status == 0; j++) {
+      FILE* small = fmemopen(data, blocksize * (j + 1), "r");
+      sprintf(name, "small-%d", j);
+      status = archive_add_stream(archive, name, small, blocksize * (j + 1));
+      fclose(small);
+    }
+
+    for (j = 0; j < 16 && status == 0; j += 2) {
+      sprintf(name, "small-%d", j);
+      status = archive_delete_file(archive, name);
+    }
+
+    int fds[2];
+    pthread_t writer;
+
+    if (status != 0 || pipe(fds) != 0) {
+      printf("Das Vorbereiten ist fehlgeschlagen\n");
+      return 1;
+    }
+
+    struct StreamSource stream_source = { fds[1], data, size };
+    FILE* pipe_file = fdopen(fds[0], "r");
+
+    double start = bench_now();
+    pthread_create(&writer, NULL, bench_stream_writer, &stream_source);
+
+    if (direct) {
+      status = archive_add_unsized(archive, "stream", pipe_file);
+    } else {
+      FILE* spool = fopen(spool_path, "w");
+      char* buffer = malloc(DEFRAG_BUFFER_SIZE);
+      size_t count;
+
+      while ((count = fread(buffer, 1, DEFRAG_BUFFER_SIZE, pipe_file)) > 0) {
+        fwrite(buffer, 1, count, spool);
+      }
+
+      free(buffer);
+      fclose(spool);
+      status = archive_add_file(archive, "stream", spool_path);
+    }
+
+    double throughput = size / 1048576.0 / (bench_now() - start);
+    pthread_join(writer, NULL);
+    fclose(pipe_file);
+
+    if (status != 0) {
+      printf("Das Hinzufügen ist fehlgeschlagen\n");
+      return 1;
+    }
+
+    struct FileInfo* file_info = archiveinfo_get_file(archive->archive_info, "stream");
+    printf("%18s %12.1f %12lu\n", direct ? "direkt" : "temporäre Datei", throughput, file_info->num_extents);
+
+    archive_free(archive);
+
+    remove(spool_path);
+    sprintf(name, "%s.structure", path);
+    remove(name);
+    sprintf(name, "%s.store", path);
+    remove(name);
+    sprintf(name, "%s.journal", path);
+    remove(name);
+  }
+
+  free(data);
+
+  return 0;
+}
+
+/**
+ * Misst, wie lange es dauert, 4 KiB an zufälligen Stellen einer Datei mit
+ * 64 MiB zu lesen: mit archive_read_range und wie früher, indem die ganze
+ * Datei gelesen und der Rest verworfen wird. Einmal ohne und einmal mit
+ * Kompression.
+ */
+int bench_range () {
+  const uint64_t blocksize = 4096;
+  const uint64_t size = 64 * 1048576;
+  const uint64_t length = 4096;
+  const int num_reads = 50;
+  const char* path = "./bench-range";
+  const char* source_path = "./bench-range.source";
+  char name[64];
+
+  char* data = malloc(size);
+  uint64_t i;
+  for (i = 0; i < size; i++) {
+    data[i] = "abcdefgh"[rand() % 8];
+  }
+
+  FILE* source = fopen(source_path, "w");
+  fwrite(data, 1, size, source);
+  fclose(source);
+  free(data);
+
+  printf("%14s %14s %14s\n", "ms pro Lesen", "ganze Datei", "Bereich");
+
+  int compressed;
+  for (compressed = 0; compressed <= 1; compressed++) {
+    struct Archive* archive = archive_create();
+    archive->archive_info->compression = compressed ? COMPRESSION_LZ : COMPRESSION_NONE;
+    archive->zero_copy = false;
+    archive_initialize_empty(archive, path, blocksize, 2 * size / blocksize);
+
+    int status = archive_add_file(archive, "data", source_path);
+    struct FileInfo* file_info = archiveinfo_get_file(archive->archive_info, "data");
+    FILE* output = fopen("/dev/null", "w");
+    double times[2];
+
+    int whole;
+    for (whole = 0; whole <= 1; whole++) {
+      srand(1);
+      double start = bench_now();
+
+      int j;
+      for (j = 0; j < num_reads && status == 0; j++) {
+        uint64_t offset = (uint64_t)rand() * rand() % (size - length);
+
+        if (whole) {
+          status = archive_read_file(archive, file_info, output);
+        } else {
+          status = archive_read_range(archive, file_info, offset, length, output);
+        }
+      }
+
+      times[whole] = (bench_now() - start) * 1000 / num_reads;
+    }
+
+    fclose(output);
+
+    if (status != 0) {
+      printf("Das Hinzufügen oder Lesen ist fehlgeschlagen\n");
+      return 1;
+    }
+
+    printf("%14s %14.3f %14.3f\n", compressed ? "komprimiert" : "unkomprimiert", times[1], times[0]);
+
+    archive_free(archive);
+
+    sprintf(name, "%s.structure", path);
+    remove(name);
+    sprintf(name, "%s.store", path);
+    remove(name);
+    sprintf(name, "%s.journal", path);
+    remove(name);
+  }
+
+  remove(source_path);
+
+  return 0;
+}
+
+/**
+ * Misst, wie lange es dauert, 100 Bytes an eine Datei mit 256 MiB anzuhängen:
+ * mit archive_write_at und wie früher mit Löschen und neu Hinzufügen. Einmal
+ * ohne und einmal mit Kompression.
+ */
+int bench_append () {
+  const uint64_t blocksize = 4096;
+  const uint64_t size = 256 * 1048576;
+  const int num_appends = 20;
+  const char* path = "./bench-append";
+  const char* source_path = "./bench-append.source";
+  const char* tail_path = "./bench-append.tail";
+  char name[64];
+
+  char* data = malloc(size);
+  uint64_t i;
+  for (i = 0; i < size; i++) {
+    data[i] = "abcdefgh"[rand() % 8];
+  }
+
+  FILE* source = fopen(source_path, "w");
+  fwrite(data, 1, size, source);
+  fclose(source);
+
+  FILE* tail = fopen(tail_path, "w");
+  fwrite(data, 1, 100, tail);
+  fclose(tail);
+
+  printf("%14s %14s %14s\n", "ms pro Anhängen", "del und add", "append");
+
+  int compressed;
+  for (compressed = 0; compressed <= 1; compressed++) {
+    double times[2];
+
+    int rewrite;
+    for (rewrite = 0; rewrite <= 1; rewrite++) {
+      struct Archive* archive = archive_create();
+      archive->archive_info->compression = compressed ? COMPRESSION_LZ : COMPRESSION_NONE;
+      archive->zero_copy = false;
+      archive_initialize_empty(archive, path, blocksize, 3 * size / blocksize);
+
+      int status = archive_add_file(archive, "data", source_path);
+      double start = bench_now();
+
+      int j;
+      for (j = 0; j < num_appends && status == 0; j++) {
+        if (rewrite) {
+          /* Die Datei wie früher komplett neu schreiben */
+          source = fopen(source_path, "a");
+          fwrite(data, 1, 100, source);
+          fclose(source);
+
+          status = archive_delete_file(archive, "data");
+          status == 0 && (status = archive_add_file(archive, "data", source_path));
+        } else {
+          status = archive_write_at(archive, "data", 0, true, tail_path);
+        }
+      }
+
+      times[rewrite] = (bench_now() - start) * 1000 / num_appends;
+
+      if (status != 0) {
+        printf("Das Anhängen ist fehlgeschlagen\n");
+        return 1;
+      }
+
+      archive_free(archive);
+
+      sprintf(name, "%s.structure", path);
+      remove(name);
+      sprintf(name, "%s.store", path);
+      remove(name);
+      sprintf(name, "%s.journal", path);
+      remove(name);
+
+      if (rewrite) {
+        truncate(source_path, size);
+      }
+    }
+
+    printf("%14s %14.3f %14.3f\n", compressed ? "komprimiert" : "unkomprimiert", times[1], times[0]);
+  }
+
+  free(data);
+  remove(source_path);
+  remove(tail_path);
+
+  return 0;
+}
+
+/**
+ * Misst, wie lange es dauert, eine Datei mit 128 MiB durch eine Fassung zu
+ * ersetzen, in der sich 1% der Blöcke unterscheiden: mit archive_update_file
+ * und wie früher mit Löschen und neu Hinzufügen. Ohne Kompression, mit
+ * Kompression und mit Deduplizierung.
+ */
+int bench_update () {
+  const uint64_t blocksize = 4096;
+  const uint64_t size = 128 * 1048576;
+  const char* path = "./bench-update";
+  const char* source_path = "./bench-update.source";
+  const char* modes[] = { "ohne", "komprimiert", "dedup" };
+  char name[64];
+
+  char* data = malloc(size);
+  uint64_t i;
+  for (i = 0; i < size; i++) {
+    data[i] = "abcdefgh"[rand() % 8];
+  }
+
+  printf("%14s %14s %14s %14s\n", "ms", "del und add", "update", "übersprungen");
+
+  int mode;
+  for (mode = 0; mode < 3; mode++) {
+    double times[2];
+    uint64_t skipped = 0;
+
+    int rewrite;
+    for (rewrite = 0; rewrite <= 1; rewrite++) {
+      struct Archive* archive = archive_create();
+      archive->archive_info->compression = mode == 1 ? COMPRESSION_LZ : COMPRESSION_NONE;
+      archive->archive_info->dedup = mode == 2;
+      archive->zero_copy = false;
+      archive_initialize_empty(archive, path, blocksize, 3 * size / blocksize);
+
+      FILE* source = fopen(source_path, "w");
+      fwrite(data, 1, size, source);
+      fclose(source);
+
+      int status = archive_add_file(archive, "data", source_path);
+
+      /* Ohne Kompression bekommen die Blöcke ihre Fingerabdrücke beim ersten update */
+      if (!rewrite) {
+        status == 0 && (status = archive_update_file(archive, "data", source_path, &skipped));
+      }
+
+      srand(1);
+      source = fopen(source_path, "r+");
+      for (i = 0; i < size / blocksize / 100; i++) {
+        fseek(source, rand() % (size / blocksize) * blocksize, SEEK_SET);
+        fputc('x', source);
+      }
+      fclose(source);
+
+      double start = bench_now();
+
+      if (rewrite) {
+        status == 0 && (status = archive_delete_file(archive, "data"));
+        status == 0 && (status = archive_add_file(archive, "data", source_path));
+      } else {
+        status == 0 && (status = archive_update_file(archive, "data", source_path, &skipped));
+      }
+
+      times[rewrite] = (bench_now() - start) * 1000;
+
+      if (status != 0) {
+        printf("Das Ersetzen ist fehlgeschlagen\n");
+        return 1;
+      }
+
+      archive_free(archive);
+
+      sprintf(name, "%s.structure", path);
+      remove(name);
+      sprintf(name, "%s.store", path);
+      remove(name);
+      sprintf(name, "%s.journal", path);
+      remove(name);
+    }
+
+    printf("%14s %14.1f %14.1f %13.1f%%\n", modes[mode], times[1], times[0], 100.0 * skipped / size);
+  }
+
+  free(data);
+  remove(source_path);
+
+  return 0;
+}
+
+int main (int argc, char** argv) {
+  if (argc < 2) {
+    printf("USAGE: bench lookup|open|defrag|get|add|copy|uring|extract|import|alloc|compress|dedup|stream|range|append|update");
+    return 66;
+  }
+
+  if (strcmp(argv[1], "lookup") == 0) {
+    return bench_lookup();
+  } else if (strcmp(argv[1], "open") == 0) {
+    return bench_open();
+  } else if (strcmp(argv[1], "defrag") == 0) {
+    return bench_defrag();
+  } else if (strcmp(argv[1], "get") == 0) {
+    return bench_get();
+  } else if (strcmp(argv[1], "add") == 0) {
+    return bench_add();
+  } else if (strcmp(argv[1], "copy") == 0) {
+    return bench_copy();
+  } else if (strcmp(argv[1], "uring") == 0) {
+    return bench_uring();
+  } else if (strcmp(argv[1], "extract") == 0) {
+    return bench_extract();
+  } else if (strcmp(argv[1], "import") == 0) {
+    return bench_import();
+  } else if (strcmp(argv[1], "alloc") == 0) {
+    return bench_alloc();
+  } else if (strcmp(argv[1], "compress") == 0) {
+    return bench_compress();
+  } else if (strcmp(argv[1], "dedup") == 0) {
+    return bench_dedup();
+  } else if (strcmp(argv[1], "stream") == 0) {
+    return bench_stream();
+  } else if (strcmp(argv[1], "range") == 0) {
+    return bench_range();
+  } else if (strcmp(argv[1], "append") == 0) {
+    return bench_append();
+  } else if (strcmp(argv[1], "update") == 0) {
+    return bench_update();
+  } else {
+    printf("Der Benchmark ist unbekannt");
+    return 66;
+  }
+}
@@ -1,5 +1,7 @@
 require "securerandom"
 require "shellwords"
+require "socket"
+require "timeout"
 
 def random_bytes n
   Shellwords.shellescape SecureRandom.base64(n)[0,n]
@@ -56,10 +58,11 @@ describe "VFS" do
     describe "when writing to a valid archive" do
       before(:each) do
         `./vfs ./tmp/archive create 8192 4`
+        `dd count=1 bs=10K if=/dev/urandom of=./tmp/10K 2>&1 > /dev/null`
       end
 
       it "should exit with code 0 when the file has been added" do
-        `./vfs ./tmp/archive add vfs.c vfs.c`
+        `./vfs ./tmp/archive add ./tmp/10K 10K`
 
         expect($?.exitstatus).to eq 0
       end
@@ -71,8 +74,8 @@ describe "VFS" do
       end
        
       it "should exit with code 11 when a file with the same name already exists" do
-        `./vfs ./tmp/archive add vfs.c vfs.c`
-        `./vfs ./tmp/archive add vfs.c vfs.c`
+        `./vfs ./tmp/archive add ./tmp/10K 10K`
+        `./vfs ./tmp/archive add ./tmp/10K 10K`
 
         expect($?.exitstatus).to eq 11
       end
@@ -92,6 +95,54 @@ describe "VFS" do
         expect($?.exitstatus).to eq 12
       end
     end
+
+    it "should write files larger than one I/O buffer into fragmented free space" do
+      `./vfs ./tmp/archive create 4096 2048`
+      `head -c 4096 /dev/urandom > ./tmp/block`
+      (1..8).each { |i| `./vfs ./tmp/archive add ./tmp/block block#{i}` }
+      [2, 5, 7].each { |i| `./vfs ./tmp/archive del block#{i}` }
+      `head -c 5000000 /dev/urandom > ./tmp/large`
+      `VFS_ALLOCATION=first VFS_ZERO_COPY=0 ./vfs ./tmp/archive add ./tmp/large large`
+      `./vfs ./tmp/archive get large ./tmp/out`
+
+      expect(`./vfs ./tmp/archive list`.lines.last).to match /^large,5000000,1221,1,4,6,8,9,10,/
+      expect(IO.read "./tmp/out").to eq IO.read("./tmp/large")
+    end
+  end
+
+  describe "Allocating blocks" do
+    before(:each) do
+      `./vfs ./tmp/archive create 10 20`
+      `echo -n #{random_bytes 10} > ./tmp/one`
+      `echo -n #{random_bytes 20} > ./tmp/two`
+      `echo -n #{random_bytes 30} > ./tmp/three`
+
+      # free runs: 3 blocks at 1, 2 blocks at 5, 12 blocks at 8
+      ["one", "three", "one", "two", "one", "one"].each_with_index do |file, i|
+        `VFS_ALLOCATION=first ./vfs ./tmp/archive add ./tmp/#{file} f#{i}`
+      end
+      ["f1", "f3", "f5"].each { |name| `./vfs ./tmp/archive del #{name}` }
+    end
+
+    it "should put files into the smallest free run they fit in by default" do
+      `./vfs ./tmp/archive add ./tmp/two new`
+
+      expect(`./vfs ./tmp/archive list`.lines.last).to eq "new,20,2,5,6\n"
+    end
+
+    it "should continue behind the last allocation with next-fit" do
+      `head -c 100 /dev/zero > ./tmp/ten`
+      `printf "add ./tmp/ten a\nadd ./tmp/one b\n" | VFS_ALLOCATION=next ./vfs ./tmp/archive batch`
+
+      expect(`./vfs ./tmp/archive list`.lines.last).to eq "b,10,1,18\n"
+    end
+
+    it "should use as few extents as possible when no free run is large enough" do
+      `head -c 140 /dev/zero > ./tmp/big`
+      `./vfs ./tmp/archive add ./tmp/big big`
+
+      expect(`./vfs ./tmp/archive list`.lines.last).to eq "big,140,14,1,2,#{(8..19).to_a.join ","}\n"
+    end
   end
 
   describe "Reading files" do
@@ -103,7 +154,7 @@ describe "VFS" do
 
     describe "when the archive exists" do
       before(:each) do
-        `./vfs ./tmp/archive create 100 1000`
+        `./vfs ./tmp/archive create 100 10000`
       end
 
       it "should exit with code 21 when the file is not in the archive" do
@@ -129,6 +180,28 @@ describe "VFS" do
           expect(IO.read("./tmp/out")).to eq IO.read("./vfs.c")
         end
 
+        it "should read fragmented files with any I/O size" do
+          `head -c 150 /dev/urandom > ./tmp/small`
+          `./vfs ./tmp/archive add ./tmp/small small`
+          `./vfs ./tmp/archive del file`
+          `./vfs ./tmp/archive add ./tmp/small other`
+          `VFS_ALLOCATION=first ./vfs ./tmp/archive add vfs.c file`
+
+          blocks = `./vfs ./tmp/archive list`.lines.last.split(",")[3..-1].map(&:to_i)
+
+          expect(blocks.each_cons(2).any? { |a, b| b != a + 1 }).to be_true
+
+          ["1", "250", "4096"].each do |io_size|
+            `VFS_ZERO_COPY=0 ./vfs ./tmp/archive get file ./tmp/out --io-size #{io_size}`
+
+            expect(IO.read("./tmp/out")).to eq IO.read("./vfs.c")
+          end
+
+          `./vfs ./tmp/archive get file ./tmp/out`
+
+          expect(IO.read("./tmp/out")).to eq IO.read("./vfs.c")
+        end
+
         it "should exit with code 30 when the output file is not writeable" do
           `./vfs ./tmp/archive get file /root/xx`
 
@@ -211,6 +284,16 @@ describe "VFS" do
         # Subtract 1 for the newline
         expect(free_bytes.to_i).to eq 340
       end
+
+      it "should report the blocks of deleted files as free again" do
+        `echo "test" > ./tmp/file`
+        3.times { |i| `./vfs ./tmp/archive add ./tmp/file file#{i}` }
+        `./vfs ./tmp/archive del file1`
+
+        free_bytes = `./vfs ./tmp/archive free`
+
+        expect(free_bytes.to_i).to eq 360
+      end
     end
   end
 
@@ -277,6 +360,18 @@ describe "VFS" do
 
         expect(output).to match "file1,76,2,2,3"
       end
+
+      it "should list the blocks of fragmented files in order" do
+        `echo "#{"a" * 75}" > ./tmp/76bytes`
+        `echo "#{"b" * 179}" > ./tmp/180bytes`
+        3.times { |i| `./vfs ./tmp/archive add ./tmp/76bytes file#{i}` }
+        `./vfs ./tmp/archive del file1`
+        `VFS_ALLOCATION=first ./vfs ./tmp/archive add ./tmp/180bytes big_file`
+
+        output = `./vfs ./tmp/archive list`
+
+        expect(output).to match "big_file,180,4,2,3,6,7"
+      end
     end
   end
 
@@ -305,9 +400,13 @@ describe "VFS" do
 
           3.times { |i| `./vfs ./tmp/archive add ./tmp/76bytes file#{i}` }
           `./vfs ./tmp/archive del file1`
-          `./vfs ./tmp/archive add ./tmp/180bytes big_file`
+          `VFS_ALLOCATION=first ./vfs ./tmp/archive add ./tmp/180bytes big_file`
 
-          `./vfs ./tmp/archive defrag`
+          @output = `./vfs ./tmp/archive defrag`
+        end
+
+        it "should report the bytes moved and what swapping blocks would have moved" do
+          expect(@output).to eq "300,400,0"
         end
 
         it "should defrag the archive" do
@@ -327,5 +426,860 @@ big_file,180,4,4,5,6,7
         end
       end
     end
+
+    it "should keep the blocks of a file in order" do
+      # "abcdef" in blocks 1 and 0, block 2 is free
+      `./vfs ./tmp/archive create 4 3`
+      `echo -n "wxyz" | ./vfs ./tmp/archive add - t`
+      `echo -n "abcd" | ./vfs ./tmp/archive add - z`
+      `echo -n "uvwx" | ./vfs ./tmp/archive add - u`
+      `./vfs ./tmp/archive del t`
+      `echo -n "ef" | ./vfs ./tmp/archive append z -`
+      `./vfs ./tmp/archive del u`
+      expect(`./vfs ./tmp/archive list`).to eq "z,6,2,1,0\n"
+
+      `./vfs ./tmp/archive defrag`
+      `./vfs ./tmp/archive get z ./tmp/out`
+
+      expect(IO.binread("./tmp/archive.store")[0, 6]).to eq "abcdef"
+      expect(IO.read("./tmp/out")).to eq "abcdef"
+    end
+
+    it "should leave blocks where they are when no block is free to move them through" do
+      `./vfs ./tmp/archive create 4 2`
+      `echo -n "wxyz" | ./vfs ./tmp/archive add - t`
+      `echo -n "abcd" | ./vfs ./tmp/archive add - z`
+      `./vfs ./tmp/archive del t`
+      `echo -n "ef" | ./vfs ./tmp/archive append z -`
+
+      expect(`./vfs ./tmp/archive defrag`).to match(/^0,\d+,8$/)
+      expect(`./vfs ./tmp/archive list`).to eq "z,6,2,1,0\n"
+      expect(`./vfs ./tmp/archive get z -`).to eq "abcdef"
+    end
+  end
+
+  describe "Incremental defragmentation" do
+    before(:each) do
+      `./vfs ./tmp/archive create 10 10`
+    end
+
+    it "should stop when the byte budget is used up and continue on the next call" do
+      `echo "#{"a" * 19}" > ./tmp/file`
+      3.times { |i| `./vfs ./tmp/archive add ./tmp/file file#{i}` }
+      `./vfs ./tmp/archive del file0`
+
+      expect(`./vfs ./tmp/archive defrag --bytes 10`).to eq "20,160,20"
+      expect(`./vfs ./tmp/archive list`).to eq "file1,20,2,0,1\nfile2,20,2,4,5\n"
+
+      expect(`./vfs ./tmp/archive defrag --bytes 10`).to eq "20,80,0"
+      expect(`./vfs ./tmp/archive list`).to eq "file1,20,2,0,1\nfile2,20,2,2,3\n"
+
+      `./vfs ./tmp/archive get file2 ./tmp/out`
+      expect(IO.read("./tmp/out")).to eq IO.read("./tmp/file")
+    end
+
+    it "should only defragment the named files" do
+      `echo "#{"a" * 9}" > ./tmp/small`
+      `echo #{random_bytes 29} > ./tmp/big`
+      2.times { |i| `./vfs ./tmp/archive add ./tmp/small small#{i}` }
+      `./vfs ./tmp/archive del small0`
+      `VFS_ALLOCATION=first ./vfs ./tmp/archive add ./tmp/big big`
+
+      expect(`./vfs ./tmp/archive defrag big`).to match(/^30,\d+,0$/)
+      expect(`./vfs ./tmp/archive list`).to eq "small1,10,1,1\nbig,30,3,4,5,6\n"
+
+      `./vfs ./tmp/archive get big ./tmp/out`
+      expect(IO.read("./tmp/out")).to eq IO.read("./tmp/big")
+    end
+
+    it "should exit with code 21 when a named file is not in the archive" do
+      `./vfs ./tmp/archive defrag missing`
+
+      expect($?.exitstatus).to eq 21
+    end
+  end
+
+  describe "Compression" do
+    before(:each) do
+      `./vfs ./tmp/archive create 512 2000 --compress`
+    end
+
+    it "should read back the same bytes" do
+      `head -c 200000 /dev/urandom > ./tmp/random`
+      `./vfs ./tmp/archive add vfs.c text`
+      `./vfs ./tmp/archive add ./tmp/random random`
+
+      `./vfs ./tmp/archive get text ./tmp/out`
+      expect(IO.read "./tmp/out").to eq IO.read("vfs.c")
+
+      `./vfs ./tmp/archive get random ./tmp/out --io-size 1000`
+      expect(IO.read "./tmp/out").to eq IO.read("./tmp/random")
+    end
+
+    it "should report used and free bytes with and without compression" do
+      `./vfs ./tmp/archive add vfs.c text`
+
+      used, logical = `./vfs ./tmp/archive used`.split(",").map(&:to_i)
+      free, estimate = `./vfs ./tmp/archive free`.split(",").map(&:to_i)
+
+      expect(logical).to eq File.size("vfs.c")
+      expect(used).to be < logical / 2
+      expect(used + free).to eq 512 * 2000
+      expect(estimate).to be > free
+      expect(`./vfs ./tmp/archive list`).to match /^text,#{File.size "vfs.c"},#{used / 512},/
+    end
+
+    it "should keep files readable after deleting, defragmenting and importing" do
+      `mkdir -p ./tmp/in`
+      `cp README.md spec.rb ./tmp/in`
+      `./vfs ./tmp/archive add vfs.c first`
+      `./vfs ./tmp/archive add spec.rb second`
+      `./vfs ./tmp/archive del first`
+      `./vfs ./tmp/archive import ./tmp/in`
+      `./vfs ./tmp/archive defrag`
+
+      `./vfs ./tmp/archive get second ./tmp/out`
+      expect(IO.read "./tmp/out").to eq IO.read("spec.rb")
+
+      `./vfs ./tmp/archive get README.md ./tmp/out`
+      expect(IO.read "./tmp/out").to eq IO.read("README.md")
+    end
+  end
+
+  describe "Deduplication" do
+    before(:each) do
+      `./vfs ./tmp/archive create 512 2000 --dedup`
+    end
+
+    it "should store identical blocks only once" do
+      `head -c 100000 /dev/urandom > ./tmp/random`
+      `./vfs ./tmp/archive add ./tmp/random first`
+      `./vfs ./tmp/archive add ./tmp/random second`
+      `cat ./tmp/random vfs.c > ./tmp/longer`
+      `./vfs ./tmp/archive add ./tmp/longer third`
+
+      used, logical = `./vfs ./tmp/archive used`.split(",").map(&:to_i)
+      expect(logical).to eq 3 * 100000 + File.size("vfs.c")
+      expect(used).to be <= 100000 + File.size("vfs.c") + 2 * 512
+
+      `./vfs ./tmp/archive get second ./tmp/out`
+      expect(IO.read "./tmp/out").to eq IO.read("./tmp/random")
+
+      `./vfs ./tmp/archive get third ./tmp/out`
+      expect(IO.read "./tmp/out").to eq IO.read("./tmp/longer")
+    end
+
+    it "should free shared blocks only when the last file is deleted" do
+      `./vfs ./tmp/archive add vfs.c first`
+      used = `./vfs ./tmp/archive used`.to_i
+      `./vfs ./tmp/archive add vfs.c second`
+      `./vfs ./tmp/archive del first`
+
+      expect(`./vfs ./tmp/archive used`.to_i).to eq used
+      `./vfs ./tmp/archive get second ./tmp/out`
+      expect(IO.read "./tmp/out").to eq IO.read("vfs.c")
+
+      `./vfs ./tmp/archive del second`
+      expect(`./vfs ./tmp/archive used`).to eq "0,0"
+    end
+
+    it "should keep shared blocks readable after defragmenting and resizing" do
+      `./vfs ./tmp/archive add spec.rb first`
+      `./vfs ./tmp/archive add vfs.c second`
+      `./vfs ./tmp/archive add spec.rb third`
+      `./vfs ./tmp/archive del first`
+      `./vfs ./tmp/archive defrag`
+      `./vfs ./tmp/archive resize #{File.size("vfs.c") / 512 + File.size("spec.rb") / 512 + 2}`
+
+      expect($?.exitstatus).to eq 0
+      `./vfs ./tmp/archive get third ./tmp/out`
+      expect(IO.read "./tmp/out").to eq IO.read("spec.rb")
+
+      `./vfs ./tmp/archive add spec.rb fourth`
+      expect($?.exitstatus).to eq 0
+    end
+
+    it "should not combine deduplication with compression" do
+      `rm -f ./tmp/archive.*`
+      `./vfs ./tmp/archive create 512 2000 --compress --dedup`
+
+      expect($?.exitstatus).to eq 66
+    end
+  end
+
+  describe "Adding from a pipe" do
+    it "should store data from stdin without knowing its size" do
+      `./vfs ./tmp/archive create 512 2000`
+      `cat vfs.c | ./vfs ./tmp/archive add - piped`
+      expect($?.exitstatus).to eq 0
+
+      expect(`./vfs ./tmp/archive list`.split(",")[0, 2]).to eq ["piped", File.size("vfs.c").to_s]
+      expect(`./vfs ./tmp/archive used`.to_i).to eq (File.size("vfs.c") + 511) / 512 * 512
+      `./vfs ./tmp/archive get piped ./tmp/out`
+      expect(IO.read "./tmp/out").to eq IO.read("vfs.c")
+    end
+
+    it "should compress and deduplicate piped data" do
+      `./vfs ./tmp/archive create 512 2000 --compress`
+      `cat vfs.c | ./vfs ./tmp/archive add - piped`
+      expect(`./vfs ./tmp/archive used`.to_i).to be < File.size("vfs.c") / 2
+      `./vfs ./tmp/archive get piped ./tmp/out`
+      expect(IO.read "./tmp/out").to eq IO.read("vfs.c")
+
+      `./vfs ./tmp/shared create 512 2000 --dedup`
+      `./vfs ./tmp/shared add vfs.c first`
+      used = `./vfs ./tmp/shared used`.to_i
+      `cat vfs.c | ./vfs ./tmp/shared add - second`
+      expect(`./vfs ./tmp/shared used`.to_i).to eq used
+      `./vfs ./tmp/shared get second ./tmp/out`
+      expect(IO.read "./tmp/out").to eq IO.read("vfs.c")
+    end
+
+    it "should exit with code 12 and free all blocks when the data does not fit" do
+      `./vfs ./tmp/archive create 512 2000`
+      `./vfs ./tmp/archive add spec.rb first`
+      free = `./vfs ./tmp/archive free`
+
+      `cat vfs.c vfs.c vfs.c vfs.c vfs.c | ./vfs ./tmp/archive add - second`
+      expect($?.exitstatus).to eq 12
+      expect(`./vfs ./tmp/archive free`).to eq free
+      expect(`./vfs ./tmp/archive list`.lines.length).to eq 1
+    end
+  end
+
+  describe "Reading ranges" do
+    it "should write a file to stdout" do
+      `./vfs ./tmp/archive create 512 2000`
+      `./vfs ./tmp/archive add vfs.c file`
+
+      expect(`./vfs ./tmp/archive get file -`).to eq IO.read("vfs.c")
+      expect(`./vfs ./tmp/archive get missing -`).to eq ""
+      expect($?.exitstatus).to eq 21
+    end
+
+    it "should write only the bytes in the range" do
+      text = IO.read("vfs.c")
+
+      ["", "--compress", "--dedup"].each_with_index do |option, i|
+        `./vfs ./tmp/archive#{i} create 512 2000 #{option}`
+        `./vfs ./tmp/archive#{i} add vfs.c file`
+
+        expect(`./vfs ./tmp/archive#{i} get file - --offset 100000 --length 1000`).to eq text[100000, 1000]
+        expect(`./vfs ./tmp/archive#{i} get file - --offset 70000 --length 1`).to eq text[70000, 1]
+        expect(`./vfs ./tmp/archive#{i} get file - --length 10`).to eq text[0, 10]
+        `./vfs ./tmp/archive#{i} get file ./tmp/out --offset 1000`
+        expect(IO.read "./tmp/out").to eq text[1000..-1]
+      end
+    end
+
+    it "should stop at the end of the file" do
+      `./vfs ./tmp/archive create 512 2000`
+      `./vfs ./tmp/archive add spec.rb file`
+
+      expect(`./vfs ./tmp/archive get file - --offset #{File.size("spec.rb") - 5} --length 100`).to eq IO.read("spec.rb")[-5..-1]
+      expect(`./vfs ./tmp/archive get file - --offset #{File.size("spec.rb") + 5}`).to eq ""
+      expect($?.exitstatus).to eq 0
+
+      `./vfs ./tmp/archive get file - --offset x`
+      expect($?.exitstatus).to eq 66
+    end
+  end
+
+  describe "Changing files" do
+    before(:each) do
+      `./vfs ./tmp/archive create 512 2000`
+      `./vfs ./tmp/archive add spec.rb file`
+    end
+
+    it "should append to the partially used last block and keep the other blocks" do
+      blocks = `./vfs ./tmp/archive list`.strip.split(",")[2..-1]
+      `echo -n "tail" | ./vfs ./tmp/archive append file -`
+      expect($?.exitstatus).to eq 0
+
+      expect(`./vfs ./tmp/archive list`.strip.split(",")[2..-1]).to eq blocks
+      expect(`./vfs ./tmp/archive get file -`).to eq IO.read("spec.rb") + "tail"
+
+      `./vfs ./tmp/archive append file vfs.c`
+      expect(`./vfs ./tmp/archive get file -`).to eq IO.read("spec.rb") + "tail" + IO.read("vfs.c")
+    end
+
+    it "should overwrite bytes in place and fill gaps with zeros" do
+      size = File.size("spec.rb")
+      `echo -n "XYZ" | ./vfs ./tmp/archive write-at file 10 -`
+      `echo -n "end" | ./vfs ./tmp/archive write-at file #{size + 5} -`
+
+      expected = IO.read("spec.rb")
+      expected[10, 3] = "XYZ"
+      expected += "\0" * 5 + "end"
+
+      expect(`./vfs ./tmp/archive get file -`).to eq expected
+      expect(`./vfs ./tmp/archive list`.split(",")[1].to_i).to eq size + 8
+    end
+
+    it "should truncate and extend files" do
+      `./vfs ./tmp/archive truncate file 1000`
+      expect(`./vfs ./tmp/archive get file -`).to eq IO.read("spec.rb")[0, 1000]
+      expect(`./vfs ./tmp/archive used`.to_i).to eq 1024
+
+      `./vfs ./tmp/archive truncate file 1100`
+      expect(`./vfs ./tmp/archive get file -`).to eq IO.read("spec.rb")[0, 1000] + "\0" * 100
+    end
+
+    it "should reject negative offsets and sizes with code 66" do
+      `echo -n "XYZ" | ./vfs ./tmp/archive write-at file -1 -`
+      expect($?.exitstatus).to eq 66
+      `./vfs ./tmp/archive truncate file -5`
+      expect($?.exitstatus).to eq 66
+      output = `printf 'write-at file -1 vfs.c\ntruncate file -5\n' | ./vfs ./tmp/archive batch -`
+      expect(output).to eq "66 write-at file -1 vfs.c\n66 truncate file -5\n"
+
+      expect(`./vfs ./tmp/archive get file -`).to eq IO.read("spec.rb")
+    end
+
+    it "should copy shared blocks before changing them" do
+      `./vfs ./tmp/shared create 512 2000 --dedup`
+      `./vfs ./tmp/shared add spec.rb first`
+      `./vfs ./tmp/shared add spec.rb second`
+      `echo -n "XYZ" | ./vfs ./tmp/shared write-at second 600 -`
+      `./vfs ./tmp/shared truncate first 700`
+
+      expected = IO.read("spec.rb")
+      expected[600, 3] = "XYZ"
+      expect(`./vfs ./tmp/shared get second -`).to eq expected
+      expect(`./vfs ./tmp/shared get first -`).to eq IO.read("spec.rb")[0, 700]
+    end
+
+    it "should exit with code 21 when the file is not in the archive and 12 when the data does not fit" do
+      `./vfs ./tmp/archive truncate missing 10`
+      expect($?.exitstatus).to eq 21
+
+      `./vfs ./tmp/archive write-at file 0 vfs.c`
+      codes = 5.times.map do
+        `./vfs ./tmp/archive append file vfs.c`
+        $?.exitstatus
+      end
+
+      expect(codes.last).to eq 12
+      expect(`./vfs ./tmp/archive get file -`).to eq IO.read("vfs.c") * (1 + codes.count(0))
+    end
+  end
+
+  describe "Updating files" do
+    before(:each) do
+      `./vfs ./tmp/archive create 512 2000`
+      `./vfs ./tmp/archive add vfs.c file`
+    end
+
+    it "should only write the blocks that changed and report the skipped bytes" do
+      text = IO.read("vfs.c")
+      text[1000, 2] = "XY"
+      IO.write("./tmp/changed", text)
+
+      expect(`./vfs ./tmp/archive update file vfs.c`).to eq File.size("vfs.c").to_s
+      expect(`./vfs ./tmp/archive update file ./tmp/changed`).to eq (File.size("vfs.c") - 512).to_s
+      expect(`./vfs ./tmp/archive get file -`).to eq text
+    end
+
+    it "should grow and shrink the file" do
+      IO.write("./tmp/longer", IO.read("vfs.c") + IO.read("spec.rb"))
+      expect(`./vfs ./tmp/archive update file ./tmp/longer`.to_i).to eq File.size("vfs.c") / 512 * 512
+      expect(`./vfs ./tmp/archive get file -`).to eq IO.read("./tmp/longer")
+
+      IO.write("./tmp/shorter", IO.read("vfs.c")[0, 5000])
+      expect(`./vfs ./tmp/archive update file ./tmp/shorter`).to eq "4608"
+      expect(`./vfs ./tmp/archive get file -`).to eq IO.read("./tmp/shorter")
+      expect(`./vfs ./tmp/archive used`.to_i).to eq 5120
+    end
+
+    it "should add files that are not in the archive yet" do
+      expect(`./vfs ./tmp/archive update other spec.rb`).to eq "0"
+      expect(`./vfs ./tmp/archive get other -`).to eq IO.read("spec.rb")
+    end
+
+    it "should compare blocks by their fingerprints in deduplicating archives" do
+      `./vfs ./tmp/shared create 512 2000 --dedup`
+      `./vfs ./tmp/shared add vfs.c first`
+      `./vfs ./tmp/shared add vfs.c second`
+      used = `./vfs ./tmp/shared used`.to_i
+
+      text = IO.read("vfs.c")
+      text[1000, 2] = "XY"
+      IO.write("./tmp/changed", text)
+
+      expect(`./vfs ./tmp/shared update second ./tmp/changed`).to eq (File.size("vfs.c") - 512).to_s
+      expect(`./vfs ./tmp/shared used`.to_i).to eq used + 512
+      expect(`./vfs ./tmp/shared get first -`).to eq IO.read("vfs.c")
+      expect(`./vfs ./tmp/shared get second -`).to eq text
+    end
+
+    it "should not trust equal fingerprints without comparing the blocks" do
+      `./vfs ./tmp/shared create 512 2000 --dedup`
+      `./vfs ./tmp/shared add vfs.c file`
+
+      # Block 1 keeps its fingerprint but no longer holds that content, as after a collision
+      File.open("./tmp/shared.store", "r+b") { |store| store.seek(600); store.write("XY") }
+
+      expect(`./vfs ./tmp/shared update file vfs.c`).to eq (File.size("vfs.c") - 512).to_s
+      expect(`./vfs ./tmp/shared get file -`).to eq IO.read("vfs.c")
+    end
+
+    it "should leave the file as it was when the new content does not fit" do
+      text = IO.read("vfs.c")[0, 150]
+      changed = "X" + text[1..-1] + IO.read("vfs.c")[0, 2850]
+
+      ["", "--dedup"].each_with_index do |option, i|
+        `./vfs ./tmp/full#{i} create 64 45 #{option}`
+        IO.write("./tmp/small", text)
+        `./vfs ./tmp/full#{i} add ./tmp/small file`
+        IO.write("./tmp/large", changed)
+
+        # The new content needs 47 blocks, the file has 3 and 42 are free
+        `./vfs ./tmp/full#{i} update file ./tmp/large`
+
+        expect($?.exitstatus).to eq 12
+        expect(`./vfs ./tmp/full#{i} get file -`).to eq text
+      end
+    end
+
+    it "should compare with the stored fingerprints without reading the old blocks" do
+      # The first update reads the blocks once and stores their fingerprints
+      expect(`./vfs ./tmp/archive update file vfs.c`).to eq File.size("vfs.c").to_s
+
+      # Block 1 no longer holds the content its fingerprint was taken from, which only reading would notice
+      File.open("./tmp/archive.store", "r+b") { |store| store.seek(600); store.write("XY") }
+
+      expect(`./vfs ./tmp/archive update file vfs.c`).to eq File.size("vfs.c").to_s
+      expect(`./vfs ./tmp/archive get file -`[600, 2]).to eq "XY"
+    end
+
+    it "should only compress the chunks that changed" do
+      `./vfs ./tmp/packed create 512 2000 --compress`
+      `./vfs ./tmp/packed add vfs.c file`
+
+      text = IO.read("vfs.c")
+      text[70000, 2] = "XY"
+      text << "appended"
+      IO.write("./tmp/changed", text)
+
+      expect(`./vfs ./tmp/packed update file ./tmp/changed`).to eq (File.size("vfs.c") / 65536 * 65536 - 65536).to_s
+      expect(`./vfs ./tmp/packed get file -`).to eq text
+      expect(`./vfs ./tmp/packed update file ./tmp/changed`).to eq text.size.to_s
+      expect(`./vfs ./tmp/packed update file vfs.c`).to eq (File.size("vfs.c") / 65536 * 65536 - 65536).to_s
+      expect(`./vfs ./tmp/packed get file -`).to eq IO.read("vfs.c")
+    end
+  end
+
+  describe "Importing directories" do
+    before(:each) do
+      `./vfs ./tmp/archive create 64 1024`
+      `mkdir -p ./tmp/in/sub`
+      `echo -n #{random_bytes 100} > ./tmp/in/a`
+      `echo -n #{random_bytes 2000} > ./tmp/in/sub/b`
+      `echo -n #{random_bytes 300} > ./tmp/in/sub/c`
+    end
+
+    it "should add all files with one contiguous extent each" do
+      `./vfs ./tmp/archive import ./tmp/in --threads 2`
+
+      expect($?.exitstatus).to eq 0
+      expect(`./vfs ./tmp/archive list`).to eq "a,100,2,0,1\nsub/b,2000,32,#{(2..33).to_a.join ","}\nsub/c,300,5,34,35,36,37,38\n"
+
+      `./vfs ./tmp/archive get sub/b ./tmp/out`
+      expect(IO.read "./tmp/out").to eq IO.read("./tmp/in/sub/b")
+    end
+
+    it "should leave the archive unchanged when a name already exists" do
+      `./vfs ./tmp/archive add ./tmp/in/a sub/c`
+      `./vfs ./tmp/archive import ./tmp/in`
+
+      expect($?.exitstatus).to eq 11
+      expect(`./vfs ./tmp/archive list`).to eq "sub/c,100,2,0,1\n"
+    end
+
+    it "should leave the archive unchanged when the files do not fit" do
+      `head -c 70000 /dev/zero > ./tmp/in/big`
+      `./vfs ./tmp/archive import ./tmp/in`
+
+      expect($?.exitstatus).to eq 12
+      expect(`./vfs ./tmp/archive list`).to eq ""
+    end
+  end
+
+  describe "Extracting files" do
+    before(:each) do
+      `./vfs ./tmp/archive create 64 1024`
+      `echo -n #{random_bytes 100} > ./tmp/a`
+      `echo -n #{random_bytes 2000} > ./tmp/b`
+      `echo -n #{random_bytes 300} > ./tmp/c`
+      `./vfs ./tmp/archive add ./tmp/a a.txt`
+      `./vfs ./tmp/archive add ./tmp/b sub/b.txt`
+      `./vfs ./tmp/archive add ./tmp/c c.bin`
+    end
+
+    it "should write all files into the directory" do
+      `./vfs ./tmp/archive extract ./tmp/out --threads 2`
+
+      expect($?.exitstatus).to eq 0
+      expect(IO.read "./tmp/out/a.txt").to eq IO.read("./tmp/a")
+      expect(IO.read "./tmp/out/sub/b.txt").to eq IO.read("./tmp/b")
+      expect(IO.read "./tmp/out/c.bin").to eq IO.read("./tmp/c")
+    end
+
+    it "should only write the files matching the pattern" do
+      `./vfs ./tmp/archive extract ./tmp/out --glob '*.txt'`
+
+      expect($?.exitstatus).to eq 0
+      expect(File.exists? "./tmp/out/a.txt").to be_true
+      expect(File.exists? "./tmp/out/sub/b.txt").to be_false
+      expect(File.exists? "./tmp/out/c.bin").to be_false
+    end
+
+    it "should not let a star in the pattern match a slash" do
+      `./vfs ./tmp/archive add ./tmp/c sub/deep/d.txt`
+      `./vfs ./tmp/archive extract ./tmp/out --glob 'sub/*'`
+
+      expect($?.exitstatus).to eq 0
+      expect(IO.read "./tmp/out/sub/b.txt").to eq IO.read("./tmp/b")
+      expect(File.exists? "./tmp/out/sub/deep/d.txt").to be_false
+    end
+
+    it "should write the named files and exit with code 21 when one is not in the archive" do
+      `./vfs ./tmp/archive extract ./tmp/out c.bin missing`
+
+      expect($?.exitstatus).to eq 21
+      expect(IO.read "./tmp/out/c.bin").to eq IO.read("./tmp/c")
+      expect(File.exists? "./tmp/out/a.txt").to be_false
+    end
+  end
+
+  describe "Copying in the kernel" do
+    before(:each) do
+      `./vfs ./tmp/archive create 4096 1024`
+      `head -c 1000000 /dev/urandom > ./tmp/large`
+    end
+
+    it "should store and read the same bytes as copying through buffers" do
+      `./vfs ./tmp/archive add ./tmp/large kernel`
+      `VFS_ZERO_COPY=0 ./vfs ./tmp/archive add ./tmp/large buffered`
+
+      ["kernel", "buffered"].each do |name|
+        `./vfs ./tmp/archive get #{name} ./tmp/out`
+        expect(IO.read "./tmp/out").to eq IO.read("./tmp/large")
+
+        `VFS_ZERO_COPY=0 ./vfs ./tmp/archive get #{name} ./tmp/out`
+        expect(IO.read "./tmp/out").to eq IO.read("./tmp/large")
+      end
+    end
+
+    it "should write into pipes" do
+      `./vfs ./tmp/archive add ./tmp/large large`
+
+      `./vfs ./tmp/archive get large /dev/stdout | cat > ./tmp/out`
+
+      expect(IO.read "./tmp/out").to eq IO.read("./tmp/large")
+    end
+  end
+
+  describe "io_uring" do
+    before(:each) do
+      `./vfs ./tmp/archive create 512 4096`
+      `head -c 300000 /dev/urandom > ./tmp/large`
+      `echo -n #{random_bytes 1000} > ./tmp/small`
+    end
+
+    it "should store, read and defragment the same bytes as blocking I/O" do
+      `VFS_URING_DEPTH=8 ./vfs ./tmp/archive add ./tmp/small small1`
+      `VFS_URING_DEPTH=8 ./vfs ./tmp/archive add ./tmp/small small2`
+      `VFS_URING_DEPTH=8 ./vfs ./tmp/archive del small1`
+      `VFS_URING_DEPTH=8 ./vfs ./tmp/archive add ./tmp/large large`
+
+      `VFS_URING_DEPTH=8 VFS_ZERO_COPY=0 ./vfs ./tmp/archive get large ./tmp/out`
+      expect(IO.read "./tmp/out").to eq IO.read("./tmp/large")
+
+      `VFS_URING_DEPTH=8 ./vfs ./tmp/archive del small2`
+      `VFS_URING_DEPTH=8 ./vfs ./tmp/archive defrag`
+
+      expect($?.exitstatus).to eq 0
+
+      `./vfs ./tmp/archive get large ./tmp/out`
+      expect(IO.read "./tmp/out").to eq IO.read("./tmp/large")
+    end
+  end
+
+  describe "Resizing" do
+    before(:each) do
+      `./vfs ./tmp/archive create 10 6`
+      `echo -n #{random_bytes 10} > ./tmp/small`
+      `echo -n #{random_bytes 25} > ./tmp/big`
+      `./vfs ./tmp/archive add ./tmp/small small`
+      `./vfs ./tmp/archive add ./tmp/big big`
+      `./vfs ./tmp/archive del small`
+    end
+
+    it "should add free blocks when growing" do
+      `./vfs ./tmp/archive resize 10`
+
+      expect($?.exitstatus).to eq 0
+      expect(`./vfs ./tmp/archive free`).to eq "70"
+      expect(File.size "./tmp/archive.store").to eq 100
+    end
+
+    it "should move the blocks behind the new end when shrinking" do
+      `./vfs ./tmp/archive resize 3`
+
+      expect($?.exitstatus).to eq 0
+      expect(`./vfs ./tmp/archive list`).to eq "big,25,3,1,2,0\n"
+      expect(File.size "./tmp/archive.store").to eq 30
+
+      `./vfs ./tmp/archive get big ./tmp/out`
+
+      expect(IO.read "./tmp/out").to eq IO.read("./tmp/big")
+    end
+
+    it "should exit with code 41 when the files do not fit" do
+      `./vfs ./tmp/archive resize 2`
+
+      expect($?.exitstatus).to eq 41
+      expect(File.size "./tmp/archive.store").to eq 60
+    end
+  end
+
+  describe "Punching holes" do
+    before(:each) do
+      `./vfs ./tmp/archive create 4096 64`
+      `head -c 65536 /dev/urandom > ./tmp/first`
+      `head -c 65536 /dev/urandom > ./tmp/second`
+      `./vfs ./tmp/archive add ./tmp/first first`
+      `./vfs ./tmp/archive add ./tmp/second second`
+    end
+
+    it "should return the blocks of deleted files to the filesystem" do
+      allocated = File.stat("./tmp/archive.store").blocks
+      `./vfs ./tmp/archive del first --punch`
+
+      expect($?.exitstatus).to eq 0
+      expect(File.stat("./tmp/archive.store").blocks).to be < allocated
+      expect(File.size "./tmp/archive.store").to eq 262144
+
+      `./vfs ./tmp/archive get second ./tmp/out`
+
+      expect(IO.read "./tmp/out").to eq IO.read("./tmp/second")
+    end
+
+    it "should punch all free blocks on trim" do
+      `./vfs ./tmp/archive del first`
+
+      expect(`./vfs ./tmp/archive trim`).to eq "196608"
+      expect(File.stat("./tmp/archive.store").blocks * 512).to be <= 65536 + 4096
+
+      `./vfs ./tmp/archive get second ./tmp/out`
+
+      expect(IO.read "./tmp/out").to eq IO.read("./tmp/second")
+    end
+  end
+
+  describe "Batch mode" do
+    before(:each) do
+      `./vfs ./tmp/archive create 10 100`
+      `echo "test" > ./tmp/file`
+    end
+
+    it "should run all commands and report their exit codes" do
+      IO.write("./tmp/commands", <<-COMMANDS)
+add ./tmp/file file1
+add ./tmp/file file1
+add ./tmp/file file2
+del file1
+get file2 ./tmp/out
+list
+      COMMANDS
+
+      output = `./vfs ./tmp/archive batch ./tmp/commands`
+
+      expect(output).to eq <<-OUTPUT
+0 add ./tmp/file file1
+11 add ./tmp/file file1
+0 add ./tmp/file file2
+0 del file1
+0 get file2 ./tmp/out
+file2,5,1,1
+0 list
+      OUTPUT
+      expect(IO.read("./tmp/out")).to eq "test\n"
+    end
+
+    it "should read commands from stdin and keep the changes" do
+      `printf "add ./tmp/file a\\ b\ndel missing\n" | ./vfs ./tmp/archive batch --checkpoint 1`
+
+      expect(`./vfs ./tmp/archive list`).to eq "a b,5,1,0\n"
+    end
+  end
+
+  describe "Server" do
+    before(:each) do
+      `./vfs ./tmp/archive create 10 100`
+      `echo "test" > ./tmp/file`
+
+      @server = Process.spawn("./vfs ./tmp/archive serve ./tmp/socket --threads 2")
+      100.times { File.exists?("./tmp/socket") ? break : sleep(0.05) }
+    end
+
+    after(:each) do
+      Process.kill("TERM", @server)
+      Process.wait(@server)
+    end
+
+    def client command
+      `VFS_SOCKET=./tmp/socket ./vfs ./tmp/archive #{command}`
+    end
+
+    it "should answer commands from clients" do
+      client "add ./tmp/file file1"
+      client "add ./tmp/file file2"
+      client "del file1"
+
+      expect(client "list").to eq "file2,5,1,1\n"
+      expect(client "used").to eq "10"
+
+      client "get file2 ./tmp/out"
+
+      expect(IO.read("./tmp/out")).to eq "test\n"
+    end
+
+    it "should report the same exit codes as without a server" do
+      client "add ./tmp/file file1"
+      client "add ./tmp/file file1"
+
+      expect($?.exitstatus).to eq 11
+
+      client "get missing ./tmp/out"
+
+      expect($?.exitstatus).to eq 21
+    end
+
+    it "should answer other clients while an upload is still being received" do
+      words = [File.realpath("./tmp/archive.structure"), "add", "slow"]
+      upload = UNIXSocket.new("./tmp/socket")
+      upload.write([words.length].pack("L<") + words.map { |word| [word.bytesize, word].pack("L<a*") }.join)
+      upload.write([25].pack("Q<") + "a" * 10)
+      upload.flush
+
+      Timeout.timeout(5) do
+        expect(client "list").to eq ""
+        expect(client "used").to eq "30"
+
+        client "add ./tmp/file slow"
+
+        expect($?.exitstatus).to eq 11
+      end
+
+      upload.write("a" * 15)
+      upload.close_write
+      upload.read
+
+      expect(client "list").to eq "slow,25,3,0,1,2\n"
+
+      client "get slow ./tmp/out"
+
+      expect(IO.read("./tmp/out")).to eq "a" * 25
+    end
+
+    it "should keep other processes from changing the archive" do
+      `./vfs ./tmp/archive add ./tmp/file local`
+      expect($?.exitstatus).to eq 2
+
+      client "add ./tmp/file file1"
+      client "append file1 ./tmp/file"
+      expect($?.exitstatus).to eq 2
+      `./vfs ./tmp/archive append file1 ./tmp/file`
+      expect($?.exitstatus).to eq 2
+
+      expect(client "get file1 -").to eq "test\n"
+      expect(`./vfs ./tmp/archive list`).to eq "file1,5,1,0\n"
+    end
+
+    it "should keep changes after it stops" do
+      client "add ./tmp/file file1"
+
+      Process.kill("TERM", @server)
+      Process.wait(@server)
+      @server = Process.spawn("true")
+
+      expect(`./vfs ./tmp/archive list`).to eq "file1,5,1,0\n"
+    end
+  end
+
+  describe "Archives in the old format" do
+    before(:each) do
+      # 3 blocks of 4 bytes, "ab" in block 2 and "cdefgh" in blocks 0 and 1
+      structure = [4, 3, 1, 1, 0, 2].pack("Q<2q<3Q<")
+      structure << [1, "x", 2].pack("l<a*Q<")
+      structure << [1, "y", 6].pack("l<a*Q<")
+
+      IO.binwrite("./tmp/archive.structure", structure)
+      IO.binwrite("./tmp/archive.store", "cdefghxxab\0\0")
+    end
+
+    it "should list their files" do
+      output = `./vfs ./tmp/archive list`
+
+      expect(output).to eq "x,2,1,2\ny,6,2,0,1\n"
+    end
+
+    it "should read their files" do
+      `./vfs ./tmp/archive get y ./tmp/out`
+
+      expect(IO.read("./tmp/out")).to eq "cdefgh"
+    end
+
+    it "should keep their files when the structure is rewritten in the new format" do
+      `./vfs ./tmp/archive defrag`
+
+      expect(IO.binread("./tmp/archive.structure", 8)).to eq "HHUVFS\0\0"
+      expect(`./vfs ./tmp/archive list`).to eq "x,2,1,2\ny,6,2,0,1\n"
+      expect(`./vfs ./tmp/archive get y -`).to eq "cdefgh"
+    end
+  end
+
+  describe "Metadata journal" do
+    before(:each) do
+      `./vfs ./tmp/archive create 10 100`
+      `echo "test" > ./tmp/file`
+    end
+
+    it "should record changes without rewriting the structure file" do
+      structure = IO.binread("./tmp/archive.structure")
+
+      `./vfs ./tmp/archive add ./tmp/file file1`
+      `./vfs ./tmp/archive add ./tmp/file file2`
+      `./vfs ./tmp/archive del file1`
+
+      expect(IO.binread("./tmp/archive.structure")).to eq structure
+      expect(`./vfs ./tmp/archive list`).to eq "file2,5,1,1\n"
+    end
+
+    it "should ignore an incomplete last entry" do
+      `./vfs ./tmp/archive add ./tmp/file file1`
+      File.open("./tmp/archive.journal", "ab") { |f| f.write("\x20\0\0\0garbage") }
+
+      expect(`./vfs ./tmp/archive list`).to eq "file1,5,1,0\n"
+
+      `./vfs ./tmp/archive add ./tmp/file file2`
+
+      expect(`./vfs ./tmp/archive list`).to eq "file1,5,1,0\nfile2,5,1,1\n"
+    end
+
+    it "should drop deleted files when the structure is rewritten" do
+      `./vfs ./tmp/other create 10 100`
+      `./vfs ./tmp/other add ./tmp/file keep`
+      `./vfs ./tmp/other defrag`
+
+      `printf "add ./tmp/file gone\ndel gone\n%.0s" $(seq 50) | ./vfs ./tmp/archive batch`
+      `./vfs ./tmp/archive add ./tmp/file keep`
+      `./vfs ./tmp/archive defrag`
+
+      expect(File.size("./tmp/archive.structure")).to eq File.size("./tmp/other.structure")
+      expect(`./vfs ./tmp/archive list`).to eq "keep,5,1,0\n"
+    end
   end
 end
@@ -1,8 +1,42 @@
+#define _POSIX_C_SOURCE 200809L
+#define _XOPEN_SOURCE 700
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdarg.h>
 #include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/syscall.h>
+#include <errno.h>
+#ifndef HAVE_IO_URING
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#endif
+#endif
+#endif
+#if HAVE_IO_URING
+#include <linux/io_uring.h>
+#endif
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <pthread.h>
+#include <signal.h>
+#include <limits.h>
+#include <fnmatch.h>
+#include <dirent.h>
 
 bool file_exists (const char* file) {
   FILE* handle = fopen(file, "r");
@@ -59,355 +93,3639 @@ int file_read (void* ptr, size_t size, size_t count, FILE* file) {
   return ferror(file);
 }
 
-struct FileInfo {
-  /**
-   * Dateiname
-   */
-  char* name;
+/**
+ * Schreibt size Bytes in den Dateideskriptor fd und gibt bei Erfolg 0 zurück.
+ */
+int file_write_fd (int fd, const void* data, size_t size) {
+  while (size > 0) {
+    ssize_t done = write(fd, data, size);
 
-  /**
-   * Dateigröße in Bytes
-   */
-  uint64_t size;
-};
+    if (done <= 0) {
+      return -1;
+    }
 
-struct FileInfo* fileinfo_create () {
-  struct FileInfo* file_info = malloc(sizeof(struct FileInfo));
-  file_info->name = NULL;
-  file_info->size = 0;
+    data = (const char*)data + done;
+    size -= done;
+  }
 
-  return file_info;
+  return 0;
 }
 
-void fileinfo_initialize (struct FileInfo* file_info, const char* name, long int size) {
-  file_info->name = malloc((strlen(name) + 1) * sizeof(char));
-  strcpy(file_info->name, name);
+/**
+ * Ein Lese- oder Schreibauftrag für num_iov Puffer ab offset
+ */
+struct IoRequest {
+  bool write;
+  struct iovec* iov;
+  int num_iov;
+  off_t offset;
+};
 
-  file_info->size = size;
-}
+/**
+ * Rückt den Auftrag um done erledigte Bytes vor. Gibt zurück, ob er damit
+ * fertig ist.
+ */
+bool iorequest_advance (struct IoRequest* request, size_t done) {
+  request->offset += done;
 
-int fileinfo_initialize_from_file (struct FileInfo* file_info, FILE* file) {
-  int status = 0;
-  int name_length;
+  while (request->num_iov > 0 && done >= request->iov->iov_len) {
+    done -= request->iov->iov_len;
+    request->iov++;
+    request->num_iov--;
+  }
 
-  status = file_read(&name_length, sizeof(int), 1, file);
+  if (request->num_iov > 0) {
+    request->iov->iov_base = (char*)request->iov->iov_base + done;
+    request->iov->iov_len -= done;
+  }
 
-  file_info->name = malloc((name_length + 1) * sizeof(char));
+  return request->num_iov == 0;
+}
 
-  status == 0 && (status = file_read(file_info->name, sizeof(char), name_length, file));
+/**
+ * Führt den Auftrag mit preadv oder pwritev auf fd aus und gibt bei Erfolg 0
+ * zurück.
+ */
+int iorequest_run (struct IoRequest* request, int fd) {
+  while (request->num_iov > 0) {
+    ssize_t done;
 
-  file_info->name[name_length] = 0;
+    if (request->write) {
+      done = pwritev(fd, request->iov, request->num_iov, request->offset);
+    } else {
+      done = preadv(fd, request->iov, request->num_iov, request->offset);
+    }
 
-  status == 0 && (status = file_read(&file_info->size, sizeof(uint64_t), 1, file));
+    if (done <= 0) {
+      return -1;
+    }
 
-  return status;
+    iorequest_advance(request, done);
+  }
+
+  return 0;
 }
 
-int fileinfo_write (struct FileInfo* file_info, FILE* file) {
-  int status = 0;
-  int name_length = strlen(file_info->name);
+#if HAVE_IO_URING
+/**
+ * Ein io_uring, über den Aufträge asynchron ausgeführt werden, sodass bis zu
+ * depth gleichzeitig beim Gerät liegen. Benutzt direkt die Systemaufrufe,
+ * weil liburing nicht vorausgesetzt wird.
+ */
+struct Uring {
+  int fd;
+  unsigned depth;
+
+  unsigned* sq_head;
+  unsigned* sq_tail;
+  unsigned* sq_mask;
+  unsigned* sq_array;
+  struct io_uring_sqe* sqes;
+
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned* cq_mask;
+  struct io_uring_cqe* cqes;
+
+  void* sq_ring;
+  size_t sq_ring_size;
+  void* cq_ring;
+  size_t cq_ring_size;
+  size_t sqes_size;
+};
 
-  status = file_write(&name_length, sizeof(int), 1, file);
-  status == 0 && (status = file_write(file_info->name, sizeof(char), strlen(file_info->name), file));
-  status == 0 && (status = file_write(&file_info->size, sizeof(uint64_t), 1, file));
+/**
+ * Legt einen io_uring mit depth Einträgen an. Gibt NULL zurück, wenn der
+ * Kernel das nicht kann oder darf.
+ */
+struct Uring* uring_create (unsigned depth) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
 
-  return status;
-}
+  int fd = syscall(__NR_io_uring_setup, depth, &params);
 
-void fileinfo_free (struct FileInfo* file_info) {
-  free(file_info->name);
-  free(file_info);
-}
+  if (fd < 0) {
+    return NULL;
+  }
 
-struct ArchiveInfo {
-  /**
-   * Größe eines Blocks in Bytes
-   */
-  uint64_t blocksize;
+  struct Uring* ring = malloc(sizeof(struct Uring));
+  ring->fd = fd;
+  ring->depth = params.sq_entries;
+  ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
 
-  /**
-   * Anzahl der Blöcke im Archiv
-   */
-  uint64_t blockcount;
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    ring->sq_ring_size = ring->sq_ring_size > ring->cq_ring_size ? ring->sq_ring_size : ring->cq_ring_size;
+    ring->cq_ring_size = ring->sq_ring_size;
+  }
 
-  /**
-   * Enthält für jeden Block ein int. Wenn der Werte -1 ist, ist der Block frei,
-   * ansonsten gehört er zu der i-ten FileInfo.
-   */
-  int64_t* blocks;
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  ring->cq_ring = ring->sq_ring;
 
-  /**
-   * Anzahl der Dateien im Archiv/Element in file_infos
-   */
-  uint64_t num_files;
+  if (ring->sq_ring != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+  }
 
-  struct FileInfo** file_infos;
-}; 
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
 
-struct ArchiveInfo* archiveinfo_create () {
-  struct ArchiveInfo* archive_info = malloc(sizeof(struct ArchiveInfo));
-  archive_info->blocksize = 0;
-  archive_info->blockcount = 0;
-  archive_info->blocks = NULL;
-  archive_info->num_files = 0;
-  archive_info->file_infos = NULL;
+  if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+    if (ring->sqes != MAP_FAILED) {
+      munmap(ring->sqes, ring->sqes_size);
+    }
 
-  return archive_info;
+    if (ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring) {
+      munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+
+    if (ring->sq_ring != MAP_FAILED) {
+      munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+
+    close(fd);
+    free(ring);
+
+    return NULL;
+  }
+
+  char* sq = ring->sq_ring;
+  ring->sq_head = (unsigned*)(sq + params.sq_off.head);
+  ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+  ring->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+
+  char* cq = ring->cq_ring;
+  ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+  ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+  ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+  return ring;
 }
 
 /**
- * Initialisiert ein ArchiveInfo für ein leeres Archiv.
+ * Stellt den Auftrag index in die Submission Queue.
+ *
+ * @private
  */
-int archiveinfo_initialize_empty (struct ArchiveInfo* archive_info, uint64_t blocksize, uint64_t blockcount) {
-  archive_info->blocksize = blocksize;
-  archive_info->blockcount = blockcount;
-  archive_info->blocks = malloc(blockcount * sizeof(int64_t));
-
-  memset(archive_info->blocks, -1, blockcount * sizeof(int64_t));
-
-  return 0;
+void uring_prepare (struct Uring* ring, int fd, struct IoRequest* request, uint64_t index) {
+  unsigned tail = *ring->sq_tail;
+  unsigned slot = tail & *ring->sq_mask;
+  struct io_uring_sqe* sqe = &ring->sqes[slot];
+
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  sqe->opcode = request->write ? IORING_OP_WRITEV : IORING_OP_READV;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t)(uintptr_t)request->iov;
+  sqe->len = request->num_iov;
+  sqe->off = request->offset;
+  sqe->user_data = index;
+
+  ring->sq_array[slot] = slot;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
 }
 
 /**
- * Lädt Archivinfos aus einer Datei.
+ * Führt die num_requests Aufträge auf fd aus, wobei bis zu depth gleichzeitig
+ * unterwegs sind. Wird ein Auftrag nur teilweise erledigt, wird der Rest
+ * blockierend nachgeholt. Nach einem Fehler werden keine Aufträge mehr
+ * gestellt, die eingereichten aber noch abgewartet, damit der Aufrufer ihre
+ * Puffer danach freigeben kann. Gibt bei Erfolg 0 zurück.
  */
-int archiveinfo_initialize_from_file (struct ArchiveInfo* archive_info, FILE* file) {
+int uring_run (struct Uring* ring, int fd, struct IoRequest* requests, uint64_t num_requests) {
+  uint64_t next = 0;
+  uint64_t in_flight = 0;
+  unsigned to_submit = 0;
   int status = 0;
 
-  status == 0 && (status = file_read(archive_info, sizeof(uint64_t), 2, file));
+  while (next < num_requests || in_flight > 0) {
+    while (status == 0 && next < num_requests && in_flight < ring->depth) {
+      uring_prepare(ring, fd, &requests[next], next);
+      next++;
+      in_flight++;
+      to_submit++;
+    }
 
-  archive_info->blocks = malloc(archive_info->blockcount * sizeof(uint64_t));
+    if (status != 0 && in_flight == 0) {
+      break;
+    }
 
-  status == 0 && (status = file_read(archive_info->blocks, sizeof(int64_t), archive_info->blockcount, file));
-  status == 0 && (status = file_read(&archive_info->num_files, sizeof(uint64_t), 1, file));
+    int submitted = syscall(__NR_io_uring_enter, ring->fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
 
-  archive_info->file_infos = malloc(archive_info->num_files * sizeof(struct FileInfo*));
+    if (submitted < 0 && errno != EINTR) {
+      /* Nicht eingereichte Aufträge zurücknehmen; die eingereichten benutzen die Puffer noch und werden abgewartet */
+      unsigned unsubmitted = *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+      struct timespec pause = { 0, 1000000 };
 
-  uint64_t i;
-  for (i = 0; i < archive_info->num_files && status == 0; i++) {
-    archive_info->file_infos[i] = fileinfo_create();
-    status = fileinfo_initialize_from_file(archive_info->file_infos[i], file);
-  }
+      __atomic_store_n(ring->sq_tail, *ring->sq_tail - unsubmitted, __ATOMIC_RELEASE);
+      in_flight -= unsubmitted;
+      to_submit = 0;
+      status = -1;
 
-  return status;
-}
+      /* Geht auch das Warten nicht, laufen die Abschlüsse beim nächsten Systemaufruf ein */
+      in_flight > 0 && nanosleep(&pause, NULL);
+    }
 
-int archiveinfo_write (struct ArchiveInfo* archive_info, FILE* file) {
-  int status = 0;
+    to_submit -= submitted > 0 ? (unsigned)submitted : 0;
 
-  status == 0 && (status = file_write(archive_info, sizeof(uint64_t), 2, file));
-  status == 0 && (status = file_write(archive_info->blocks, sizeof(int64_t), archive_info->blockcount, file));
-  status == 0 && (status = file_write(&archive_info->num_files, sizeof(uint64_t), 1, file));
+    unsigned head = *ring->cq_head;
 
-  uint64_t i;
-  for (i = 0; i < archive_info->num_files && status == 0; i++) {
-    status = fileinfo_write(archive_info->file_infos[i], file);
-  }
+    while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+      struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+      struct IoRequest* request = &requests[cqe->user_data];
 
-  return status;
-}
+      if (cqe->res <= 0) {
+        status = -1;
+      } else if (!iorequest_advance(request, cqe->res) && iorequest_run(request, fd) != 0) {
+        status = -1;
+      }
 
-bool archiveinfo_has_file (struct ArchiveInfo* archive_info, const char* name) {
-  uint64_t i;
-  for (i = 0; i < archive_info->num_files; i++) {
-    if (strcmp(name, archive_info->file_infos[i]->name) == 0) {
-      return true;
+      in_flight--;
+      head++;
     }
+
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
   }
 
-  return false;
+  return status;
 }
 
-/**
- * Gibt die Anzahl der freien Blöcke im Archiv zurück.
- */
-uint64_t archiveinfo_num_free_blocks (struct ArchiveInfo* archive_info) {
-  uint64_t num_free = 0;
+void uring_free (struct Uring* ring) {
+  munmap(ring->sqes, ring->sqes_size);
 
-  uint64_t i;
-  for (i = 0; i < archive_info->blockcount; i++) {
-    if (archive_info->blocks[i] == -1) {
-      num_free++;
-    }
+  if (ring->cq_ring != ring->sq_ring) {
+    munmap(ring->cq_ring, ring->cq_ring_size);
   }
 
-  return num_free;
+  munmap(ring->sq_ring, ring->sq_ring_size);
+  close(ring->fd);
+  free(ring);
 }
-
+#else
 /**
- * Gibt die Anzahl der freien Blöcke zurück, die benötigt werden, um eine Datei
- * der Größe size zu speichern.
+ * Ohne linux/io_uring.h gibt es keinen io_uring, gearbeitet wird blockierend.
  */
-uint64_t archiveinfo_needed_blocks (struct ArchiveInfo* archive_info, long int size) {
-  uint64_t needed = size / archive_info->blocksize;
+struct Uring {
+  int fd;
+};
 
-  if (size % archive_info->blocksize != 0) {
-    needed++;
-  }
+struct Uring* uring_create (unsigned depth) {
+  (void)depth;
 
-  return needed;
+  return NULL;
 }
 
-/**
- * Schreibt die Indizes von num freien Blöcken in das Array blocks.
- */
-void archiveinfo_get_free_blocks (struct ArchiveInfo* archive_info, uint64_t* blocks, uint64_t num) {
-  uint64_t block_index = 0;
-  uint64_t i;
-  for (i = 0; i < archive_info->blockcount && block_index < num; i++) {
-    if (archive_info->blocks[i] == -1) {
-      blocks[block_index] = i;
-      block_index++;
-    }
-  }
+int uring_run (struct Uring* ring, int fd, struct IoRequest* requests, uint64_t num_requests) {
+  (void)ring;
+  (void)fd;
+  (void)requests;
+  (void)num_requests;
+
+  return -1;
+}
+
+void uring_free (struct Uring* ring) {
+  free(ring);
 }
+#endif
 
 /**
- * Gibt den Index der Datei in der internen Liste der Dateien zurück.
- *
- * @private
+ * Ein wachsender Speicherbereich, in dem Daten zusammengestellt werden.
  */
-int64_t archiveinfo_get_file_index (struct ArchiveInfo* archive_info, const char* name) {
-  uint64_t i;
-  for (i = 0; i < archive_info->num_files; i++) {
-    if (strcmp(name, archive_info->file_infos[i]->name) == 0) {
-      return i;
-    }
-  }
+struct Buffer {
+  char* data;
 
-  return -1;
-}
+  /**
+   * Anzahl der benutzten Bytes
+   */
+  size_t length;
 
-uint64_t archiveinfo_get_file_size (struct ArchiveInfo* archive_info, const char* name) {
-  int64_t index = archiveinfo_get_file_index(archive_info, name);
+  /**
+   * Anzahl der reservierten Bytes
+   */
+  size_t capacity;
+};
 
-  if (index == -1) {
-    return 0;
-  } else {
-    return archive_info->file_infos[index]->size;
-  }
+struct Buffer* buffer_create () {
+  struct Buffer* buffer = malloc(sizeof(struct Buffer));
+  buffer->data = NULL;
+  buffer->length = 0;
+  buffer->capacity = 0;
+
+  return buffer;
 }
 
-uint64_t archiveinfo_get_num_allocated_blocks (struct ArchiveInfo* archive_info, const char* name) {
-  int index = archiveinfo_get_file_index(archive_info, name);
+/**
+ * Hängt size Bytes aus data an.
+ */
+void buffer_append (struct Buffer* buffer, const void* data, size_t size) {
+  if (size == 0) {
+    return;
+  }
 
-  if (index == -1) {
-    return 0;
-  } else {
-    uint64_t num = 0;
+  if (buffer->length + size > buffer->capacity) {
+    buffer->capacity = buffer->capacity == 0 ? 64 : buffer->capacity;
 
-    uint64_t i;
-    for (i = 0; i < archive_info->blockcount; i++) {
-      if (archive_info->blocks[i] == index) {
-        num++;
-      }
+    while (buffer->length + size > buffer->capacity) {
+      buffer->capacity *= 2;
     }
 
-    return num;
+    buffer->data = realloc(buffer->data, buffer->capacity);
   }
+
+  memcpy(buffer->data + buffer->length, data, size);
+  buffer->length += size;
 }
 
-void archiveinfo_get_allocated_blocks (struct ArchiveInfo* archive_info, const char* name, uint64_t* blocks) {
-  int index = archiveinfo_get_file_index(archive_info, name);
+void buffer_clear (struct Buffer* buffer) {
+  buffer->length = 0;
+}
 
-  if (index != -1) {
-    int block_index = 0;
-    uint64_t i;
-    for (i = 0; i < archive_info->blockcount; i++) {
-      if (archive_info->blocks[i] == index) {
-        blocks[block_index] = i;
-        block_index++;
-      }
-    }
-  }
+void buffer_free (struct Buffer* buffer) {
+  free(buffer->data);
+  free(buffer);
 }
 
 /**
- * Fügt eine neue Datei hinzu und reserviert die übergebenen Blöcke dafür.
+ * Liest size Bytes ab position aus data, das length Bytes lang ist, und
+ * verschiebt position dahinter. Gibt false zurück, wenn data zu kurz ist.
  */
-void archiveinfo_add_file (struct ArchiveInfo* archive_info, const char* name, long int size, uint64_t* blocks, uint64_t num_blocks) {
-  int file_info_index = archive_info->num_files;
-
-  archive_info->num_files++;
-  archive_info->file_infos = realloc(archive_info->file_infos, (archive_info->num_files) * sizeof(struct FileInfo*));
-  archive_info->file_infos[file_info_index] = fileinfo_create();
-  fileinfo_initialize(archive_info->file_infos[file_info_index], name, size);
+bool buffer_take (const char* data, uint64_t length, uint64_t* position, void* out, uint64_t size) {
+  if (length < size || *position > length - size) {
+    return false;
+  } else {
+    memcpy(out, data + *position, size);
+    *position += size;
 
-  uint64_t i;
-  for (i = 0; i < num_blocks; i++) {
-    archive_info->blocks[blocks[i]] = file_info_index;
+    return true;
   }
 }
 
-void archiveinfo_delete_file (struct ArchiveInfo* archive_info, const char* name) {
-  int index = archiveinfo_get_file_index(archive_info, name);
+/**
+ * Länge der Präfixe, nach denen lz_compress sucht
+ */
+#define LZ_MIN_MATCH 4
 
-  if (index != -1) {
-    uint64_t i;
-    for (i = index; i < archive_info->num_files - 1; i++) {
-      archive_info->file_infos[i] = archive_info->file_infos[i + 1];
+/**
+ * lz_compress merkt sich 2^LZ_HASH_BITS Positionen
+ */
+#define LZ_HASH_BITS 12
+
+/**
+ * Hängt den Teil einer Länge an, der nicht mehr in die 4 Bits des Tokens
+ * passt: so viele Bytes 255 wie nötig und ein letztes kleineres Byte. Gibt
+ * false zurück, wenn out vorher end erreicht.
+ *
+ * @private
+ */
+bool lz_put_length (uint8_t** out, uint8_t* end, uint64_t length) {
+  while (length >= 255) {
+    if (*out == end) {
+      return false;
     }
 
-    archive_info->num_files--;
-    archive_info->file_infos = realloc(archive_info->file_infos, archive_info->num_files * sizeof(struct FileInfo*));
+    *(*out)++ = 255;
+    length -= 255;
+  }
 
-    for (i = 0; i < archive_info->blockcount; i++) {
-      if (archive_info->blocks[i] == index) {
-        archive_info->blocks[i] = -1;
-      } else if (archive_info->blocks[i] > index) {
-        archive_info->blocks[i]--;
-      }
-    }
+  if (*out == end) {
+    return false;
   }
+
+  *(*out)++ = length;
+
+  return true;
 }
 
 /**
- * Gibt die Anzahl belegter Blöcke zurück.
+ * Liest eine Länge, deren Token 15 enthielt, weiter und addiert sie auf
+ * *length.
  *
  * @private
  */
-uint64_t archiveinfo_count_allocated_blocks (struct ArchiveInfo* archive_info) {
-  uint64_t count = 0;
-  uint64_t i;
-  for (i = 0; i < archive_info->blockcount; i++) {
-    if (archive_info->blocks[i] != -1) {
-      count++;
+bool lz_get_length (const uint8_t** in, const uint8_t* end, uint64_t* length) {
+  uint8_t byte;
+
+  do {
+    if (*in == end) {
+      return false;
     }
-  }
 
-  return count;
+    byte = *(*in)++;
+    *length += byte;
+  } while (byte == 255);
+
+  return true;
 }
 
 /**
- * Gibt die verbrauchten Bytes zurück.
+ * Hängt eine Sequenz an: ein Token mit den Längen, num_literals Bytes aus
+ * literals und eine Wiederholung von match_length Bytes, die offset Bytes
+ * zurückliegen. Die letzte Sequenz hat keine Wiederholung (match_length 0).
  *
- * Dabei werden Bytes allerdings blockweise addiert.
+ * @private
  */
-uint64_t archiveinfo_used_bytes (struct ArchiveInfo* archive_info) {
-  return archiveinfo_count_allocated_blocks(archive_info) * archive_info->blocksize;
-}
+bool lz_put_sequence (uint8_t** out, uint8_t* end, const uint8_t* literals, uint64_t num_literals, uint64_t offset, uint64_t match_length) {
+  uint64_t match_code = match_length == 0 ? 0 : match_length - LZ_MIN_MATCH;
 
-/**
- * Gibt die Bytes in freien Blöcken zurück.
- */
-uint64_t archiveinfo_free_bytes (struct ArchiveInfo* archive_info) {
-  return (archive_info->blockcount * archive_info->blocksize) - archiveinfo_used_bytes(archive_info);
-}
+  if (*out == end) {
+    return false;
+  }
 
-void archiveinfo_free (struct ArchiveInfo* archive_info) {
-  free(archive_info->blocks);
+  *(*out)++ = (num_literals < 15 ? num_literals : 15) << 4 | (match_code < 15 ? match_code : 15);
 
-  uint64_t i;
-  for (i = 0; i < archive_info->num_files; i++) {
-    fileinfo_free(archive_info->file_infos[i]);
+  if (num_literals >= 15 && !lz_put_length(out, end, num_literals - 15)) {
+    return false;
+  } else if ((uint64_t)(end - *out) < num_literals) {
+    return false;
   }
 
-  free(archive_info->file_infos);
-
-  free(archive_info); 
-}
+  memcpy(*out, literals, num_literals);
+  *out += num_literals;
 
-#define ARCHIVE_ALREADY_EXISTS 1
+  if (match_length == 0) {
+    return true;
+  } else if (end - *out < 2) {
+    return false;
+  }
+
+  *(*out)++ = offset & 0xff;
+  *(*out)++ = offset >> 8;
+
+  return match_code < 15 || lz_put_length(out, end, match_code - 15);
+}
+
+/**
+ * Komprimiert length Bytes aus input nach output, in das höchstens capacity
+ * Bytes passen. Das Format ist das der Blöcke von LZ4: Sequenzen aus
+ * unveränderten Bytes und Wiederholungen aus den letzten 64 KiB. Gesucht wird
+ * über eine Hashtabelle der zuletzt gesehenen Stelle jedes 4-Byte-Präfixes,
+ * was schnell ist, aber nicht jede Wiederholung findet.
+ *
+ * Gibt die Länge der komprimierten Daten zurück oder 0, wenn sie nicht in
+ * output passen.
+ */
+uint64_t lz_compress (const char* input, uint64_t length, char* output, uint64_t capacity) {
+  const uint8_t* in = (const uint8_t*)input;
+  uint8_t* out = (uint8_t*)output;
+  uint8_t* end = out + capacity;
+
+  /* Position + 1 des letzten Vorkommens, 0 für keins */
+  uint64_t table[1 << LZ_HASH_BITS];
+  memset(table, 0, sizeof(table));
+
+  uint64_t anchor = 0;
+  uint64_t i = 0;
+
+  while (i + LZ_MIN_MATCH <= length) {
+    uint32_t word, other;
+    memcpy(&word, in + i, sizeof(uint32_t));
+
+    uint32_t hash = (word * 2654435761u) >> (32 - LZ_HASH_BITS);
+    uint64_t candidate = table[hash];
+    table[hash] = i + 1;
+
+    if (candidate == 0 || i - (candidate - 1) > 65535) {
+      i++;
+      continue;
+    }
+
+    uint64_t match = candidate - 1;
+    memcpy(&other, in + match, sizeof(uint32_t));
+
+    if (other != word) {
+      i++;
+      continue;
+    }
+
+    uint64_t match_length = LZ_MIN_MATCH;
+
+    while (i + match_length < length && in[match + match_length] == in[i + match_length]) {
+      match_length++;
+    }
+
+    if (!lz_put_sequence(&out, end, in + anchor, i - anchor, i - match, match_length)) {
+      return 0;
+    }
+
+    i += match_length;
+    anchor = i;
+  }
+
+  if (!lz_put_sequence(&out, end, in + anchor, length - anchor, 0, 0)) {
+    return 0;
+  }
+
+  return out - (uint8_t*)output;
+}
+
+/**
+ * Entpackt length Bytes aus input, die von lz_compress kommen, in genau size
+ * Bytes in output. Gibt false zurück, wenn die Daten kaputt sind.
+ */
+bool lz_decompress (const char* input, uint64_t length, char* output, uint64_t size) {
+  const uint8_t* in = (const uint8_t*)input;
+  const uint8_t* in_end = in + length;
+  uint8_t* out = (uint8_t*)output;
+  uint8_t* out_end = out + size;
+
+  while (in < in_end) {
+    uint8_t token = *in++;
+    uint64_t num_literals = token >> 4;
+    uint64_t match_length = token & 15;
+
+    if (num_literals == 15 && !lz_get_length(&in, in_end, &num_literals)) {
+      return false;
+    } else if (num_literals > (uint64_t)(in_end - in) || num_literals > (uint64_t)(out_end - out)) {
+      return false;
+    }
+
+    memcpy(out, in, num_literals);
+    in += num_literals;
+    out += num_literals;
+
+    if (in == in_end) {
+      break;
+    } else if (in_end - in < 2) {
+      return false;
+    }
+
+    uint64_t offset = in[0] | in[1] << 8;
+    in += 2;
+
+    if (match_length == 15 && !lz_get_length(&in, in_end, &match_length)) {
+      return false;
+    }
+
+    match_length += LZ_MIN_MATCH;
+
+    if (offset == 0 || offset > (uint64_t)(out - (uint8_t*)output) || match_length > (uint64_t)(out_end - out)) {
+      return false;
+    }
+
+    if (offset >= match_length) {
+      memcpy(out, out - offset, match_length);
+    } else {
+      /* Byteweise, weil sich die Wiederholung mit sich selbst überlappt */
+      uint64_t i;
+      for (i = 0; i < match_length; i++) {
+        out[i] = out[i - offset];
+      }
+    }
+
+    out += match_length;
+  }
+
+  return out == out_end;
+}
+
+/**
+ * Ein zusammenhängender Bereich von Blöcken im Archiv.
+ */
+struct Extent {
+  /**
+   * Index des ersten Blocks
+   */
+  uint64_t start;
+
+  /**
+   * Anzahl der Blöcke
+   */
+  uint64_t length;
+};
+
+struct FileInfo {
+  /**
+   * Dateiname
+   */
+  char* name;
+
+  /**
+   * Dateigröße in Bytes
+   */
+  uint64_t size;
+
+  /**
+   * Wie viele Bytes die Datei im Store belegt. Bei komprimierten Archiven die
+   * Länge der komprimierten Daten, sonst gleich size.
+   */
+  uint64_t stored_size;
+
+  /**
+   * Anzahl der Elemente in extents
+   */
+  uint64_t num_extents;
+
+  /**
+   * Für wie viele Extents in extents Platz reserviert ist
+   */
+  uint64_t extent_capacity;
+
+  /**
+   * Die Blöcke der Datei in der Reihenfolge ihres Inhalts
+   */
+  struct Extent* extents;
+
+  /**
+   * Fingerabdruck jedes Blocks, in komprimierten Archiven jedes Stücks, über
+   * die Bytes der Datei darin, oder NULL, wenn keiner bekannt ist. Einzelne
+   * unbekannte sind 0. Bei Deduplizierung immer NULL, dort steht der
+   * Fingerabdruck jedes Blocks in block_hashes.
+   */
+  uint64_t* hashes;
+};
+
+struct FileInfo* fileinfo_create () {
+  struct FileInfo* file_info = malloc(sizeof(struct FileInfo));
+  file_info->name = NULL;
+  file_info->size = 0;
+  file_info->stored_size = 0;
+  file_info->num_extents = 0;
+  file_info->extent_capacity = 0;
+  file_info->extents = NULL;
+  file_info->hashes = NULL;
+
+  return file_info;
+}
+
+void fileinfo_initialize (struct FileInfo* file_info, const char* name, long int size) {
+  file_info->name = malloc((strlen(name) + 1) * sizeof(char));
+  strcpy(file_info->name, name);
+
+  file_info->size = size;
+  file_info->stored_size = size;
+}
+
+int fileinfo_initialize_from_file (struct FileInfo* file_info, FILE* file) {
+  int status = 0;
+  int name_length;
+
+  status = file_read(&name_length, sizeof(int), 1, file);
+
+  file_info->name = malloc((name_length + 1) * sizeof(char));
+
+  status == 0 && (status = file_read(file_info->name, sizeof(char), name_length, file));
+
+  file_info->name[name_length] = 0;
+
+  status == 0 && (status = file_read(&file_info->size, sizeof(uint64_t), 1, file));
+
+  return status;
+}
+
+/**
+ * Liest die Extents der Datei aus einer Strukturdatei.
+ */
+int fileinfo_read_extents (struct FileInfo* file_info, FILE* file) {
+  int status = 0;
+  uint64_t num_extents = 0;
+
+  status = file_read(&num_extents, sizeof(uint64_t), 1, file);
+
+  if (status == 0) {
+    file_info->num_extents = num_extents;
+    file_info->extent_capacity = num_extents;
+    file_info->extents = malloc(num_extents * sizeof(struct Extent));
+
+    status = file_read(file_info->extents, sizeof(struct Extent), num_extents, file);
+  }
+
+  return status;
+}
+
+int fileinfo_write_extents (struct FileInfo* file_info, FILE* file) {
+  int status = 0;
+
+  status = file_write(&file_info->num_extents, sizeof(uint64_t), 1, file);
+  status == 0 && (status = file_write(file_info->extents, sizeof(struct Extent), file_info->num_extents, file));
+
+  return status;
+}
+
+int fileinfo_write (struct FileInfo* file_info, FILE* file) {
+  int status = 0;
+  int name_length = strlen(file_info->name);
+
+  status = file_write(&name_length, sizeof(int), 1, file);
+  status == 0 && (status = file_write(file_info->name, sizeof(char), strlen(file_info->name), file));
+  status == 0 && (status = file_write(&file_info->size, sizeof(uint64_t), 1, file));
+
+  return status;
+}
+
+/**
+ * Hängt length Blöcke ab start an die Datei an. Schließen sie direkt an das
+ * letzte Extent an, wird dieses verlängert.
+ */
+void fileinfo_append_extent (struct FileInfo* file_info, uint64_t start, uint64_t length) {
+  if (length == 0) {
+    return;
+  }
+
+  if (file_info->num_extents > 0) {
+    struct Extent* last = &file_info->extents[file_info->num_extents - 1];
+
+    if (last->start + last->length == start) {
+      last->length += length;
+
+      return;
+    }
+  }
+
+  if (file_info->num_extents == file_info->extent_capacity) {
+    file_info->extent_capacity = file_info->extent_capacity == 0 ? 4 : 2 * file_info->extent_capacity;
+    file_info->extents = realloc(file_info->extents, file_info->extent_capacity * sizeof(struct Extent));
+  }
+
+  file_info->extents[file_info->num_extents].start = start;
+  file_info->extents[file_info->num_extents].length = length;
+  file_info->num_extents++;
+}
+
+/**
+ * Gibt die Anzahl der Blöcke zurück, die der Datei gehören.
+ */
+uint64_t fileinfo_num_blocks (struct FileInfo* file_info) {
+  uint64_t num = 0;
+
+  uint64_t i;
+  for (i = 0; i < file_info->num_extents; i++) {
+    num += file_info->extents[i].length;
+  }
+
+  return num;
+}
+
+void fileinfo_free (struct FileInfo* file_info) {
+  free(file_info->name);
+  free(file_info->extents);
+  free(file_info->hashes);
+  free(file_info);
+}
+
+/**
+ * Rückgabewert der Suchfunktionen von FreeSpace, wenn nichts gefunden wurde.
+ */
+#define FREESPACE_NONE UINT64_MAX
+
+/**
+ * Kennzahlen eines Knotens im Freispeicherbaum, jeweils in Blöcken.
+ */
+struct FreeSpaceNode {
+  /**
+   * Länge des freien Laufs am Anfang des Bereichs
+   */
+  uint64_t prefix;
+
+  /**
+   * Länge des freien Laufs am Ende des Bereichs
+   */
+  uint64_t suffix;
+
+  /**
+   * Länge des längsten freien Laufs innerhalb des Bereichs
+   */
+  uint64_t longest;
+};
+
+/**
+ * Verwaltet die freien Blöcke eines Archivs.
+ *
+ * Die Blöcke werden in einer Bitmap gespeichert (ein gesetztes Bit heißt frei),
+ * über deren Wörtern ein Segmentbaum liegt. So ist die Anzahl freier Blöcke in
+ * O(1) bekannt und freie Läufe einer bestimmten Länge werden in O(log n)
+ * gefunden.
+ */
+struct FreeSpace {
+  /**
+   * Anzahl der verwalteten Blöcke
+   */
+  uint64_t blockcount;
+
+  /**
+   * Anzahl der freien Blöcke
+   */
+  uint64_t num_free;
+
+  /**
+   * Anzahl der Wörter in der Bitmap, immer eine Zweierpotenz. Die Bits hinter
+   * blockcount sind nie gesetzt.
+   */
+  uint64_t num_words;
+
+  uint64_t* words;
+
+  /**
+   * Der Baum als implizites Array: Knoten i hat die Kinder 2i und 2i + 1, die
+   * Blätter liegen ab Index num_words.
+   */
+  struct FreeSpaceNode* nodes;
+
+  /**
+   * Ob words und nodes in einer gemappten Strukturdatei liegen und deshalb
+   * nicht freigegeben werden dürfen
+   */
+  bool mapped;
+};
+
+/**
+ * Gibt die Anzahl der Blöcke zurück, die der Knoten i abdeckt.
+ *
+ * @private
+ */
+uint64_t freespace_node_span (struct FreeSpace* free_space, uint64_t i) {
+  int depth = 63 - __builtin_clzll(i);
+
+  return (free_space->num_words >> depth) * 64;
+}
+
+/**
+ * Gibt den ersten Block zurück, den der Knoten i abdeckt.
+ *
+ * @private
+ */
+uint64_t freespace_node_start (struct FreeSpace* free_space, uint64_t i) {
+  int depth = 63 - __builtin_clzll(i);
+
+  return (i - ((uint64_t)1 << depth)) * freespace_node_span(free_space, i);
+}
+
+/**
+ * Berechnet die Kennzahlen eines Knotens neu.
+ *
+ * @private
+ */
+void freespace_update_node (struct FreeSpace* free_space, uint64_t i) {
+  struct FreeSpaceNode* node = &free_space->nodes[i];
+
+  if (i >= free_space->num_words) {
+    uint64_t word = free_space->words[i - free_space->num_words];
+
+    if (word == UINT64_MAX) {
+      node->prefix = node->suffix = node->longest = 64;
+    } else {
+      node->prefix = __builtin_ctzll(~word);
+      node->suffix = __builtin_clzll(~word);
+      node->longest = 0;
+
+      while (word != 0) {
+        word &= word >> 1;
+        node->longest++;
+      }
+    }
+  } else {
+    struct FreeSpaceNode* left = &free_space->nodes[2 * i];
+    struct FreeSpaceNode* right = &free_space->nodes[2 * i + 1];
+    uint64_t child_span = freespace_node_span(free_space, 2 * i);
+
+    node->prefix = left->prefix == child_span ? child_span + right->prefix : left->prefix;
+    node->suffix = right->suffix == child_span ? child_span + left->suffix : right->suffix;
+    node->longest = left->suffix + right->prefix;
+
+    if (left->longest > node->longest) {
+      node->longest = left->longest;
+    }
+
+    if (right->longest > node->longest) {
+      node->longest = right->longest;
+    }
+  }
+}
+
+/**
+ * Berechnet die Blätter der Wörter first bis last und alle ihre Vorfahren neu.
+ *
+ * @private
+ */
+void freespace_update_words (struct FreeSpace* free_space, uint64_t first, uint64_t last) {
+  uint64_t lo = free_space->num_words + first;
+  uint64_t hi = free_space->num_words + last;
+
+  while (lo >= 1) {
+    uint64_t i;
+    for (i = lo; i <= hi; i++) {
+      freespace_update_node(free_space, i);
+    }
+
+    lo /= 2;
+    hi /= 2;
+  }
+}
+
+struct FreeSpace* freespace_create () {
+  struct FreeSpace* free_space = malloc(sizeof(struct FreeSpace));
+  free_space->blockcount = 0;
+  free_space->num_free = 0;
+  free_space->num_words = 0;
+  free_space->words = NULL;
+  free_space->nodes = NULL;
+  free_space->mapped = false;
+
+  return free_space;
+}
+
+/**
+ * Initialisiert die Verwaltung für blockcount Blöcke, die anfangs alle frei
+ * oder alle belegt sind.
+ */
+void freespace_initialize (struct FreeSpace* free_space, uint64_t blockcount, bool all_free) {
+  uint64_t needed_words = (blockcount + 63) / 64;
+
+  free_space->blockcount = blockcount;
+  free_space->num_words = 1;
+
+  while (free_space->num_words < needed_words) {
+    free_space->num_words *= 2;
+  }
+
+  free_space->words = calloc(free_space->num_words, sizeof(uint64_t));
+  free_space->nodes = malloc(2 * free_space->num_words * sizeof(struct FreeSpaceNode));
+  free_space->num_free = 0;
+
+  if (all_free) {
+    free_space->num_free = blockcount;
+    memset(free_space->words, 0xff, (blockcount / 64) * sizeof(uint64_t));
+
+    if (blockcount % 64 != 0) {
+      free_space->words[blockcount / 64] = ((uint64_t)1 << (blockcount % 64)) - 1;
+    }
+  }
+
+  freespace_update_words(free_space, 0, free_space->num_words - 1);
+}
+
+/**
+ * Setzt die Bits der Blöcke start bis start + length - 1 auf free.
+ *
+ * @private
+ */
+void freespace_mark (struct FreeSpace* free_space, uint64_t start, uint64_t length, bool free) {
+  if (length == 0) {
+    return;
+  }
+
+  uint64_t end = start + length;
+  uint64_t first = start / 64;
+  uint64_t last = (end - 1) / 64;
+
+  uint64_t w;
+  for (w = first; w <= last; w++) {
+    uint64_t lo = w == first ? start % 64 : 0;
+    uint64_t hi = w == last ? (end - 1) % 64 : 63;
+    uint64_t mask = (UINT64_MAX >> (63 - hi)) & (UINT64_MAX << lo);
+    uint64_t old = free_space->words[w];
+
+    if (free) {
+      free_space->words[w] |= mask;
+      free_space->num_free += __builtin_popcountll(mask & ~old);
+    } else {
+      free_space->words[w] &= ~mask;
+      free_space->num_free -= __builtin_popcountll(mask & old);
+    }
+  }
+
+  freespace_update_words(free_space, first, last);
+}
+
+/**
+ * Markiert length Blöcke ab start als belegt.
+ */
+void freespace_allocate (struct FreeSpace* free_space, uint64_t start, uint64_t length) {
+  freespace_mark(free_space, start, length, false);
+}
+
+/**
+ * Markiert length Blöcke ab start als frei.
+ */
+void freespace_release (struct FreeSpace* free_space, uint64_t start, uint64_t length) {
+  freespace_mark(free_space, start, length, true);
+}
+
+bool freespace_is_free (struct FreeSpace* free_space, uint64_t block) {
+  return (free_space->words[block / 64] >> (block % 64)) & 1;
+}
+
+/**
+ * Sucht in einem Wort ab dem Bit from den ersten freien Lauf mit mindestens
+ * length Blöcken. Gibt das Bit zurück, an dem er beginnt, oder 64. In
+ * suffix wird die Länge des freien Laufs am oberen Ende des Wortes abgelegt.
+ *
+ * @private
+ */
+int freespace_search_word (uint64_t word, int from, uint64_t length, uint64_t* suffix) {
+  int position = from;
+  *suffix = 0;
+
+  while (position < 64) {
+    uint64_t rest = word >> position;
+
+    if (rest == 0) {
+      break;
+    }
+
+    position += __builtin_ctzll(rest);
+    rest = word >> position;
+
+    int run = rest == (UINT64_MAX >> position) ? 64 - position : __builtin_ctzll(~rest);
+
+    if ((uint64_t)run >= length) {
+      return position;
+    } else if (position + run == 64) {
+      *suffix = run;
+      break;
+    }
+
+    position += run;
+  }
+
+  return 64;
+}
+
+/**
+ * Gibt den Anfang des ersten freien Laufs zurück, der ab dem Block from
+ * beginnt und mindestens length Blöcke lang ist, oder FREESPACE_NONE.
+ */
+uint64_t freespace_find (struct FreeSpace* free_space, uint64_t from, uint64_t length) {
+  if (length == 0) {
+    length = 1;
+  }
+
+  if (from >= free_space->blockcount || free_space->nodes[1].longest < length) {
+    return FREESPACE_NONE;
+  }
+
+  uint64_t carry = 0;
+  uint64_t carry_start = 0;
+  uint64_t word_index = from / 64;
+  int bit = freespace_search_word(free_space->words[word_index], from % 64, length, &carry);
+
+  if (bit < 64) {
+    return word_index * 64 + bit;
+  }
+
+  carry_start = word_index * 64 + 64 - carry;
+
+  /* Die Knoten, die alle Wörter hinter word_index abdecken, von links nach rechts */
+  uint64_t l = free_space->num_words + word_index + 1;
+  uint64_t r = 2 * free_space->num_words;
+
+  while (l < r) {
+    if (l & 1) {
+      struct FreeSpaceNode* node = &free_space->nodes[l];
+      uint64_t span = freespace_node_span(free_space, l);
+      uint64_t start = freespace_node_start(free_space, l);
+
+      if (carry + node->prefix >= length) {
+        return carry > 0 ? carry_start : start;
+      } else if (node->longest >= length) {
+        uint64_t i = l;
+
+        while (i < free_space->num_words) {
+          struct FreeSpaceNode* left = &free_space->nodes[2 * i];
+          struct FreeSpaceNode* right = &free_space->nodes[2 * i + 1];
+
+          if (left->longest >= length) {
+            i = 2 * i;
+          } else if (left->suffix + right->prefix >= length) {
+            return freespace_node_start(free_space, 2 * i + 1) - left->suffix;
+          } else {
+            i = 2 * i + 1;
+          }
+        }
+
+        uint64_t unused;
+        return freespace_node_start(free_space, i) + freespace_search_word(free_space->words[i - free_space->num_words], 0, length, &unused);
+      } else if (node->prefix == span) {
+        if (carry == 0) {
+          carry_start = start;
+        }
+
+        carry += span;
+      } else {
+        carry = node->suffix;
+        carry_start = start + span - carry;
+      }
+
+      l++;
+    }
+
+    l /= 2;
+    r /= 2;
+  }
+
+  return FREESPACE_NONE;
+}
+
+/**
+ * Gibt den ersten belegten Block ab from zurück, also das Ende des freien
+ * Laufs, in dem from liegt. Gibt es keinen, wird blockcount zurückgegeben.
+ */
+uint64_t freespace_run_end (struct FreeSpace* free_space, uint64_t from) {
+  if (from >= free_space->blockcount) {
+    return free_space->blockcount;
+  }
+
+  uint64_t word_index = from / 64;
+  uint64_t used = ~free_space->words[word_index] & (UINT64_MAX << (from % 64));
+
+  if (used != 0) {
+    return word_index * 64 + __builtin_ctzll(used);
+  }
+
+  uint64_t l = free_space->num_words + word_index + 1;
+  uint64_t r = 2 * free_space->num_words;
+
+  while (l < r) {
+    if (l & 1) {
+      if (free_space->nodes[l].prefix != freespace_node_span(free_space, l)) {
+        uint64_t i = l;
+
+        while (i < free_space->num_words) {
+          if (free_space->nodes[2 * i].prefix == freespace_node_span(free_space, 2 * i)) {
+            i = 2 * i + 1;
+          } else {
+            i = 2 * i;
+          }
+        }
+
+        return freespace_node_start(free_space, i) + free_space->nodes[i].prefix;
+      }
+
+      l++;
+    }
+
+    l /= 2;
+    r /= 2;
+  }
+
+  return free_space->blockcount;
+}
+
+/**
+ * Gibt den Anfang des kürzesten freien Laufs zurück, der mindestens length
+ * Blöcke lang ist, oder FREESPACE_NONE. Kürzere Läufe überspringt
+ * freespace_find über den Segmentbaum, angesehen werden nur passende.
+ */
+uint64_t freespace_best_fit (struct FreeSpace* free_space, uint64_t length) {
+  uint64_t best = FREESPACE_NONE;
+  uint64_t best_length = UINT64_MAX;
+  uint64_t start = freespace_find(free_space, 0, length);
+
+  while (start != FREESPACE_NONE) {
+    uint64_t end = freespace_run_end(free_space, start);
+
+    if (end - start < best_length) {
+      best = start;
+      best_length = end - start;
+    }
+
+    if (best_length == length) {
+      break;
+    }
+
+    start = freespace_find(free_space, end, length);
+  }
+
+  return best;
+}
+
+/**
+ * Ändert die Anzahl der verwalteten Blöcke auf blockcount. Beim Vergrößern
+ * sind die neuen Blöcke frei, beim Verkleinern fallen die Blöcke ab
+ * blockcount weg.
+ */
+void freespace_resize (struct FreeSpace* free_space, uint64_t blockcount) {
+  uint64_t* old_words = free_space->words;
+  uint64_t old_count = free_space->blockcount;
+  uint64_t kept = old_count < blockcount ? old_count : blockcount;
+
+  if (!free_space->mapped) {
+    free(free_space->nodes);
+  }
+
+  freespace_initialize(free_space, blockcount, false);
+  memcpy(free_space->words, old_words, ((kept + 63) / 64) * sizeof(uint64_t));
+
+  if (kept % 64 != 0) {
+    free_space->words[kept / 64] &= ((uint64_t)1 << (kept % 64)) - 1;
+  }
+
+  if (!free_space->mapped) {
+    free(old_words);
+  }
+
+  free_space->mapped = false;
+
+  uint64_t w;
+  for (w = 0; w < (kept + 63) / 64; w++) {
+    free_space->num_free += __builtin_popcountll(free_space->words[w]);
+  }
+
+  freespace_update_words(free_space, 0, free_space->num_words - 1);
+  freespace_release(free_space, kept, blockcount - kept);
+}
+
+void freespace_free (struct FreeSpace* free_space) {
+  if (!free_space->mapped) {
+    free(free_space->words);
+    free(free_space->nodes);
+  }
+
+  free(free_space);
+}
+
+struct ArchiveInfo;
+const char* archiveinfo_get_name (struct ArchiveInfo*, uint64_t);
+
+/**
+ * Ein Eintrag in der Hashtabelle der Dateinamen.
+ */
+struct NameIndexSlot {
+  uint64_t hash;
+
+  /**
+   * Index der Datei, NAMEINDEX_EMPTY oder NAMEINDEX_DELETED
+   */
+  int64_t file;
+};
+
+#define NAMEINDEX_EMPTY -1
+#define NAMEINDEX_DELETED -2
+
+/**
+ * Hashtabelle mit offener Adressierung, die Dateinamen auf den Index ihrer
+ * FileInfo abbildet.
+ */
+struct NameIndex {
+  /**
+   * Anzahl der Slots, immer eine Zweierpotenz
+   */
+  uint64_t capacity;
+
+  /**
+   * Anzahl der Slots, die belegt oder als gelöscht markiert sind
+   */
+  uint64_t num_used;
+
+  /**
+   * Anzahl der eingetragenen Namen
+   */
+  uint64_t num_names;
+
+  struct NameIndexSlot* slots;
+
+  /**
+   * Ob slots in einer gemappten Strukturdatei liegt
+   */
+  bool mapped;
+};
+
+/**
+ * FNV-1a über den Dateinamen.
+ */
+uint64_t nameindex_hash (const char* name) {
+  uint64_t hash = 14695981039346656037ULL;
+
+  while (*name != 0) {
+    hash ^= (unsigned char)*name;
+    hash *= 1099511628211ULL;
+    name++;
+  }
+
+  return hash;
+}
+
+struct NameIndex* nameindex_create () {
+  struct NameIndex* name_index = malloc(sizeof(struct NameIndex));
+  name_index->capacity = 0;
+  name_index->num_used = 0;
+  name_index->num_names = 0;
+  name_index->slots = NULL;
+  name_index->mapped = false;
+
+  return name_index;
+}
+
+/**
+ * Legt eine leere Tabelle mit Platz für mindestens num_files Dateien an.
+ */
+void nameindex_initialize (struct NameIndex* name_index, uint64_t num_files) {
+  name_index->capacity = 16;
+
+  while (name_index->capacity < 2 * num_files) {
+    name_index->capacity *= 2;
+  }
+
+  name_index->num_used = 0;
+  name_index->num_names = 0;
+  name_index->slots = malloc(name_index->capacity * sizeof(struct NameIndexSlot));
+
+  uint64_t i;
+  for (i = 0; i < name_index->capacity; i++) {
+    name_index->slots[i].hash = 0;
+    name_index->slots[i].file = NAMEINDEX_EMPTY;
+  }
+}
+
+/**
+ * Sucht den Slot, in dem der Name steht. Die Namen der eingetragenen Dateien
+ * kommen aus archive_info. Gibt -1 zurück, wenn der Name nicht in der Tabelle
+ * ist.
+ *
+ * @private
+ */
+int64_t nameindex_find_slot (struct NameIndex* name_index, struct ArchiveInfo* archive_info, const char* name, uint64_t hash) {
+  uint64_t mask = name_index->capacity - 1;
+  uint64_t i = hash & mask;
+
+  while (name_index->slots[i].file != NAMEINDEX_EMPTY) {
+    struct NameIndexSlot* slot = &name_index->slots[i];
+
+    if (slot->file >= 0 && slot->hash == hash && strcmp(archiveinfo_get_name(archive_info, slot->file), name) == 0) {
+      return i;
+    }
+
+    i = (i + 1) & mask;
+  }
+
+  return -1;
+}
+
+/**
+ * Gibt den Index der Datei mit dem Namen name zurück oder -1.
+ */
+int64_t nameindex_get (struct NameIndex* name_index, struct ArchiveInfo* archive_info, const char* name) {
+  int64_t slot = nameindex_find_slot(name_index, archive_info, name, nameindex_hash(name));
+
+  if (slot == -1) {
+    return -1;
+  } else {
+    return name_index->slots[slot].file;
+  }
+}
+
+/**
+ * Trägt die Datei mit dem Index file ohne Prüfung auf Duplikate ein.
+ *
+ * @private
+ */
+void nameindex_insert_hashed (struct NameIndex* name_index, uint64_t hash, int64_t file) {
+  uint64_t mask = name_index->capacity - 1;
+  uint64_t i = hash & mask;
+
+  while (name_index->slots[i].file >= 0) {
+    i = (i + 1) & mask;
+  }
+
+  if (name_index->slots[i].file == NAMEINDEX_EMPTY) {
+    name_index->num_used++;
+  }
+
+  name_index->slots[i].hash = hash;
+  name_index->slots[i].file = file;
+}
+
+/**
+ * Baut die Tabelle mit der neuen Größe capacity neu auf. Dabei verschwinden
+ * auch alle Löschmarkierungen.
+ *
+ * @private
+ */
+void nameindex_rehash (struct NameIndex* name_index, uint64_t capacity) {
+  struct NameIndexSlot* old_slots = name_index->slots;
+  uint64_t old_capacity = name_index->capacity;
+
+  name_index->capacity = capacity;
+  name_index->num_used = 0;
+  name_index->slots = malloc(capacity * sizeof(struct NameIndexSlot));
+
+  uint64_t i;
+  for (i = 0; i < capacity; i++) {
+    name_index->slots[i].hash = 0;
+    name_index->slots[i].file = NAMEINDEX_EMPTY;
+  }
+
+  for (i = 0; i < old_capacity; i++) {
+    if (old_slots[i].file >= 0) {
+      nameindex_insert_hashed(name_index, old_slots[i].hash, old_slots[i].file);
+    }
+  }
+
+  if (!name_index->mapped) {
+    free(old_slots);
+  }
+
+  name_index->mapped = false;
+}
+
+/**
+ * Trägt den Namen mit dem Index file ein.
+ */
+void nameindex_insert (struct NameIndex* name_index, const char* name, int64_t file) {
+  if (2 * (name_index->num_used + 1) > name_index->capacity) {
+    /* Bestehen die belegten Slots vor allem aus Löschmarkierungen, reicht es, sie wegzuräumen */
+    if (4 * (name_index->num_names + 1) > name_index->capacity) {
+      nameindex_rehash(name_index, 2 * name_index->capacity);
+    } else {
+      nameindex_rehash(name_index, name_index->capacity);
+    }
+  }
+
+  nameindex_insert_hashed(name_index, nameindex_hash(name), file);
+  name_index->num_names++;
+}
+
+/**
+ * Entfernt den Namen aus der Tabelle.
+ */
+void nameindex_remove (struct NameIndex* name_index, struct ArchiveInfo* archive_info, const char* name) {
+  int64_t slot = nameindex_find_slot(name_index, archive_info, name, nameindex_hash(name));
+
+  if (slot != -1) {
+    name_index->slots[slot].file = NAMEINDEX_DELETED;
+    name_index->num_names--;
+  }
+}
+
+void nameindex_free (struct NameIndex* name_index) {
+  if (!name_index->mapped) {
+    free(name_index->slots);
+  }
+
+  free(name_index);
+}
+
+/**
+ * Konstanten für block_hash, dieselben wie bei xxHash64
+ */
+#define BLOCK_HASH_PRIME1 11400714785074694791ULL
+#define BLOCK_HASH_PRIME2 14029467366897019727ULL
+#define BLOCK_HASH_PRIME3 1609587929392839161ULL
+#define BLOCK_HASH_PRIME4 9650029242287828579ULL
+
+/**
+ * Rotiert value um bits Bits nach links.
+ *
+ * @private
+ */
+uint64_t block_hash_rotate (uint64_t value, int bits) {
+  return (value << bits) | (value >> (64 - bits));
+}
+
+/**
+ * Mischt ein Wort in eine der vier Ketten von block_hash.
+ *
+ * @private
+ */
+uint64_t block_hash_round (uint64_t lane, uint64_t word) {
+  return block_hash_rotate(lane + word * BLOCK_HASH_PRIME2, 31) * BLOCK_HASH_PRIME1;
+}
+
+/**
+ * Schneller 64-Bit-Hash über den Inhalt eines Blocks nach dem Vorbild von
+ * xxHash64: vier unabhängige Ketten über je 8 Bytes, damit die
+ * Multiplikationen parallel laufen. Gibt nie 0 zurück, damit 0 für Blöcke
+ * ohne Fingerabdruck stehen kann.
+ */
+uint64_t block_hash (const char* data, uint64_t length) {
+  uint64_t lanes[4] = { BLOCK_HASH_PRIME1 + BLOCK_HASH_PRIME2, BLOCK_HASH_PRIME2, 0, -BLOCK_HASH_PRIME1 };
+  uint64_t words[4];
+  uint64_t i = 0;
+
+  for (; i + 32 <= length; i += 32) {
+    memcpy(words, data + i, 32);
+    lanes[0] = block_hash_round(lanes[0], words[0]);
+    lanes[1] = block_hash_round(lanes[1], words[1]);
+    lanes[2] = block_hash_round(lanes[2], words[2]);
+    lanes[3] = block_hash_round(lanes[3], words[3]);
+  }
+
+  uint64_t hash = block_hash_rotate(lanes[0], 1) + block_hash_rotate(lanes[1], 7) + block_hash_rotate(lanes[2], 12) + block_hash_rotate(lanes[3], 18) + length;
+
+  for (; i + 8 <= length; i += 8) {
+    memcpy(words, data + i, 8);
+    hash = block_hash_rotate(hash ^ block_hash_round(0, words[0]), 27) * BLOCK_HASH_PRIME1 + BLOCK_HASH_PRIME4;
+  }
+
+  for (; i < length; i++) {
+    hash = block_hash_rotate(hash ^ ((unsigned char)data[i] * BLOCK_HASH_PRIME3), 11) * BLOCK_HASH_PRIME1;
+  }
+
+  hash ^= hash >> 33;
+  hash *= BLOCK_HASH_PRIME2;
+  hash ^= hash >> 29;
+  hash *= BLOCK_HASH_PRIME3;
+  hash ^= hash >> 32;
+
+  return hash == 0 ? 1 : hash;
+}
+
+/**
+ * Ein Eintrag in der Hashtabelle der Fingerabdrücke.
+ */
+struct BlockIndexSlot {
+  uint64_t hash;
+
+  /**
+   * Block mit diesem Fingerabdruck, BLOCKINDEX_EMPTY oder BLOCKINDEX_DELETED
+   */
+  int64_t block;
+};
+
+#define BLOCKINDEX_EMPTY -1
+#define BLOCKINDEX_DELETED -2
+
+/**
+ * Hashtabelle mit offener Adressierung, die den Fingerabdruck eines Blocks
+ * auf den Block abbildet, in dem dieser Inhalt schon liegt. Aufgebaut wie der
+ * NameIndex, nur ist der Hash selbst der Schlüssel.
+ */
+struct BlockIndex {
+  /**
+   * Anzahl der Slots, immer eine Zweierpotenz
+   */
+  uint64_t capacity;
+
+  /**
+   * Anzahl der Slots, die belegt oder als gelöscht markiert sind
+   */
+  uint64_t num_used;
+
+  /**
+   * Anzahl der eingetragenen Blöcke
+   */
+  uint64_t num_blocks;
+
+  struct BlockIndexSlot* slots;
+
+  /**
+   * Ob slots in einer gemappten Strukturdatei liegt
+   */
+  bool mapped;
+};
+
+struct BlockIndex* blockindex_create () {
+  struct BlockIndex* block_index = malloc(sizeof(struct BlockIndex));
+  block_index->capacity = 0;
+  block_index->num_used = 0;
+  block_index->num_blocks = 0;
+  block_index->slots = NULL;
+  block_index->mapped = false;
+
+  return block_index;
+}
+
+/**
+ * Legt eine leere Tabelle mit capacity Slots an. capacity muss eine
+ * Zweierpotenz sein.
+ */
+void blockindex_initialize (struct BlockIndex* block_index, uint64_t capacity) {
+  block_index->capacity = capacity;
+  block_index->num_used = 0;
+  block_index->num_blocks = 0;
+  block_index->slots = malloc(capacity * sizeof(struct BlockIndexSlot));
+
+  uint64_t i;
+  for (i = 0; i < capacity; i++) {
+    block_index->slots[i].hash = 0;
+    block_index->slots[i].block = BLOCKINDEX_EMPTY;
+  }
+}
+
+/**
+ * Gibt den Block mit dem Fingerabdruck hash zurück oder -1.
+ */
+int64_t blockindex_get (struct BlockIndex* block_index, uint64_t hash) {
+  uint64_t mask = block_index->capacity - 1;
+  uint64_t i = hash & mask;
+
+  while (block_index->slots[i].block != BLOCKINDEX_EMPTY) {
+    if (block_index->slots[i].block >= 0 && block_index->slots[i].hash == hash) {
+      return block_index->slots[i].block;
+    }
+
+    i = (i + 1) & mask;
+  }
+
+  return -1;
+}
+
+/**
+ * Trägt den Block ohne Prüfung auf Duplikate ein.
+ *
+ * @private
+ */
+void blockindex_insert_hashed (struct BlockIndex* block_index, uint64_t hash, int64_t block) {
+  uint64_t mask = block_index->capacity - 1;
+  uint64_t i = hash & mask;
+
+  while (block_index->slots[i].block >= 0) {
+    i = (i + 1) & mask;
+  }
+
+  if (block_index->slots[i].block == BLOCKINDEX_EMPTY) {
+    block_index->num_used++;
+  }
+
+  block_index->slots[i].hash = hash;
+  block_index->slots[i].block = block;
+}
+
+/**
+ * Baut die Tabelle mit der neuen Größe capacity neu auf. Dabei verschwinden
+ * auch alle Löschmarkierungen.
+ *
+ * @private
+ */
+void blockindex_rehash (struct BlockIndex* block_index, uint64_t capacity) {
+  struct BlockIndexSlot* old_slots = block_index->slots;
+  uint64_t old_capacity = block_index->capacity;
+  uint64_t num_blocks = block_index->num_blocks;
+
+  blockindex_initialize(block_index, capacity);
+  block_index->num_blocks = num_blocks;
+
+  uint64_t i;
+  for (i = 0; i < old_capacity; i++) {
+    if (old_slots[i].block >= 0) {
+      blockindex_insert_hashed(block_index, old_slots[i].hash, old_slots[i].block);
+    }
+  }
+
+  if (!block_index->mapped) {
+    free(old_slots);
+  }
+
+  block_index->mapped = false;
+}
+
+/**
+ * Trägt ein, dass im Block block der Inhalt mit dem Fingerabdruck hash liegt.
+ */
+void blockindex_insert (struct BlockIndex* block_index, uint64_t hash, int64_t block) {
+  if (2 * (block_index->num_used + 1) > block_index->capacity) {
+    if (4 * (block_index->num_blocks + 1) > block_index->capacity) {
+      blockindex_rehash(block_index, 2 * block_index->capacity);
+    } else {
+      blockindex_rehash(block_index, block_index->capacity);
+    }
+  }
+
+  blockindex_insert_hashed(block_index, hash, block);
+  block_index->num_blocks++;
+}
+
+/**
+ * Entfernt den Eintrag des Blocks block mit dem Fingerabdruck hash.
+ */
+void blockindex_remove (struct BlockIndex* block_index, uint64_t hash, int64_t block) {
+  uint64_t mask = block_index->capacity - 1;
+  uint64_t i = hash & mask;
+
+  while (block_index->slots[i].block != BLOCKINDEX_EMPTY) {
+    if (block_index->slots[i].block == block && block_index->slots[i].hash == hash) {
+      block_index->slots[i].block = BLOCKINDEX_DELETED;
+      block_index->num_blocks--;
+
+      return;
+    }
+
+    i = (i + 1) & mask;
+  }
+}
+
+void blockindex_free (struct BlockIndex* block_index) {
+  if (!block_index->mapped) {
+    free(block_index->slots);
+  }
+
+  free(block_index);
+}
+
+/**
+ * Kennung am Anfang jeder Strukturdatei. Ältere Strukturdateien beginnen
+ * direkt mit der Blockgröße und haben keine Versionsnummer.
+ */
+#define STRUCTURE_MAGIC "HHUVFS\0\0"
+
+/**
+ * Version des Formats, in dem Strukturdateien geschrieben werden. Die Datei
+ * besteht aus Tabellen fester Breite, die direkt aus einer gemappten Datei
+ * benutzt werden können.
+ */
+#define STRUCTURE_VERSION 1
+
+/**
+ * Kopf einer Strukturdatei. Alle Offsets sind in Bytes vom Anfang der Datei
+ * gezählt und durch 8 teilbar.
+ */
+struct StructureHeader {
+  char magic[8];
+  uint64_t version;
+  uint64_t generation;
+  uint64_t blocksize;
+  uint64_t blockcount;
+  uint64_t num_ids;
+  uint64_t num_files;
+
+  /**
+   * Tabelle mit einem StructureFile für jede ID
+   */
+  uint64_t files_offset;
+
+  /**
+   * Extents aller Dateien hintereinander
+   */
+  uint64_t extents_offset;
+  uint64_t num_extents;
+
+  /**
+   * Nullterminierte Dateinamen hintereinander
+   */
+  uint64_t names_offset;
+  uint64_t names_size;
+
+  /**
+   * Bitmap und Segmentbaum des FreeSpace
+   */
+  uint64_t num_free;
+  uint64_t num_words;
+  uint64_t words_offset;
+  uint64_t nodes_offset;
+
+  /**
+   * Slots des NameIndex
+   */
+  uint64_t index_capacity;
+  uint64_t index_used;
+  uint64_t index_offset;
+
+  /**
+   * Eine der COMPRESSION_-Konstanten
+   */
+  uint64_t compression;
+
+  /**
+   * Gespeicherte Größe jeder ID als uint64_t oder 0, wenn das Archiv nicht
+   * komprimiert ist
+   */
+  uint64_t stored_sizes_offset;
+
+  /**
+   * 1, wenn gleiche Blöcke nur einmal gespeichert werden
+   */
+  uint64_t dedup;
+
+  /**
+   * Nur bei dedup: die Anzahl der Verweise auf jeden Block als uint32_t, der
+   * Fingerabdruck jedes Blocks als uint64_t und die Slots des BlockIndex
+   */
+  uint64_t refcounts_offset;
+  uint64_t block_hashes_offset;
+  uint64_t block_index_capacity;
+  uint64_t block_index_used;
+  uint64_t block_index_blocks;
+  uint64_t block_index_offset;
+
+  /**
+   * Für jede ID der Index ihres ersten Fingerabdrucks in der Tabelle bei
+   * hashes_offset als uint64_t oder UINT64_MAX, wenn keine bekannt sind
+   */
+  uint64_t file_hashes_offset;
+  uint64_t hashes_offset;
+  uint64_t num_hashes;
+};
+
+/**
+ * Ein Eintrag der Dateitabelle
+ */
+struct StructureFile {
+  uint64_t size;
+
+  /**
+   * Offset des Namens im Namensbereich
+   */
+  uint64_t name_offset;
+
+  /**
+   * Index des ersten Extents im Extentbereich
+   */
+  uint64_t first_extent;
+  uint64_t num_extents;
+
+  /**
+   * 0, wenn die ID zu keiner Datei gehört
+   */
+  uint64_t live;
+};
+
+/**
+ * Dateien werden unverändert gespeichert
+ */
+#define COMPRESSION_NONE 0
+
+/**
+ * Dateien werden in Stücken mit dem eingebauten LZ-Verfahren komprimiert
+ */
+#define COMPRESSION_LZ 1
+
+/**
+ * Die ersten freien Blöcke der Reihe nach, egal wie verstreut sie sind
+ */
+#define ALLOCATION_FIRST_FIT 0
+
+/**
+ * Der kürzeste freie Lauf, in den die Datei ganz passt
+ */
+#define ALLOCATION_BEST_FIT 1
+
+/**
+ * Der erste freie Lauf hinter der zuletzt vergebenen Stelle, in den die Datei
+ * ganz passt
+ */
+#define ALLOCATION_NEXT_FIT 2
+
+struct ArchiveInfo {
+  /**
+   * Wird bei jedem vollständigen Schreiben der Struktur erhöht. Das Journal
+   * gehört nur zu der Struktur mit derselben Generation.
+   */
+  uint64_t generation;
+
+  /**
+   * Größe eines Blocks in Bytes
+   */
+  uint64_t blocksize;
+
+  /**
+   * Anzahl der Blöcke im Archiv
+   */
+  uint64_t blockcount;
+
+  /**
+   * Anzahl der Dateien im Archiv
+   */
+  uint64_t num_files;
+
+  /**
+   * Anzahl der bisher vergebenen IDs und damit Länge von file_infos. Eine ID
+   * bleibt der Datei erhalten, bis sie gelöscht wird, und wird danach nicht
+   * wieder vergeben, auch nicht, wenn die Struktur neu geschrieben wird. Nur
+   * beim Laden werden zu viele Lücken mit archiveinfo_compact_ids geschlossen.
+   */
+  uint64_t num_ids;
+
+  /**
+   * Für wie viele Einträge in file_infos Platz reserviert ist
+   */
+  uint64_t file_capacity;
+
+  /**
+   * Die Dateien nach ihrer ID. Gelöschte Dateien hinterlassen NULL.
+   */
+  struct FileInfo** file_infos;
+
+  /**
+   * Freie Blöcke
+   */
+  struct FreeSpace* free_space;
+
+  /**
+   * Bildet die Dateinamen auf ihre ID ab
+   */
+  struct NameIndex* name_index;
+
+  /**
+   * Gemappte Strukturdatei oder NULL. Dateien daraus werden erst in
+   * file_infos übernommen, wenn sie gebraucht werden.
+   */
+  char* image;
+  uint64_t image_size;
+
+  /**
+   * Tabellen in image
+   */
+  struct StructureFile* image_files;
+  uint64_t image_num_ids;
+  struct Extent* image_extents;
+  uint64_t image_num_extents;
+  const char* image_names;
+  uint64_t image_names_size;
+  uint64_t* image_stored_sizes;
+  uint64_t* image_file_hashes;
+  uint64_t* image_hashes;
+  uint64_t image_num_hashes;
+
+  /**
+   * Eine der COMPRESSION_-Konstanten. Wird beim Anlegen des Archivs
+   * festgelegt.
+   */
+  int compression;
+
+  /**
+   * Ob Blöcke mit gleichem Inhalt nur einmal gespeichert werden. Wird beim
+   * Anlegen des Archivs festgelegt.
+   */
+  bool dedup;
+
+  /**
+   * Nur bei dedup: wie viele Verweise aus Dateien es auf jeden Block gibt. Ein
+   * Block ist frei, sobald keiner mehr übrig ist.
+   */
+  uint32_t* refcounts;
+
+  /**
+   * Nur bei dedup: der Fingerabdruck jedes Blocks, der im block_index steht,
+   * sonst 0
+   */
+  uint64_t* block_hashes;
+
+  /**
+   * Ob refcounts und block_hashes in der gemappten Strukturdatei liegen
+   */
+  bool blocks_mapped;
+
+  /**
+   * Nur bei dedup: bildet Fingerabdrücke auf Blöcke mit diesem Inhalt ab
+   */
+  struct BlockIndex* block_index;
+
+  /**
+   * Wie freie Blöcke für neue Dateien ausgesucht werden, eine der
+   * ALLOCATION_-Konstanten. Archive nehmen sie aus der Umgebungsvariable
+   * VFS_ALLOCATION (first, best oder next), Standard ist best.
+   */
+  int allocation;
+
+  /**
+   * Block hinter der zuletzt vergebenen Stelle, ab dem bei
+   * ALLOCATION_NEXT_FIT gesucht wird. Wird nicht gespeichert.
+   */
+  uint64_t next_fit;
+
+  /**
+   * Neue Dateien, die gerade ohne Sperre in ihre reservierten Blöcke
+   * geschrieben werden. Die Blöcke gelten im FreeSpace als belegt, werden
+   * aber als frei gespeichert, damit sie nach einem Absturz nicht verloren
+   * sind.
+   */
+  struct FileInfo** reservations;
+  uint64_t num_reservations;
+}; 
+
+struct ArchiveInfo* archiveinfo_create () {
+  struct ArchiveInfo* archive_info = malloc(sizeof(struct ArchiveInfo));
+  archive_info->generation = 0;
+  archive_info->blocksize = 0;
+  archive_info->blockcount = 0;
+  archive_info->num_files = 0;
+  archive_info->num_ids = 0;
+  archive_info->file_capacity = 0;
+  archive_info->file_infos = NULL;
+  archive_info->free_space = NULL;
+  archive_info->name_index = NULL;
+  archive_info->image = NULL;
+  archive_info->image_size = 0;
+  archive_info->image_files = NULL;
+  archive_info->image_num_ids = 0;
+  archive_info->image_extents = NULL;
+  archive_info->image_num_extents = 0;
+  archive_info->image_names = NULL;
+  archive_info->image_names_size = 0;
+  archive_info->image_stored_sizes = NULL;
+  archive_info->image_file_hashes = NULL;
+  archive_info->image_hashes = NULL;
+  archive_info->image_num_hashes = 0;
+  archive_info->compression = COMPRESSION_NONE;
+  archive_info->dedup = false;
+  archive_info->refcounts = NULL;
+  archive_info->block_hashes = NULL;
+  archive_info->blocks_mapped = false;
+  archive_info->block_index = NULL;
+  archive_info->allocation = ALLOCATION_BEST_FIT;
+  archive_info->next_fit = 0;
+  archive_info->reservations = NULL;
+  archive_info->num_reservations = 0;
+
+  return archive_info;
+}
+
+/**
+ * Initialisiert ein ArchiveInfo für ein leeres Archiv.
+ */
+int archiveinfo_initialize_empty (struct ArchiveInfo* archive_info, uint64_t blocksize, uint64_t blockcount) {
+  archive_info->blocksize = blocksize;
+  archive_info->blockcount = blockcount;
+
+  archive_info->free_space = freespace_create();
+  freespace_initialize(archive_info->free_space, blockcount, true);
+
+  archive_info->name_index = nameindex_create();
+  nameindex_initialize(archive_info->name_index, 0);
+
+  if (archive_info->dedup) {
+    archive_info->refcounts = calloc(blockcount, sizeof(uint32_t));
+    archive_info->block_hashes = calloc(blockcount, sizeof(uint64_t));
+    archive_info->block_index = blockindex_create();
+    blockindex_initialize(archive_info->block_index, 16);
+  }
+
+  return 0;
+}
+
+/**
+ * Sorgt dafür, dass in file_infos Platz für num_ids Einträge ist.
+ *
+ * @private
+ */
+void archiveinfo_reserve_ids (struct ArchiveInfo* archive_info, uint64_t num_ids) {
+  if (num_ids > archive_info->file_capacity) {
+    uint64_t capacity = archive_info->file_capacity == 0 ? 16 : archive_info->file_capacity;
+
+    while (capacity < num_ids) {
+      capacity *= 2;
+    }
+
+    archive_info->file_infos = realloc(archive_info->file_infos, capacity * sizeof(struct FileInfo*));
+    memset(archive_info->file_infos + archive_info->file_capacity, 0, (capacity - archive_info->file_capacity) * sizeof(struct FileInfo*));
+    archive_info->file_capacity = capacity;
+  }
+}
+
+/**
+ * Gibt den Eintrag der Datei id in der gemappten Strukturdatei zurück oder
+ * NULL, wenn es dort keine gültige Datei mit dieser ID gibt.
+ *
+ * @private
+ */
+struct StructureFile* archiveinfo_image_file (struct ArchiveInfo* archive_info, uint64_t id) {
+  if (id >= archive_info->image_num_ids) {
+    return NULL;
+  }
+
+  struct StructureFile* entry = &archive_info->image_files[id];
+
+  if (!entry->live || entry->name_offset >= archive_info->image_names_size || entry->first_extent > archive_info->image_num_extents || entry->num_extents > archive_info->image_num_extents - entry->first_extent) {
+    return NULL;
+  } else {
+    return entry;
+  }
+}
+
+uint64_t archiveinfo_num_hashes (struct ArchiveInfo*, uint64_t);
+
+/**
+ * Gibt die Fingerabdrücke der Datei id mit size Bytes in der gemappten
+ * Strukturdatei zurück oder NULL, wenn dort keine gültigen stehen.
+ *
+ * @private
+ */
+const uint64_t* archiveinfo_image_hashes (struct ArchiveInfo* archive_info, uint64_t id, uint64_t size) {
+  uint64_t num_hashes = archiveinfo_num_hashes(archive_info, size);
+
+  if (archive_info->image_file_hashes == NULL || id >= archive_info->image_num_ids || num_hashes == 0) {
+    return NULL;
+  }
+
+  uint64_t first = archive_info->image_file_hashes[id];
+
+  if (first > archive_info->image_num_hashes || num_hashes > archive_info->image_num_hashes - first) {
+    return NULL;
+  } else {
+    return archive_info->image_hashes + first;
+  }
+}
+
+/**
+ * Gibt die FileInfo der Datei id zurück oder NULL, wenn es die Datei nicht
+ * gibt. Steht die Datei nur in der gemappten Strukturdatei, wird sie dabei
+ * ausgelesen.
+ */
+struct FileInfo* archiveinfo_file (struct ArchiveInfo* archive_info, uint64_t id) {
+  if (id >= archive_info->num_ids) {
+    return NULL;
+  } else if (archive_info->file_infos[id] != NULL) {
+    return archive_info->file_infos[id];
+  }
+
+  struct StructureFile* entry = archiveinfo_image_file(archive_info, id);
+
+  if (entry == NULL) {
+    return NULL;
+  }
+
+  struct FileInfo* file_info = fileinfo_create();
+  fileinfo_initialize(file_info, archive_info->image_names + entry->name_offset, entry->size);
+
+  file_info->num_extents = entry->num_extents;
+  file_info->extent_capacity = entry->num_extents;
+  file_info->extents = malloc(entry->num_extents * sizeof(struct Extent));
+  memcpy(file_info->extents, archive_info->image_extents + entry->first_extent, entry->num_extents * sizeof(struct Extent));
+
+  if (archive_info->image_stored_sizes != NULL) {
+    file_info->stored_size = archive_info->image_stored_sizes[id];
+  }
+
+  const uint64_t* hashes = archiveinfo_image_hashes(archive_info, id, entry->size);
+
+  if (hashes != NULL) {
+    uint64_t num_hashes = archiveinfo_num_hashes(archive_info, entry->size);
+
+    file_info->hashes = malloc(num_hashes * sizeof(uint64_t));
+    memcpy(file_info->hashes, hashes, num_hashes * sizeof(uint64_t));
+  }
+
+  archive_info->file_infos[id] = file_info;
+
+  return file_info;
+}
+
+/**
+ * Liest alle Dateien aus der gemappten Strukturdatei aus. Danach verändern
+ * lesende Zugriffe das ArchiveInfo nicht mehr, sodass mehrere Threads
+ * gleichzeitig lesen können.
+ */
+void archiveinfo_materialize (struct ArchiveInfo* archive_info) {
+  uint64_t i;
+  for (i = 0; i < archive_info->num_ids; i++) {
+    archiveinfo_file(archive_info, i);
+  }
+}
+
+/**
+ * Gibt den Namen der Datei id zurück, ohne sie dafür auszulesen.
+ */
+const char* archiveinfo_get_name (struct ArchiveInfo* archive_info, uint64_t id) {
+  if (id < archive_info->num_ids && archive_info->file_infos[id] != NULL) {
+    return archive_info->file_infos[id]->name;
+  }
+
+  struct StructureFile* entry = archiveinfo_image_file(archive_info, id);
+
+  if (entry == NULL) {
+    return "";
+  } else {
+    return archive_info->image_names + entry->name_offset;
+  }
+}
+
+/**
+ * Liest eine Strukturdatei im alten Format ohne Versionsnummer, in der für
+ * jeden Block der Index seiner Datei steht. Die Blockgröße ist schon gelesen.
+ *
+ * @private
+ */
+int archiveinfo_read_legacy_structure (struct ArchiveInfo* archive_info, FILE* file) {
+  int status = 0;
+
+  status = file_read(&archive_info->blockcount, sizeof(uint64_t), 1, file);
+
+  int64_t* blocks = malloc(archive_info->blockcount * sizeof(int64_t));
+
+  status == 0 && (status = file_read(blocks, sizeof(int64_t), archive_info->blockcount, file));
+  status == 0 && (status = file_read(&archive_info->num_files, sizeof(uint64_t), 1, file));
+
+  if (status == 0) {
+    archive_info->num_ids = archive_info->num_files;
+    archiveinfo_reserve_ids(archive_info, archive_info->num_ids);
+  }
+
+  uint64_t i;
+  for (i = 0; i < archive_info->num_files && status == 0; i++) {
+    archive_info->file_infos[i] = fileinfo_create();
+    status = fileinfo_initialize_from_file(archive_info->file_infos[i], file);
+  }
+
+  if (status == 0) {
+    archive_info->free_space = freespace_create();
+    freespace_initialize(archive_info->free_space, archive_info->blockcount, true);
+
+    for (i = 0; i < archive_info->blockcount; i++) {
+      if (blocks[i] >= 0 && (uint64_t)blocks[i] < archive_info->num_files) {
+        fileinfo_append_extent(archive_info->file_infos[blocks[i]], i, 1);
+        freespace_allocate(archive_info->free_space, i, 1);
+      }
+    }
+  }
+
+  free(blocks);
+
+  return status;
+}
+
+/**
+ * Gibt true zurück, wenn count Einträge der Größe size ab offset in einer Datei
+ * der Größe file_size liegen.
+ *
+ * @private
+ */
+bool structure_table_fits (uint64_t file_size, uint64_t offset, uint64_t count, uint64_t size) {
+  return offset % 8 == 0 && offset <= file_size && count <= (file_size - offset) / size;
+}
+
+/**
+ * Mappt eine Strukturdatei in den Speicher. Bitmap, Segmentbaum und
+ * Namenstabelle werden direkt darin benutzt; Dateien werden erst bei Bedarf
+ * von archiveinfo_file ausgelesen. Änderungen landen nur im Speicher.
+ *
+ * @private
+ */
+int archiveinfo_map_structure (struct ArchiveInfo* archive_info, FILE* file) {
+  long int size = file_size(file);
+  struct StructureHeader header_copy;
+
+  if (size < (long int)sizeof(struct StructureHeader)) {
+    return 1;
+  }
+
+  char* image = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(file), 0);
+
+  if (image == MAP_FAILED) {
+    return 1;
+  }
+
+  memcpy(&header_copy, image, sizeof(struct StructureHeader));
+
+  struct StructureHeader* header = &header_copy;
+  uint64_t needed_words = (header->blockcount + 63) / 64;
+
+  bool valid = structure_table_fits(size, header->files_offset, header->num_ids, sizeof(struct StructureFile))
+    && structure_table_fits(size, header->extents_offset, header->num_extents, sizeof(struct Extent))
+    && structure_table_fits(size, header->names_offset, header->names_size, 1)
+    && (header->names_size == 0 || image[header->names_offset + header->names_size - 1] == 0)
+    && header->num_words > 0 && (header->num_words & (header->num_words - 1)) == 0 && header->num_words >= needed_words
+    && header->num_words <= (uint64_t)size / sizeof(uint64_t)
+    && structure_table_fits(size, header->words_offset, header->num_words, sizeof(uint64_t))
+    && structure_table_fits(size, header->nodes_offset, 2 * header->num_words, sizeof(struct FreeSpaceNode))
+    && header->index_capacity >= 16 && (header->index_capacity & (header->index_capacity - 1)) == 0
+    && structure_table_fits(size, header->index_offset, header->index_capacity, sizeof(struct NameIndexSlot))
+    && header->num_files <= header->num_ids && header->num_free <= header->blockcount
+    && header->compression <= COMPRESSION_LZ
+    && (header->compression == COMPRESSION_NONE || structure_table_fits(size, header->stored_sizes_offset, header->num_ids, sizeof(uint64_t)))
+    && header->dedup <= 1 && (header->dedup == 0 || header->compression == COMPRESSION_NONE)
+    && (header->dedup == 0 || (structure_table_fits(size, header->refcounts_offset, header->blockcount, sizeof(uint32_t))
+      && structure_table_fits(size, header->block_hashes_offset, header->blockcount, sizeof(uint64_t))
+      && header->block_index_capacity >= 16 && (header->block_index_capacity & (header->block_index_capacity - 1)) == 0
+      && structure_table_fits(size, header->block_index_offset, header->block_index_capacity, sizeof(struct BlockIndexSlot))))
+    && structure_table_fits(size, header->file_hashes_offset, header->num_ids, sizeof(uint64_t))
+    && structure_table_fits(size, header->hashes_offset, header->num_hashes, sizeof(uint64_t));
+
+  if (!valid) {
+    munmap(image, size);
+
+    return 1;
+  }
+
+  archive_info->image = image;
+  archive_info->image_size = size;
+  archive_info->image_files = (struct StructureFile*)(image + header->files_offset);
+  archive_info->image_num_ids = header->num_ids;
+  archive_info->image_extents = (struct Extent*)(image + header->extents_offset);
+  archive_info->image_num_extents = header->num_extents;
+  archive_info->image_names = image + header->names_offset;
+  archive_info->image_names_size = header->names_size;
+  archive_info->image_stored_sizes = header->compression == COMPRESSION_NONE ? NULL : (uint64_t*)(image + header->stored_sizes_offset);
+  archive_info->image_file_hashes = (uint64_t*)(image + header->file_hashes_offset);
+  archive_info->image_hashes = (uint64_t*)(image + header->hashes_offset);
+  archive_info->image_num_hashes = header->num_hashes;
+
+  archive_info->compression = header->compression;
+  archive_info->dedup = header->dedup;
+  archive_info->generation = header->generation;
+  archive_info->blocksize = header->blocksize;
+  archive_info->blockcount = header->blockcount;
+  archive_info->num_ids = header->num_ids;
+  archive_info->num_files = header->num_files;
+
+  /* Nur Platz für die Zeiger, die Dateien selbst bleiben in image */
+  archive_info->file_infos = calloc(header->num_ids == 0 ? 1 : header->num_ids, sizeof(struct FileInfo*));
+  archive_info->file_capacity = header->num_ids;
+
+  struct FreeSpace* free_space = freespace_create();
+  free_space->blockcount = header->blockcount;
+  free_space->num_free = header->num_free;
+  free_space->num_words = header->num_words;
+  free_space->words = (uint64_t*)(image + header->words_offset);
+  free_space->nodes = (struct FreeSpaceNode*)(image + header->nodes_offset);
+  free_space->mapped = true;
+  archive_info->free_space = free_space;
+
+  struct NameIndex* name_index = nameindex_create();
+  name_index->capacity = header->index_capacity;
+  name_index->num_used = header->index_used;
+  name_index->num_names = header->num_files;
+  name_index->slots = (struct NameIndexSlot*)(image + header->index_offset);
+  name_index->mapped = true;
+  archive_info->name_index = name_index;
+
+  if (archive_info->dedup) {
+    archive_info->refcounts = (uint32_t*)(image + header->refcounts_offset);
+    archive_info->block_hashes = (uint64_t*)(image + header->block_hashes_offset);
+    archive_info->blocks_mapped = true;
+
+    struct BlockIndex* block_index = blockindex_create();
+    block_index->capacity = header->block_index_capacity;
+    block_index->num_used = header->block_index_used;
+    block_index->num_blocks = header->block_index_blocks;
+    block_index->slots = (struct BlockIndexSlot*)(image + header->block_index_offset);
+    block_index->mapped = true;
+    archive_info->block_index = block_index;
+  }
+
+  return 0;
+}
+
+/**
+ * Lädt Archivinfos aus einer Datei.
+ */
+int archiveinfo_initialize_from_file (struct ArchiveInfo* archive_info, FILE* file) {
+  int status = 0;
+  char magic[8];
+  uint64_t version = 0;
+
+  status = file_read(magic, sizeof(char), 8, file);
+
+  if (status == 0 && memcmp(magic, STRUCTURE_MAGIC, 8) == 0) {
+    status = file_read(&version, sizeof(uint64_t), 1, file);
+
+    if (status == 0 && version == STRUCTURE_VERSION) {
+      return archiveinfo_map_structure(archive_info, file);
+    } else {
+      status = 1;
+    }
+  } else if (status == 0) {
+    memcpy(&archive_info->blocksize, magic, sizeof(uint64_t));
+    status = archiveinfo_read_legacy_structure(archive_info, file);
+  }
+
+  if (status == 0) {
+    archive_info->name_index = nameindex_create();
+    nameindex_initialize(archive_info->name_index, archive_info->num_files);
+
+    uint64_t i;
+    for (i = 0; i < archive_info->num_ids; i++) {
+      if (archive_info->file_infos[i] != NULL) {
+        nameindex_insert(archive_info->name_index, archive_info->file_infos[i]->name, i);
+      }
+    }
+  }
+
+  return status;
+}
+
+/**
+ * Nummeriert die Dateien ohne die Lücken gelöschter IDs neu, in ihrer
+ * bisherigen Reihenfolge. Dateien, die noch nur in der gemappten
+ * Strukturdatei stehen, werden dort auf ihre neue Zeile verschoben, weil
+ * keine Datei dabei eine größere ID bekommt. Danach passt keine alte ID
+ * mehr, auch nicht die in der Strukturdatei und im Journal, also nur direkt
+ * nach dem Laden aufrufen und vor der nächsten Änderung die ganze Struktur
+ * schreiben.
+ *
+ * Gibt zurück, ob sich IDs geändert haben.
+ *
+ * @private
+ */
+bool archiveinfo_compact_ids (struct ArchiveInfo* archive_info) {
+  if (archive_info->num_ids == archive_info->num_files) {
+    return false;
+  }
+
+  struct NameIndex* name_index = archive_info->name_index;
+  int64_t* new_ids = malloc(archive_info->num_ids * sizeof(int64_t));
+  uint64_t next = 0;
+
+  uint64_t i;
+  for (i = 0; i < archive_info->num_ids; i++) {
+    struct FileInfo* file_info = archive_info->file_infos[i];
+    struct StructureFile* entry = file_info == NULL ? archiveinfo_image_file(archive_info, i) : NULL;
+
+    new_ids[i] = NAMEINDEX_DELETED;
+
+    if (file_info == NULL && entry == NULL) {
+      continue;
+    }
+
+    if (next != i) {
+      archive_info->file_infos[next] = file_info;
+      archive_info->file_infos[i] = NULL;
+
+      if (entry != NULL) {
+        archive_info->image_files[next] = *entry;
+
+        if (archive_info->image_stored_sizes != NULL) {
+          archive_info->image_stored_sizes[next] = archive_info->image_stored_sizes[i];
+        }
+
+        if (archive_info->image_file_hashes != NULL) {
+          archive_info->image_file_hashes[next] = archive_info->image_file_hashes[i];
+        }
+      } else if (next < archive_info->image_num_ids) {
+        archive_info->image_files[next].live = 0;
+      }
+    }
+
+    new_ids[i] = next;
+    next++;
+  }
+
+  archive_info->num_ids = next;
+  archive_info->image_num_ids = archive_info->image_num_ids < next ? archive_info->image_num_ids : next;
+
+  /* Die Tabelle wird dabei auch kleiner und verliert ihre Löschmarkierungen */
+  uint64_t capacity = 16;
+
+  while (capacity < 2 * (name_index->num_names + 1)) {
+    capacity *= 2;
+  }
+
+  nameindex_rehash(name_index, capacity);
+
+  for (i = 0; i < name_index->capacity; i++) {
+    if (name_index->slots[i].file >= 0) {
+      name_index->slots[i].file = new_ids[name_index->slots[i].file];
+    }
+  }
+
+  free(new_ids);
+
+  return true;
+}
+
+/**
+ * Gibt die Blöcke aller Reservierungen im FreeSpace frei oder belegt sie
+ * wieder, je nach hold.
+ *
+ * @private
+ */
+void archiveinfo_hold_reservations (struct ArchiveInfo* archive_info, bool hold) {
+  uint64_t i;
+  for (i = 0; i < archive_info->num_reservations; i++) {
+    struct FileInfo* reserved = archive_info->reservations[i];
+
+    uint64_t j;
+    for (j = 0; j < reserved->num_extents; j++) {
+      if (hold) {
+        freespace_allocate(archive_info->free_space, reserved->extents[j].start, reserved->extents[j].length);
+      } else {
+        freespace_release(archive_info->free_space, reserved->extents[j].start, reserved->extents[j].length);
+      }
+    }
+  }
+}
+
+/**
+ * Schreibt die Struktur im aktuellen Format. Dateien, die noch nicht aus der
+ * gemappten Strukturdatei ausgelesen wurden, werden direkt von dort kopiert.
+ */
+int archiveinfo_write (struct ArchiveInfo* archive_info, FILE* file) {
+  int status = 0;
+  struct StructureHeader header;
+  struct StructureFile* files = calloc(archive_info->num_ids == 0 ? 1 : archive_info->num_ids, sizeof(struct StructureFile));
+  struct Buffer* extents = buffer_create();
+  struct Buffer* names = buffer_create();
+  uint64_t* stored_sizes = calloc(archive_info->num_ids == 0 ? 1 : archive_info->num_ids, sizeof(uint64_t));
+  uint64_t* file_hashes = malloc((archive_info->num_ids == 0 ? 1 : archive_info->num_ids) * sizeof(uint64_t));
+  struct Buffer* hashes = buffer_create();
+  struct FreeSpace* free_space = archive_info->free_space;
+  struct NameIndex* name_index = archive_info->name_index;
+  struct FreeSpaceNode unused_node = { 0, 0, 0 };
+
+  uint64_t i;
+
+  /* Reservierte Blöcke werden als frei gespeichert */
+  archiveinfo_hold_reservations(archive_info, false);
+
+  for (i = 0; i < archive_info->num_ids; i++) {
+    struct FileInfo* file_info = archive_info->file_infos[i];
+    struct StructureFile* entry = file_info == NULL ? archiveinfo_image_file(archive_info, i) : NULL;
+    const uint64_t* file_hash = NULL;
+
+    if (file_info != NULL) {
+      file_hash = file_info->hashes;
+      files[i].size = file_info->size;
+      stored_sizes[i] = file_info->stored_size;
+      files[i].num_extents = file_info->num_extents;
+      files[i].live = 1;
+      files[i].name_offset = names->length;
+      buffer_append(names, file_info->name, strlen(file_info->name) + 1);
+      files[i].first_extent = extents->length / sizeof(struct Extent);
+      buffer_append(extents, file_info->extents, file_info->num_extents * sizeof(struct Extent));
+    } else if (entry != NULL) {
+      const char* name = archive_info->image_names + entry->name_offset;
+
+      file_hash = archiveinfo_image_hashes(archive_info, i, entry->size);
+      files[i].size = entry->size;
+      stored_sizes[i] = archive_info->image_stored_sizes == NULL ? entry->size : archive_info->image_stored_sizes[i];
+      files[i].num_extents = entry->num_extents;
+      files[i].live = 1;
+      files[i].name_offset = names->length;
+      buffer_append(names, name, strlen(name) + 1);
+      files[i].first_extent = extents->length / sizeof(struct Extent);
+      buffer_append(extents, archive_info->image_extents + entry->first_extent, entry->num_extents * sizeof(struct Extent));
+    }
+
+    file_hashes[i] = file_hash == NULL ? UINT64_MAX : hashes->length / sizeof(uint64_t);
+
+    if (file_hash != NULL) {
+      buffer_append(hashes, file_hash, archiveinfo_num_hashes(archive_info, files[i].size) * sizeof(uint64_t));
+    }
+  }
+
+  while (names->length % 8 != 0) {
+    buffer_append(names, "", 1);
+  }
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, STRUCTURE_MAGIC, 8);
+  header.version = STRUCTURE_VERSION;
+  header.generation = archive_info->generation;
+  header.blocksize = archive_info->blocksize;
+  header.blockcount = archive_info->blockcount;
+  header.num_ids = archive_info->num_ids;
+  header.num_files = archive_info->num_files;
+  header.files_offset = sizeof(struct StructureHeader);
+  header.extents_offset = header.files_offset + archive_info->num_ids * sizeof(struct StructureFile);
+  header.num_extents = extents->length / sizeof(struct Extent);
+  header.names_offset = header.extents_offset + extents->length;
+  header.names_size = names->length;
+  header.num_free = free_space->num_free;
+  header.num_words = free_space->num_words;
+  header.words_offset = header.names_offset + names->length;
+  header.nodes_offset = header.words_offset + free_space->num_words * sizeof(uint64_t);
+  header.index_capacity = name_index->capacity;
+  header.index_used = name_index->num_used;
+  header.index_offset = header.nodes_offset + 2 * free_space->num_words * sizeof(struct FreeSpaceNode);
+  header.compression = archive_info->compression;
+  header.stored_sizes_offset = archive_info->compression == COMPRESSION_NONE ? 0 : header.index_offset + name_index->capacity * sizeof(struct NameIndexSlot);
+  header.dedup = archive_info->dedup;
+
+  if (archive_info->dedup) {
+    struct BlockIndex* block_index = archive_info->block_index;
+
+    header.refcounts_offset = header.index_offset + name_index->capacity * sizeof(struct NameIndexSlot);
+    header.block_hashes_offset = header.refcounts_offset + (archive_info->blockcount + 1) / 2 * sizeof(uint64_t);
+    header.block_index_capacity = block_index->capacity;
+    header.block_index_used = block_index->num_used;
+    header.block_index_blocks = block_index->num_blocks;
+    header.block_index_offset = header.block_hashes_offset + archive_info->blockcount * sizeof(uint64_t);
+    header.file_hashes_offset = header.block_index_offset + block_index->capacity * sizeof(struct BlockIndexSlot);
+  } else {
+    header.file_hashes_offset = header.index_offset + name_index->capacity * sizeof(struct NameIndexSlot);
+    header.file_hashes_offset += header.stored_sizes_offset != 0 ? archive_info->num_ids * sizeof(uint64_t) : 0;
+  }
+
+  header.hashes_offset = header.file_hashes_offset + archive_info->num_ids * sizeof(uint64_t);
+  header.num_hashes = hashes->length / sizeof(uint64_t);
+
+  status = file_write(&header, sizeof(struct StructureHeader), 1, file);
+  status == 0 && (status = file_write(files, sizeof(struct StructureFile), archive_info->num_ids, file));
+  status == 0 && extents->length > 0 && (status = file_write(extents->data, 1, extents->length, file));
+  status == 0 && names->length > 0 && (status = file_write(names->data, 1, names->length, file));
+  status == 0 && (status = file_write(free_space->words, sizeof(uint64_t), free_space->num_words, file));
+
+  /* Knoten 0 wird im Segmentbaum nicht benutzt */
+  status == 0 && (status = file_write(&unused_node, sizeof(struct FreeSpaceNode), 1, file));
+  status == 0 && (status = file_write(free_space->nodes + 1, sizeof(struct FreeSpaceNode), 2 * free_space->num_words - 1, file));
+  status == 0 && (status = file_write(name_index->slots, sizeof(struct NameIndexSlot), name_index->capacity, file));
+  status == 0 && header.stored_sizes_offset != 0 && (status = file_write(stored_sizes, sizeof(uint64_t), archive_info->num_ids, file));
+
+  if (archive_info->dedup) {
+    uint32_t padding = 0;
+
+    status == 0 && (status = file_write(archive_info->refcounts, sizeof(uint32_t), archive_info->blockcount, file));
+    status == 0 && archive_info->blockcount % 2 != 0 && (status = file_write(&padding, sizeof(uint32_t), 1, file));
+    status == 0 && (status = file_write(archive_info->block_hashes, sizeof(uint64_t), archive_info->blockcount, file));
+    status == 0 && (status = file_write(archive_info->block_index->slots, sizeof(struct BlockIndexSlot), archive_info->block_index->capacity, file));
+  }
+
+  status == 0 && (status = file_write(file_hashes, sizeof(uint64_t), archive_info->num_ids, file));
+  status == 0 && hashes->length > 0 && (status = file_write(hashes->data, 1, hashes->length, file));
+
+  archiveinfo_hold_reservations(archive_info, true);
+
+  free(files);
+  free(stored_sizes);
+  free(file_hashes);
+  buffer_free(hashes);
+  buffer_free(extents);
+  buffer_free(names);
+
+  return status;
+}
+
+int64_t archiveinfo_get_file_index (struct ArchiveInfo*, const char*);
+
+bool archiveinfo_has_file (struct ArchiveInfo* archive_info, const char* name) {
+  return archiveinfo_get_file_index(archive_info, name) != -1;
+}
+
+/**
+ * Gibt die Anzahl der freien Blöcke im Archiv zurück.
+ */
+uint64_t archiveinfo_num_free_blocks (struct ArchiveInfo* archive_info) {
+  if (archive_info->free_space == NULL) {
+    return 0;
+  } else {
+    return archive_info->free_space->num_free;
+  }
+}
+
+/**
+ * Gibt die Anzahl der freien Blöcke zurück, die benötigt werden, um eine Datei
+ * der Größe size zu speichern.
+ */
+uint64_t archiveinfo_needed_blocks (struct ArchiveInfo* archive_info, long int size) {
+  uint64_t needed = size / archive_info->blocksize;
+
+  if (size % archive_info->blocksize != 0) {
+    needed++;
+  }
+
+  return needed;
+}
+
+/**
+ * Vergleicht zwei Extents nach ihrem Anfang.
+ *
+ * @private
+ */
+int extent_compare (const void* a, const void* b) {
+  uint64_t start_a = ((const struct Extent*)a)->start;
+  uint64_t start_b = ((const struct Extent*)b)->start;
+
+  return (start_a > start_b) - (start_a < start_b);
+}
+
+/**
+ * Vergleicht zwei Extents absteigend nach ihrer Länge, gleich lange nach
+ * ihrem Anfang.
+ *
+ * @private
+ */
+int extent_compare_length (const void* a, const void* b) {
+  uint64_t length_a = ((const struct Extent*)a)->length;
+  uint64_t length_b = ((const struct Extent*)b)->length;
+
+  if (length_a != length_b) {
+    return (length_a < length_b) - (length_a > length_b);
+  }
+
+  return extent_compare(a, b);
+}
+
+/**
+ * Legt num freie Blöcke in möglichst wenigen Extents ab: die längsten freien
+ * Läufe, bis genug Blöcke zusammen sind, nach ihrer Position sortiert.
+ *
+ * Gibt die Anzahl der Extents zurück.
+ *
+ * @private
+ */
+uint64_t archiveinfo_get_fewest_extents (struct ArchiveInfo* archive_info, uint64_t num, struct Extent** extents) {
+  struct FreeSpace* free_space = archive_info->free_space;
+  uint64_t num_runs = 0;
+  uint64_t capacity = 16;
+  struct Extent* runs = malloc(capacity * sizeof(struct Extent));
+  uint64_t start = freespace_find(free_space, 0, 1);
+
+  while (start != FREESPACE_NONE) {
+    uint64_t end = freespace_run_end(free_space, start);
+
+    if (num_runs == capacity) {
+      capacity *= 2;
+      runs = realloc(runs, capacity * sizeof(struct Extent));
+    }
+
+    runs[num_runs].start = start;
+    runs[num_runs].length = end - start;
+    num_runs++;
+
+    start = freespace_find(free_space, end, 1);
+  }
+
+  qsort(runs, num_runs, sizeof(struct Extent), extent_compare_length);
+
+  uint64_t num_extents = 0;
+  while (num_extents < num_runs && num > 0) {
+    runs[num_extents].length = runs[num_extents].length > num ? num : runs[num_extents].length;
+    num -= runs[num_extents].length;
+    num_extents++;
+  }
+
+  qsort(runs, num_extents, sizeof(struct Extent), extent_compare);
+  *extents = num_extents == 0 ? realloc(runs, sizeof(struct Extent)) : realloc(runs, num_extents * sizeof(struct Extent));
+
+  return num_extents;
+}
+
+/**
+ * Länge der Stücke, in denen Dateien komprimiert werden
+ */
+#define COMPRESSION_CHUNK_SIZE 65536
+
+/**
+ * Gibt zurück, wie viele Bytes eine Datei der Größe size im Store höchstens
+ * belegt. In komprimierten Archiven steht vor jedem Stück seine Länge als
+ * uint32_t, und Stücke, die nicht kleiner werden, bleiben unverändert.
+ */
+uint64_t archiveinfo_max_stored_size (struct ArchiveInfo* archive_info, uint64_t size) {
+  if (archive_info->compression == COMPRESSION_NONE) {
+    return size;
+  }
+
+  return size + (size + COMPRESSION_CHUNK_SIZE - 1) / COMPRESSION_CHUNK_SIZE * sizeof(uint32_t);
+}
+
+/**
+ * Gibt zurück, über wie viele Bytes einer Datei jeweils einer ihrer
+ * Fingerabdrücke geht: einen Block, in komprimierten Archiven ein Stück. Bei
+ * Deduplizierung 0, dort haben die Dateien keine eigenen.
+ */
+uint64_t archiveinfo_hash_unit (struct ArchiveInfo* archive_info) {
+  if (archive_info->dedup) {
+    return 0;
+  } else if (archive_info->compression != COMPRESSION_NONE) {
+    return COMPRESSION_CHUNK_SIZE;
+  } else {
+    return archive_info->blocksize;
+  }
+}
+
+/**
+ * Gibt die Anzahl der Fingerabdrücke einer Datei mit size Bytes zurück.
+ */
+uint64_t archiveinfo_num_hashes (struct ArchiveInfo* archive_info, uint64_t size) {
+  uint64_t unit = archiveinfo_hash_unit(archive_info);
+
+  return unit == 0 ? 0 : (size + unit - 1) / unit;
+}
+
+/**
+ * Legt Platz für die Fingerabdrücke an, die beim Schreiben einer neuen Datei
+ * mit size Bytes entstehen. Das sind nur die der Stücke in komprimierten
+ * Archiven, die beim Komprimieren nebenbei abfallen. Blöcke bekommen ihre
+ * erst beim ersten archive_update_file, damit das Hinzufügen dafür keine
+ * Rechenzeit braucht. Gibt sonst NULL zurück.
+ */
+uint64_t* archiveinfo_create_hashes (struct ArchiveInfo* archive_info, uint64_t size) {
+  uint64_t num_hashes = archiveinfo_num_hashes(archive_info, size);
+
+  if (archive_info->compression == COMPRESSION_NONE || num_hashes == 0) {
+    return NULL;
+  }
+
+  return calloc(num_hashes, sizeof(uint64_t));
+}
+
+/**
+ * Passt die Fingerabdrücke der Datei file_info an ihre neue Größe an, nachdem
+ * sie von old_size geändert wurde. Ab dem Block oder Stück, in dem die
+ * kürzere der beiden endet, sind sie danach unbekannt.
+ *
+ * @private
+ */
+void archiveinfo_resize_hashes (struct ArchiveInfo* archive_info, struct FileInfo* file_info, uint64_t old_size) {
+  uint64_t unit = archiveinfo_hash_unit(archive_info);
+  uint64_t num_hashes = archiveinfo_num_hashes(archive_info, file_info->size);
+
+  if (file_info->hashes == NULL || old_size == file_info->size) {
+    return;
+  } else if (num_hashes == 0) {
+    free(file_info->hashes);
+    file_info->hashes = NULL;
+
+    return;
+  }
+
+  uint64_t kept = (old_size < file_info->size ? old_size : file_info->size) / unit;
+
+  file_info->hashes = realloc(file_info->hashes, num_hashes * sizeof(uint64_t));
+  memset(file_info->hashes + kept, 0, (num_hashes - kept) * sizeof(uint64_t));
+}
+
+/**
+ * Setzt count Fingerabdrücke der Datei file_info ab dem Index first. Was
+ * hinter ihrem Ende liegt, wird ignoriert.
+ *
+ * @private
+ */
+void archiveinfo_set_hashes (struct ArchiveInfo* archive_info, struct FileInfo* file_info, const uint64_t* hashes, uint64_t first, uint64_t count) {
+  uint64_t num_hashes = archiveinfo_num_hashes(archive_info, file_info->size);
+
+  if (first >= num_hashes) {
+    return;
+  } else if (file_info->hashes == NULL) {
+    file_info->hashes = calloc(num_hashes, sizeof(uint64_t));
+  }
+
+  count = count < num_hashes - first ? count : num_hashes - first;
+  memcpy(file_info->hashes + first, hashes, count * sizeof(uint64_t));
+}
+
+/**
+ * Sucht num freie Blöcke und legt sie als Liste von Extents in extents ab.
+ * Die Liste muss vom Aufrufer freigegeben werden.
+ *
+ * Bei ALLOCATION_BEST_FIT und ALLOCATION_NEXT_FIT wird ein einzelner freier
+ * Lauf gesucht, in den alle Blöcke passen. Gibt es keinen, werden die Blöcke
+ * auf möglichst wenige Läufe verteilt.
+ *
+ * Gibt die Anzahl der Extents zurück.
+ */
+uint64_t archiveinfo_get_free_extents (struct ArchiveInfo* archive_info, uint64_t num, struct Extent** extents) {
+  if (archive_info->allocation != ALLOCATION_FIRST_FIT && num > 0) {
+    struct FreeSpace* free_space = archive_info->free_space;
+    uint64_t start;
+
+    if (archive_info->allocation == ALLOCATION_BEST_FIT) {
+      start = freespace_best_fit(free_space, num);
+    } else {
+      start = freespace_find(free_space, archive_info->next_fit, num);
+      start = start == FREESPACE_NONE ? freespace_find(free_space, 0, num) : start;
+    }
+
+    uint64_t num_extents = 1;
+
+    if (start != FREESPACE_NONE) {
+      *extents = malloc(sizeof(struct Extent));
+      (*extents)[0].start = start;
+      (*extents)[0].length = num;
+    } else {
+      num_extents = archiveinfo_get_fewest_extents(archive_info, num, extents);
+    }
+
+    archive_info->next_fit = (*extents)[num_extents - 1].start + (*extents)[num_extents - 1].length;
+
+    return num_extents;
+  }
+
+  uint64_t num_extents = 0;
+  uint64_t capacity = 4;
+  uint64_t start = freespace_find(archive_info->free_space, 0, 1);
+
+  *extents = malloc(capacity * sizeof(struct Extent));
+
+  while (start != FREESPACE_NONE && num > 0) {
+    uint64_t length = freespace_run_end(archive_info->free_space, start) - start;
+
+    if (length > num) {
+      length = num;
+    }
+
+    if (num_extents == capacity) {
+      capacity *= 2;
+      *extents = realloc(*extents, capacity * sizeof(struct Extent));
+    }
+
+    (*extents)[num_extents].start = start;
+    (*extents)[num_extents].length = length;
+    num_extents++;
+    num -= length;
+
+    start = freespace_find(archive_info->free_space, start + length, 1);
+  }
+
+  return num_extents;
+}
+
+/**
+ * Gibt die ID der Datei zurück oder -1, wenn es keine Datei mit dem Namen
+ * gibt.
+ *
+ * @private
+ */
+int64_t archiveinfo_get_file_index (struct ArchiveInfo* archive_info, const char* name) {
+  if (archive_info->name_index == NULL) {
+    return -1;
+  } else {
+    return nameindex_get(archive_info->name_index, archive_info, name);
+  }
+}
+
+/**
+ * Gibt die FileInfo zu einem Namen zurück oder NULL.
+ */
+struct FileInfo* archiveinfo_get_file (struct ArchiveInfo* archive_info, const char* name) {
+  int64_t index = archiveinfo_get_file_index(archive_info, name);
+
+  if (index == -1) {
+    return NULL;
+  } else {
+    return archiveinfo_file(archive_info, index);
+  }
+}
+
+uint64_t archiveinfo_get_file_size (struct ArchiveInfo* archive_info, const char* name) {
+  int64_t index = archiveinfo_get_file_index(archive_info, name);
+
+  if (index == -1) {
+    return 0;
+  } else {
+    return archiveinfo_file(archive_info, index)->size;
+  }
+}
+
+/**
+ * Trägt ein, dass im Block block der Inhalt mit dem Fingerabdruck hash liegt,
+ * sodass neue Dateien darauf verweisen können.
+ */
+void archiveinfo_remember_block (struct ArchiveInfo* archive_info, uint64_t block, uint64_t hash) {
+  archive_info->block_hashes[block] = hash;
+  blockindex_insert(archive_info->block_index, hash, block);
+}
+
+/**
+ * Nimmt den Block block aus dem Index der Fingerabdrücke.
+ */
+void archiveinfo_forget_block (struct ArchiveInfo* archive_info, uint64_t block) {
+  if (archive_info->block_hashes[block] != 0) {
+    blockindex_remove(archive_info->block_index, archive_info->block_hashes[block], block);
+    archive_info->block_hashes[block] = 0;
+  }
+}
+
+/**
+ * Nimmt alle Blöcke der Extents, auf die keine Datei verweist, aus dem Index
+ * der Fingerabdrücke. Wird gebraucht, wenn Blöcke beim Schreiben schon
+ * eingetragen, aber nie einer Datei zugeordnet wurden.
+ */
+void archiveinfo_forget_unused (struct ArchiveInfo* archive_info, struct Extent* extents, uint64_t num_extents) {
+  if (!archive_info->dedup) {
+    return;
+  }
+
+  uint64_t i;
+  for (i = 0; i < num_extents; i++) {
+    uint64_t block;
+    for (block = extents[i].start; block < extents[i].start + extents[i].length; block++) {
+      if (archive_info->refcounts[block] == 0) {
+        archiveinfo_forget_block(archive_info, block);
+      }
+    }
+  }
+}
+
+/**
+ * Belegt length Blöcke ab start für eine Datei. Bei Deduplizierung wird nur
+ * der Verweis gezählt und ein Block, auf den schon eine Datei verweist,
+ * bleibt einfach belegt.
+ *
+ * @private
+ */
+void archiveinfo_claim_blocks (struct ArchiveInfo* archive_info, uint64_t start, uint64_t length) {
+  if (!archive_info->dedup) {
+    freespace_allocate(archive_info->free_space, start, length);
+
+    return;
+  }
+
+  uint64_t block;
+  for (block = start; block < start + length; block++) {
+    if (archive_info->refcounts[block]++ == 0) {
+      freespace_allocate(archive_info->free_space, block, 1);
+    }
+  }
+}
+
+/**
+ * Gibt length Blöcke ab start frei, die zu einer Datei gehört haben. Bei
+ * Deduplizierung wird ein Block erst frei, wenn keine Datei mehr darauf
+ * verweist.
+ *
+ * @private
+ */
+void archiveinfo_release_blocks (struct ArchiveInfo* archive_info, uint64_t start, uint64_t length) {
+  if (!archive_info->dedup) {
+    freespace_release(archive_info->free_space, start, length);
+
+    return;
+  }
+
+  uint64_t block;
+  for (block = start; block < start + length; block++) {
+    if (--archive_info->refcounts[block] == 0) {
+      freespace_release(archive_info->free_space, block, 1);
+      archiveinfo_forget_block(archive_info, block);
+    }
+  }
+}
+
+/**
+ * Trägt eine Datei mit einer vorgegebenen ID ein und reserviert die
+ * übergebenen Extents dafür.
+ *
+ * @private
+ */
+void archiveinfo_insert_file (struct ArchiveInfo* archive_info, uint64_t id, const char* name, uint64_t size, struct Extent* extents, uint64_t num_extents) {
+  archiveinfo_reserve_ids(archive_info, id + 1);
+
+  if (id >= archive_info->num_ids) {
+    archive_info->num_ids = id + 1;
+  }
+
+  archive_info->num_files++;
+
+  struct FileInfo* file_info = fileinfo_create();
+  archive_info->file_infos[id] = file_info;
+  fileinfo_initialize(file_info, name, size);
+
+  nameindex_insert(archive_info->name_index, name, id);
+
+  uint64_t i;
+  for (i = 0; i < num_extents; i++) {
+    fileinfo_append_extent(file_info, extents[i].start, extents[i].length);
+    archiveinfo_claim_blocks(archive_info, extents[i].start, extents[i].length);
+  }
+}
+
+/**
+ * Fügt eine neue Datei hinzu und reserviert die übergebenen Extents dafür.
+ *
+ * Gibt die ID der neuen Datei zurück.
+ */
+uint64_t archiveinfo_add_file (struct ArchiveInfo* archive_info, const char* name, long int size, struct Extent* extents, uint64_t num_extents) {
+  uint64_t id = archive_info->num_ids;
+
+  archiveinfo_insert_file(archive_info, id, name, size, extents, num_extents);
+
+  return id;
+}
+
+/**
+ * Löscht die Datei mit der ID id und gibt ihre Blöcke frei, bei
+ * Deduplizierung nur die, auf die keine andere Datei mehr verweist.
+ */
+void archiveinfo_delete_id (struct ArchiveInfo* archive_info, uint64_t id) {
+  struct FileInfo* file_info = archiveinfo_file(archive_info, id);
+
+  uint64_t i;
+  for (i = 0; i < file_info->num_extents; i++) {
+    archiveinfo_release_blocks(archive_info, file_info->extents[i].start, file_info->extents[i].length);
+  }
+
+  nameindex_remove(archive_info->name_index, archive_info, file_info->name);
+  fileinfo_free(file_info);
+
+  archive_info->file_infos[id] = NULL;
+
+  if (id < archive_info->image_num_ids) {
+    archive_info->image_files[id].live = 0;
+  }
+
+  archive_info->num_files--;
+}
+
+/**
+ * Ersetzt die Extents der Datei id. Die alten Blöcke werden frei, die neuen
+ * belegt.
+ */
+void archiveinfo_set_extents (struct ArchiveInfo* archive_info, uint64_t id, struct Extent* extents, uint64_t num_extents) {
+  struct FileInfo* file_info = archiveinfo_file(archive_info, id);
+
+  /* Bei Deduplizierung werden die neuen Verweise zuerst gezählt, damit Blöcke in beiden Listen nicht zwischendurch frei werden */
+  uint64_t i;
+  for (i = 0; i < num_extents && archive_info->dedup; i++) {
+    archiveinfo_claim_blocks(archive_info, extents[i].start, extents[i].length);
+  }
+
+  for (i = 0; i < file_info->num_extents; i++) {
+    archiveinfo_release_blocks(archive_info, file_info->extents[i].start, file_info->extents[i].length);
+  }
+
+  file_info->num_extents = 0;
+
+  for (i = 0; i < num_extents; i++) {
+    fileinfo_append_extent(file_info, extents[i].start, extents[i].length);
+
+    if (!archive_info->dedup) {
+      archiveinfo_claim_blocks(archive_info, extents[i].start, extents[i].length);
+    }
+  }
+}
+
+/**
+ * Ändert die Anzahl der Blöcke im Archiv. Hinter dem neuen Ende darf keine
+ * Datei mehr Blöcke belegen.
+ */
+void archiveinfo_resize (struct ArchiveInfo* archive_info, uint64_t blockcount) {
+  if (archive_info->dedup) {
+    uint64_t kept = archive_info->blockcount < blockcount ? archive_info->blockcount : blockcount;
+    uint32_t* refcounts = calloc(blockcount, sizeof(uint32_t));
+    uint64_t* block_hashes = calloc(blockcount, sizeof(uint64_t));
+
+    memcpy(refcounts, archive_info->refcounts, kept * sizeof(uint32_t));
+    memcpy(block_hashes, archive_info->block_hashes, kept * sizeof(uint64_t));
+
+    if (!archive_info->blocks_mapped) {
+      free(archive_info->refcounts);
+      free(archive_info->block_hashes);
+    }
+
+    archive_info->refcounts = refcounts;
+    archive_info->block_hashes = block_hashes;
+    archive_info->blocks_mapped = false;
+  }
+
+  archive_info->blockcount = blockcount;
+  freespace_resize(archive_info->free_space, blockcount);
+}
+
+void archiveinfo_delete_file (struct ArchiveInfo* archive_info, const char* name) {
+  int64_t id = archiveinfo_get_file_index(archive_info, name);
+
+  if (id != -1) {
+    archiveinfo_delete_id(archive_info, id);
+  }
+}
+
+/**
+ * Kennung am Anfang jedes Journals
+ */
+#define JOURNAL_MAGIC "HHUVFSJ\0"
+
+/**
+ * Größe des Journal-Kopfes aus Kennung und Generation
+ */
+#define JOURNAL_HEADER_SIZE 16
+
+#define JOURNAL_ADD 1
+#define JOURNAL_DELETE 2
+#define JOURNAL_EXTENTS 3
+#define JOURNAL_HASHES 4
+
+/**
+ * Prüfsumme über einen Journaleintrag (FNV-1a mit 32 Bit).
+ *
+ * @private
+ */
+uint32_t journal_checksum (const char* data, uint64_t length) {
+  uint32_t hash = 2166136261U;
+
+  uint64_t i;
+  for (i = 0; i < length; i++) {
+    hash ^= (unsigned char)data[i];
+    hash *= 16777619U;
+  }
+
+  return hash;
+}
+
+/**
+ * Hängt einen Eintrag mit dem Inhalt record an das Journal an. Vor dem Inhalt
+ * stehen seine Länge und Prüfsumme, damit ein unvollständig geschriebener
+ * Eintrag beim Laden erkannt wird.
+ *
+ * @private
+ */
+void journal_append_record (struct Buffer* journal, struct Buffer* record) {
+  uint32_t length = record->length;
+  uint32_t checksum = journal_checksum(record->data, record->length);
+
+  buffer_append(journal, &length, sizeof(uint32_t));
+  buffer_append(journal, &checksum, sizeof(uint32_t));
+  buffer_append(journal, record->data, record->length);
+}
+
+/**
+ * Schreibt einen Journaleintrag, der die Datei id mit allen ihren Daten
+ * einträgt.
+ */
+void archiveinfo_journal_add (struct ArchiveInfo* archive_info, struct Buffer* journal, uint64_t id) {
+  struct FileInfo* file_info = archiveinfo_file(archive_info, id);
+  struct Buffer* record = buffer_create();
+  uint8_t type = JOURNAL_ADD;
+  uint64_t name_length = strlen(file_info->name);
+
+  buffer_append(record, &type, sizeof(uint8_t));
+  buffer_append(record, &id, sizeof(uint64_t));
+  buffer_append(record, &file_info->size, sizeof(uint64_t));
+  buffer_append(record, &name_length, sizeof(uint64_t));
+  buffer_append(record, file_info->name, name_length);
+  buffer_append(record, &file_info->num_extents, sizeof(uint64_t));
+  buffer_append(record, file_info->extents, file_info->num_extents * sizeof(struct Extent));
+  buffer_append(record, &file_info->stored_size, sizeof(uint64_t));
+
+  /* Bei Deduplizierung die Fingerabdrücke der Blöcke, damit auch neu geschriebene Blöcke wieder in den Index kommen */
+  uint64_t i;
+  for (i = 0; i < file_info->num_extents && archive_info->dedup; i++) {
+    buffer_append(record, archive_info->block_hashes + file_info->extents[i].start, file_info->extents[i].length * sizeof(uint64_t));
+  }
+
+  /* Sonst die Fingerabdrücke der Datei selbst, falls bekannt */
+  if (file_info->hashes != NULL) {
+    buffer_append(record, file_info->hashes, archiveinfo_num_hashes(archive_info, file_info->size) * sizeof(uint64_t));
+  }
+
+  journal_append_record(journal, record);
+  buffer_free(record);
+}
+
+/**
+ * Schreibt einen Journaleintrag, der die Datei id löscht.
+ */
+void archiveinfo_journal_delete (struct ArchiveInfo* archive_info, struct Buffer* journal, uint64_t id) {
+  (void)archive_info;
+
+  struct Buffer* record = buffer_create();
+  uint8_t type = JOURNAL_DELETE;
+
+  buffer_append(record, &type, sizeof(uint8_t));
+  buffer_append(record, &id, sizeof(uint64_t));
+
+  journal_append_record(journal, record);
+  buffer_free(record);
+}
+
+/**
+ * Schreibt einen Journaleintrag, der die Extents und die Größe der Datei id
+ * ersetzt.
+ */
+void archiveinfo_journal_extents (struct ArchiveInfo* archive_info, struct Buffer* journal, uint64_t id) {
+  struct FileInfo* file_info = archiveinfo_file(archive_info, id);
+  struct Buffer* record = buffer_create();
+  uint8_t type = JOURNAL_EXTENTS;
+
+  buffer_append(record, &type, sizeof(uint8_t));
+  buffer_append(record, &id, sizeof(uint64_t));
+  buffer_append(record, &file_info->num_extents, sizeof(uint64_t));
+  buffer_append(record, file_info->extents, file_info->num_extents * sizeof(struct Extent));
+  buffer_append(record, &file_info->size, sizeof(uint64_t));
+  buffer_append(record, &file_info->stored_size, sizeof(uint64_t));
+
+  uint64_t i;
+  for (i = 0; i < file_info->num_extents && archive_info->dedup; i++) {
+    buffer_append(record, archive_info->block_hashes + file_info->extents[i].start, file_info->extents[i].length * sizeof(uint64_t));
+  }
+
+  journal_append_record(journal, record);
+  buffer_free(record);
+}
+
+/**
+ * Schreibt einen Journaleintrag, der count Fingerabdrücke der Datei id ab dem
+ * Index first auf ihren aktuellen Wert setzt.
+ */
+void archiveinfo_journal_hashes (struct ArchiveInfo* archive_info, struct Buffer* journal, uint64_t id, uint64_t first, uint64_t count) {
+  struct FileInfo* file_info = archiveinfo_file(archive_info, id);
+  struct Buffer* record = buffer_create();
+  uint8_t type = JOURNAL_HASHES;
+
+  buffer_append(record, &type, sizeof(uint8_t));
+  buffer_append(record, &id, sizeof(uint64_t));
+  buffer_append(record, &first, sizeof(uint64_t));
+  buffer_append(record, &count, sizeof(uint64_t));
+  buffer_append(record, file_info->hashes + first, count * sizeof(uint64_t));
+
+  journal_append_record(journal, record);
+  buffer_free(record);
+}
+
+/**
+ * Wendet einen einzelnen Journaleintrag an. Gibt false zurück, wenn er nicht
+ * zum aktuellen Zustand passt.
+ *
+ * @private
+ */
+bool archiveinfo_apply_journal_record (struct ArchiveInfo* archive_info, const char* data, uint64_t length) {
+  uint64_t position = 0;
+  uint8_t type;
+  uint64_t id;
+
+  if (!buffer_take(data, length, &position, &type, sizeof(uint8_t)) || !buffer_take(data, length, &position, &id, sizeof(uint64_t))) {
+    return false;
+  }
+
+  bool exists = archiveinfo_file(archive_info, id) != NULL;
+
+  if (type == JOURNAL_ADD) {
+    uint64_t size, name_length, num_extents, stored_size;
+
+    if (exists || !buffer_take(data, length, &position, &size, sizeof(uint64_t)) || !buffer_take(data, length, &position, &name_length, sizeof(uint64_t)) || name_length > length - position) {
+      return false;
+    }
+
+    char* name = malloc(name_length + 1);
+    buffer_take(data, length, &position, name, name_length);
+    name[name_length] = 0;
+
+    /* Hinter den Extents steht noch die gespeicherte Größe */
+    bool valid = buffer_take(data, length, &position, &num_extents, sizeof(uint64_t)) && length - position >= sizeof(uint64_t)
+      && num_extents <= (length - position - sizeof(uint64_t)) / sizeof(struct Extent) && !archiveinfo_has_file(archive_info, name);
+
+    if (valid) {
+      struct Extent* extents = malloc(num_extents * sizeof(struct Extent));
+      buffer_take(data, length, &position, extents, num_extents * sizeof(struct Extent));
+      buffer_take(data, length, &position, &stored_size, sizeof(uint64_t));
+
+      archiveinfo_insert_file(archive_info, id, name, size, extents, num_extents);
+      archive_info->file_infos[id]->stored_size = stored_size;
+
+      uint64_t i;
+      for (i = 0; i < num_extents && archive_info->dedup; i++) {
+        uint64_t block, hash;
+        for (block = extents[i].start; block < extents[i].start + extents[i].length && buffer_take(data, length, &position, &hash, sizeof(uint64_t)); block++) {
+          if (hash != 0 && archive_info->block_hashes[block] == 0) {
+            archiveinfo_remember_block(archive_info, block, hash);
+          }
+        }
+      }
+
+      /* Nur, wenn die Datei Fingerabdrücke hat */
+      struct FileInfo* file_info = archive_info->file_infos[id];
+      uint64_t num_hashes = archiveinfo_num_hashes(archive_info, size);
+
+      if (num_hashes > 0 && num_hashes <= (length - position) / sizeof(uint64_t)) {
+        file_info->hashes = malloc(num_hashes * sizeof(uint64_t));
+        buffer_take(data, length, &position, file_info->hashes, num_hashes * sizeof(uint64_t));
+      }
+
+      free(extents);
+    }
+
+    free(name);
+
+    return valid;
+  } else if (type == JOURNAL_DELETE && exists) {
+    archiveinfo_delete_id(archive_info, id);
+
+    return true;
+  } else if (type == JOURNAL_EXTENTS && exists) {
+    uint64_t num_extents, size = 0, stored_size = 0;
+
+    /* Hinter den Extents stehen noch Größe und gespeicherte Größe */
+    if (!buffer_take(data, length, &position, &num_extents, sizeof(uint64_t)) || length - position < 2 * sizeof(uint64_t) || num_extents > (length - position - 2 * sizeof(uint64_t)) / sizeof(struct Extent)) {
+      return false;
+    }
+
+    struct Extent* extents = malloc(num_extents * sizeof(struct Extent));
+    buffer_take(data, length, &position, extents, num_extents * sizeof(struct Extent));
+    buffer_take(data, length, &position, &size, sizeof(uint64_t));
+    buffer_take(data, length, &position, &stored_size, sizeof(uint64_t));
+
+    archiveinfo_set_extents(archive_info, id, extents, num_extents);
+
+    struct FileInfo* file_info = archive_info->file_infos[id];
+    uint64_t old_size = file_info->size;
+
+    file_info->size = size;
+    file_info->stored_size = stored_size;
+    archiveinfo_resize_hashes(archive_info, file_info, old_size);
+
+    uint64_t i;
+    for (i = 0; i < num_extents && archive_info->dedup; i++) {
+      uint64_t block, hash;
+      for (block = extents[i].start; block < extents[i].start + extents[i].length && buffer_take(data, length, &position, &hash, sizeof(uint64_t)); block++) {
+        if (hash != 0 && archive_info->block_hashes[block] == 0) {
+          archiveinfo_remember_block(archive_info, block, hash);
+        }
+      }
+    }
+
+    free(extents);
+
+    return true;
+  } else if (type == JOURNAL_HASHES && exists) {
+    uint64_t first, count;
+
+    if (!buffer_take(data, length, &position, &first, sizeof(uint64_t)) || !buffer_take(data, length, &position, &count, sizeof(uint64_t)) || count > (length - position) / sizeof(uint64_t)) {
+      return false;
+    }
+
+    uint64_t* hashes = malloc((count == 0 ? 1 : count) * sizeof(uint64_t));
+    buffer_take(data, length, &position, hashes, count * sizeof(uint64_t));
+    archiveinfo_set_hashes(archive_info, archive_info->file_infos[id], hashes, first, count);
+    free(hashes);
+
+    return true;
+  } else {
+    return false;
+  }
+}
+
+/**
+ * Spielt die Einträge eines Journals ohne Kopf ab. Gibt die Anzahl der Bytes
+ * zurück, die zu vollständigen und gültigen Einträgen gehören.
+ */
+uint64_t archiveinfo_replay_journal (struct ArchiveInfo* archive_info, const char* data, uint64_t length) {
+  uint64_t position = 0;
+
+  while (true) {
+    uint64_t start = position;
+    uint32_t record_length, checksum;
+
+    if (!buffer_take(data, length, &position, &record_length, sizeof(uint32_t)) || !buffer_take(data, length, &position, &checksum, sizeof(uint32_t))) {
+      return start;
+    } else if (record_length > length - position || journal_checksum(data + position, record_length) != checksum) {
+      return start;
+    } else if (!archiveinfo_apply_journal_record(archive_info, data + position, record_length)) {
+      return start;
+    }
+
+    position += record_length;
+  }
+}
+
+/**
+ * Plant das Defragmentieren: Die Dateien kommen nach ihrer ID sortiert und
+ * jeweils am Stück an den Anfang des Archivs. Gibt für jeden Block zurück,
+ * welcher Block dorthin verschoben werden muss, oder -1, wenn sich dort nichts
+ * ändert. In used steht danach die Anzahl der belegten Blöcke. Das Array muss
+ * vom Aufrufer freigegeben werden.
+ *
+ * Bei Deduplizierung bekommt ein Block, auf den mehrere Dateien verweisen,
+ * nur bei seinem ersten Vorkommen ein Ziel.
+ */
+int64_t* archiveinfo_defrag_sources (struct ArchiveInfo* archive_info, uint64_t* used) {
+  int64_t* sources = malloc(archive_info->blockcount * sizeof(int64_t));
+  bool* planned = archive_info->dedup ? calloc(archive_info->blockcount, sizeof(bool)) : NULL;
+  memset(sources, -1, archive_info->blockcount * sizeof(int64_t));
+
+  uint64_t position = 0;
+  uint64_t i;
+  for (i = 0; i < archive_info->num_ids; i++) {
+    struct FileInfo* file_info = archiveinfo_file(archive_info, i);
+
+    if (file_info != NULL) {
+      uint64_t j;
+      for (j = 0; j < file_info->num_extents; j++) {
+        uint64_t k;
+        for (k = 0; k < file_info->extents[j].length; k++) {
+          uint64_t block = file_info->extents[j].start + k;
+
+          if (planned != NULL && planned[block]) {
+            continue;
+          } else if (planned != NULL) {
+            planned[block] = true;
+          }
+
+          if (block != position) {
+            sources[position] = block;
+          }
+
+          position++;
+        }
+      }
+    }
+  }
+
+  *used = position;
+  free(planned);
+
+  return sources;
+}
+
+/**
+ * Berechnet, wie viele Bytes das frühere Defragmentieren bewegt hätte. Es hat
+ * die Blöcke jeder Datei in der Reihenfolge ihrer Position einzeln nach links
+ * getauscht. Ein Block wurde dabei mit jedem noch nicht einsortierten Block
+ * oder freien Block links von ihm getauscht, was ein Fenwick-Baum über die
+ * ursprünglichen Positionen zählt. Jeder Tausch schreibt zwei Blöcke. Blöcke,
+ * auf die mehrere Dateien verweisen, zählen nur beim ersten Mal.
+ */
+uint64_t archiveinfo_swap_defrag_bytes (struct ArchiveInfo* archive_info) {
+  uint64_t n = archive_info->blockcount;
+  uint64_t* tree = calloc(n + 1, sizeof(uint64_t));
+  bool* counted = archive_info->dedup ? calloc(n, sizeof(bool)) : NULL;
+  uint64_t swaps = 0;
+
+  uint64_t i;
+  for (i = 1; i <= n; i++) {
+    tree[i]++;
+
+    if (i + (i & -i) <= n) {
+      tree[i + (i & -i)] += tree[i];
+    }
+  }
+
+  for (i = 0; i < archive_info->num_ids; i++) {
+    struct FileInfo* file_info = archiveinfo_file(archive_info, i);
+
+    if (file_info == NULL || file_info->num_extents == 0) {
+      continue;
+    }
+
+    struct Extent* extents = malloc(file_info->num_extents * sizeof(struct Extent));
+    memcpy(extents, file_info->extents, file_info->num_extents * sizeof(struct Extent));
+    qsort(extents, file_info->num_extents, sizeof(struct Extent), extent_compare);
+
+    uint64_t j;
+    for (j = 0; j < file_info->num_extents; j++) {
+      uint64_t k;
+      for (k = 0; k < extents[j].length; k++) {
+        uint64_t block = extents[j].start + k;
+        uint64_t position;
+
+        if (counted != NULL && counted[block]) {
+          continue;
+        } else if (counted != NULL) {
+          counted[block] = true;
+        }
+
+        for (position = block; position > 0; position -= position & -position) {
+          swaps += tree[position];
+        }
+
+        for (position = block + 1; position <= n; position += position & -position) {
+          tree[position]--;
+        }
+      }
+    }
+
+    free(extents);
+  }
+
+  free(tree);
+  free(counted);
+
+  return 2 * swaps * archive_info->blocksize;
+}
+
+/**
+ * Gibt die Anzahl belegter Blöcke zurück.
+ *
+ * @private
+ */
+uint64_t archiveinfo_count_allocated_blocks (struct ArchiveInfo* archive_info) {
+  return archive_info->blockcount - archiveinfo_num_free_blocks(archive_info);
+}
+
+/**
+ * Gibt die verbrauchten Bytes zurück.
+ *
+ * Dabei werden Bytes allerdings blockweise addiert.
+ */
+uint64_t archiveinfo_used_bytes (struct ArchiveInfo* archive_info) {
+  return archiveinfo_count_allocated_blocks(archive_info) * archive_info->blocksize;
+}
+
+/**
+ * Zählt die Größen aller Dateien in *logical und ihre gespeicherten Größen in
+ * *stored zusammen, ohne die Dateien dafür aus der gemappten Strukturdatei
+ * auszulesen.
+ */
+void archiveinfo_sum_sizes (struct ArchiveInfo* archive_info, uint64_t* logical, uint64_t* stored) {
+  *logical = 0;
+  *stored = 0;
+
+  uint64_t i;
+  for (i = 0; i < archive_info->num_ids; i++) {
+    struct FileInfo* file_info = archive_info->file_infos[i];
+    struct StructureFile* entry = file_info == NULL ? archiveinfo_image_file(archive_info, i) : NULL;
+
+    if (file_info != NULL) {
+      *logical += file_info->size;
+      *stored += file_info->stored_size;
+    } else if (entry != NULL) {
+      *logical += entry->size;
+      *stored += archive_info->image_stored_sizes == NULL ? entry->size : archive_info->image_stored_sizes[i];
+    }
+  }
+}
+
+/**
+ * Gibt die Bytes in freien Blöcken zurück.
+ */
+uint64_t archiveinfo_free_bytes (struct ArchiveInfo* archive_info) {
+  return (archive_info->blockcount * archive_info->blocksize) - archiveinfo_used_bytes(archive_info);
+}
+
+void archiveinfo_free (struct ArchiveInfo* archive_info) {
+  uint64_t i;
+  for (i = 0; i < archive_info->num_ids; i++) {
+    if (archive_info->file_infos[i] != NULL) {
+      fileinfo_free(archive_info->file_infos[i]);
+    }
+  }
+
+  free(archive_info->file_infos);
+  free(archive_info->reservations);
+
+  if (archive_info->free_space != NULL) {
+    freespace_free(archive_info->free_space);
+  }
+
+  if (archive_info->name_index != NULL) {
+    nameindex_free(archive_info->name_index);
+  }
+
+  if (archive_info->block_index != NULL) {
+    blockindex_free(archive_info->block_index);
+  }
+
+  if (!archive_info->blocks_mapped) {
+    free(archive_info->refcounts);
+    free(archive_info->block_hashes);
+  }
+
+  if (archive_info->image != NULL) {
+    munmap(archive_info->image, archive_info->image_size);
+  }
+
+  free(archive_info); 
+}
+
+#define ARCHIVE_ALREADY_EXISTS 1
 #define ARCHIVE_NOT_WRITEABLE 2
 #define ARCHIVE_NOT_READABLE 3
 #define ARCHIVE_FILE_ALREADY_EXISTS 4
@@ -415,630 +3733,6183 @@ void archiveinfo_free (struct ArchiveInfo* archive_info) {
 #define ARCHIVE_FILE_NOT_FOUND 6
 #define FILE_NOT_READABLE 7
 #define FILE_NOT_WRITEABLE 8
+#define ARCHIVE_TOO_SMALL 9
+
+/**
+ * Ein High-Level-Interface um mit einem Archiv zu interagieren.
+ */
+struct Archive {
+  char* structure_file;
+  char* store_file;
+  char* journal_file;
+  struct ArchiveInfo* archive_info;
+
+  /**
+   * Größe der Strukturdatei beim letzten vollständigen Schreiben
+   */
+  uint64_t structure_size;
+
+  /**
+   * Größe des Journals in Bytes. 0 heißt, dass das Journal vor dem nächsten
+   * Eintrag neu angelegt werden muss.
+   */
+  uint64_t journal_size;
+
+  /**
+   * Solange das nicht NULL ist, werden Journaleinträge hier gesammelt und erst
+   * von archive_flush_journal geschrieben.
+   */
+  struct Buffer* deferred_journal;
+
+  /**
+   * Offener Store oder -1. Gelesen und geschrieben wird mit pread und
+   * pwrite, sodass mehrere Threads ihn gleichzeitig benutzen können.
+   */
+  int store_fd;
+
+  /**
+   * Ob neue Blöcke im Store gleich auf der Platte reserviert werden. Sonst
+   * entsteht nur ein Loch in der Datei, das erst beim Schreiben belegt wird.
+   */
+  bool preallocate;
+
+  /**
+   * Wie viele Bytes beim Lesen von Dateien höchstens auf einmal gelesen und
+   * geschrieben werden
+   */
+  uint64_t io_size;
+
+  /**
+   * Ob Daten zwischen Store und anderen Dateien, wenn möglich, direkt im
+   * Kernel kopiert werden. Mit der Umgebungsvariable VFS_ZERO_COPY=0 ist das
+   * anfangs ausgeschaltet.
+   */
+  bool zero_copy;
+
+  /**
+   * Wie viele Aufträge über io_uring gleichzeitig beim Store liegen dürfen. 0
+   * heißt, dass blockierend gelesen und geschrieben wird. Kommt aus der
+   * Umgebungsvariable VFS_URING_DEPTH.
+   */
+  unsigned uring_depth;
+
+  /**
+   * io_uring für den Store oder NULL, wenn es keinen gibt. Darf nur von einem
+   * Thread gleichzeitig benutzt werden.
+   */
+  struct Uring* uring;
+
+  /**
+   * Mit wie vielen Threads die Stücke einer Datei in komprimierten Archiven
+   * gleichzeitig komprimiert werden
+   */
+  int compress_threads;
+
+  /**
+   * Ob frei gewordene Blöcke als Loch aus dem Store gestanzt werden, damit
+   * das Dateisystem ihren Platz zurückbekommt
+   */
+  bool punch_holes;
+
+  /**
+   * Frei gewordene Extents, die noch gestanzt werden müssen, sobald ihre
+   * Freigabe gespeichert ist
+   */
+  struct Buffer* freed_extents;
+};
+
+/**
+ * Standardwert für io_size
+ */
+#define ARCHIVE_IO_SIZE (1024 * 1024)
+
+/**
+ * Ab dieser durchschnittlichen Länge der Extents einer Datei in Bytes lohnt
+ * es sich, sie im Kernel zu kopieren
+ */
+#define ARCHIVE_ZERO_COPY_EXTENT (64 * 1024)
+
+/**
+ * Unterhalb dieser Größe wird das Journal nie in die Struktur übernommen
+ */
+#define JOURNAL_CHECKPOINT_SIZE 65536
+
+/**
+ * Erstellt ein leeres Archiv, das dann mit einer der Initializer-Methoden
+ * geladen werden muss.
+ */
+struct Archive* archive_create () {
+  struct Archive* archive = malloc(sizeof(struct Archive));
+  archive->structure_file = NULL;
+  archive->store_file = NULL;
+  archive->journal_file = NULL;
+  archive->archive_info = archiveinfo_create();
+  archive->structure_size = 0;
+  archive->journal_size = 0;
+  archive->deferred_journal = NULL;
+  archive->store_fd = -1;
+  archive->preallocate = false;
+  archive->io_size = ARCHIVE_IO_SIZE;
+  archive->zero_copy = getenv("VFS_ZERO_COPY") == NULL || strcmp(getenv("VFS_ZERO_COPY"), "0") != 0;
+  archive->uring_depth = getenv("VFS_URING_DEPTH") == NULL ? 0 : strtoul(getenv("VFS_URING_DEPTH"), NULL, 10);
+  archive->uring = NULL;
+  archive->compress_threads = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+  archive->punch_holes = false;
+  archive->freed_extents = buffer_create();
+
+  const char* allocation = getenv("VFS_ALLOCATION");
+
+  if (allocation != NULL && strcmp(allocation, "first") == 0) {
+    archive->archive_info->allocation = ALLOCATION_FIRST_FIT;
+  } else if (allocation != NULL && strcmp(allocation, "next") == 0) {
+    archive->archive_info->allocation = ALLOCATION_NEXT_FIT;
+  }
+
+  return archive;
+}
+
+int archive_write_archive_info (struct Archive*);
+int archive_load_journal (struct Archive*);
+int archive_append_journal (struct Archive*, struct Buffer*);
+int archive_journal_add (struct Archive*, uint64_t);
+int archive_journal_delete (struct Archive*, uint64_t);
+int archive_journal_extents (struct Archive*, uint64_t);
+int archive_journal_hashes (struct Archive*, uint64_t, uint64_t, uint64_t);
+int archive_forget_hashes (struct Archive*, uint64_t, uint64_t, uint64_t);
+int archive_initialize_store(struct Archive*);
+int archive_resize_store(struct Archive*, uint64_t, uint64_t);
+void archive_sync_directory(const char*);
+void archive_initialize_paths(struct Archive* archive, const char* archive_path);
+
+/**
+ * Initialisiert ein leeres Archiv.
+ */
+int archive_initialize_empty (struct Archive* archive, const char* archive_path, uint64_t blocksize, uint64_t blockcount) {
+  archive_initialize_paths(archive, archive_path);
+
+  archiveinfo_initialize_empty(archive->archive_info, blocksize, blockcount);
+
+  int status = 0;
+
+  if (file_exists(archive->store_file) || file_exists(archive->structure_file)) {
+    status = ARCHIVE_ALREADY_EXISTS;
+  }
+
+  status == 0 && (status = archive_write_archive_info(archive));
+  status == 0 && (status = archive_initialize_store(archive));
+
+  if (status == 0) {
+    archive_sync_directory(archive->store_file);
+  }
+
+  return status;
+}
+
+/**
+ * Lädt ein Archiv aus den zwei Archivdateien.
+ */
+int archive_initialize_from_file (struct Archive* archive, const char* archive_path) {
+  archive_initialize_paths(archive, archive_path);
+
+  int status = 0;
+
+  FILE* file = fopen(archive->structure_file, "r");
+
+  if (file == NULL || !file_exists(archive->store_file)) {
+    status = ARCHIVE_NOT_READABLE;
+  } else {
+    if (archiveinfo_initialize_from_file(archive->archive_info, file) != 0) {
+      status = ARCHIVE_NOT_READABLE;
+    } else {
+      archive->structure_size = file_size(file);
+    }
+
+    fclose(file);
+  }
+
+  status == 0 && (status = archive_load_journal(archive));
+
+  /* Solange noch keine Operation eine ID kennt, dürfen sich die IDs ändern; das Journal kennt die neuen nicht, also schreibt die nächste Änderung alles */
+  if (status == 0 && 2 * archive->archive_info->num_files < archive->archive_info->num_ids && archiveinfo_compact_ids(archive->archive_info)) {
+    archive->journal_size = 0;
+  }
+
+  return status;
+}
+
+/**
+ * Öffnet den Store, falls das noch nicht passiert ist.
+ *
+ * @private
+ */
+int archive_open_store (struct Archive* archive) {
+  if (archive->store_fd == -1) {
+    archive->store_fd = open(archive->store_file, O_RDWR);
+  }
+
+  if (archive->store_fd == -1) {
+    archive->store_fd = open(archive->store_file, O_RDONLY);
+  }
+
+  if (archive->store_fd != -1 && archive->uring == NULL && archive->uring_depth > 0) {
+    archive->uring = uring_create(archive->uring_depth);
+
+    /* Ohne io_uring wird blockierend weitergemacht */
+    archive->uring_depth = archive->uring == NULL ? 0 : archive->uring_depth;
+  }
+
+  return archive->store_fd == -1 ? ARCHIVE_NOT_READABLE : 0;
+}
+
+/**
+ * Führt die num_requests Aufträge auf dem Store aus, über io_uring, falls es
+ * einen gibt, sonst nacheinander. Gibt bei Erfolg 0 zurück.
+ *
+ * @private
+ */
+int archive_run_requests (struct Archive* archive, struct IoRequest* requests, uint64_t num_requests) {
+  if (archive->uring != NULL) {
+    return uring_run(archive->uring, archive->store_fd, requests, num_requests);
+  }
+
+  uint64_t i;
+  for (i = 0; i < num_requests; i++) {
+    if (iorequest_run(&requests[i], archive->store_fd) != 0) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Stanzt length Blöcke ab start als Loch aus dem Store. Die Größe des Stores
+ * bleibt dabei gleich.
+ *
+ * @private
+ */
+int archive_punch (struct Archive* archive, uint64_t start, uint64_t length) {
+  uint64_t blocksize = archive->archive_info->blocksize;
+  int status = archive_open_store(archive);
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+  if (status == 0 && fallocate(archive->store_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, start * blocksize, length * blocksize) != 0) {
+    status = ARCHIVE_NOT_WRITEABLE;
+  }
+#else
+  status = ARCHIVE_NOT_WRITEABLE;
+#endif
+
+  return status;
+}
+
+/**
+ * Stanzt alle freien Blöcke zwischen start und end als Löcher aus dem Store.
+ * In bytes werden die gestanzten Bytes aufaddiert.
+ *
+ * @private
+ */
+int archive_punch_free_runs (struct Archive* archive, uint64_t start, uint64_t end, uint64_t* bytes) {
+  struct FreeSpace* free_space = archive->archive_info->free_space;
+  int status = 0;
+  uint64_t run = freespace_find(free_space, start, 1);
+
+  while (run < end && status == 0) {
+    uint64_t run_end = freespace_run_end(free_space, run);
+    run_end = run_end > end ? end : run_end;
+
+    status = archive_punch(archive, run, run_end - run);
+    *bytes += (run_end - run) * archive->archive_info->blocksize;
+
+    run = freespace_find(free_space, run_end, 1);
+  }
+
+  return status;
+}
+
+/**
+ * Merkt sich die Extents, damit sie später gestanzt werden, falls
+ * punch_holes gesetzt ist.
+ *
+ * @private
+ */
+void archive_queue_holes (struct Archive* archive, struct Extent* extents, uint64_t num_extents) {
+  if (archive->punch_holes) {
+    buffer_append(archive->freed_extents, extents, num_extents * sizeof(struct Extent));
+  }
+}
+
+/**
+ * Stanzt die gemerkten Extents als Löcher aus dem Store. Sie werden vorher
+ * sortiert und benachbarte zusammengefasst, sodass jeder Bereich nur einmal
+ * gestanzt wird. Blöcke, die inzwischen wieder belegt sind, bleiben stehen.
+ *
+ * Darf erst aufgerufen werden, wenn die Freigabe gespeichert ist. Fehler beim
+ * Stanzen werden ignoriert, der Platz bleibt dann eben belegt.
+ */
+void archive_punch_holes (struct Archive* archive) {
+  struct Extent* extents = (struct Extent*)archive->freed_extents->data;
+  uint64_t num_extents = archive->freed_extents->length / sizeof(struct Extent);
+  uint64_t bytes = 0;
+
+  if (num_extents == 0) {
+    return;
+  }
+
+  qsort(extents, num_extents, sizeof(struct Extent), extent_compare);
+
+  uint64_t start = extents[0].start;
+  uint64_t end = start + extents[0].length;
+  int status = 0;
+
+  uint64_t i;
+  for (i = 1; i <= num_extents && status == 0; i++) {
+    if (i < num_extents && extents[i].start <= end) {
+      uint64_t extent_end = extents[i].start + extents[i].length;
+      end = extent_end > end ? extent_end : end;
+    } else {
+      status = archive_punch_free_runs(archive, start, end, &bytes);
+
+      if (i < num_extents) {
+        start = extents[i].start;
+        end = start + extents[i].length;
+      }
+    }
+  }
+
+  buffer_clear(archive->freed_extents);
+}
+
+/**
+ * Stanzt alle freien Blöcke des Archivs als Löcher aus dem Store und legt die
+ * gestanzten Bytes in bytes ab.
+ */
+int archive_trim (struct Archive* archive, uint64_t* bytes) {
+  *bytes = 0;
+
+  return archive_punch_free_runs(archive, 0, archive->archive_info->blockcount, bytes);
+}
+
+/**
+ * Wie Daten im Kernel kopiert werden können
+ */
+#define ZERO_COPY_NONE 0
+#define ZERO_COPY_SENDFILE 1
+#define ZERO_COPY_RANGE 2
+
+/**
+ * Gibt zurück, ob die Datei file mit num_extents Extents zwischen Store und
+ * fd im Kernel kopiert werden soll und wie.
+ *
+ * @private
+ */
+int archive_zero_copy_mode (struct Archive* archive, int fd, uint64_t size, uint64_t num_extents) {
+  struct stat info;
+
+  if (!archive->zero_copy || fd == -1 || num_extents == 0 || size / num_extents < ARCHIVE_ZERO_COPY_EXTENT || fstat(fd, &info) != 0) {
+    return ZERO_COPY_NONE;
+  } else if (S_ISREG(info.st_mode)) {
+    return ZERO_COPY_RANGE;
+  } else {
+    return ZERO_COPY_SENDFILE;
+  }
+}
+
+/**
+ * Kopiert im Kernel length Bytes ab offset aus dem Store an die aktuelle
+ * Position von fd, mit copy_file_range oder sendfile, das bei Pipes und
+ * Sockets splice benutzt. Klappt copy_file_range nicht, wird sendfile
+ * versucht, klappt auch das nicht, wird *mode auf ZERO_COPY_NONE gesetzt.
+ *
+ * Gibt die Anzahl der kopierten Bytes zurück. Den Rest muss der Aufrufer
+ * selbst kopieren.
+ *
+ * @private
+ */
+uint64_t archive_zero_copy_out (struct Archive* archive, int* mode, int fd, off_t offset, uint64_t length) {
+  uint64_t copied = 0;
+
+#ifdef __linux__
+  while (copied < length && *mode != ZERO_COPY_NONE) {
+    ssize_t done;
+
+    if (*mode == ZERO_COPY_RANGE) {
+      done = copy_file_range(archive->store_fd, &offset, fd, NULL, length - copied, 0);
+    } else {
+      done = sendfile(fd, archive->store_fd, &offset, length - copied);
+    }
+
+    if (done > 0) {
+      copied += done;
+    } else {
+      *mode = *mode == ZERO_COPY_RANGE ? ZERO_COPY_SENDFILE : ZERO_COPY_NONE;
+    }
+  }
+#else
+  *mode = ZERO_COPY_NONE;
+#endif
+
+  return copied;
+}
+
+/**
+ * Kopiert im Kernel mit copy_file_range ab der aktuellen Position von fd
+ * höchstens bytes Bytes in die Extents. Gibt die Anzahl der kopierten Bytes
+ * zurück; bricht das Kopieren ab, muss der Aufrufer den Rest selbst kopieren.
+ *
+ * @private
+ */
+uint64_t archive_zero_copy_in (struct Archive* archive, int fd, uint64_t bytes, struct Extent* extents, uint64_t num_extents) {
+  uint64_t blocksize = archive->archive_info->blocksize;
+  uint64_t copied = 0;
+
+#ifdef __linux__
+  uint64_t i;
+  for (i = 0; i < num_extents && copied < bytes; i++) {
+    off_t offset = extents[i].start * blocksize;
+    uint64_t length = extents[i].length * blocksize;
+    length = length > bytes - copied ? bytes - copied : length;
+
+    while (length > 0) {
+      ssize_t done = copy_file_range(fd, NULL, archive->store_fd, &offset, length, 0);
+
+      if (done <= 0) {
+        return copied;
+      }
+
+      copied += done;
+      length -= done;
+    }
+  }
+#endif
+
+  return copied;
+}
+
+/**
+ * Gibt zurück, wie viele Bytes auf einmal gelesen oder geschrieben werden:
+ * io_size auf ganze Blöcke abgerundet, aber mindestens ein Block.
+ *
+ * @private
+ */
+uint64_t archive_io_size (struct Archive* archive) {
+  uint64_t blocksize = archive->archive_info->blocksize;
+  uint64_t io_size = archive->io_size - archive->io_size % blocksize;
+
+  return io_size < blocksize ? blocksize : io_size;
+}
+
+/**
+ * Anzahl der Puffer, die beim Hinzufügen gleichzeitig unterwegs sind
+ */
+#define ADD_PIPELINE_DEPTH 4
+
+/**
+ * Hinzufügen einer Datei als Pipeline: Der aufrufende Thread liest die Quelle
+ * reihum in die Puffer, ein zweiter Thread schreibt gefüllte Puffer in den
+ * Store. So überlappen Lesen und Schreiben.
+ */
+struct AddPipeline {
+  struct Archive* archive;
+
+  /**
+   * Ziel der Daten und wie weit das aktuelle Extent schon geschrieben ist
+   */
+  struct Extent* extents;
+  uint64_t extent;
+  uint64_t extent_offset;
+
+  char* buffers[ADD_PIPELINE_DEPTH];
+  uint64_t lengths[ADD_PIPELINE_DEPTH];
+  uint64_t buffer_size;
+
+  /**
+   * Der älteste gefüllte Puffer und wie viele gefüllt sind
+   */
+  uint64_t first;
+  uint64_t filled;
+
+  /**
+   * Ob der Leser fertig ist
+   */
+  bool done;
+
+  int read_status;
+  int write_status;
+
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+};
+
+/**
+ * Schreibt die count gefüllten Puffer ab first in den Store. Alles, was in
+ * dasselbe Extent fällt, wird mit einem pwritev geschrieben.
+ *
+ * @private
+ */
+int add_pipeline_write (struct AddPipeline* pipeline, uint64_t first, uint64_t count) {
+  uint64_t blocksize = pipeline->archive->archive_info->blocksize;
+  uint64_t bytes = 0;
+
+  uint64_t i;
+  for (i = 0; i < count; i++) {
+    bytes += pipeline->lengths[(first + i) % ADD_PIPELINE_DEPTH];
+  }
+
+  /* Jeder Bereich außer dem ersten beginnt an einem Extent und ist mindestens einen Block lang */
+  uint64_t max_requests = bytes / blocksize + 2;
+  struct IoRequest* requests = malloc(max_requests * sizeof(struct IoRequest));
+  struct iovec* iov = malloc((max_requests + count) * sizeof(struct iovec));
+  uint64_t num_requests = 0;
+  uint64_t num_iov = 0;
+  uint64_t done = 0;
+  uint64_t buffer_offset = 0;
+
+  while (done < count) {
+    struct Extent* extent = &pipeline->extents[pipeline->extent];
+    uint64_t room = extent->length * blocksize - pipeline->extent_offset;
+    uint64_t run = 0;
+
+    requests[num_requests].write = true;
+    requests[num_requests].iov = &iov[num_iov];
+    requests[num_requests].num_iov = 0;
+    requests[num_requests].offset = extent->start * blocksize + pipeline->extent_offset;
+
+    while (done < count && run < room) {
+      uint64_t slot = (first + done) % ADD_PIPELINE_DEPTH;
+      uint64_t length = pipeline->lengths[slot] - buffer_offset;
+      length = length > room - run ? room - run : length;
+
+      iov[num_iov].iov_base = pipeline->buffers[slot] + buffer_offset;
+      iov[num_iov].iov_len = length;
+      num_iov++;
+      requests[num_requests].num_iov++;
+
+      run += length;
+      buffer_offset += length;
+
+      if (buffer_offset == pipeline->lengths[slot]) {
+        done++;
+        buffer_offset = 0;
+      }
+    }
+
+    num_requests++;
+    pipeline->extent_offset += run;
+
+    if (pipeline->extent_offset == extent->length * blocksize) {
+      pipeline->extent++;
+      pipeline->extent_offset = 0;
+    }
+  }
+
+  int status = archive_run_requests(pipeline->archive, requests, num_requests) == 0 ? 0 : ARCHIVE_NOT_WRITEABLE;
+
+  free(requests);
+  free(iov);
+
+  return status;
+}
+
+/**
+ * Schreibt gefüllte Puffer, bis der Leser fertig ist oder ein Fehler
+ * auftritt.
+ *
+ * @private
+ */
+void* add_pipeline_writer (void* argument) {
+  struct AddPipeline* pipeline = argument;
+
+  pthread_mutex_lock(&pipeline->lock);
+
+  while (pipeline->write_status == 0) {
+    while (pipeline->filled == 0 && !pipeline->done) {
+      pthread_cond_wait(&pipeline->changed, &pipeline->lock);
+    }
+
+    uint64_t first = pipeline->first;
+    uint64_t count = pipeline->filled;
+
+    if (count == 0) {
+      break;
+    }
+
+    pthread_mutex_unlock(&pipeline->lock);
+    int status = add_pipeline_write(pipeline, first, count);
+    pthread_mutex_lock(&pipeline->lock);
+
+    pipeline->first = (first + count) % ADD_PIPELINE_DEPTH;
+    pipeline->filled -= count;
+    pipeline->write_status = status;
+    pthread_cond_broadcast(&pipeline->changed);
+  }
+
+  pthread_mutex_unlock(&pipeline->lock);
+
+  return NULL;
+}
+
+/**
+ * Schreibt bytes Bytes der Datei file in die num_extents Extents, die durch
+ * extents beschrieben werden.
+ *
+ * Ist file eine normale Datei, aus der stdio noch nichts vorausgelesen hat,
+ * und sind die Extents lang genug, kopiert der Kernel die Daten direkt.
+ * Sonst wird in Stücken von io_size Bytes gelesen und geschrieben. Passt die
+ * Datei nicht in ein Stück, schreibt ein zweiter Thread die Puffer, während
+ * der nächste gelesen wird.
+ */
+int archive_write_file_to_blocks (struct Archive* archive, FILE* file, uint64_t bytes, struct Extent* extents, uint64_t num_extents) {
+  if (archive_open_store(archive) != 0) {
+    return ARCHIVE_NOT_WRITEABLE;
+  }
+
+  if (num_extents == 0) {
+    return 0;
+  }
+
+  uint64_t blocksize = archive->archive_info->blocksize;
+  uint64_t extent = 0;
+  uint64_t extent_offset = 0;
+  int fd = fileno(file);
+
+  if (archive_zero_copy_mode(archive, fd, bytes, num_extents) == ZERO_COPY_RANGE && lseek(fd, 0, SEEK_CUR) == ftello(file)) {
+    uint64_t copied = archive_zero_copy_in(archive, fd, bytes, extents, num_extents);
+
+    if (copied == bytes) {
+      return 0;
+    } else if (copied > 0 && fseeko(file, lseek(fd, 0, SEEK_CUR), SEEK_SET) != 0) {
+      return FILE_NOT_READABLE;
+    }
+
+    bytes -= copied;
+    extent_offset = copied;
+
+    while (extent_offset >= extents[extent].length * blocksize) {
+      extent_offset -= extents[extent].length * blocksize;
+      extent++;
+    }
+  }
+
+  struct AddPipeline pipeline;
+  pipeline.archive = archive;
+  pipeline.extents = extents;
+  pipeline.extent = extent;
+  pipeline.extent_offset = extent_offset;
+  pipeline.buffer_size = archive_io_size(archive);
+  pipeline.buffer_size = pipeline.buffer_size > bytes ? bytes : pipeline.buffer_size;
+  pipeline.first = 0;
+  pipeline.filled = 0;
+  pipeline.done = false;
+  pipeline.read_status = 0;
+  pipeline.write_status = 0;
+
+  bool threaded = bytes > pipeline.buffer_size;
+  pthread_t writer;
+
+  int i;
+  for (i = 0; i < ADD_PIPELINE_DEPTH; i++) {
+    pipeline.buffers[i] = i == 0 || threaded ? malloc(pipeline.buffer_size) : NULL;
+  }
+
+  pthread_mutex_init(&pipeline.lock, NULL);
+  pthread_cond_init(&pipeline.changed, NULL);
+
+  if (threaded && pthread_create(&writer, NULL, add_pipeline_writer, &pipeline) != 0) {
+    threaded = false;
+  }
+
+  while (bytes > 0) {
+    pthread_mutex_lock(&pipeline.lock);
+
+    while (pipeline.filled == ADD_PIPELINE_DEPTH && pipeline.write_status == 0) {
+      pthread_cond_wait(&pipeline.changed, &pipeline.lock);
+    }
+
+    uint64_t slot = (pipeline.first + pipeline.filled) % ADD_PIPELINE_DEPTH;
+    bool stop = pipeline.write_status != 0;
+    pthread_mutex_unlock(&pipeline.lock);
+
+    if (stop) {
+      break;
+    }
+
+    uint64_t length = bytes > pipeline.buffer_size ? pipeline.buffer_size : bytes;
+
+    if (fread(pipeline.buffers[slot], 1, length, file) != length) {
+      pipeline.read_status = FILE_NOT_READABLE;
+      break;
+    }
+
+    bytes -= length;
+
+    pthread_mutex_lock(&pipeline.lock);
+    pipeline.lengths[slot] = length;
+    pipeline.filled++;
+    pthread_cond_broadcast(&pipeline.changed);
+    pthread_mutex_unlock(&pipeline.lock);
+
+    if (!threaded) {
+      pipeline.write_status = add_pipeline_write(&pipeline, slot, 1);
+      pipeline.filled = 0;
+    }
+  }
+
+  pthread_mutex_lock(&pipeline.lock);
+  pipeline.done = true;
+  pthread_cond_broadcast(&pipeline.changed);
+  pthread_mutex_unlock(&pipeline.lock);
+
+  if (threaded) {
+    pthread_join(writer, NULL);
+  }
+
+  pthread_mutex_destroy(&pipeline.lock);
+  pthread_cond_destroy(&pipeline.changed);
+
+  for (i = 0; i < ADD_PIPELINE_DEPTH; i++) {
+    free(pipeline.buffers[i]);
+  }
+
+  return pipeline.read_status != 0 ? pipeline.read_status : pipeline.write_status;
+}
+
+/**
+ * Liest oder schreibt length Bytes ab dem Byte offset der Daten, die
+ * hintereinander in den Extents stehen, mit einem Auftrag pro Extent.
+ *
+ * @private
+ */
+int archive_stream_io (struct Archive* archive, struct Extent* extents, uint64_t num_extents, uint64_t offset, char* buffer, uint64_t length, bool write) {
+  uint64_t blocksize = archive->archive_info->blocksize;
+  struct IoRequest* requests = malloc((num_extents == 0 ? 1 : num_extents) * sizeof(struct IoRequest));
+  struct iovec* iov = malloc((num_extents == 0 ? 1 : num_extents) * sizeof(struct iovec));
+  uint64_t num_requests = 0;
+
+  uint64_t i;
+  for (i = 0; i < num_extents && length > 0; i++) {
+    uint64_t extent_bytes = extents[i].length * blocksize;
+
+    if (offset >= extent_bytes) {
+      offset -= extent_bytes;
+      continue;
+    }
+
+    uint64_t chunk_size = extent_bytes - offset < length ? extent_bytes - offset : length;
+
+    iov[num_requests].iov_base = buffer;
+    iov[num_requests].iov_len = chunk_size;
+    requests[num_requests].write = write;
+    requests[num_requests].iov = &iov[num_requests];
+    requests[num_requests].num_iov = 1;
+    requests[num_requests].offset = extents[i].start * blocksize + offset;
+    num_requests++;
+
+    buffer += chunk_size;
+    length -= chunk_size;
+    offset = 0;
+  }
+
+  int status = length > 0 ? -1 : archive_run_requests(archive, requests, num_requests);
+
+  free(requests);
+  free(iov);
+
+  return status;
+}
+
+/**
+ * Ein Stück einer Datei, das komprimiert wird
+ */
+struct CompressJob {
+  const char* raw;
+  uint64_t raw_length;
+
+  /**
+   * Länge als uint32_t und danach die komprimierten Daten oder, wenn sie
+   * nicht kleiner geworden sind, die unveränderten
+   */
+  char* packed;
+  uint64_t packed_length;
+
+  /**
+   * Fingerabdruck von raw
+   */
+  uint64_t hash;
+};
+
+/**
+ * Die Stücke, die ein Thread komprimiert: first, first + step, ...
+ */
+struct CompressWorker {
+  struct CompressJob* jobs;
+  uint64_t num_jobs;
+  uint64_t first;
+  uint64_t step;
+};
+
+/**
+ * @private
+ */
+void* compress_worker (void* argument) {
+  struct CompressWorker* worker = argument;
+
+  uint64_t i;
+  for (i = worker->first; i < worker->num_jobs; i += worker->step) {
+    struct CompressJob* job = &worker->jobs[i];
+    uint32_t length = lz_compress(job->raw, job->raw_length, job->packed + sizeof(uint32_t), job->raw_length - 1);
+
+    if (length == 0) {
+      length = job->raw_length;
+      memcpy(job->packed + sizeof(uint32_t), job->raw, job->raw_length);
+    }
+
+    memcpy(job->packed, &length, sizeof(uint32_t));
+    job->packed_length = sizeof(uint32_t) + length;
+    job->hash = block_hash(job->raw, job->raw_length);
+  }
+
+  return NULL;
+}
+
+/**
+ * Anzahl der Stücke, die beim Komprimieren auf einmal gelesen, auf die
+ * Threads verteilt und dann zusammen geschrieben werden
+ */
+#define COMPRESSION_BATCH 32
+
+/**
+ * Komprimiert die höchstens COMPRESSION_BATCH Stücke in jobs, verteilt auf bis
+ * zu compress_threads Threads.
+ *
+ * @private
+ */
+void archive_compress_jobs (struct Archive* archive, struct CompressJob* jobs, uint64_t num_jobs) {
+  struct CompressWorker workers[COMPRESSION_BATCH];
+  pthread_t threads[COMPRESSION_BATCH];
+  uint64_t num_threads = (uint64_t)archive->compress_threads < num_jobs ? (uint64_t)archive->compress_threads : num_jobs;
+
+  if (num_jobs == 0) {
+    return;
+  }
+
+  uint64_t i;
+  for (i = 0; i < num_threads; i++) {
+    workers[i].jobs = jobs;
+    workers[i].num_jobs = num_jobs;
+    workers[i].first = i;
+    workers[i].step = num_threads;
+
+    if (i > 0 && pthread_create(&threads[i], NULL, compress_worker, &workers[i]) != 0) {
+      workers[i].step = 0;
+    }
+  }
+
+  compress_worker(&workers[0]);
+
+  for (i = 1; i < num_threads; i++) {
+    if (workers[i].step == 0) {
+      workers[i].step = num_threads;
+      compress_worker(&workers[i]);
+    } else {
+      pthread_join(threads[i], NULL);
+    }
+  }
+}
+
+/**
+ * Komprimiert bytes Bytes aus file in Stücken von COMPRESSION_CHUNK_SIZE und
+ * schreibt sie hintereinander in die Extents, beginnend bei *stored_size. Die
+ * Stücke eines Durchgangs werden mit archive_compress_jobs gleichzeitig
+ * komprimiert. *stored_size wird um die geschriebenen Bytes erhöht. Ist
+ * hashes nicht NULL, kommt dort der Fingerabdruck jedes Stücks hinein.
+ *
+ * @private
+ */
+int archive_write_compressed (struct Archive* archive, FILE* file, uint64_t bytes, struct Extent* extents, uint64_t num_extents, uint64_t* stored_size, uint64_t* hashes) {
+  struct CompressJob jobs[COMPRESSION_BATCH];
+  uint64_t slot_size = sizeof(uint32_t) + COMPRESSION_CHUNK_SIZE;
+  int status = 0;
+
+  char* raw = malloc(COMPRESSION_BATCH * COMPRESSION_CHUNK_SIZE);
+  char* packed = malloc(COMPRESSION_BATCH * slot_size);
+
+  while (bytes > 0 && status == 0) {
+    uint64_t length = bytes < COMPRESSION_BATCH * COMPRESSION_CHUNK_SIZE ? bytes : COMPRESSION_BATCH * COMPRESSION_CHUNK_SIZE;
+    uint64_t num_jobs = (length + COMPRESSION_CHUNK_SIZE - 1) / COMPRESSION_CHUNK_SIZE;
+
+    if (file_read(raw, 1, length, file) != 0) {
+      status = FILE_NOT_READABLE;
+      break;
+    }
+
+    uint64_t i;
+    for (i = 0; i < num_jobs; i++) {
+      jobs[i].raw = raw + i * COMPRESSION_CHUNK_SIZE;
+      jobs[i].raw_length = i + 1 < num_jobs ? COMPRESSION_CHUNK_SIZE : length - i * COMPRESSION_CHUNK_SIZE;
+      jobs[i].packed = packed + i * slot_size;
+    }
+
+    archive_compress_jobs(archive, jobs, num_jobs);
+
+    /* Die Stücke zusammenschieben, damit sie mit einem Auftrag pro Extent geschrieben werden */
+    uint64_t packed_length = 0;
+
+    for (i = 0; i < num_jobs; i++) {
+      memmove(packed + packed_length, jobs[i].packed, jobs[i].packed_length);
+      packed_length += jobs[i].packed_length;
+
+      if (hashes != NULL) {
+        *hashes++ = jobs[i].hash;
+      }
+    }
+
+    if (archive_stream_io(archive, extents, num_extents, *stored_size, packed, packed_length, true) != 0) {
+      status = ARCHIVE_NOT_WRITEABLE;
+    }
+
+    *stored_size += packed_length;
+    bytes -= length;
+  }
+
+  free(raw);
+  free(packed);
+
+  return status;
+}
+
+/**
+ * Schreibt bytes Bytes aus file in ein Archiv mit Deduplizierung. Für jeden
+ * Block wird sein Fingerabdruck im Index gesucht. Liegt der Inhalt schon in
+ * einem Block, was durch Vergleichen geprüft wird, verweist die Datei darauf.
+ * Sonst kommt er in den nächsten Block der num_extents reservierten Extents
+ * und wird in den Index eingetragen. Der letzte Block wird mit Nullen
+ * aufgefüllt. Reichen die reservierten Blöcke nicht, wird mit
+ * ARCHIVE_FILE_TOO_BIG abgebrochen.
+ *
+ * Die Blöcke der Datei werden der Reihe nach an mapped angehängt. Im Fehlerfall
+ * stehen dort nur die bis dahin zugeordneten.
+ *
+ * @private
+ */
+int archive_write_deduplicated (struct Archive* archive, FILE* file, uint64_t bytes, struct Extent* extents, uint64_t num_extents, struct FileInfo* mapped) {
+  struct ArchiveInfo* archive_info = archive->archive_info;
+  uint64_t blocksize = archive_info->blocksize;
+  uint64_t chunk_blocks = archive_io_size(archive) / blocksize;
+  char* buffer = malloc(chunk_blocks * blocksize);
+  char* existing = malloc(chunk_blocks * blocksize);
+  int64_t* candidates = malloc(chunk_blocks * sizeof(int64_t));
+  int64_t* targets = malloc(chunk_blocks * sizeof(int64_t));
+  struct IoRequest* requests = malloc(chunk_blocks * sizeof(struct IoRequest));
+  struct iovec* iov = malloc(chunk_blocks * sizeof(struct iovec));
+  uint64_t extent = 0;
+  uint64_t extent_offset = 0;
+  int status = 0;
+
+  while (bytes > 0 && status == 0) {
+    uint64_t length = bytes > chunk_blocks * blocksize ? chunk_blocks * blocksize : bytes;
+    uint64_t num_blocks = (length + blocksize - 1) / blocksize;
+    uint64_t chunk_extent = extent;
+    uint64_t chunk_offset = extent_offset;
+    uint64_t num_requests = 0;
+
+    if (fread(buffer, 1, length, file) != length) {
+      status = FILE_NOT_READABLE;
+      break;
+    }
+
+    memset(buffer + length, 0, num_blocks * blocksize - length);
+    bytes -= length;
+
+    /* Fingerabdrücke suchen; neue Blöcke bekommen gleich ihr Ziel, damit spätere Blöcke im selben Stück sie finden */
+    uint64_t k;
+    for (k = 0; k < num_blocks; k++) {
+      uint64_t hash = block_hash(buffer + k * blocksize, blocksize);
+      int64_t candidate = blockindex_get(archive_info->block_index, hash);
+
+      candidates[k] = candidate >= 0 && (uint64_t)candidate < archive_info->blockcount && archive_info->block_hashes[candidate] == hash ? candidate : -1;
+      targets[k] = -1;
+
+      if (candidates[k] == -1 && extent == num_extents) {
+        status = ARCHIVE_FILE_TOO_BIG;
+        break;
+      } else if (candidates[k] == -1) {
+        targets[k] = extents[extent].start + extent_offset;
+        archiveinfo_remember_block(archive_info, targets[k], hash);
+
+        if (++extent_offset == extents[extent].length) {
+          extent++;
+          extent_offset = 0;
+        }
+
+        continue;
+      }
+
+      /* Im selben Stück neu geschriebene Blöcke werden im Puffer verglichen */
+      bool in_chunk = false;
+
+      uint64_t e;
+      for (e = chunk_extent; e <= extent && e < num_extents && !in_chunk; e++) {
+        uint64_t start = extents[e].start + (e == chunk_extent ? chunk_offset : 0);
+        uint64_t end = e == extent ? extents[e].start + extent_offset : extents[e].start + extents[e].length;
+
+        in_chunk = (uint64_t)candidate >= start && (uint64_t)candidate < end;
+      }
+
+      if (in_chunk) {
+        continue;
+      }
+
+      struct IoRequest* last = num_requests > 0 ? &requests[num_requests - 1] : NULL;
+
+      if (last != NULL && (char*)last->iov->iov_base + last->iov->iov_len == existing + k * blocksize && last->offset + (off_t)last->iov->iov_len == candidate * (off_t)blocksize) {
+        last->iov->iov_len += blocksize;
+      } else {
+        iov[num_requests].iov_base = existing + k * blocksize;
+        iov[num_requests].iov_len = blocksize;
+        requests[num_requests].write = false;
+        requests[num_requests].iov = &iov[num_requests];
+        requests[num_requests].num_iov = 1;
+        requests[num_requests].offset = candidate * blocksize;
+        num_requests++;
+      }
+    }
+
+    if (status == 0 && num_requests > 0 && archive_run_requests(archive, requests, num_requests) != 0) {
+      status = ARCHIVE_NOT_READABLE;
+    }
+
+    if (status != 0) {
+      break;
+    }
+
+    /* Vergleichen und zuordnen; bei gleichem Fingerabdruck mit anderem Inhalt wird der Block doch neu geschrieben */
+    for (k = 0; k < num_blocks; k++) {
+      if (candidates[k] != -1) {
+        const char* other = existing + k * blocksize;
+
+        uint64_t j;
+        for (j = 0; j < k && other == existing + k * blocksize; j++) {
+          if (targets[j] == candidates[k]) {
+            other = buffer + j * blocksize;
+          }
+        }
+
+        if (memcmp(other, buffer + k * blocksize, blocksize) == 0) {
+          fileinfo_append_extent(mapped, candidates[k], 1);
+          continue;
+        } else if (extent == num_extents) {
+          status = ARCHIVE_FILE_TOO_BIG;
+          break;
+        }
+
+        targets[k] = extents[extent].start + extent_offset;
+
+        if (++extent_offset == extents[extent].length) {
+          extent++;
+          extent_offset = 0;
+        }
+      }
+
+      fileinfo_append_extent(mapped, targets[k], 1);
+    }
+
+    /* Neue Blöcke schreiben, benachbarte mit einem Auftrag */
+    num_requests = 0;
+
+    for (k = 0; k < num_blocks && status == 0; k++) {
+      if (targets[k] == -1) {
+        continue;
+      }
+
+      struct IoRequest* last = num_requests > 0 ? &requests[num_requests - 1] : NULL;
+
+      if (last != NULL && (char*)last->iov->iov_base + last->iov->iov_len == buffer + k * blocksize && last->offset + (off_t)last->iov->iov_len == targets[k] * (off_t)blocksize) {
+        last->iov->iov_len += blocksize;
+      } else {
+        iov[num_requests].iov_base = buffer + k * blocksize;
+        iov[num_requests].iov_len = blocksize;
+        requests[num_requests].write = true;
+        requests[num_requests].iov = &iov[num_requests];
+        requests[num_requests].num_iov = 1;
+        requests[num_requests].offset = targets[k] * blocksize;
+        num_requests++;
+      }
+    }
+
+    if (num_requests > 0 && archive_run_requests(archive, requests, num_requests) != 0) {
+      status = ARCHIVE_NOT_WRITEABLE;
+    }
+  }
+
+  free(buffer);
+  free(existing);
+  free(candidates);
+  free(targets);
+  free(requests);
+  free(iov);
+
+  return status;
+}
+
+/**
+ * Schreibt bytes Bytes aus file in die *num_extents Extents *extents, in
+ * komprimierten Archiven komprimiert. Danach steht in *stored_size, wie viele
+ * Bytes geschrieben wurden, und in *extents bleiben nur die Blöcke, die dafür
+ * gebraucht werden. Ist hashes nicht NULL, kommen dort in komprimierten
+ * Archiven die Fingerabdrücke der Stücke hinein.
+ *
+ * In Archiven mit Deduplizierung wird *extents durch die Blöcke der Datei
+ * ersetzt, die teils schon anderen Dateien gehören. Schlägt das Schreiben
+ * fehl, werden die neu eingetragenen Fingerabdrücke wieder entfernt.
+ */
+int archive_store_file (struct Archive* archive, FILE* file, uint64_t bytes, struct Extent** extents, uint64_t* num_extents, uint64_t* stored_size, uint64_t* hashes) {
+  struct ArchiveInfo* archive_info = archive->archive_info;
+
+  if (archive_info->compression == COMPRESSION_NONE && !archive_info->dedup) {
+    *stored_size = bytes;
+
+    return archive_write_file_to_blocks(archive, file, bytes, *extents, *num_extents);
+  } else if (archive_open_store(archive) != 0) {
+    return ARCHIVE_NOT_WRITEABLE;
+  }
+
+  if (archive_info->dedup) {
+    struct FileInfo* mapped = fileinfo_create();
+    int status = archive_write_deduplicated(archive, file, bytes, *extents, *num_extents, mapped);
+
+    if (status != 0) {
+      archiveinfo_forget_unused(archive_info, *extents, *num_extents);
+    }
+
+    free(*extents);
+    *extents = mapped->extents == NULL ? malloc(sizeof(struct Extent)) : mapped->extents;
+    *num_extents = mapped->num_extents;
+    *stored_size = bytes;
+
+    mapped->extents = NULL;
+    fileinfo_free(mapped);
+
+    return status;
+  }
+
+  *stored_size = 0;
+
+  int status = archive_write_compressed(archive, file, bytes, *extents, *num_extents, stored_size, hashes);
+  uint64_t num_blocks = archiveinfo_needed_blocks(archive_info, *stored_size);
+
+  uint64_t i;
+  for (i = 0; i < *num_extents && num_blocks > 0; i++) {
+    (*extents)[i].length = (*extents)[i].length < num_blocks ? (*extents)[i].length : num_blocks;
+    num_blocks -= (*extents)[i].length;
+  }
+
+  *num_extents = i;
+
+  return status;
+}
+
+/**
+ * Fügt dem Archiv size Bytes aus source unter dem Namen name hinzu. Die Datei
+ * wird erst eingetragen, wenn alle Daten geschrieben sind, sodass ein Fehler
+ * beim Lesen nichts verändert.
+ */
+int archive_add_stream (struct Archive* archive, const char* name, FILE* source, uint64_t size) {
+  int status = 0;
+  struct ArchiveInfo* archive_info = archive->archive_info;
+
+  uint64_t num_free = archiveinfo_num_free_blocks(archive_info);
+  uint64_t num_needed = archiveinfo_needed_blocks(archive_info, archiveinfo_max_stored_size(archive_info, size));
+
+  if (archiveinfo_has_file(archive_info, name)) {
+    status = ARCHIVE_FILE_ALREADY_EXISTS;
+  } else if (num_free < num_needed && !archive_info->dedup) {
+    status = ARCHIVE_FILE_TOO_BIG;
+  } else {
+    /* Bei Deduplizierung zeigt sich erst beim Schreiben, wie viele Blöcke wirklich neu sind */
+    num_needed = num_needed > num_free ? num_free : num_needed;
+
+    struct Extent* extents;
+    uint64_t num_extents = archiveinfo_get_free_extents(archive_info, num_needed, &extents);
+    uint64_t stored_size;
+    uint64_t* hashes = archiveinfo_create_hashes(archive_info, size);
+
+    status = archive_store_file(archive, source, size, &extents, &num_extents, &stored_size, hashes);
+
+    if (status == 0) {
+      uint64_t id = archiveinfo_add_file(archive_info, name, size, extents, num_extents);
+      archiveinfo_file(archive_info, id)->stored_size = stored_size;
+      archiveinfo_file(archive_info, id)->hashes = hashes;
+      hashes = NULL;
+      status = archive_journal_add(archive, id);
+    }
+
+    free(extents);
+    free(hashes);
+  }
+
+  return status;
+}
+
+/**
+ * So viele Bytes werden beim Hinzufügen aus einem Strom unbekannter Länge
+ * zuerst reserviert. Jede weitere Reservierung ist doppelt so groß, bis
+ * STREAM_MAX_RESERVATION erreicht ist.
+ */
+#define STREAM_RESERVATION (1024 * 1024)
+#define STREAM_MAX_RESERVATION (64 * 1024 * 1024)
+
+/**
+ * Reserviert weitere Blöcke, bis in reserved mindestens num_blocks stehen.
+ * Jede Reservierung schließt, wenn möglich, direkt an die letzte an und liegt
+ * sonst im längsten freien Lauf, damit die Datei dort weiter wachsen kann.
+ * *window ist die Anzahl der Blöcke, die als Nächstes reserviert werden, und
+ * verdoppelt sich dabei. Die Blöcke gelten im FreeSpace als belegt, gehören
+ * aber noch keiner Datei.
+ *
+ * Gibt ARCHIVE_FILE_TOO_BIG zurück, wenn keine freien Blöcke mehr übrig sind.
+ *
+ * @private
+ */
+int archiveinfo_reserve_stream (struct ArchiveInfo* archive_info, struct FileInfo* reserved, uint64_t num_blocks, uint64_t* window) {
+  struct FreeSpace* free_space = archive_info->free_space;
+  uint64_t max_window = STREAM_MAX_RESERVATION / archive_info->blocksize;
+  uint64_t reserved_blocks = fileinfo_num_blocks(reserved);
+
+  while (reserved_blocks < num_blocks) {
+    uint64_t wanted = num_blocks - reserved_blocks > *window ? num_blocks - reserved_blocks : *window;
+    uint64_t start = FREESPACE_NONE;
+    uint64_t length = 0;
+
+    *window = 2 * *window > max_window ? (max_window > *window ? max_window : *window) : 2 * *window;
+
+    if (reserved->num_extents > 0) {
+      struct Extent* last = &reserved->extents[reserved->num_extents - 1];
+      uint64_t end = last->start + last->length;
+
+      if (end < archive_info->blockcount && freespace_is_free(free_space, end)) {
+        start = end;
+        length = freespace_run_end(free_space, end) - end;
+      }
+    }
+
+    if (start == FREESPACE_NONE && free_space->num_free > 0) {
+      length = free_space->nodes[1].longest;
+      start = freespace_find(free_space, 0, length);
+    }
+
+    if (start == FREESPACE_NONE) {
+      return ARCHIVE_FILE_TOO_BIG;
+    }
+
+    length = length > wanted ? wanted : length;
+    freespace_allocate(free_space, start, length);
+    fileinfo_append_extent(reserved, start, length);
+    reserved_blocks += length;
+  }
+
+  return 0;
+}
+
+/**
+ * Legt in slice die count Blöcke ab dem Block skip der Extents ab.
+ *
+ * @private
+ */
+void extents_slice (struct Extent* extents, uint64_t num_extents, uint64_t skip, uint64_t count, struct FileInfo* slice) {
+  slice->num_extents = 0;
+
+  uint64_t i;
+  for (i = 0; i < num_extents && count > 0; i++) {
+    if (skip >= extents[i].length) {
+      skip -= extents[i].length;
+      continue;
+    }
+
+    uint64_t length = extents[i].length - skip < count ? extents[i].length - skip : count;
+    fileinfo_append_extent(slice, extents[i].start + skip, length);
+
+    count -= length;
+    skip = 0;
+  }
+}
+
+/**
+ * Reserviert Blöcke für eine neue Datei name mit size Bytes, damit sie mit
+ * archive_write_reserved ohne Sperre geschrieben und danach mit
+ * archive_commit_reserved eingetragen werden kann. Nur für Archive ohne
+ * Deduplizierung, dort hängen die Blöcke von den anderen Dateien ab.
+ *
+ * Gibt ARCHIVE_FILE_ALREADY_EXISTS zurück, wenn es den Namen schon gibt oder
+ * er gerade reserviert ist, und ARCHIVE_FILE_TOO_BIG, wenn nicht genug Blöcke
+ * frei sind.
+ */
+int archive_reserve_file (struct Archive* archive, const char* name, uint64_t size, struct FileInfo** reserved) {
+  struct ArchiveInfo* archive_info = archive->archive_info;
+  uint64_t num_needed = archiveinfo_needed_blocks(archive_info, archiveinfo_max_stored_size(archive_info, size));
+
+  uint64_t i;
+  for (i = 0; i < archive_info->num_reservations; i++) {
+    if (strcmp(archive_info->reservations[i]->name, name) == 0) {
+      return ARCHIVE_FILE_ALREADY_EXISTS;
+    }
+  }
+
+  if (archiveinfo_has_file(archive_info, name)) {
+    return ARCHIVE_FILE_ALREADY_EXISTS;
+  } else if (archiveinfo_num_free_blocks(archive_info) < num_needed) {
+    return ARCHIVE_FILE_TOO_BIG;
+  }
+
+  *reserved = fileinfo_create();
+  fileinfo_initialize(*reserved, name, size);
+  (*reserved)->hashes = archiveinfo_create_hashes(archive_info, size);
+  (*reserved)->num_extents = archiveinfo_get_free_extents(archive_info, num_needed, &(*reserved)->extents);
+
+  for (i = 0; i < (*reserved)->num_extents; i++) {
+    freespace_allocate(archive_info->free_space, (*reserved)->extents[i].start, (*reserved)->extents[i].length);
+  }
+
+  archive_info->reservations = realloc(archive_info->reservations, (archive_info->num_reservations + 1) * sizeof(struct FileInfo*));
+  archive_info->reservations[archive_info->num_reservations++] = *reserved;
+
+  return 0;
+}
+
+/**
+ * Schreibt die Daten einer mit archive_reserve_file reservierten Datei aus
+ * source in ihre Blöcke. Verändert die Struktur nicht und braucht deshalb
+ * keine Sperre, solange die Reservierung besteht.
+ */
+int archive_write_reserved (struct Archive* archive, struct FileInfo* reserved, FILE* source) {
+  uint64_t num_extents = reserved->num_extents;
+  struct Extent* extents = malloc((num_extents == 0 ? 1 : num_extents) * sizeof(struct Extent));
+
+  memcpy(extents, reserved->extents, num_extents * sizeof(struct Extent));
+
+  int status = archive_store_file(archive, source, reserved->size, &extents, &num_extents, &reserved->stored_size, reserved->hashes);
+  free(extents);
+
+  return status;
+}
+
+/**
+ * Hebt die Reservierung reserved auf und gibt sie frei. War status, das
+ * Ergebnis von archive_write_reserved, 0, wird die Datei vorher mit den
+ * gebrauchten Blöcken eingetragen.
+ */
+int archive_commit_reserved (struct Archive* archive, struct FileInfo* reserved, int status) {
+  struct ArchiveInfo* archive_info = archive->archive_info;
+
+  uint64_t i = 0;
+
+  while (archive_info->reservations[i] != reserved) {
+    i++;
+  }
+
+  archive_info->reservations[i] = archive_info->reservations[--archive_info->num_reservations];
+
+  for (i = 0; i < reserved->num_extents; i++) {
+    freespace_release(archive_info->free_space, reserved->extents[i].start, reserved->extents[i].length);
+  }
+
+  if (status == 0) {
+    struct FileInfo* used = fileinfo_create();
+    extents_slice(reserved->extents, reserved->num_extents, 0, archiveinfo_needed_blocks(archive_info, reserved->stored_size), used);
+
+    uint64_t id = archiveinfo_add_file(archive_info, reserved->name, reserved->size, used->extents, used->num_extents);
+    archiveinfo_file(archive_info, id)->stored_size = reserved->stored_size;
+    archiveinfo_file(archive_info, id)->hashes = reserved->hashes;
+    reserved->hashes = NULL;
+    status = archive_journal_add(archive, id);
+
+    fileinfo_free(used);
+  }
+
+  fileinfo_free(reserved);
+
+  return status;
+}
+
+/**
+ * Fügt dem Archiv alles, was bis zum Ende aus source kommt, unter dem Namen
+ * name hinzu, ohne die Länge vorher zu kennen. Gelesen wird in Stücken, für
+ * die jeweils erst dann Blöcke reserviert werden, wenn sie da sind, wie bei
+ * archiveinfo_reserve_stream beschrieben. Am Ende werden die nicht
+ * gebrauchten Blöcke wieder frei und die Datei wird eingetragen. Bricht der
+ * Strom ab oder ist das Archiv voll, wird alles wieder freigegeben und das
+ * Archiv bleibt unverändert.
+ */
+int archive_add_unsized (struct Archive* archive, const char* name, FILE* source) {
+  struct ArchiveInfo* archive_info = archive->archive_info;
+  uint64_t blocksize = archive_info->blocksize;
+
+  if (archiveinfo_has_file(archive_info, name)) {
+    return ARCHIVE_FILE_ALREADY_EXISTS;
+  } else if (archive_open_store(archive) != 0) {
+    return ARCHIVE_NOT_WRITEABLE;
+  }
+
+  /* Stücke aus ganzen Blöcken bzw. ganzen Stücken der Kompression, damit die Daten genauso liegen wie bei bekannter Länge */
+  uint64_t segment_size = COMPRESSION_BATCH * COMPRESSION_CHUNK_SIZE;
+
+  if (archive_info->compression == COMPRESSION_NONE) {
+    segment_size = segment_size < blocksize ? blocksize : segment_size - segment_size % blocksize;
+  }
+
+  char* segment = malloc(segment_size);
+  struct FileInfo* reserved = fileinfo_create();
+  struct FileInfo* mapped = fileinfo_create();
+  struct FileInfo* slice = fileinfo_create();
+  uint64_t window = STREAM_RESERVATION / blocksize;
+  uint64_t size = 0;
+  uint64_t stored_size = 0;
+  uint64_t used_blocks = 0;
+  uint64_t* hashes = NULL;
+  int status = 0;
+
+  window = window == 0 ? 1 : window;
+
+  while (status == 0) {
+    uint64_t length = fread(segment, 1, segment_size, source);
+
+    if (length < segment_size && ferror(source)) {
+      status = FILE_NOT_READABLE;
+      break;
+    } else if (length == 0) {
+      break;
+    }
+
+    size += length;
+
+    if (archive_info->dedup) {
+      uint64_t num_blocks = archiveinfo_needed_blocks(archive_info, length);
+      FILE* data = fmemopen(segment, length, "r");
+
+      status = archiveinfo_reserve_stream(archive_info, reserved, used_blocks + num_blocks, &window);
+      extents_slice(reserved->extents, reserved->num_extents, used_blocks, num_blocks, slice);
+      status == 0 && (status = archive_write_deduplicated(archive, data, length, slice->extents, slice->num_extents, mapped));
+      used_blocks += num_blocks;
+
+      fclose(data);
+    } else if (archive_info->compression != COMPRESSION_NONE) {
+      uint64_t needed = archiveinfo_needed_blocks(archive_info, stored_size + archiveinfo_max_stored_size(archive_info, length));
+      FILE* data = fmemopen(segment, length, "r");
+
+      /* Jedes Stück außer dem letzten ist ein Vielfaches von COMPRESSION_CHUNK_SIZE */
+      uint64_t first_hash = archiveinfo_num_hashes(archive_info, size - length);
+      hashes = realloc(hashes, archiveinfo_num_hashes(archive_info, size) * sizeof(uint64_t));
+
+      status = archiveinfo_reserve_stream(archive_info, reserved, needed, &window);
+      status == 0 && (status = archive_write_compressed(archive, data, length, reserved->extents, reserved->num_extents, &stored_size, hashes + first_hash));
+
+      fclose(data);
+    } else {
+      status = archiveinfo_reserve_stream(archive_info, reserved, archiveinfo_needed_blocks(archive_info, size), &window);
+
+      if (status == 0 && archive_stream_io(archive, reserved->extents, reserved->num_extents, stored_size, segment, length, true) != 0) {
+        status = ARCHIVE_NOT_WRITEABLE;
+      }
+
+      stored_size = size;
+    }
+
+    if (length < segment_size) {
+      break;
+    }
+  }
+
+  /* Die Reservierung aufheben; die Datei belegt ihre Blöcke gleich selbst */
+  uint64_t i;
+  for (i = 0; i < reserved->num_extents; i++) {
+    freespace_release(archive_info->free_space, reserved->extents[i].start, reserved->extents[i].length);
+  }
+
+  if (status != 0) {
+    archiveinfo_forget_unused(archive_info, reserved->extents, reserved->num_extents);
+  } else {
+    if (archive_info->dedup) {
+      stored_size = size;
+    } else {
+      extents_slice(reserved->extents, reserved->num_extents, 0, archiveinfo_needed_blocks(archive_info, stored_size), mapped);
+    }
+
+    uint64_t id = archiveinfo_add_file(archive_info, name, size, mapped->extents, mapped->num_extents);
+    archiveinfo_file(archive_info, id)->stored_size = stored_size;
+    archiveinfo_file(archive_info, id)->hashes = hashes;
+    hashes = NULL;
+    status = archive_journal_add(archive, id);
+  }
+
+  free(segment);
+  free(hashes);
+  fileinfo_free(reserved);
+  fileinfo_free(mapped);
+  fileinfo_free(slice);
+
+  return status;
+}
+
+/**
+ * Fügt dem Archiv die Datei unter dem gegebenen Namen hinzu. Ist path "-",
+ * wird die Standardeingabe gelesen. Lässt sich die Größe nicht bestimmen,
+ * z.B. bei einer Pipe, wird gelesen, bis nichts mehr kommt.
+ */
+int archive_add_file (struct Archive* archive, const char* name, const char* path) {
+  int status = 0;
+
+  if (archiveinfo_has_file(archive->archive_info, name)) {
+    status = ARCHIVE_FILE_ALREADY_EXISTS;
+  } else if (strcmp(path, "-") == 0) {
+    status = archive_add_unsized(archive, name, stdin);
+  } else {
+    FILE* file = fopen(path, "r");
+
+    if (file == NULL) {
+      status = FILE_NOT_READABLE;
+    } else {
+      long int size = file_size(file);
+
+      if (size == -1) {
+        status = archive_add_unsized(archive, name, file);
+      } else {
+        status = archive_add_stream(archive, name, file, size);
+      }
+
+      fclose(file);
+    }
+  }
+
+  return status;
+}
+
+/**
+ * Eine Datei, die beim Importieren hinzugefügt wird
+ */
+struct ImportFile {
+  /**
+   * Name im Archiv, der Pfad relativ zum importierten Verzeichnis
+   */
+  char* name;
+
+  char* path;
+  uint64_t size;
+  uint64_t stored_size;
+  struct Extent* extents;
+  uint64_t num_extents;
+  uint64_t* hashes;
+};
+
+/**
+ * Gemeinsamer Zustand beim Importieren
+ */
+struct Import {
+  struct Archive* archive;
+  struct ImportFile* files;
+  uint64_t num_files;
+  uint64_t capacity;
+
+  /**
+   * Index der nächsten Datei, die noch keinen Thread hat
+   */
+  uint64_t next;
+
+  /**
+   * Erster Fehler beim Kopieren und die Datei, bei der er aufgetreten ist
+   */
+  int status;
+  uint64_t failed;
+
+  pthread_mutex_t lock;
+};
+
+/**
+ * Sammelt alle normalen Dateien unter path, sortiert nach Namen, mit den
+ * Namen prefix/... in import ein. Gibt bei Erfolg 0 zurück, sonst
+ * FILE_NOT_READABLE und in *failed den Pfad, der nicht lesbar war.
+ *
+ * @private
+ */
+int import_walk (struct Import* import, const char* path, const char* prefix, char** failed) {
+  struct dirent** entries;
+  int num_entries = scandir(path, &entries, NULL, alphasort);
+  int status = 0;
+
+  if (num_entries < 0) {
+    *failed = strdup(path);
+    return FILE_NOT_READABLE;
+  }
+
+  int i;
+  for (i = 0; i < num_entries; i++) {
+    const char* entry = entries[i]->d_name;
+    struct stat info;
+
+    if (status != 0 || strcmp(entry, ".") == 0 || strcmp(entry, "..") == 0) {
+      free(entries[i]);
+      continue;
+    }
+
+    char* entry_path = malloc(strlen(path) + 1 + strlen(entry) + 1);
+    char* name = malloc(strlen(prefix) + 1 + strlen(entry) + 1);
+    sprintf(entry_path, "%s/%s", path, entry);
+    sprintf(name, *prefix == 0 ? "%s%s" : "%s/%s", prefix, entry);
+
+    if (lstat(entry_path, &info) != 0) {
+      *failed = strdup(entry_path);
+      status = FILE_NOT_READABLE;
+    } else if (S_ISDIR(info.st_mode)) {
+      status = import_walk(import, entry_path, name, failed);
+    } else if (S_ISREG(info.st_mode)) {
+      if (import->num_files == import->capacity) {
+        import->capacity *= 2;
+        import->files = realloc(import->files, import->capacity * sizeof(struct ImportFile));
+      }
+
+      struct ImportFile* file = &import->files[import->num_files++];
+      file->name = name;
+      file->path = entry_path;
+      file->size = info.st_size;
+      file->stored_size = info.st_size;
+      file->extents = NULL;
+      file->num_extents = 0;
+      file->hashes = NULL;
+
+      entry_path = NULL;
+      name = NULL;
+    }
+
+    free(entry_path);
+    free(name);
+    free(entries[i]);
+  }
+
+  free(entries);
+
+  return status;
+}
+
+/**
+ * Reserviert für jede Datei einen zusammenhängenden Bereich, möglichst direkt
+ * hinter dem der vorherigen Datei, und nur wenn es keinen mehr gibt, der groß
+ * genug ist, einzelne freie Bereiche. Danach werden die Blöcke wieder
+ * freigegeben; sie werden erst beim Eintragen der Dateien endgültig belegt.
+ *
+ * @private
+ */
+void import_allocate (struct Import* import) {
+  struct ArchiveInfo* archive_info = import->archive->archive_info;
+  struct FreeSpace* free_space = archive_info->free_space;
+  uint64_t cursor = 0;
+
+  uint64_t i;
+  for (i = 0; i < import->num_files; i++) {
+    struct ImportFile* file = &import->files[i];
+    uint64_t num_needed = archiveinfo_needed_blocks(archive_info, archiveinfo_max_stored_size(archive_info, file->size));
+
+    if (num_needed == 0) {
+      continue;
+    }
+
+    uint64_t start = freespace_find(free_space, cursor, num_needed);
+    start = start == FREESPACE_NONE ? freespace_find(free_space, 0, num_needed) : start;
+
+    if (start != FREESPACE_NONE) {
+      file->extents = malloc(sizeof(struct Extent));
+      file->extents[0].start = start;
+      file->extents[0].length = num_needed;
+      file->num_extents = 1;
+      cursor = start + num_needed;
+    } else {
+      file->num_extents = archiveinfo_get_free_extents(archive_info, num_needed, &file->extents);
+    }
+
+    uint64_t j;
+    for (j = 0; j < file->num_extents; j++) {
+      freespace_allocate(free_space, file->extents[j].start, file->extents[j].length);
+    }
+  }
+
+  for (i = 0; i < import->num_files; i++) {
+    uint64_t j;
+    for (j = 0; j < import->files[i].num_extents; j++) {
+      freespace_release(free_space, import->files[i].extents[j].start, import->files[i].extents[j].length);
+    }
+  }
+}
+
+/**
+ * Kopiert so lange die nächste Datei in ihre Blöcke, bis alle vergeben sind
+ * oder eine fehlgeschlagen ist.
+ *
+ * @private
+ */
+void* import_worker (void* argument) {
+  struct Import* import = argument;
+
+  while (true) {
+    pthread_mutex_lock(&import->lock);
+    uint64_t i = import->next;
+    import->next += i < import->num_files && import->status == 0 ? 1 : 0;
+    pthread_mutex_unlock(&import->lock);
+
+    if (i == import->num_files || import->status != 0) {
+      return NULL;
+    }
+
+    struct ImportFile* file = &import->files[i];
+    FILE* source = fopen(file->path, "r");
+    int status = 0;
+
+    if (source == NULL) {
+      status = FILE_NOT_READABLE;
+    } else {
+      file->hashes = archiveinfo_create_hashes(import->archive->archive_info, file->size);
+      status = archive_store_file(import->archive, source, file->size, &file->extents, &file->num_extents, &file->stored_size, file->hashes);
+      fclose(source);
+    }
+
+    if (status != 0) {
+      pthread_mutex_lock(&import->lock);
+
+      if (import->status == 0) {
+        import->status = status;
+        import->failed = i;
+      }
+
+      pthread_mutex_unlock(&import->lock);
+    }
+  }
+}
+
+/**
+ * Fügt alle Dateien unter directory mit ihrem Pfad relativ zu directory als
+ * Namen hinzu. Der nötige Platz wird vorher für alle Dateien zusammen
+ * geprüft und reserviert, dann kopieren num_threads Threads die Dateien und
+ * zum Schluss wird die Struktur einmal geschrieben. Schlägt etwas fehl,
+ * bleibt das Archiv unverändert.
+ *
+ * Bei einem Fehler steht in *failed der Name oder Pfad, um den es geht, der
+ * vom Aufrufer freigegeben werden muss.
+ *
+ * In Archiven mit Deduplizierung kopiert nur ein Thread, weil jeder Block im
+ * gemeinsamen Index der Fingerabdrücke nachgeschlagen wird.
+ */
+int archive_import (struct Archive* archive, const char* directory, int num_threads, char** failed) {
+  struct ArchiveInfo* archive_info = archive->archive_info;
+  struct Import import;
+  int status = 0;
+
+  if (archive_info->dedup) {
+    num_threads = 1;
+  }
+
+  import.archive = archive;
+  import.capacity = 16;
+  import.files = malloc(import.capacity * sizeof(struct ImportFile));
+  import.num_files = 0;
+  import.next = 0;
+  import.status = 0;
+  import.failed = 0;
+
+  *failed = NULL;
+  status = import_walk(&import, directory, "", failed);
+
+  uint64_t num_needed = 0;
+
+  uint64_t i;
+  for (i = 0; i < import.num_files && status == 0; i++) {
+    num_needed += archiveinfo_needed_blocks(archive_info, archiveinfo_max_stored_size(archive_info, import.files[i].size));
+
+    if (archiveinfo_has_file(archive_info, import.files[i].name)) {
+      *failed = strdup(import.files[i].name);
+      status = ARCHIVE_FILE_ALREADY_EXISTS;
+    }
+  }
+
+  if (status == 0 && num_needed > archiveinfo_num_free_blocks(archive_info)) {
+    *failed = strdup(directory);
+    status = ARCHIVE_FILE_TOO_BIG;
+  }
+
+  status == 0 && (status = archive_open_store(archive));
+
+  if (status == 0) {
+    import_allocate(&import);
+    pthread_mutex_init(&import.lock, NULL);
+
+    pthread_t* threads = malloc(num_threads * sizeof(pthread_t));
+
+    int j;
+    for (j = 1; j < num_threads; j++) {
+      pthread_create(&threads[j], NULL, import_worker, &import);
+    }
+
+    import_worker(&import);
+
+    for (j = 1; j < num_threads; j++) {
+      pthread_join(threads[j], NULL);
+    }
+
+    free(threads);
+    pthread_mutex_destroy(&import.lock);
+
+    status = import.status;
+
+    if (status != 0) {
+      *failed = strdup(status == FILE_NOT_READABLE ? import.files[import.failed].path : import.files[import.failed].name);
+    }
+
+    for (i = 0; i < import.num_files && status != 0; i++) {
+      archiveinfo_forget_unused(archive_info, import.files[i].extents, import.files[i].num_extents);
+    }
+  }
+
+  if (status == 0) {
+    for (i = 0; i < import.num_files; i++) {
+      struct ImportFile* file = &import.files[i];
+      uint64_t id = archiveinfo_add_file(archive_info, file->name, file->size, file->extents, file->num_extents);
+      archiveinfo_file(archive_info, id)->stored_size = file->stored_size;
+      archiveinfo_file(archive_info, id)->hashes = file->hashes;
+      file->hashes = NULL;
+    }
+
+    if (archive_write_archive_info(archive) != 0) {
+      /* Die Struktur auf der Platte ist unverändert, also auch im Speicher zurück */
+      for (i = import.num_files; i > 0; i--) {
+        archiveinfo_delete_file(archive_info, import.files[i - 1].name);
+      }
+
+      status = ARCHIVE_NOT_WRITEABLE;
+    }
+  }
+
+  for (i = 0; i < import.num_files; i++) {
+    free(import.files[i].name);
+    free(import.files[i].path);
+    free(import.files[i].extents);
+    free(import.files[i].hashes);
+  }
+
+  free(import.files);
+
+  return status;
+}
+
+/**
+ * Schreibt den Inhalt der Datei file_info nach output.
+ */
+/**
+ * Schreibt size Bytes aus buffer nach output. Hat output einen
+ * Dateideskriptor, wird an stdio vorbei direkt geschrieben.
+ *
+ * @private
+ */
+int archive_write_output (FILE* output, const char* buffer, uint64_t size) {
+  int fd = fileno(output);
+
+  if (fd == -1) {
+    return file_write(buffer, 1, size, output) == 0 ? 0 : FILE_NOT_WRITEABLE;
+  } else {
+    return file_write_fd(fd, buffer, size) == 0 ? 0 : FILE_NOT_WRITEABLE;
+  }
+}
+
+/**
+ * Liest die gespeicherten Daten einer Datei in komprimierten Archiven
+ * nacheinander in einen Puffer
+ */
+struct CompressedReader {
+  struct Archive* archive;
+  struct FileInfo* file_info;
+  char* window;
+  uint64_t capacity;
+
+  /**
+   * Wie viele Bytes in window stehen und wie viele davon schon verbraucht
+   * sind
+   */
+  uint64_t filled;
+  uint64_t position;
+
+  /**
+   * Wie viele gespeicherte Bytes schon gelesen wurden
+   */
+  uint64_t offset;
+};
+
+/**
+ * Sorgt dafür, dass ab position mindestens length Bytes in window stehen.
+ * Gibt false zurück, wenn die Datei so viele nicht mehr hat oder der Store
+ * nicht lesbar ist.
+ *
+ * @private
+ */
+bool compressedreader_fill (struct CompressedReader* reader, uint64_t length) {
+  if (reader->filled - reader->position >= length) {
+    return true;
+  }
+
+  memmove(reader->window, reader->window + reader->position, reader->filled - reader->position);
+  reader->filled -= reader->position;
+  reader->position = 0;
+
+  uint64_t left = reader->file_info->stored_size - reader->offset;
+  uint64_t chunk_size = reader->capacity - reader->filled < left ? reader->capacity - reader->filled : left;
+  struct FileInfo* file_info = reader->file_info;
+
+  if (reader->filled + chunk_size < length) {
+    return false;
+  } else if (archive_stream_io(reader->archive, file_info->extents, file_info->num_extents, reader->offset, reader->window + reader->filled, chunk_size, false) != 0) {
+    return false;
+  }
+
+  reader->filled += chunk_size;
+  reader->offset += chunk_size;
+
+  return true;
+}
+
+/**
+ * Überspringt das nächste Stück. Steht es nicht schon in window, wird nur
+ * seine Länge aus dem Store gelesen, nicht die Daten.
+ *
+ * @private
+ */
+bool compressedreader_skip (struct CompressedReader* reader) {
+  struct FileInfo* file_info = reader->file_info;
+  uint64_t buffered = reader->filled - reader->position;
+  uint32_t length;
+
+  if (buffered >= sizeof(uint32_t)) {
+    memcpy(&length, reader->window + reader->position, sizeof(uint32_t));
+  } else {
+    reader->offset -= buffered;
+    reader->filled = 0;
+    reader->position = 0;
+    buffered = 0;
+
+    if (reader->offset + sizeof(uint32_t) > file_info->stored_size) {
+      return false;
+    } else if (archive_stream_io(reader->archive, file_info->extents, file_info->num_extents, reader->offset, (char*)&length, sizeof(uint32_t), false) != 0) {
+      return false;
+    }
+  }
+
+  uint64_t skipped = sizeof(uint32_t) + length;
+
+  if (buffered >= skipped) {
+    reader->position += skipped;
+  } else {
+    reader->offset += skipped - buffered;
+    reader->filled = 0;
+    reader->position = 0;
+  }
+
+  return reader->offset <= file_info->stored_size;
+}
+
+/**
+ * Entpackt das nächste Stück, das raw_length Bytes lang ist, nach buffer.
+ * Gibt false zurück, wenn es nicht gelesen oder entpackt werden kann.
+ *
+ * @private
+ */
+bool compressedreader_next (struct CompressedReader* reader, char* buffer, uint64_t raw_length) {
+  uint32_t length;
+
+  if (!compressedreader_fill(reader, sizeof(uint32_t))) {
+    return false;
+  }
+
+  memcpy(&length, reader->window + reader->position, sizeof(uint32_t));
+  reader->position += sizeof(uint32_t);
+
+  if (length > raw_length || !compressedreader_fill(reader, length)) {
+    return false;
+  } else if (length == raw_length) {
+    memcpy(buffer, reader->window + reader->position, length);
+  } else if (!lz_decompress(reader->window + reader->position, length, buffer, raw_length)) {
+    return false;
+  }
+
+  reader->position += length;
+
+  return true;
+}
+
+/**
+ * Kopiert das nächste Stück, das raw_length Bytes lang ist, so wie es
+ * gespeichert ist, mit seiner Länge davor nach slot und gibt in *length
+ * zurück, wie viele Bytes das sind. Gibt false zurück, wenn es nicht gelesen
+ * werden kann.
+ *
+ * @private
+ */
+bool compressedreader_copy (struct CompressedReader* reader, char* slot, uint64_t raw_length, uint64_t* length) {
+  uint32_t packed_length;
+
+  if (!compressedreader_fill(reader, sizeof(uint32_t))) {
+    return false;
+  }
+
+  memcpy(&packed_length, reader->window + reader->position, sizeof(uint32_t));
+
+  if (packed_length > raw_length || !compressedreader_fill(reader, sizeof(uint32_t) + packed_length)) {
+    return false;
+  }
+
+  *length = sizeof(uint32_t) + packed_length;
+  memcpy(slot, reader->window + reader->position, *length);
+  reader->position += *length;
+
+  return true;
+}
+
+/**
+ * Schreibt length Bytes ab dem Byte offset einer Datei aus einem komprimierten
+ * Archiv nach output. Die Stücke vor offset werden übersprungen, ohne sie zu
+ * lesen oder zu entpacken. Die gespeicherten Daten werden in Stücken von
+ * io_size Bytes gelesen, die entpackten Daten in Stücken von io_size Bytes
+ * geschrieben.
+ *
+ * @private
+ */
+int archive_read_compressed (struct Archive* archive, struct FileInfo* file_info, uint64_t offset, uint64_t length, FILE* output) {
+  struct CompressedReader reader;
+  uint64_t io_size = archive_io_size(archive);
+  uint64_t output_size = io_size < COMPRESSION_CHUNK_SIZE ? COMPRESSION_CHUNK_SIZE : io_size;
+  uint64_t bytes_left = length;
+  uint64_t filled = 0;
+  int status = 0;
+
+  /* Byte der Datei, bei dem das nächste Stück beginnt */
+  uint64_t position = 0;
+
+  reader.archive = archive;
+  reader.file_info = file_info;
+  reader.capacity = io_size + sizeof(uint32_t) + COMPRESSION_CHUNK_SIZE;
+  reader.window = malloc(reader.capacity);
+  reader.filled = 0;
+  reader.position = 0;
+  reader.offset = 0;
+
+  char* buffer = malloc(output_size);
+
+  while (bytes_left > 0 && status == 0 && position + COMPRESSION_CHUNK_SIZE <= offset) {
+    if (!compressedreader_skip(&reader)) {
+      status = ARCHIVE_NOT_READABLE;
+    }
+
+    position += COMPRESSION_CHUNK_SIZE;
+  }
+
+  while (bytes_left > 0 && status == 0) {
+    uint64_t raw_length = file_info->size - position < COMPRESSION_CHUNK_SIZE ? file_info->size - position : COMPRESSION_CHUNK_SIZE;
+
+    if (output_size - filled < raw_length) {
+      status = archive_write_output(output, buffer, filled);
+      filled = 0;
+    }
+
+    if (status != 0) {
+      break;
+    } else if (!compressedreader_next(&reader, buffer + filled, raw_length)) {
+      status = ARCHIVE_NOT_READABLE;
+    }
+
+    /* Nur der Teil des Stücks, der im Bereich liegt */
+    uint64_t skip = offset > position ? offset - position : 0;
+    uint64_t used = raw_length - skip < bytes_left ? raw_length - skip : bytes_left;
+
+    if (skip > 0) {
+      memmove(buffer + filled, buffer + filled + skip, used);
+    }
+
+    position += raw_length;
+    filled += used;
+    bytes_left -= used;
+  }
+
+  if (status == 0 && filled > 0) {
+    status = archive_write_output(output, buffer, filled);
+  }
+
+  free(reader.window);
+  free(buffer);
+
+  return status;
+}
+
+/**
+ * Begrenzt den Bereich ab dem Byte *offset mit *length Bytes auf die Datei.
+ * Beginnt er hinter ihrem Ende, ist er danach leer.
+ *
+ * @private
+ */
+void fileinfo_clamp_range (struct FileInfo* file_info, uint64_t* offset, uint64_t* length) {
+  *offset = *offset > file_info->size ? file_info->size : *offset;
+  *length = *length > file_info->size - *offset ? file_info->size - *offset : *length;
+}
+
+/**
+ * Schreibt range_length Bytes ab dem Byte range_offset der Datei nach output.
+ * Reicht der Bereich über das Ende der Datei hinaus, wird nur bis dorthin
+ * geschrieben. Das Extent mit range_offset wird über die Längen der Extents
+ * davor gefunden, gelesen werden nur die Blöcke, die im Bereich liegen.
+ *
+ * Bei Dateien mit langen Extents kopiert der Kernel die Daten direkt nach
+ * output, solange das klappt. Sonst werden benachbarte Blöcke mit einem
+ * Auftrag pro Extent gelesen, aber höchstens io_size Bytes auf einmal. Der
+ * Puffer wird über Extentgrenzen hinweg gefüllt und erst voll geschrieben,
+ * sodass auch output in Stücken von io_size Bytes beschrieben wird. Mit
+ * io_uring liegen die Aufträge für einen Puffer gleichzeitig beim Gerät. Für
+ * lange Extents bekommt der Kernel den Hinweis, dass sie der Reihe nach
+ * gelesen werden.
+ */
+int archive_read_range (struct Archive* archive, struct FileInfo* file_info, uint64_t range_offset, uint64_t range_length, FILE* output) {
+  int status = 0;
+  uint64_t blocksize = archive->archive_info->blocksize;
+
+  if (archive_open_store(archive) != 0) {
+    return ARCHIVE_NOT_READABLE;
+  }
+
+  fileinfo_clamp_range(file_info, &range_offset, &range_length);
+
+  if (fflush(output) != 0) {
+    return FILE_NOT_WRITEABLE;
+  } else if (archive->archive_info->compression != COMPRESSION_NONE) {
+    return archive_read_compressed(archive, file_info, range_offset, range_length, output);
+  }
+
+  uint64_t io_size = archive_io_size(archive);
+  char* buffer = malloc(io_size < range_length ? io_size : range_length + 1);
+  uint64_t filled = 0;
+  uint64_t bytes_left = range_length;
+  uint64_t skip = range_offset;
+
+  /* Ein Auftrag pro Extent, das in den Puffer fällt */
+  uint64_t max_requests = io_size / blocksize + 1;
+  struct IoRequest* requests = malloc(max_requests * sizeof(struct IoRequest));
+  struct iovec* iov = malloc(max_requests * sizeof(struct iovec));
+  uint64_t num_requests = 0;
+
+  int fd = fileno(output);
+  int mode = archive_zero_copy_mode(archive, fd, file_info->size, file_info->num_extents);
+
+  uint64_t i;
+  for (i = 0; i < file_info->num_extents && bytes_left > 0 && status == 0; i++) {
+    uint64_t length = file_info->extents[i].length * blocksize;
+
+    if (skip >= length) {
+      skip -= length;
+      continue;
+    }
+
+    off_t offset = file_info->extents[i].start * blocksize + skip;
+    length -= skip;
+    length = length > bytes_left ? bytes_left : length;
+    skip = 0;
+
+    if (length >= io_size) {
+      posix_fadvise(archive->store_fd, offset, length, POSIX_FADV_SEQUENTIAL);
+    }
+
+    if (mode != ZERO_COPY_NONE && filled == 0) {
+      uint64_t copied = archive_zero_copy_out(archive, &mode, fd, offset, length);
+
+      offset += copied;
+      length -= copied;
+      bytes_left -= copied;
+    }
+
+    while (length > 0 && status == 0) {
+      uint64_t chunk_size = io_size - filled;
+      chunk_size = chunk_size > length ? length : chunk_size;
+
+      iov[num_requests].iov_base = buffer + filled;
+      iov[num_requests].iov_len = chunk_size;
+      requests[num_requests].write = false;
+      requests[num_requests].iov = &iov[num_requests];
+      requests[num_requests].num_iov = 1;
+      requests[num_requests].offset = offset;
+      num_requests++;
+
+      filled += chunk_size;
+      offset += chunk_size;
+      length -= chunk_size;
+      bytes_left -= chunk_size;
+
+      if (filled == io_size || bytes_left == 0) {
+        if (archive_run_requests(archive, requests, num_requests) != 0) {
+          status = ARCHIVE_NOT_READABLE;
+        } else {
+          status = archive_write_output(output, buffer, filled);
+        }
+
+        filled = 0;
+        num_requests = 0;
+      }
+    }
+  }
+
+  free(buffer);
+  free(requests);
+  free(iov);
+
+  return status;
+}
+
+/**
+ * Schreibt den Inhalt der Datei nach output.
+ */
+int archive_read_file (struct Archive* archive, struct FileInfo* file_info, FILE* output) {
+  return archive_read_range(archive, file_info, 0, file_info->size, output);
+}
+
+/**
+ * Schreibt length Bytes ab dem Byte offset der Datei name in die Datei
+ * output_path oder, wenn sie "-" ist, nach stdout.
+ */
+int archive_get_range (struct Archive* archive, const char* name, const char* output_path, uint64_t offset, uint64_t length) {
+  int status = 0;
+
+  struct FileInfo* file_info = archiveinfo_get_file(archive->archive_info, name);
+
+  if (file_info == NULL) {
+    status = ARCHIVE_FILE_NOT_FOUND;
+  } else if (archive_open_store(archive) != 0) {
+    status = ARCHIVE_NOT_READABLE;
+  } else if (strcmp(output_path, "-") == 0) {
+    status = archive_read_range(archive, file_info, offset, length, stdout);
+
+    if (fflush(stdout) != 0 && status == 0) {
+      status = FILE_NOT_WRITEABLE;
+    }
+  } else {
+    FILE* output = fopen(output_path, "w");
+
+    if (output == NULL) {
+      status = FILE_NOT_WRITEABLE;
+    } else {
+      status = archive_read_range(archive, file_info, offset, length, output);
+
+      if (fclose(output) != 0 && status == 0) {
+        status = FILE_NOT_WRITEABLE;
+      }
+    }
+  }
+
+  return status;
+}
+
+int archive_get_file (struct Archive* archive, const char* name, const char* output_path) {
+  return archive_get_range(archive, name, output_path, 0, UINT64_MAX);
+}
+
+int archive_delete_file (struct Archive* archive, const char* name) {
+  int status = 0;
+  struct ArchiveInfo* archive_info = archive->archive_info;
+
+  int64_t id = archiveinfo_get_file_index(archive_info, name);
+
+  if (id == -1) {
+    status = ARCHIVE_FILE_NOT_FOUND;
+  } else {
+    struct FileInfo* file_info = archiveinfo_file(archive_info, id);
+    archive_queue_holes(archive, file_info->extents, file_info->num_extents);
+
+    archiveinfo_delete_id(archive_info, id);
+    status = archive_journal_delete(archive, id);
+  }
+
+  if (status != 0) {
+    buffer_clear(archive->freed_extents);
+  } else if (archive->deferred_journal == NULL) {
+    archive_punch_holes(archive);
+  }
+
+  return status;
+}
+
+/**
+ * Die Bytes, die beim Ändern einer Datei ab einer Stelle geschrieben werden:
+ * zuerst zeros Nullbytes für eine Lücke hinter dem alten Ende, dann bis zu
+ * length Bytes aus source.
+ */
+struct Rewrite {
+  uint64_t zeros;
+  FILE* source;
+  uint64_t length;
+
+  /**
+   * Wie viele Bytes schon geliefert wurden
+   */
+  uint64_t produced;
+};
+
+/**
+ * Füllt buffer mit bis zu size Bytes aus rewrite. Weniger kommen nur, wenn
+ * rewrite erschöpft ist. Gibt FILE_NOT_READABLE zurück, wenn source nicht
+ * lesbar ist.
+ *
+ * @private
+ */
+int rewrite_read (struct Rewrite* rewrite, char* buffer, uint64_t size, uint64_t* count) {
+  uint64_t zeros = rewrite->zeros < size ? rewrite->zeros : size;
+
+  memset(buffer, 0, zeros);
+  rewrite->zeros -= zeros;
+  *count = zeros;
+
+  uint64_t wanted = size - zeros < rewrite->length ? size - zeros : rewrite->length;
+
+  if (wanted > 0 && rewrite->source != NULL) {
+    uint64_t length = fread(buffer + zeros, 1, wanted, rewrite->source);
+
+    if (length < wanted && ferror(rewrite->source)) {
+      return FILE_NOT_READABLE;
+    } else if (length < wanted) {
+      rewrite->length = 0;
+    } else {
+      rewrite->length -= length;
+    }
+
+    *count += length;
+  }
+
+  rewrite->produced += *count;
+
+  return 0;
+}
+
+/**
+ * Schließt eine Änderung der Datei id ab: Die Blöcke der Datei werden durch
+ * die Extents in result ersetzt und die neue Größe wird eingetragen. Ist
+ * hashes nicht NULL, stehen darin die count Fingerabdrücke ab dem Index
+ * first, die sich dabei geändert haben; sie kommen im selben Journaleintrag
+ * dazu. Blöcke, die dabei frei werden, bekommen bei --punch-holes Löcher.
+ *
+ * @private
+ */
+int archive_finish_rewrite (struct Archive* archive, uint64_t id, struct FileInfo* result, uint64_t size, uint64_t stored_size, const uint64_t* hashes, uint64_t first, uint64_t count) {
+  struct ArchiveInfo* archive_info = archive->archive_info;
+  struct FileInfo* file_info = archiveinfo_file(archive_info, id);
+  struct Buffer* records = buffer_create();
+  uint64_t old_size = file_info->size;
+
+  archive_queue_holes(archive, file_info->extents, file_info->num_extents);
+  archiveinfo_set_extents(archive_info, id, result->extents, result->num_extents);
+  file_info->size = size;
+  file_info->stored_size = stored_size;
+  archiveinfo_resize_hashes(archive_info, file_info, old_size);
+  archiveinfo_journal_extents(archive_info, records, id);
+
+  uint64_t num_hashes = archiveinfo_num_hashes(archive_info, size);
+  count = first < num_hashes && count > num_hashes - first ? num_hashes - first : count;
+
+  if (hashes != NULL && first < num_hashes && count > 0) {
+    archiveinfo_set_hashes(archive_info, file_info, hashes, first, count);
+    archiveinfo_journal_hashes(archive_info, records, id, first, count);
+  }
+
+  int status = archive_append_journal(archive, records);
+  buffer_free(records);
+
+  if (status != 0) {
+    buffer_clear(archive->freed_extents);
+  } else if (archive->deferred_journal == NULL) {
+    archive_punch_holes(archive);
+  }
+
+  return status;
+}
+
+/**
+ * Gibt die Blöcke ab dem Block skip in reserved wieder frei, die für eine
+ * Änderung reserviert, aber noch keiner Datei zugeordnet sind.
+ *
+ * @private
+ */
+void archiveinfo_release_reserved (struct ArchiveInfo* archive_info, struct FileInfo* reserved, uint64_t skip) {
+  struct FileInfo* slice = fileinfo_create();
+  extents_slice(reserved->extents, reserved->num_extents, skip, UINT64_MAX, slice);
+
+  uint64_t i;
+  for (i = 0; i < slice->num_extents; i++) {
+    freespace_release(archive_info->free_space, slice->extents[i].start, slice->extents[i].length);
+  }
+
+  fileinfo_free(slice);
+}
+
+/**
+ * Ändert die Datei id in einem Archiv ohne Kompression und Deduplizierung ab
+ * dem Byte start. Die Bytes werden direkt in die vorhandenen Blöcke
+ * geschrieben, auch in den nur teilweise benutzten letzten; nur für das, was
+ * über den letzten Block hinausgeht, werden neue Blöcke reserviert, wenn
+ * möglich direkt dahinter. Die Fingerabdrücke der geänderten Blöcke werden
+ * vorher vergessen; neue bekommen sie erst beim nächsten archive_update_file.
+ *
+ * @private
+ */
+int archive_rewrite_in_place (struct Archive* archive, uint64_t id, uint64_t start, struct Rewrite* rewrite, bool truncate) {
+  struct ArchiveInfo* archive_info = archive->archive_info;
+  struct FileInfo* file_info = archiveinfo_file(archive_info, id);
+  uint64_t blocksize = archive_info->blocksize;
+  uint64_t segment_size = COMPRESSION_BATCH * COMPRESSION_CHUNK_SIZE;
+  segment_size = segment_size < blocksize ? blocksize : segment_size - segment_size % blocksize;
+
+  char* segment = malloc(segment_size);
+  struct FileInfo* grown = fileinfo_create();
+  struct FileInfo* result = fileinfo_create();
+  uint64_t old_blocks = fileinfo_num_blocks(file_info);
+  uint64_t window = STREAM_RESERVATION / blocksize;
+  uint64_t position = start;
+  int status = 0;
+
+  window = window == 0 ? 1 : window;
+  extents_slice(file_info->extents, file_info->num_extents, 0, old_blocks, grown);
+
+  /* Hinter dem alten Ende wird nichts überschrieben, was einen Fingerabdruck hat */
+  if (start < file_info->size && rewrite->source != NULL && rewrite->length > 0) {
+    status = archive_forget_hashes(archive, id, start / blocksize, UINT64_MAX);
+  }
+
+  while (status == 0) {
+    uint64_t length;
+    status = rewrite_read(rewrite, segment, segment_size, &length);
+
+    if (status != 0 || length == 0) {
+      break;
+    }
+
+    status = archiveinfo_reserve_stream(archive_info, grown, archiveinfo_needed_blocks(archive_info, position + length), &window);
+
+    if (status == 0 && archive_stream_io(archive, grown->extents, grown->num_extents, position, segment, length, true) != 0) {
+      status = ARCHIVE_NOT_WRITEABLE;
+    }
+
+    position += length;
+  }
+
+  archiveinfo_release_reserved(archive_info, grown, old_blocks);
+
+  if (status == 0) {
+    uint64_t size = truncate || position > file_info->size ? position : file_info->size;
+
+    extents_slice(grown->extents, grown->num_extents, 0, archiveinfo_needed_blocks(archive_info, size), result);
+    status = archive_finish_rewrite(archive, id, result, size, size, NULL, 0, 0);
+  }
+
+  free(segment);
+  fileinfo_free(grown);
+  fileinfo_free(result);
+
+  return status;
+}
+
+/**
+ * Ändert die Datei id in einem Archiv mit Deduplizierung ab dem Byte start.
+ * Weil andere Dateien auf dieselben Blöcke verweisen können, werden die
+ * betroffenen Blöcke nicht überschrieben, sondern mit dem unveränderten Rest
+ * ihres alten Inhalts neu über archive_write_deduplicated geschrieben. Die
+ * Blöcke davor und dahinter bleiben, wie sie sind.
+ *
+ * @private
+ */
+int archive_rewrite_deduplicated (struct Archive* archive, uint64_t id, uint64_t start, struct Rewrite* rewrite, bool truncate) {
+  struct ArchiveInfo* archive_info = archive->archive_info;
+  struct FileInfo* file_info = archiveinfo_file(archive_info, id);
+  uint64_t blocksize = archive_info->blocksize;
+  uint64_t segment_size = COMPRESSION_BATCH * COMPRESSION_CHUNK_SIZE;
+  segment_size = segment_size < blocksize ? blocksize : segment_size - segment_size % blocksize;
+
+  /* Platz für den Rest des letzten Blocks hinter den neuen Bytes */
+  char* segment = malloc(segment_size + blocksize);
+  struct FileInfo* reserved = fileinfo_create();
+  struct FileInfo* mapped = fileinfo_create();
+  struct FileInfo* slice = fileinfo_create();
+  struct FileInfo* result = fileinfo_create();
+  uint64_t old_blocks = fileinfo_num_blocks(file_info);
+  uint64_t first_block = start / blocksize;
+  uint64_t window = STREAM_RESERVATION / blocksize;
+  uint64_t used_blocks = 0;
+  int status = 0;
+
+  window = window == 0 ? 1 : window;
+
+  /* Der Anfang des ersten Blocks bleibt */
+  uint64_t filled = start - first_block * blocksize;
+
+  if (filled > 0 && archive_stream_io(archive, file_info->extents, file_info->num_extents, first_block * blocksize, segment, filled, false) != 0) {
+    status = ARCHIVE_NOT_READABLE;
+  }
+
+  bool exhausted = false;
+
+  while (status == 0 && !exhausted) {
+    uint64_t length;
+    status = rewrite_read(rewrite, segment + filled, segment_size - filled, &length);
+    exhausted = filled + length < segment_size;
+    filled += length;
+
+    uint64_t end = start + rewrite->produced;
+    uint64_t block_end = archiveinfo_needed_blocks(archive_info, end) * blocksize;
+    uint64_t rest = (block_end < file_info->size ? block_end : file_info->size) - end;
+
+    /* Der Rest des letzten Blocks bleibt, wenn die Datei dort weitergeht */
+    if (status == 0 && exhausted && !truncate && end < file_info->size && rest > 0) {
+      if (archive_stream_io(archive, file_info->extents, file_info->num_extents, end, segment + filled, rest, false) != 0) {
+        status = ARCHIVE_NOT_READABLE;
+      }
+
+      filled += rest;
+    }
+
+    if (status == 0 && filled > 0) {
+      uint64_t num_blocks = archiveinfo_needed_blocks(archive_info, filled);
+      FILE* data = fmemopen(segment, filled, "r");
+
+      status = archiveinfo_reserve_stream(archive_info, reserved, used_blocks + num_blocks, &window);
+      extents_slice(reserved->extents, reserved->num_extents, used_blocks, num_blocks, slice);
+      status == 0 && (status = archive_write_deduplicated(archive, data, filled, slice->extents, slice->num_extents, mapped));
+      used_blocks += num_blocks;
+
+      fclose(data);
+    }
+
+    filled = 0;
+  }
+
+  archiveinfo_release_reserved(archive_info, reserved, 0);
+
+  if (status == 0) {
+    uint64_t end = start + rewrite->produced;
+    uint64_t size = truncate || end > file_info->size ? end : file_info->size;
+    uint64_t next_block = archiveinfo_needed_blocks(archive_info, end);
+
+    extents_slice(file_info->extents, file_info->num_extents, 0, first_block, result);
+
+    uint64_t i;
+    for (i = 0; i < mapped->num_extents; i++) {
+      fileinfo_append_extent(result, mapped->extents[i].start, mapped->extents[i].length);
+    }
+
+    if (!truncate && next_block < old_blocks) {
+      extents_slice(file_info->extents, file_info->num_extents, next_block, old_blocks - next_block, slice);
+
+      for (i = 0; i < slice->num_extents; i++) {
+        fileinfo_append_extent(result, slice->extents[i].start, slice->extents[i].length);
+      }
+    }
+
+    status = archive_finish_rewrite(archive, id, result, size, size, NULL, 0, 0);
+  }
+
+  archiveinfo_forget_unused(archive_info, reserved->extents, reserved->num_extents);
+
+  free(segment);
+  fileinfo_free(reserved);
+  fileinfo_free(mapped);
+  fileinfo_free(slice);
+  fileinfo_free(result);
+
+  return status;
+}
+
+/**
+ * Ändert die Datei id in einem komprimierten Archiv ab dem Byte start. Die
+ * Stücke vor dem Stück mit start bleiben, wie sie sind. Ab dort wird der
+ * neue Inhalt in einer temporären Datei zusammengesetzt und neu komprimiert
+ * in die vorhandenen Blöcke geschrieben, weil sich mit der Länge eines
+ * Stücks die Lage aller folgenden verschiebt. Beim Anhängen ist das nur das
+ * letzte Stück. Die Blöcke werden reserviert, bevor etwas überschrieben wird.
+ *
+ * @private
+ */
+int archive_rewrite_compressed (struct Archive* archive, uint64_t id, uint64_t start, struct Rewrite* rewrite, bool truncate) {
+  struct ArchiveInfo* archive_info = archive->archive_info;
+  struct FileInfo* file_info = archiveinfo_file(archive_info, id);
+  uint64_t first = start / COMPRESSION_CHUNK_SIZE * COMPRESSION_CHUNK_SIZE;
+  uint64_t old_blocks = fileinfo_num_blocks(file_info);
+  char* buffer = malloc(COMPRESSION_CHUNK_SIZE);
+  uint64_t size = first;
+  uint64_t stored_size = 0;
+
+  /* Bleibt vom alten Inhalt ab dem Stück nichts und ist die Länge bekannt, wird direkt aus source komprimiert */
+  bool direct = start == first && rewrite->zeros == 0 && truncate && rewrite->source != NULL && rewrite->length != UINT64_MAX;
+  FILE* spool = direct ? NULL : tmpfile();
+  int status = !direct && spool == NULL ? FILE_NOT_WRITEABLE : 0;
+
+  if (direct) {
+    size += rewrite->length;
+  } else {
+    status == 0 && (status = archive_read_range(archive, file_info, first, start - first, spool));
+
+    while (status == 0) {
+      uint64_t length;
+      status = rewrite_read(rewrite, buffer, COMPRESSION_CHUNK_SIZE, &length);
+
+      if (status != 0 || length == 0) {
+        break;
+      }
+
+      status = archive_write_output(spool, buffer, length);
+    }
+
+    uint64_t end = start + rewrite->produced;
+
+    if (status == 0 && !truncate && end < file_info->size) {
+      status = archive_read_range(archive, file_info, end, file_info->size - end, spool);
+    }
+
+    /* archive_read_range und archive_write_output schreiben am FILE vorbei direkt in den Deskriptor */
+    off_t spooled = status == 0 ? lseek(fileno(spool), 0, SEEK_CUR) : 0;
+    size += spooled == -1 ? 0 : spooled;
+
+    if (spooled == -1) {
+      status = FILE_NOT_WRITEABLE;
+    } else if (status == 0) {
+      rewind(spool);
+    }
+  }
+
+  /* Wo das erste geänderte Stück gespeichert ist */
+  struct CompressedReader reader;
+  reader.archive = archive;
+  reader.file_info = file_info;
+  reader.window = NULL;
+  reader.capacity = 0;
+  reader.filled = 0;
+  reader.position = 0;
+  reader.offset = 0;
+
+  uint64_t chunk;
+  for (chunk = 0; chunk < first / COMPRESSION_CHUNK_SIZE && status == 0; chunk++) {
+    if (!compressedreader_skip(&reader)) {
+      status = ARCHIVE_NOT_READABLE;
+    }
+  }
+
+  struct FileInfo* grown = fileinfo_create();
+  struct FileInfo* result = fileinfo_create();
+  uint64_t window = 1;
+
+  extents_slice(file_info->extents, file_info->num_extents, 0, old_blocks, grown);
+  stored_size = reader.offset;
+
+  uint64_t needed = archiveinfo_needed_blocks(archive_info, stored_size + archiveinfo_max_stored_size(archive_info, size - first));
+  uint64_t* hashes = archiveinfo_create_hashes(archive_info, size - first);
+
+  /* Vor dem Reservieren, weil dabei die ganze Struktur geschrieben werden kann und reservierte Blöcke dort als belegt stünden */
+  status == 0 && (status = archive_forget_hashes(archive, id, first / COMPRESSION_CHUNK_SIZE, UINT64_MAX));
+  status == 0 && (status = archiveinfo_reserve_stream(archive_info, grown, needed, &window));
+  status == 0 && (status = archive_write_compressed(archive, direct ? rewrite->source : spool, size - first, grown->extents, grown->num_extents, &stored_size, hashes));
+
+  archiveinfo_release_reserved(archive_info, grown, old_blocks);
+
+  if (status == 0) {
+    extents_slice(grown->extents, grown->num_extents, 0, archiveinfo_needed_blocks(archive_info, stored_size), result);
+    status = archive_finish_rewrite(archive, id, result, size, stored_size, hashes, first / COMPRESSION_CHUNK_SIZE, archiveinfo_num_hashes(archive_info, size - first));
+  }
+
+  if (spool != NULL) {
+    fclose(spool);
+  }
+
+  free(buffer);
+  free(hashes);
+  fileinfo_free(grown);
+  fileinfo_free(result);
+
+  return status;
+}
+
+/**
+ * Ändert die Datei id ab dem Byte offset: Bis zu length Bytes aus source
+ * ersetzen den alten Inhalt, dahinter bleibt er, oder die Datei endet dort,
+ * wenn truncate gesetzt ist. Liegt offset hinter dem Ende, wird die Lücke mit
+ * Nullen gefüllt. Unveränderte Blöcke werden weder gelesen noch geschrieben.
+ *
+ * Ist die Länge bekannt, wird ARCHIVE_FILE_TOO_BIG zurückgegeben, bevor etwas
+ * geschrieben wird. Sonst kann ein volles Archiv ohne Kompression und
+ * Deduplizierung mitten im Schreiben auffallen; Größe und Blöcke der Datei
+ * bleiben dann die alten, die vorhandenen Blöcke können aber schon neue
+ * Bytes enthalten.
+ *
+ * @private
+ */
+int archive_rewrite (struct Archive* archive, uint64_t id, uint64_t offset, FILE* source, uint64_t length, bool truncate) {
+  struct ArchiveInfo* archive_info = archive->archive_info;
+  struct FileInfo* file_info = archiveinfo_file(archive_info, id);
+  struct Rewrite rewrite;
+
+  uint64_t start = offset < file_info->size ? offset : file_info->size;
+
+  rewrite.zeros = offset - start;
+  rewrite.source = source;
+  rewrite.length = source == NULL ? 0 : length;
+  rewrite.produced = 0;
+
+  if (archive_open_store(archive) != 0) {
+    return ARCHIVE_NOT_WRITEABLE;
+  }
+
+  if (archive_info->dedup) {
+    return archive_rewrite_deduplicated(archive, id, start, &rewrite, truncate);
+  } else if (archive_info->compression != COMPRESSION_NONE) {
+    return archive_rewrite_compressed(archive, id, start, &rewrite, truncate);
+  }
+
+  uint64_t end = offset + rewrite.length;
+  uint64_t size = truncate || end > file_info->size ? end : file_info->size;
+
+  if (rewrite.length != UINT64_MAX && archiveinfo_needed_blocks(archive_info, size) > fileinfo_num_blocks(file_info) + archiveinfo_num_free_blocks(archive_info)) {
+    return ARCHIVE_FILE_TOO_BIG;
+  }
+
+  return archive_rewrite_in_place(archive, id, start, &rewrite, truncate);
+}
+
+/**
+ * Schreibt den Inhalt der Datei path ab dem Byte offset in die Datei name im
+ * Archiv und überschreibt dort, was schon steht. Ist append gesetzt, wird
+ * offset ignoriert und an das Ende angehängt. Ist path "-", wird die
+ * Standardeingabe gelesen.
+ */
+int archive_write_at (struct Archive* archive, const char* name, uint64_t offset, bool append, const char* path) {
+  int64_t id = archiveinfo_get_file_index(archive->archive_info, name);
+
+  if (id == -1) {
+    return ARCHIVE_FILE_NOT_FOUND;
+  }
+
+  FILE* source = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+
+  if (source == NULL) {
+    return FILE_NOT_READABLE;
+  }
+
+  long int size = file_size(source);
+  struct FileInfo* file_info = archiveinfo_file(archive->archive_info, id);
+
+  offset = append ? file_info->size : offset;
+
+  int status = archive_rewrite(archive, id, offset, source, size == -1 ? UINT64_MAX : (uint64_t)(size - ftell(source)), false);
+
+  if (source != stdin) {
+    fclose(source);
+  }
+
+  return status;
+}
+
+/**
+ * Kürzt die Datei name auf size Bytes oder verlängert sie mit Nullen.
+ */
+int archive_truncate_file (struct Archive* archive, const char* name, uint64_t size) {
+  int64_t id = archiveinfo_get_file_index(archive->archive_info, name);
+
+  if (id == -1) {
+    return ARCHIVE_FILE_NOT_FOUND;
+  }
+
+  return archive_rewrite(archive, id, size, NULL, 0, true);
+}
+
+/**
+ * Vergleicht die ersten common_blocks Blöcke der Datei id mit den nächsten
+ * Bytes aus source und schreibt nur die Blöcke, die sich unterscheiden. Dafür
+ * bekommt jeder neue Block seinen Fingerabdruck.
+ *
+ * Ohne Deduplizierung zeigen die Fingerabdrücke der Datei, welche Blöcke sich
+ * geändert haben, ohne dass die alten gelesen werden; nur Blöcke ohne
+ * bekannten Fingerabdruck werden gelesen und verglichen. Geänderte Blöcke
+ * werden an ihrer Stelle überschrieben, nachdem ihre alten Fingerabdrücke
+ * mit archive_forget_hashes vergessen sind, und die neuen kommen danach ins
+ * Journal.
+ *
+ * Mit Deduplizierung stehen die Fingerabdrücke bei den Blöcken; nur die mit
+ * gleichem Fingerabdruck werden noch gelesen und verglichen, wie bei
+ * archive_write_deduplicated. Geänderte Blöcke werden wie bei
+ * archive_rewrite_deduplicated neu geschrieben und die Datei bekommt ihre
+ * neuen Extents, aber nur, wenn danach noch spare_blocks Blöcke für den Rest
+ * der Datei frei sind; sonst bleibt sie, wie sie war, und es wird
+ * ARCHIVE_FILE_TOO_BIG zurückgegeben. In *skipped kommen die Bytes der
+ * gleichen Blöcke dazu.
+ *
+ * @private
+ */
+int archive_update_blocks (struct Archive* archive, uint64_t id, FILE* source, uint64_t common_blocks, uint64_t spare_blocks, uint64_t* skipped) {
+  struct ArchiveInfo* archive_info = archive->archive_info;
+  struct FileInfo* file_info = archiveinfo_file(archive_info, id);
+  uint64_t blocksize = archive_info->blocksize;
+  uint64_t chunk_blocks = archive_io_size(archive) / blocksize;
+  uint64_t old_blocks = fileinfo_num_blocks(file_info);
+  char* buffer = malloc(chunk_blocks * blocksize);
+  char* existing = malloc(chunk_blocks * blocksize);
+  uint64_t* blocks = malloc(chunk_blocks * sizeof(uint64_t));
+  bool* compare = malloc(chunk_blocks * sizeof(bool));
+  bool* changed = malloc(chunk_blocks * sizeof(bool));
+  struct IoRequest* requests = malloc(chunk_blocks * sizeof(struct IoRequest));
+  struct iovec* iov = malloc(chunk_blocks * sizeof(struct iovec));
+  struct FileInfo* slice = fileinfo_create();
+  struct FileInfo* reserved = fileinfo_create();
+  struct FileInfo* written = fileinfo_create();
+  struct FileInfo* result = fileinfo_create();
+  uint64_t window = STREAM_RESERVATION / blocksize;
+  uint64_t used_blocks = 0;
+  int status = 0;
+
+  /* Die alten Fingerabdrücke, weil die im Bereich geänderter Blöcke vor dem Schreiben vergessen werden */
+  uint64_t* known = NULL;
+  uint64_t* hashes = archive_info->dedup ? NULL : malloc((common_blocks == 0 ? 1 : common_blocks) * sizeof(uint64_t));
+  uint64_t learned = common_blocks;
+  bool forgotten = false;
+
+  if (file_info->hashes != NULL && !archive_info->dedup) {
+    known = malloc((common_blocks == 0 ? 1 : common_blocks) * sizeof(uint64_t));
+    memcpy(known, file_info->hashes, common_blocks * sizeof(uint64_t));
+  }
+
+  window = window == 0 ? 1 : window;
+
+  uint64_t first;
+  for (first = 0; first < common_blocks && status == 0; first += chunk_blocks) {
+    uint64_t num_blocks = common_blocks - first < chunk_blocks ? common_blocks - first : chunk_blocks;
+    uint64_t num_changed = 0;
+    uint64_t num_requests = 0;
+
+    if (file_read(buffer, blocksize, num_blocks, source) != 0) {
+      status = FILE_NOT_READABLE;
+      break;
+    }
+
+    extents_slice(file_info->extents, file_info->num_extents, first, num_blocks, slice);
+
+    uint64_t i, k = 0;
+    for (i = 0; i < slice->num_extents; i++) {
+      uint64_t block;
+      for (block = slice->extents[i].start; block < slice->extents[i].start + slice->extents[i].length; block++) {
+        blocks[k++] = block;
+      }
+    }
+
+    /* Gelesen werden mit Deduplizierung die Blöcke mit gleichem Fingerabdruck, damit eine Kollision nicht den alten Inhalt behält, sonst die ohne bekannten */
+    for (k = 0; k < num_blocks; k++) {
+      uint64_t hash = block_hash(buffer + k * blocksize, blocksize);
+      uint64_t stored = archive_info->dedup ? archive_info->block_hashes[blocks[k]] : (known == NULL ? 0 : known[first + k]);
+
+      compare[k] = archive_info->dedup ? stored != 0 && stored == hash : stored == 0;
+      changed[k] = archive_info->dedup ? !compare[k] : !compare[k] && stored != hash;
+
+      if (!archive_info->dedup) {
+        hashes[first + k] = hash;
+        learned = (compare[k] || changed[k]) && first + k < learned ? first + k : learned;
+      }
+
+      if (!compare[k]) {
+        continue;
+      }
+
+      struct IoRequest* last = num_requests > 0 ? &requests[num_requests - 1] : NULL;
+
+      if (last != NULL && (char*)last->iov->iov_base + last->iov->iov_len == existing + k * blocksize && last->offset + (off_t)last->iov->iov_len == (off_t)(blocks[k] * blocksize)) {
+        last->iov->iov_len += blocksize;
+      } else {
+        iov[num_requests].iov_base = existing + k * blocksize;
+        iov[num_requests].iov_len = blocksize;
+        requests[num_requests].write = false;
+        requests[num_requests].iov = &iov[num_requests];
+        requests[num_requests].num_iov = 1;
+        requests[num_requests].offset = blocks[k] * blocksize;
+        num_requests++;
+      }
+    }
+
+    if (num_requests > 0 && archive_run_requests(archive, requests, num_requests) != 0) {
+      status = ARCHIVE_NOT_READABLE;
+      break;
+    }
+
+    for (k = 0; k < num_blocks; k++) {
+      changed[k] = changed[k] || (compare[k] && memcmp(existing + k * blocksize, buffer + k * blocksize, blocksize) != 0);
+    }
+
+    /* Ohne Deduplizierung wird jeder Lauf geänderter Blöcke an seiner Stelle überschrieben */
+    uint64_t run = 0;
+
+    for (k = 0; k <= num_blocks && !archive_info->dedup && status == 0; k++) {
+      if (k < num_blocks && changed[k]) {
+        run++;
+        continue;
+      }
+
+      if (run > 0 && !forgotten) {
+        status = archive_forget_hashes(archive, id, first + k - run, common_blocks - (first + k - run));
+        forgotten = true;
+      }
+
+      if (status == 0 && run > 0 && archive_stream_io(archive, slice->extents, slice->num_extents, (k - run) * blocksize, buffer + (k - run) * blocksize, run * blocksize, true) != 0) {
+        status = ARCHIVE_NOT_WRITEABLE;
+      }
+
+      num_changed += run;
+      run = 0;
+    }
+
+    /* Mit Deduplizierung kommen geänderte Blöcke hintereinander nach existing und werden neu geschrieben */
+    for (k = 0; k < num_blocks && archive_info->dedup; k++) {
+      if (changed[k]) {
+        memcpy(existing + num_changed * blocksize, buffer + k * blocksize, blocksize);
+        blocks[k] = UINT64_MAX;
+        num_changed++;
+      }
+    }
+
+    *skipped += (num_blocks - num_changed) * blocksize;
+
+    if (!archive_info->dedup || status != 0) {
+      continue;
+    }
+
+    written->num_extents = 0;
+
+    if (num_changed > 0) {
+      FILE* data = fmemopen(existing, num_changed * blocksize, "r");
+
+      status = archiveinfo_reserve_stream(archive_info, reserved, used_blocks + num_changed, &window);
+      extents_slice(reserved->extents, reserved->num_extents, used_blocks, num_changed, slice);
+      status == 0 && (status = archive_write_deduplicated(archive, data, num_changed * blocksize, slice->extents, slice->num_extents, written));
+      used_blocks += num_changed;
+
+      fclose(data);
+    }
+
+    /* Gleiche Blöcke behalten, für geänderte die neuen der Reihe nach einsetzen */
+    uint64_t next = 0;
+
+    for (k = 0; k < num_blocks && status == 0; k++) {
+      if (blocks[k] == UINT64_MAX) {
+        extents_slice(written->extents, written->num_extents, next++, 1, slice);
+        blocks[k] = slice->extents[0].start;
+      }
+
+      fileinfo_append_extent(result, blocks[k], 1);
+    }
+  }
+
+  /* Die Fingerabdrücke ab dem ersten Block, der geändert wurde oder noch keinen hatte */
+  if (!archive_info->dedup && status == 0 && learned < common_blocks) {
+    archiveinfo_set_hashes(archive_info, file_info, hashes + learned, learned, common_blocks - learned);
+    status = archive_journal_hashes(archive, id, learned, common_blocks - learned);
+  }
+
+  if (archive_info->dedup) {
+    archiveinfo_release_reserved(archive_info, reserved, 0);
+
+    /* Von den freien Blöcken belegen die neuen gleich wieder höchstens used_blocks */
+    if (status == 0 && used_blocks > 0 && archiveinfo_num_free_blocks(archive_info) < used_blocks + spare_blocks) {
+      status = ARCHIVE_FILE_TOO_BIG;
+    }
+
+    if (status == 0 && used_blocks > 0) {
+      extents_slice(file_info->extents, file_info->num_extents, common_blocks, old_blocks - common_blocks, slice);
+
+      uint64_t i;
+      for (i = 0; i < slice->num_extents; i++) {
+        fileinfo_append_extent(result, slice->extents[i].start, slice->extents[i].length);
+      }
+
+      status = archive_finish_rewrite(archive, id, result, file_info->size, file_info->stored_size, NULL, 0, 0);
+    }
+
+    archiveinfo_forget_unused(archive_info, reserved->extents, reserved->num_extents);
+  }
+
+  free(buffer);
+  free(existing);
+  free(blocks);
+  free(compare);
+  free(changed);
+  free(requests);
+  free(iov);
+  free(known);
+  free(hashes);
+  fileinfo_free(slice);
+  fileinfo_free(reserved);
+  fileinfo_free(written);
+  fileinfo_free(result);
+
+  return status;
+}
+
+/**
+ * Ersetzt in einem komprimierten Archiv den Inhalt der Datei id durch die
+ * size Bytes aus source. Welche Stücke gleich geblieben sind, zeigen ihre
+ * Fingerabdrücke, ohne dass die alten gelesen werden; nur Stücke ohne
+ * bekannten Fingerabdruck werden entpackt und verglichen. Die Stücke vor dem
+ * ersten geänderten bleiben, wo sie sind. Ab dort kommt der neue Inhalt in
+ * frisch reservierte Blöcke: gleiche Stücke so, wie sie gespeichert sind,
+ * nur geänderte werden neu komprimiert. Weil dabei nichts überschrieben
+ * wird, was die Datei noch braucht, muss kein Fingerabdruck vergessen
+ * werden. In *skipped kommen die Bytes der gleichen Stücke.
+ *
+ * Reicht der freie Platz dafür nicht, wird ab dem ersten geänderten Stück
+ * mit archive_rewrite geschrieben.
+ *
+ * @private
+ */
+int archive_update_compressed (struct Archive* archive, uint64_t id, FILE* source, uint64_t size, uint64_t* skipped) {
+  struct ArchiveInfo* archive_info = archive->archive_info;
+  struct FileInfo* file_info = archiveinfo_file(archive_info, id);
+  uint64_t blocksize = archive_info->blocksize;
+  uint64_t slot_size = sizeof(uint32_t) + COMPRESSION_CHUNK_SIZE;
+  uint64_t old_size = file_info->size;
+  uint64_t old_chunks = archiveinfo_num_hashes(archive_info, old_size);
+  uint64_t num_chunks = archiveinfo_num_hashes(archive_info, size);
+  uint64_t* hashes = malloc((num_chunks + 1) * sizeof(uint64_t));
+  bool* same = malloc(num_chunks + 1);
+  char* raw = malloc(COMPRESSION_BATCH * COMPRESSION_CHUNK_SIZE);
+  char* existing = malloc(COMPRESSION_CHUNK_SIZE);
+  int status = 0;
+
+  struct CompressedReader reader;
+  reader.archive = archive;
+  reader.file_info = file_info;
+  reader.capacity = archive_io_size(archive) + slot_size;
+  reader.window = malloc(reader.capacity);
+  reader.filled = 0;
+  reader.position = 0;
+  reader.offset = 0;
+
+  /* Das Stück, bei dem reader steht */
+  uint64_t at = 0;
+
+  /* Das erste geänderte Stück und das erste, dessen Fingerabdruck neu ins Journal kommt */
+  uint64_t first = num_chunks;
+  uint64_t learned = num_chunks;
+
+  uint64_t chunk;
+  for (chunk = 0; chunk < num_chunks && status == 0; chunk++) {
+    uint64_t length = size - chunk * COMPRESSION_CHUNK_SIZE < COMPRESSION_CHUNK_SIZE ? size - chunk * COMPRESSION_CHUNK_SIZE : COMPRESSION_CHUNK_SIZE;
+    uint64_t old_length = chunk >= old_chunks ? 0 : old_size - chunk * COMPRESSION_CHUNK_SIZE < COMPRESSION_CHUNK_SIZE ? old_size - chunk * COMPRESSION_CHUNK_SIZE : COMPRESSION_CHUNK_SIZE;
+    uint64_t known = file_info->hashes != NULL && chunk < old_chunks ? file_info->hashes[chunk] : 0;
+
+    if (file_read(raw, 1, length, source) != 0) {
+      status = FILE_NOT_READABLE;
+      break;
+    }
+
+    hashes[chunk] = block_hash(raw, length);
+    same[chunk] = length == old_length && known != 0 && known == hashes[chunk];
+
+    /* Ohne Fingerabdruck wird das alte Stück entpackt und verglichen */
+    if (length == old_length && known == 0) {
+      for (; at < chunk && status == 0; at++) {
+        if (!compressedreader_skip(&reader)) {
+          status = ARCHIVE_NOT_READABLE;
+        }
+      }
+
+      if (status == 0 && !compressedreader_next(&reader, existing, length)) {
+        status = ARCHIVE_NOT_READABLE;
+      }
+
+      at++;
+      same[chunk] = status == 0 && memcmp(raw, existing, length) == 0;
+      learned = learned < chunk ? learned : chunk;
+    }
+
+    first = first == num_chunks && !same[chunk] ? chunk : first;
+  }
+
+  learned = learned < first ? learned : first;
+
+  /* Gleich viele gleiche Stücke heißt gleich groß, weil auch das letzte gleich lang ist */
+  if (status == 0 && first == num_chunks && num_chunks == old_chunks) {
+    *skipped += size;
+
+    if (learned < num_chunks) {
+      archiveinfo_set_hashes(archive_info, file_info, hashes + learned, learned, num_chunks - learned);
+      status = archive_journal_hashes(archive, id, learned, num_chunks - learned);
+    }
+
+    free(hashes);
+    free(same);
+    free(raw);
+    free(existing);
+    free(reader.window);
+
+    return status;
+  }
+
+  /* Wo das erste geänderte Stück gespeichert ist */
+  if (at > first) {
+    reader.filled = 0;
+    reader.position = 0;
+    reader.offset = 0;
+    at = 0;
+  }
+
+  for (; at < first && status == 0; at++) {
+    if (!compressedreader_skip(&reader)) {
+      status = ARCHIVE_NOT_READABLE;
+    }
+  }
+
+  uint64_t prefix = reader.offset - (reader.filled - reader.position);
+  uint64_t head = prefix % blocksize;
+  uint64_t kept = prefix / blocksize;
+  uint64_t needed = archiveinfo_needed_blocks(archive_info, head + archiveinfo_max_stored_size(archive_info, size - first * COMPRESSION_CHUNK_SIZE));
+  struct FileInfo* reserved = fileinfo_create();
+  struct FileInfo* slice = fileinfo_create();
+  struct FileInfo* result = fileinfo_create();
+  struct CompressJob jobs[COMPRESSION_BATCH];
+  char* slots = malloc(COMPRESSION_BATCH * slot_size);
+  char* packed = malloc(head + COMPRESSION_BATCH * slot_size);
+  uint64_t window = 1;
+
+  /* Der Anfang des Blocks, in dem das erste geänderte Stück beginnt, kommt mit in den neuen */
+  uint64_t packed_length = head;
+  uint64_t written = 0;
+  uint64_t same_bytes = first * COMPRESSION_CHUNK_SIZE;
+
+  status == 0 && (status = archiveinfo_reserve_stream(archive_info, reserved, needed, &window));
+
+  if (status == 0 && archive_stream_io(archive, file_info->extents, file_info->num_extents, prefix - head, packed, head, false) != 0) {
+    status = ARCHIVE_NOT_READABLE;
+  } else if (status == 0 && fseeko(source, first * COMPRESSION_CHUNK_SIZE, SEEK_SET) != 0) {
+    status = FILE_NOT_READABLE;
+  }
+
+  uint64_t batch;
+  for (batch = first; batch < num_chunks && status == 0; batch += COMPRESSION_BATCH) {
+    uint64_t count = num_chunks - batch < COMPRESSION_BATCH ? num_chunks - batch : COMPRESSION_BATCH;
+    uint64_t length = size - batch * COMPRESSION_CHUNK_SIZE < count * COMPRESSION_CHUNK_SIZE ? size - batch * COMPRESSION_CHUNK_SIZE : count * COMPRESSION_CHUNK_SIZE;
+    uint64_t num_jobs = 0;
+
+    if (file_read(raw, 1, length, source) != 0) {
+      status = FILE_NOT_READABLE;
+      break;
+    }
+
+    uint64_t i;
+    for (i = 0; i < count; i++) {
+      if (!same[batch + i]) {
+        jobs[num_jobs].raw = raw + i * COMPRESSION_CHUNK_SIZE;
+        jobs[num_jobs].raw_length = length - i * COMPRESSION_CHUNK_SIZE < COMPRESSION_CHUNK_SIZE ? length - i * COMPRESSION_CHUNK_SIZE : COMPRESSION_CHUNK_SIZE;
+        jobs[num_jobs].packed = slots + num_jobs * slot_size;
+        num_jobs++;
+      }
+    }
+
+    archive_compress_jobs(archive, jobs, num_jobs);
+
+    /* Gleiche Stücke kommen aus dem Store, die anderen von den Jobs, alte geänderte werden übersprungen */
+    uint64_t job = 0;
+
+    for (i = 0; i < count && status == 0; i++) {
+      uint64_t slot_length;
+
+      if (same[batch + i]) {
+        if (!compressedreader_copy(&reader, packed + packed_length, COMPRESSION_CHUNK_SIZE, &slot_length)) {
+          status = ARCHIVE_NOT_READABLE;
+          break;
+        }
+
+        same_bytes += length - i * COMPRESSION_CHUNK_SIZE < COMPRESSION_CHUNK_SIZE ? length - i * COMPRESSION_CHUNK_SIZE : COMPRESSION_CHUNK_SIZE;
+      } else {
+        if (at < old_chunks && !compressedreader_skip(&reader)) {
+          status = ARCHIVE_NOT_READABLE;
+          break;
+        }
+
+        slot_length = jobs[job].packed_length;
+        memcpy(packed + packed_length, jobs[job++].packed, slot_length);
+      }
+
+      packed_length += slot_length;
+      at++;
+    }
+
+    if (status == 0 && archive_stream_io(archive, reserved->extents, reserved->num_extents, written, packed, packed_length, true) != 0) {
+      status = ARCHIVE_NOT_WRITEABLE;
+    }
+
+    written += packed_length;
+    packed_length = 0;
+  }
+
+  /* Leer bleibt der neue Teil nur, wenn die Datei mit dem ersten geänderten Stück endet */
+  if (status == 0 && batch == first && head > 0) {
+    if (archive_stream_io(archive, reserved->extents, reserved->num_extents, 0, packed, head, true) != 0) {
+      status = ARCHIVE_NOT_WRITEABLE;
+    }
+
+    written = head;
+  }
+
+  archiveinfo_release_reserved(archive_info, reserved, 0);
+
+  if (status == 0) {
+    extents_slice(file_info->extents, file_info->num_extents, 0, kept, result);
+    extents_slice(reserved->extents, reserved->num_extents, 0, archiveinfo_needed_blocks(archive_info, written), slice);
+
+    uint64_t i;
+    for (i = 0; i < slice->num_extents; i++) {
+      fileinfo_append_extent(result, slice->extents[i].start, slice->extents[i].length);
+    }
+
+    *skipped += same_bytes;
+    status = archive_finish_rewrite(archive, id, result, size, kept * blocksize + written, hashes + learned, learned, num_chunks - learned);
+  } else if (status == ARCHIVE_FILE_TOO_BIG && fseeko(source, first * COMPRESSION_CHUNK_SIZE, SEEK_SET) == 0) {
+    *skipped += first * COMPRESSION_CHUNK_SIZE;
+    status = archive_rewrite(archive, id, first * COMPRESSION_CHUNK_SIZE, source, size - first * COMPRESSION_CHUNK_SIZE, true);
+  }
+
+  free(hashes);
+  free(same);
+  free(raw);
+  free(existing);
+  free(reader.window);
+  free(slots);
+  free(packed);
+  fileinfo_free(reserved);
+  fileinfo_free(slice);
+  fileinfo_free(result);
+
+  return status;
+}
+
+/**
+ * Ersetzt den Inhalt der Datei name durch den der Datei path und schreibt
+ * dabei nur, was sich geändert hat. Die ganzen Blöcke, die in der alten und
+ * der neuen Fassung liegen, werden wie bei archive_update_blocks verglichen;
+ * der Rest ab dem letzten davon wird mit archive_rewrite geschrieben und die
+ * Datei dabei gekürzt oder verlängert. Komprimierte Archive vergleichen
+ * stattdessen mit archive_update_compressed Stück für Stück. Gibt es name
+ * noch nicht, wird die Datei hinzugefügt.
+ *
+ * In *skipped steht danach, wie viele Bytes nicht geschrieben oder neu
+ * komprimiert werden mussten.
+ */
+int archive_update_file (struct Archive* archive, const char* name, const char* path, uint64_t* skipped) {
+  struct ArchiveInfo* archive_info = archive->archive_info;
+  int64_t id = archiveinfo_get_file_index(archive_info, name);
+
+  *skipped = 0;
+
+  if (id == -1) {
+    return archive_add_file(archive, name, path);
+  }
+
+  FILE* source = fopen(path, "r");
+  long int size = source == NULL ? -1 : file_size(source);
+  int status = size == -1 ? FILE_NOT_READABLE : 0;
+
+  if (status == 0 && archive_open_store(archive) != 0) {
+    status = ARCHIVE_NOT_WRITEABLE;
+  }
+
+  if (status == 0 && archive_info->compression != COMPRESSION_NONE) {
+    status = archive_update_compressed(archive, id, source, size, skipped);
+    fclose(source);
+
+    return status;
+  }
+
+  struct FileInfo* file_info = archiveinfo_file(archive_info, id);
+  uint64_t common_size = (uint64_t)size < file_info->size ? (uint64_t)size : file_info->size;
+  uint64_t common_blocks = common_size / archive_info->blocksize;
+  uint64_t start = common_blocks * archive_info->blocksize;
+
+  /* Passt die neue Fassung nicht, darf noch kein Block der alten geändert sein */
+  if (status == 0 && archiveinfo_needed_blocks(archive_info, size) > fileinfo_num_blocks(file_info) + archiveinfo_num_free_blocks(archive_info)) {
+    status = ARCHIVE_FILE_TOO_BIG;
+  }
+
+  status == 0 && (status = archive_update_blocks(archive, id, source, common_blocks, archiveinfo_needed_blocks(archive_info, size) - common_blocks, skipped));
+
+  /* Bei gleicher Größe kann auch der Rest hinter dem letzten ganzen Block gleich geblieben sein */
+  if (status == 0 && (uint64_t)size == file_info->size && start < (uint64_t)size) {
+    uint64_t length = size - start;
+    uint64_t known = file_info->hashes == NULL ? 0 : file_info->hashes[common_blocks];
+    char* buffer = malloc(2 * length + 1);
+
+    /* Mit Platz für die Null, die fmemopen ans Ende schreibt */
+    FILE* existing = fmemopen(buffer + length, length + 1, "w");
+
+    bool same = false;
+
+    /* Mit bekanntem Fingerabdruck muss der alte Rest nicht gelesen werden */
+    if (file_read(buffer, 1, length, source) != 0) {
+      status = FILE_NOT_READABLE;
+    } else if (known != 0) {
+      same = block_hash(buffer, length) == known;
+    } else if (archive_read_range(archive, file_info, start, length, existing) != 0 || fflush(existing) != 0) {
+      status = ARCHIVE_NOT_READABLE;
+    } else {
+      same = memcmp(buffer, buffer + length, length) == 0;
+    }
+
+    if (same) {
+      *skipped += length;
+      start = size;
+    } else if (status == 0 && fseek(source, start, SEEK_SET) != 0) {
+      status = FILE_NOT_READABLE;
+    }
+
+    fclose(existing);
+    free(buffer);
+  }
+
+  /* Gleich große Dateien, bei denen alles gleich geblieben ist, sind schon fertig */
+  if (status == 0 && (start < (uint64_t)size || (uint64_t)size != file_info->size)) {
+    status = archive_rewrite(archive, id, start, source, size - start, true);
+  }
+
+  if (source != NULL) {
+    fclose(source);
+  }
+
+  return status;
+}
+
+uint64_t archive_free_bytes (struct Archive* archive) {
+  return archiveinfo_free_bytes(archive->archive_info);
+}
+
+uint64_t archive_used_bytes (struct Archive* archive) {
+  return archiveinfo_used_bytes(archive->archive_info);
+}
+
+/**
+ * Schreibt die freien Bytes nach out. Bei komprimierten Archiven folgt nach
+ * einem Komma, wie viele unkomprimierte Bytes bei der bisherigen Kompression
+ * noch hineinpassen.
+ */
+void archive_print_free (struct Archive* archive, FILE* out) {
+  uint64_t free_bytes = archive_free_bytes(archive);
+  uint64_t logical, stored;
+
+  fprintf(out, "%lu", free_bytes);
+
+  if (archive->archive_info->compression != COMPRESSION_NONE) {
+    archiveinfo_sum_sizes(archive->archive_info, &logical, &stored);
+    fprintf(out, ",%lu", stored == 0 ? free_bytes : (uint64_t)((double)free_bytes * logical / stored));
+  }
+}
+
+/**
+ * Schreibt die belegten Bytes nach out. Bei komprimierten Archiven und
+ * Archiven mit Deduplizierung folgt nach einem Komma die Summe der
+ * Dateigrößen.
+ */
+void archive_print_used (struct Archive* archive, FILE* out) {
+  uint64_t logical, stored;
+
+  fprintf(out, "%lu", archive_used_bytes(archive));
+
+  if (archive->archive_info->compression != COMPRESSION_NONE || archive->archive_info->dedup) {
+    archiveinfo_sum_sizes(archive->archive_info, &logical, &stored);
+    fprintf(out, ",%lu", logical);
+  }
+}
+
+void archive_print_list (struct Archive* archive, FILE* out) {
+  struct ArchiveInfo* archive_info = archive->archive_info;
+
+  uint64_t i;
+  for (i = 0; i < archive_info->num_ids; i++) {
+    struct FileInfo* file_info = archiveinfo_file(archive_info, i);
+
+    if (file_info == NULL) {
+      continue;
+    }
+
+    uint64_t num_blocks = fileinfo_num_blocks(file_info);
+
+    /* Das wird in 2 Aufrufen gemacht, weil für num_blocks sonst komischerweise immer 0 ausgegeben wird */
+    fprintf(out, "%s,%lu,", file_info->name, file_info->size);
+    fprintf(out, "%lu", num_blocks);
+
+    uint64_t j;
+    for (j = 0; j < file_info->num_extents; j++) {
+      uint64_t k;
+      for (k = 0; k < file_info->extents[j].length; k++) {
+        fprintf(out, ",%lu", file_info->extents[j].start + k);
+      }
+    }
+
+    fprintf(out, "\n");
+  }
+}
+
+/**
+ * Eine Datei, die beim Extrahieren geschrieben wird
+ */
+struct ExtractJob {
+  const char* name;
+
+  /**
+   * NULL, wenn es die Datei nicht im Archiv gibt
+   */
+  struct FileInfo* file_info;
+
+  int status;
+};
+
+/**
+ * Gemeinsamer Zustand der Threads beim Extrahieren
+ */
+struct Extract {
+  struct Archive* archive;
+  const char* directory;
+  struct ExtractJob* jobs;
+  uint64_t num_jobs;
+
+  /**
+   * Index des nächsten Auftrags, der noch keinen Thread hat
+   */
+  uint64_t next;
+  pthread_mutex_t lock;
+};
+
+/**
+ * Ordnet Aufträge nach dem ersten Block ihrer Datei.
+ *
+ * @private
+ */
+int extract_job_compare (const void* a, const void* b) {
+  const struct ExtractJob* job_a = a;
+  const struct ExtractJob* job_b = b;
+  uint64_t start_a = job_a->file_info == NULL || job_a->file_info->num_extents == 0 ? 0 : job_a->file_info->extents[0].start;
+  uint64_t start_b = job_b->file_info == NULL || job_b->file_info->num_extents == 0 ? 0 : job_b->file_info->extents[0].start;
+
+  if (start_a < start_b) {
+    return -1;
+  } else if (start_a > start_b) {
+    return 1;
+  } else {
+    return 0;
+  }
+}
+
+/**
+ * Gibt den Pfad zurück, unter dem die Datei name in directory geschrieben
+ * wird, und legt die Verzeichnisse davor an. Namen, die aus directory
+ * herausführen würden, ergeben NULL. Der Pfad muss vom Aufrufer freigegeben
+ * werden.
+ *
+ * @private
+ */
+char* extract_output_path (const char* directory, const char* name) {
+  if (*name == 0 || *name == '/' || strcmp(name, "..") == 0 || strncmp(name, "../", 3) == 0 || strstr(name, "/../") != NULL) {
+    return NULL;
+  } else if (strlen(name) >= 3 && strcmp(name + strlen(name) - 3, "/..") == 0) {
+    return NULL;
+  }
+
+  char* path = malloc(strlen(directory) + 1 + strlen(name) + 1);
+  sprintf(path, "%s/%s", directory, name);
+
+  char* slash;
+  for (slash = strchr(path + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+    *slash = 0;
+    mkdir(path, 0777);
+    *slash = '/';
+  }
+
+  return path;
+}
+
+/**
+ * Schreibt die Datei des Auftrags job in das Zielverzeichnis.
+ *
+ * @private
+ */
+int archive_extract_job (struct Archive* archive, const char* directory, struct ExtractJob* job) {
+  if (job->file_info == NULL) {
+    return ARCHIVE_FILE_NOT_FOUND;
+  }
+
+  char* path = extract_output_path(directory, job->name);
+  FILE* output = path == NULL ? NULL : fopen(path, "w");
+  int status = 0;
+
+  if (output == NULL) {
+    status = FILE_NOT_WRITEABLE;
+  } else {
+    status = archive_read_file(archive, job->file_info, output);
+
+    if (fclose(output) != 0 && status == 0) {
+      status = FILE_NOT_WRITEABLE;
+    }
+  }
+
+  free(path);
+
+  return status;
+}
+
+/**
+ * Nimmt sich so lange den nächsten offenen Auftrag, bis alle vergeben sind.
+ *
+ * @private
+ */
+void* extract_worker (void* argument) {
+  struct Extract* extract = argument;
+
+  while (true) {
+    pthread_mutex_lock(&extract->lock);
+    uint64_t i = extract->next;
+    extract->next += i < extract->num_jobs ? 1 : 0;
+    pthread_mutex_unlock(&extract->lock);
+
+    if (i == extract->num_jobs) {
+      return NULL;
+    }
+
+    extract->jobs[i].status = archive_extract_job(extract->archive, extract->directory, &extract->jobs[i]);
+  }
+}
+
+/**
+ * Schreibt die Dateien der num_jobs Aufträge mit num_threads Threads nach
+ * directory und trägt in jeden Auftrag seinen Status ein. Die Aufträge werden
+ * dafür nach der Position ihrer Dateien im Store sortiert, sodass der Store
+ * möglichst der Reihe nach gelesen wird. Alle Threads lesen über denselben
+ * Dateideskriptor, der Store wird dafür nur zum Lesen geöffnet.
+ *
+ * Das ArchiveInfo muss vorher mit archiveinfo_materialize ausgelesen sein.
+ * Gibt einen Fehler nur zurück, wenn der Store nicht lesbar ist.
+ */
+int archive_extract (struct Archive* archive, const char* directory, struct ExtractJob* jobs, uint64_t num_jobs, int num_threads) {
+  struct Extract extract;
+
+  if (archive->store_fd == -1) {
+    archive->store_fd = open(archive->store_file, O_RDONLY);
+  }
+
+  if (archive_open_store(archive) != 0) {
+    return ARCHIVE_NOT_READABLE;
+  }
+
+  mkdir(directory, 0777);
+  qsort(jobs, num_jobs, sizeof(struct ExtractJob), extract_job_compare);
+
+  extract.archive = archive;
+  extract.directory = directory;
+  extract.jobs = jobs;
+  extract.num_jobs = num_jobs;
+  extract.next = 0;
+  pthread_mutex_init(&extract.lock, NULL);
+
+  pthread_t* threads = malloc(num_threads * sizeof(pthread_t));
+
+  int i;
+  for (i = 1; i < num_threads; i++) {
+    pthread_create(&threads[i], NULL, extract_worker, &extract);
+  }
+
+  extract_worker(&extract);
+
+  for (i = 1; i < num_threads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  free(threads);
+  pthread_mutex_destroy(&extract.lock);
+
+  return 0;
+}
+
+/**
+ * Wie viele Bytes beim Defragmentieren höchstens auf einmal gelesen und
+ * geschrieben werden
+ */
+#define DEFRAG_BUFFER_SIZE (1024 * 1024)
+
+/**
+ * Wie viele Bytes eines Zielbereichs höchstens auf einmal geräumt und gefüllt
+ * werden, bevor die neuen Stellen ins Journal kommen
+ */
+#define DEFRAG_STEP_SIZE (16 * 1024 * 1024)
+
+/**
+ * Liest count Blöcke ab dem Block start aus dem Store in buffer.
+ *
+ * @private
+ */
+int archive_read_blocks (struct Archive* archive, char* buffer, uint64_t start, uint64_t count) {
+  uint64_t blocksize = archive->archive_info->blocksize;
+  struct iovec iov = { buffer, count * blocksize };
+  struct IoRequest request = { false, &iov, 1, start * blocksize };
+
+  return archive_run_requests(archive, &request, 1) == 0 ? 0 : ARCHIVE_NOT_READABLE;
+}
+
+/**
+ * Schreibt count Blöcke aus buffer ab dem Block start in den Store.
+ *
+ * @private
+ */
+int archive_write_blocks (struct Archive* archive, const char* buffer, uint64_t start, uint64_t count) {
+  uint64_t blocksize = archive->archive_info->blocksize;
+  struct iovec iov = { (char*)buffer, count * blocksize };
+  struct IoRequest request = { true, &iov, 1, start * blocksize };
+
+  return archive_run_requests(archive, &request, 1) == 0 ? 0 : ARCHIVE_NOT_WRITEABLE;
+}
+
+/**
+ * Wie viel ein Defragmentieren höchstens tun darf. 0 steht jeweils für
+ * unbegrenzt.
+ */
+struct DefragBudget {
+  uint64_t bytes;
+  double seconds;
+};
+
+/**
+ * Ergebnis eines Defragmentierens
+ */
+struct DefragReport {
+  /**
+   * Geschriebene Bytes
+   */
+  uint64_t moved_bytes;
+
+  /**
+   * Bytes, die das frühere Tauschen benachbarter Blöcke für das ganze Archiv
+   * geschrieben hätte
+   */
+  uint64_t swap_bytes;
+
+  /**
+   * Bytes, die noch verschoben werden müssen, weil das Budget aufgebraucht
+   * war oder kein Platz frei war
+   */
+  uint64_t remaining_bytes;
+};
+
+/**
+ * Gibt die aktuelle Zeit in Sekunden zurück.
+ *
+ * @private
+ */
+double defrag_now () {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/**
+ * Ein Block, der an einen freien Block kopiert wird
+ */
+struct DefragMove {
+  uint64_t from;
+  uint64_t to;
+};
+
+/**
+ * Zustand beim Verschieben der Blöcke während des Defragmentierens
+ */
+struct Defrag {
+  uint64_t blocksize;
+
+  /**
+   * Budget, ab dem nach dem nächsten Journaleintrag aufgehört wird
+   */
+  uint64_t max_bytes;
+  double deadline;
+
+  /**
+   * Puffer für buffer_blocks Blöcke zum Verschieben
+   */
+  char* buffer;
+  uint64_t buffer_blocks;
+
+  /**
+   * Verschiebungen des aktuellen Schritts, höchstens step_blocks
+   */
+  struct DefragMove* moves;
+  uint64_t num_moves;
+  uint64_t step_blocks;
+
+  /**
+   * Für jedes Ziel des aktuellen Schritts, wo sein Block gerade liegt
+   */
+  uint64_t* locations;
+
+  /**
+   * Für jeden Block, wohin er im aktuellen Schritt wandert, oder
+   * FREESPACE_NONE
+   */
+  uint64_t* moved_to;
+
+  /**
+   * Für jeden belegten Block, an welcher Stelle er am Anfang lag, oder
+   * FREESPACE_NONE. Unter dieser Stelle stehen ab owner_starts in owners die
+   * Dateien, die auf ihn verweisen.
+   */
+  uint64_t* identities;
+  uint64_t* owner_starts;
+  uint64_t* owners;
+
+  /**
+   * Marken, damit jede Datei bzw. bei Deduplizierung jeder Block pro Durchlauf
+   * nur einmal zählt
+   */
+  uint64_t* file_stamps;
+  uint64_t* block_stamps;
+  uint64_t stamp;
+
+  /**
+   * Zwischen welchen Blöcken der nächste freie Block für Blöcke gesucht wird,
+   * die im Weg liegen
+   */
+  uint64_t cursor;
+  uint64_t cursor_limit;
+
+  /**
+   * Anzahl der geschriebenen Blöcke
+   */
+  uint64_t moved_blocks;
+};
+
+/**
+ * Bereitet das Verschieben vor.
+ *
+ * @private
+ */
+void defrag_initialize (struct Defrag* defrag, uint64_t blocksize, struct DefragBudget* budget) {
+  defrag->blocksize = blocksize;
+  defrag->max_bytes = budget->bytes;
+  defrag->deadline = budget->seconds > 0 ? defrag_now() + budget->seconds : 0;
+  defrag->buffer_blocks = DEFRAG_BUFFER_SIZE / blocksize;
+  defrag->buffer_blocks = defrag->buffer_blocks == 0 ? 1 : defrag->buffer_blocks;
+  defrag->buffer = malloc(defrag->buffer_blocks * blocksize);
+  defrag->moves = NULL;
+  defrag->num_moves = 0;
+  defrag->step_blocks = DEFRAG_STEP_SIZE / blocksize;
+  defrag->step_blocks = defrag->step_blocks == 0 ? 1 : defrag->step_blocks;
+  defrag->locations = NULL;
+  defrag->moved_to = NULL;
+  defrag->identities = NULL;
+  defrag->owner_starts = NULL;
+  defrag->owners = NULL;
+  defrag->file_stamps = NULL;
+  defrag->block_stamps = NULL;
+  defrag->stamp = 0;
+  defrag->cursor = 0;
+  defrag->cursor_limit = 0;
+  defrag->moved_blocks = 0;
+}
+
+/**
+ * Gibt zurück, ob das Budget aufgebraucht ist.
+ *
+ * @private
+ */
+bool defrag_exhausted (struct Defrag* defrag) {
+  if (defrag->max_bytes > 0 && defrag->moved_blocks * defrag->blocksize >= defrag->max_bytes) {
+    return true;
+  } else {
+    return defrag->deadline > 0 && defrag_now() >= defrag->deadline;
+  }
+}
+
+void defrag_free (struct Defrag* defrag) {
+  free(defrag->buffer);
+  free(defrag->moves);
+  free(defrag->locations);
+  free(defrag->moved_to);
+  free(defrag->identities);
+  free(defrag->owner_starts);
+  free(defrag->owners);
+  free(defrag->file_stamps);
+  free(defrag->block_stamps);
+}
+
+/**
+ * Merkt sich für jeden belegten Block, welche Dateien auf ihn verweisen,
+ * damit beim Verschieben alle ihre Extents angepasst werden können.
+ *
+ * @private
+ */
+void defrag_index_owners (struct Defrag* defrag, struct ArchiveInfo* archive_info) {
+  uint64_t blockcount = archive_info->blockcount;
+
+  defrag->moves = malloc(defrag->step_blocks * sizeof(struct DefragMove));
+  defrag->locations = malloc(defrag->step_blocks * sizeof(uint64_t));
+  defrag->moved_to = malloc(blockcount * sizeof(uint64_t));
+  defrag->identities = malloc(blockcount * sizeof(uint64_t));
+  defrag->owner_starts = calloc(blockcount + 1, sizeof(uint64_t));
+  defrag->file_stamps = calloc(archive_info->num_ids, sizeof(uint64_t));
+  defrag->block_stamps = archive_info->dedup ? calloc(blockcount, sizeof(uint64_t)) : NULL;
+
+  uint64_t i;
+  for (i = 0; i < blockcount; i++) {
+    defrag->moved_to[i] = FREESPACE_NONE;
+    defrag->identities[i] = FREESPACE_NONE;
+  }
+
+  /* Zuerst zählen, dann jede Datei an ihrer Stelle eintragen */
+  int pass;
+  for (pass = 0; pass < 2; pass++) {
+    for (i = 0; i < archive_info->num_ids; i++) {
+      struct FileInfo* file_info = archiveinfo_file(archive_info, i);
+
+      if (file_info == NULL) {
+        continue;
+      }
+
+      uint64_t j;
+      for (j = 0; j < file_info->num_extents; j++) {
+        uint64_t block;
+        for (block = file_info->extents[j].start; block < file_info->extents[j].start + file_info->extents[j].length; block++) {
+          if (pass == 0) {
+            defrag->owner_starts[block + 1]++;
+            defrag->identities[block] = block;
+          } else {
+            defrag->owners[defrag->owner_starts[block]++] = i;
+          }
+        }
+      }
+    }
+
+    if (pass == 0) {
+      for (i = 0; i < blockcount; i++) {
+        defrag->owner_starts[i + 1] += defrag->owner_starts[i];
+      }
+
+      defrag->owners = malloc((defrag->owner_starts[blockcount] + 1) * sizeof(uint64_t));
+    }
+  }
+
+  /* Beim Eintragen ist jeder Anfang bis zum nächsten gewandert */
+  for (i = blockcount; i > 0; i--) {
+    defrag->owner_starts[i] = defrag->owner_starts[i - 1];
+  }
+
+  defrag->owner_starts[0] = 0;
+}
+
+/**
+ * Zählt die Blöcke der Datei, die ab dem Block start ihr Ziel bekommen, und
+ * trägt für jedes Ziel zwischen from und to in locations ein, wo sein Block
+ * gerade liegt. Blöcke vor start teilt die Datei mit einer früheren Datei,
+ * die schon fertig ist.
+ *
+ * @private
+ */
+uint64_t defrag_locate (struct Defrag* defrag, struct FileInfo* file_info, uint64_t start, uint64_t from, uint64_t to) {
+  uint64_t target = start;
+  defrag->stamp++;
+
+  uint64_t i;
+  for (i = 0; i < file_info->num_extents; i++) {
+    uint64_t block;
+    for (block = file_info->extents[i].start; block < file_info->extents[i].start + file_info->extents[i].length; block++) {
+      if (defrag->block_stamps != NULL && (block < start || defrag->block_stamps[block] == defrag->stamp)) {
+        continue;
+      } else if (defrag->block_stamps != NULL) {
+        defrag->block_stamps[block] = defrag->stamp;
+      }
+
+      if (target >= from && target < to) {
+        defrag->locations[target - from] = block;
+      }
+
+      target++;
+    }
+  }
+
+  return target - start;
+}
+
+/**
+ * Sucht einen freien Block für einen Block, der im Weg liegt. Zuerst hinter
+ * den used Blöcken, die am Ende belegt sind, weil er dort nicht noch einmal
+ * im Weg liegen kann, danach zwischen dem Block end und used. Jeder Block wird
+ * pro Schritt nur einmal vergeben. Gibt FREESPACE_NONE zurück, wenn keiner
+ * mehr frei ist.
+ *
+ * @private
+ */
+uint64_t defrag_take_free (struct Defrag* defrag, struct FreeSpace* free_space, uint64_t used, uint64_t end) {
+  uint64_t block = freespace_find(free_space, defrag->cursor, 1);
+  block = block >= defrag->cursor_limit ? FREESPACE_NONE : block;
+
+  if (block == FREESPACE_NONE && defrag->cursor_limit > used) {
+    defrag->cursor_limit = used;
+    block = freespace_find(free_space, end, 1);
+    block = block >= used ? FREESPACE_NONE : block;
+  }
+
+  if (block != FREESPACE_NONE) {
+    defrag->cursor = block + 1;
+  }
+
+  return block;
+}
+
+/**
+ * Kopiert die Blöcke der gesammelten Verschiebungen an ihre neuen Stellen,
+ * trägt sie in allen Dateien ein, die darauf verweisen, und hält deren
+ * Extents im Journal fest. Aufeinanderfolgende Blöcke werden am Stück
+ * gelesen und geschrieben. Weil nur in freie Blöcke geschrieben wird, liegt
+ * bis zum Journaleintrag jeder Block noch an der Stelle, an der ihn die
+ * gespeicherte Struktur sucht.
+ *
+ * @private
+ */
+int archive_defrag_move (struct Archive* archive, struct Defrag* defrag) {
+  struct ArchiveInfo* archive_info = archive->archive_info;
+  struct DefragMove* moves = defrag->moves;
+  uint64_t num_moves = defrag->num_moves;
+  int status = 0;
+
+  defrag->num_moves = 0;
+
+  uint64_t i = 0;
+  while (i < num_moves && status == 0) {
+    uint64_t count = 1;
+
+    while (i + count < num_moves && count < defrag->buffer_blocks && moves[i + count].from == moves[i].from + count && moves[i + count].to == moves[i].to + count) {
+      count++;
+    }
+
+    status = archive_read_blocks(archive, defrag->buffer, moves[i].from, count);
+    status == 0 && (status = archive_write_blocks(archive, defrag->buffer, moves[i].to, count));
+
+    struct Extent extent = { moves[i].from, count };
+    archive_queue_holes(archive, &extent, 1);
+
+    i += count;
+  }
+
+  if (status != 0 || num_moves == 0) {
+    return status;
+  }
+
+  struct Buffer* touched = buffer_create();
+  uint64_t* hashes = archive_info->dedup ? malloc(num_moves * sizeof(uint64_t)) : NULL;
+  defrag->stamp++;
+
+  for (i = 0; i < num_moves; i++) {
+    uint64_t identity = defrag->identities[moves[i].from];
+    defrag->moved_to[moves[i].from] = moves[i].to;
+
+    if (hashes != NULL) {
+      hashes[i] = archive_info->block_hashes[moves[i].from];
+    }
+
+    uint64_t j;
+    for (j = defrag->owner_starts[identity]; j < defrag->owner_starts[identity + 1]; j++) {
+      uint64_t id = defrag->owners[j];
+
+      if (defrag->file_stamps[id] != defrag->stamp) {
+        defrag->file_stamps[id] = defrag->stamp;
+        buffer_append(touched, &id, sizeof(uint64_t));
+      }
+    }
+  }
+
+  uint64_t* ids = (uint64_t*)touched->data;
+  uint64_t num_ids = touched->length / sizeof(uint64_t);
+  struct FileInfo* relocated = fileinfo_create();
+
+  for (i = 0; i < num_ids; i++) {
+    struct FileInfo* file_info = archiveinfo_file(archive_info, ids[i]);
+    relocated->num_extents = 0;
+
+    uint64_t j;
+    for (j = 0; j < file_info->num_extents; j++) {
+      uint64_t block;
+      for (block = file_info->extents[j].start; block < file_info->extents[j].start + file_info->extents[j].length; block++) {
+        fileinfo_append_extent(relocated, defrag->moved_to[block] == FREESPACE_NONE ? block : defrag->moved_to[block], 1);
+      }
+    }
+
+    archiveinfo_set_extents(archive_info, ids[i], relocated->extents, relocated->num_extents);
+  }
+
+  /* Erst jetzt, weil die alten Blöcke ihren Fingerabdruck beim Freigeben vergessen */
+  for (i = 0; i < num_moves; i++) {
+    if (hashes != NULL && hashes[i] != 0) {
+      archiveinfo_remember_block(archive_info, moves[i].to, hashes[i]);
+    }
+
+    defrag->identities[moves[i].to] = defrag->identities[moves[i].from];
+    defrag->identities[moves[i].from] = FREESPACE_NONE;
+    defrag->moved_to[moves[i].from] = FREESPACE_NONE;
+  }
+
+  struct Buffer* records = buffer_create();
+
+  for (i = 0; i < num_ids; i++) {
+    archiveinfo_journal_extents(archive_info, records, ids[i]);
+  }
+
+  status = archive_append_journal(archive, records);
+  defrag->moved_blocks += num_moves;
+
+  buffer_free(records);
+  fileinfo_free(relocated);
+  buffer_free(touched);
+  free(hashes);
+
+  return status;
+}
+
+/**
+ * Bringt die Blöcke der Datei id, deren Ziele zwischen from und *to liegen,
+ * an ihr Ziel. Ihr Zielbereich beginnt beim Block start, davor ist schon
+ * alles fertig. Was im Weg liegt, wird zuerst in freie Blöcke außerhalb
+ * kopiert und eingetragen, danach kommen die Blöcke der Datei in die so frei
+ * gewordenen Ziele. Gibt es nicht für alles, was im Weg liegt, einen freien
+ * Block, endet der Schritt früher und *to wird entsprechend kleiner.
+ *
+ * @private
+ */
+int archive_defrag_step (struct Archive* archive, struct Defrag* defrag, uint64_t id, uint64_t start, uint64_t from, uint64_t* to, uint64_t used) {
+  struct ArchiveInfo* archive_info = archive->archive_info;
+  struct FileInfo* file_info = archiveinfo_file(archive_info, id);
+  int status = 0;
+
+  defrag_locate(defrag, file_info, start, from, *to);
+  defrag->cursor = used;
+  defrag->cursor_limit = archive_info->blockcount;
+
+  uint64_t position;
+  for (position = from; position < *to; position++) {
+    if (freespace_is_free(archive_info->free_space, position) || defrag->locations[position - from] == position) {
+      continue;
+    }
+
+    uint64_t block = defrag_take_free(defrag, archive_info->free_space, used, *to);
+
+    if (block == FREESPACE_NONE) {
+      break;
+    }
+
+    defrag->moves[defrag->num_moves].from = position;
+    defrag->moves[defrag->num_moves].to = block;
+    defrag->num_moves++;
+  }
+
+  *to = position;
+  status = archive_defrag_move(archive, defrag);
+
+  if (status == 0) {
+    defrag_locate(defrag, file_info, start, from, *to);
+
+    for (position = from; position < *to; position++) {
+      if (defrag->locations[position - from] != position) {
+        defrag->moves[defrag->num_moves].from = defrag->locations[position - from];
+        defrag->moves[defrag->num_moves].to = position;
+        defrag->num_moves++;
+      }
+    }
+
+    status = archive_defrag_move(archive, defrag);
+  }
+
+  return status;
+}
+
+/**
+ * Schiebt alle Dateien an den Anfang des Archivs, sodass jede Datei am Stück
+ * liegt. Die Dateien kommen nach ihrer ID sortiert dran, jeweils in
+ * Schritten von höchstens DEFRAG_STEP_SIZE Bytes. Geschrieben wird nur in
+ * Blöcke, auf die weder die Struktur noch das Journal verweist, und jede
+ * Verschiebung steht im Journal, bevor ihr alter Block wieder beschrieben
+ * wird. Wird der Prozess abgebrochen, sind so alle Dateien vollständig, und
+ * der nächste Aufruf macht weiter.
+ *
+ * Liegt ein Block im Weg, für den es keinen freien Block mehr gibt, wird dort
+ * aufgehört. Ist das Budget aufgebraucht, wird nach dem aktuellen Schritt
+ * aufgehört. Weil das Ziel jedes Blocks nur von der Reihenfolge der Dateien
+ * abhängt, macht der nächste Aufruf dort weiter. Nach einem Lese- oder
+ * Schreibfehler bleibt eingetragen, was bis dahin angekommen ist, und der
+ * Fehler wird zurückgegeben. Sonst wird am Ende die Struktur neu geschrieben.
+ */
+int archive_defrag (struct Archive* archive, struct DefragBudget* budget, struct DefragReport* report) {
+  int status = 0;
+  struct ArchiveInfo* archive_info = archive->archive_info;
+
+  if (archive_open_store(archive) != 0) {
+    return ARCHIVE_NOT_READABLE;
+  }
+
+  struct Defrag defrag;
+  uint64_t used;
+
+  report->swap_bytes = archiveinfo_swap_defrag_bytes(archive_info);
+  free(archiveinfo_defrag_sources(archive_info, &used));
+
+  defrag_initialize(&defrag, archive_info->blocksize, budget);
+  defrag_index_owners(&defrag, archive_info);
+
+  uint64_t start = 0;
+  bool stopped = false;
+
+  uint64_t id;
+  for (id = 0; id < archive_info->num_ids && status == 0 && !stopped; id++) {
+    struct FileInfo* file_info = archiveinfo_file(archive_info, id);
+
+    if (file_info == NULL) {
+      continue;
+    }
+
+    uint64_t end = start + defrag_locate(&defrag, file_info, start, start, start);
+    uint64_t from = start;
+
+    while (from < end && status == 0 && !stopped) {
+      uint64_t to = end - from > defrag.step_blocks ? from + defrag.step_blocks : end;
+
+      stopped = defrag_exhausted(&defrag);
+      stopped || (status = archive_defrag_step(archive, &defrag, id, start, from, &to, used));
+      stopped = stopped || to == from;
+
+      from = to;
+    }
+
+    start = end;
+  }
+
+  report->moved_bytes = defrag.moved_blocks * archive_info->blocksize;
+  report->remaining_bytes = 0;
+
+  int64_t* sources = archiveinfo_defrag_sources(archive_info, &used);
+
+  uint64_t i;
+  for (i = 0; i < used; i++) {
+    if (sources[i] != -1) {
+      report->remaining_bytes += archive_info->blocksize;
+    }
+  }
+
+  free(sources);
+
+  /* Alles steht schon im Journal, die Struktur fasst es nur zusammen */
+  status == 0 && (status = archive_write_archive_info(archive));
+
+  if (status == 0) {
+    archive_punch_holes(archive);
+  } else {
+    buffer_clear(archive->freed_extents);
+  }
+
+  defrag_free(&defrag);
+
+  return status;
+}
+
+/**
+ * Kopiert die Blöcke einer Datei der Reihe nach an den Block start.
+ *
+ * @private
+ */
+int archive_copy_file_blocks (struct Archive* archive, struct Defrag* defrag, struct FileInfo* file_info, uint64_t start) {
+  int status = 0;
+  uint64_t position = start;
+
+  uint64_t i;
+  for (i = 0; i < file_info->num_extents && status == 0; i++) {
+    uint64_t done = 0;
+
+    while (done < file_info->extents[i].length && status == 0) {
+      uint64_t count = file_info->extents[i].length - done;
+      count = count > defrag->buffer_blocks ? defrag->buffer_blocks : count;
+
+      status = archive_read_blocks(archive, defrag->buffer, file_info->extents[i].start + done, count);
+      status == 0 && (status = archive_write_blocks(archive, defrag->buffer, position, count));
+
+      done += count;
+      position += count;
+    }
+  }
+
+  return status;
+}
+
+/**
+ * Defragmentiert nur die Dateien names. Jede wird am Stück in den ersten
+ * ausreichend großen freien Bereich kopiert und ihre neuen Extents werden im
+ * Journal festgehalten, bevor die alten Blöcke frei werden. Dateien, für die
+ * es keinen solchen Bereich gibt, bleiben, wie sie sind.
+ */
+int archive_defrag_files (struct Archive* archive, const char** names, uint64_t num_names, struct DefragBudget* budget, struct DefragReport* report) {
+  int status = 0;
+  struct ArchiveInfo* archive_info = archive->archive_info;
+
+  uint64_t i;
+  for (i = 0; i < num_names; i++) {
+    if (!archiveinfo_has_file(archive_info, names[i])) {
+      return ARCHIVE_FILE_NOT_FOUND;
+    }
+  }
+
+  if (archive_open_store(archive) != 0) {
+    return ARCHIVE_NOT_READABLE;
+  }
+
+  struct Defrag defrag;
+  defrag_initialize(&defrag, archive_info->blocksize, budget);
+
+  report->swap_bytes = archiveinfo_swap_defrag_bytes(archive_info);
+  report->remaining_bytes = 0;
+
+  for (i = 0; i < num_names && status == 0; i++) {
+    int64_t id = archiveinfo_get_file_index(archive_info, names[i]);
+    struct FileInfo* file_info = archiveinfo_file(archive_info, id);
+    uint64_t num_blocks = fileinfo_num_blocks(file_info);
+
+    if (file_info->num_extents <= 1) {
+      continue;
+    }
+
+    struct Extent extent;
+    extent.start = defrag_exhausted(&defrag) ? FREESPACE_NONE : freespace_find(archive_info->free_space, 0, num_blocks);
+    extent.length = num_blocks;
+
+    if (extent.start == FREESPACE_NONE) {
+      report->remaining_bytes += num_blocks * archive_info->blocksize;
+      continue;
+    }
+
+    status = archive_copy_file_blocks(archive, &defrag, file_info, extent.start);
+
+    if (status == 0) {
+      defrag.moved_blocks += num_blocks;
+
+      archive_queue_holes(archive, file_info->extents, file_info->num_extents);
+      archiveinfo_set_extents(archive_info, id, &extent, 1);
+      status = archive_journal_extents(archive, id);
+    }
+
+    if (status != 0) {
+      buffer_clear(archive->freed_extents);
+    } else if (archive->deferred_journal == NULL) {
+      archive_punch_holes(archive);
+    }
+  }
+
+  report->moved_bytes = defrag.moved_blocks * archive_info->blocksize;
+
+  defrag_free(&defrag);
+
+  return status;
+}
+
+/**
+ * Verschiebt alle belegten Blöcke ab dem Block blockcount in freie Blöcke
+ * davor. Die Reihenfolge der Blöcke jeder Datei bleibt erhalten.
+ *
+ * @private
+ */
+int archive_relocate_tail (struct Archive* archive, uint64_t blockcount) {
+  struct ArchiveInfo* archive_info = archive->archive_info;
+  struct FreeSpace* free_space = archive_info->free_space;
+  uint64_t tail_free = 0;
+  uint64_t start = freespace_find(free_space, blockcount, 1);
+
+  while (start != FREESPACE_NONE) {
+    uint64_t end = freespace_run_end(free_space, start);
+    tail_free += end - start;
+    start = freespace_find(free_space, end, 1);
+  }
+
+  if (free_space->num_free - tail_free < archive_info->blockcount - blockcount - tail_free) {
+    return ARCHIVE_TOO_SMALL;
+  }
+
+  if (archive_info->blockcount - blockcount == tail_free) {
+    return 0;
+  }
+
+  if (archive_open_store(archive) != 0) {
+    return ARCHIVE_NOT_WRITEABLE;
+  }
+
+  int status = 0;
+  struct DefragBudget budget = { 0, 0 };
+  struct Defrag defrag;
+  defrag_initialize(&defrag, archive_info->blocksize, &budget);
+
+  /* Der Rest gilt als belegt, damit nur Blöcke vor blockcount gefunden werden */
+  freespace_allocate(free_space, blockcount, archive_info->blockcount - blockcount);
+
+  struct FileInfo* relocated = fileinfo_create();
+
+  /* Bei Deduplizierung wird jeder Block nur einmal kopiert, weitere Verweise zeigen auf seine Kopie */
+  uint64_t* moved = NULL;
+
+  if (archive_info->dedup) {
+    moved = malloc((archive_info->blockcount - blockcount) * sizeof(uint64_t));
+
+    uint64_t i;
+    for (i = 0; i < archive_info->blockcount - blockcount; i++) {
+      moved[i] = FREESPACE_NONE;
+    }
+  }
+
+  uint64_t id;
+  for (id = 0; id < archive_info->num_ids && status == 0; id++) {
+    struct FileInfo* file_info = archiveinfo_file(archive_info, id);
+
+    if (file_info == NULL) {
+      continue;
+    }
+
+    bool in_tail = false;
+    relocated->num_extents = 0;
+
+    uint64_t i;
+    for (i = 0; i < file_info->num_extents && status == 0; i++) {
+      struct Extent extent = file_info->extents[i];
+
+      while (extent.length > 0 && status == 0 && extent.start < blockcount) {
+        uint64_t length = blockcount - extent.start < extent.length ? blockcount - extent.start : extent.length;
+        fileinfo_append_extent(relocated, extent.start, length);
+
+        extent.start += length;
+        extent.length -= length;
+      }
+
+      while (extent.length > 0 && status == 0) {
+        if (moved != NULL && moved[extent.start - blockcount] != FREESPACE_NONE) {
+          fileinfo_append_extent(relocated, moved[extent.start - blockcount], 1);
+
+          extent.start++;
+          extent.length--;
+          in_tail = true;
+          continue;
+        }
+
+        uint64_t target = freespace_find(free_space, 0, 1);
+        uint64_t end = freespace_run_end(free_space, target);
+        uint64_t count = end - target;
+
+        count = count > extent.length ? extent.length : count;
+        count = count > defrag.buffer_blocks ? defrag.buffer_blocks : count;
+
+        uint64_t j;
+        for (j = 1; j < count && moved != NULL; j++) {
+          if (moved[extent.start + j - blockcount] != FREESPACE_NONE) {
+            count = j;
+          }
+        }
+
+        status = archive_read_blocks(archive, defrag.buffer, extent.start, count);
+        status == 0 && (status = archive_write_blocks(archive, defrag.buffer, target, count));
+
+        freespace_allocate(free_space, target, count);
+        fileinfo_append_extent(relocated, target, count);
+
+        for (j = 0; j < count && moved != NULL; j++) {
+          uint64_t hash = archive_info->block_hashes[extent.start + j];
+          moved[extent.start + j - blockcount] = target + j;
+
+          if (hash != 0) {
+            archiveinfo_forget_block(archive_info, extent.start + j);
+            archiveinfo_remember_block(archive_info, target + j, hash);
+          }
+        }
+
+        extent.start += count;
+        extent.length -= count;
+        in_tail = true;
+      }
+    }
+
+    if (in_tail && status == 0) {
+      archiveinfo_set_extents(archive_info, id, relocated->extents, relocated->num_extents);
+      freespace_allocate(free_space, blockcount, archive_info->blockcount - blockcount);
+    }
+  }
+
+  fileinfo_free(relocated);
+  defrag_free(&defrag);
+  free(moved);
+
+  return status;
+}
+
+/**
+ * Ändert die Anzahl der Blöcke des Archivs auf blockcount. Beim Vergrößern
+ * wird nur der Store verlängert und die Struktur neu geschrieben. Beim
+ * Verkleinern werden vorher die belegten Blöcke hinter dem neuen Ende nach
+ * vorne kopiert; erst wenn die Struktur auf die Kopien zeigt, wird der Store
+ * gekürzt.
+ */
+int archive_resize (struct Archive* archive, uint64_t blockcount) {
+  struct ArchiveInfo* archive_info = archive->archive_info;
+  uint64_t old_blockcount = archive_info->blockcount;
+  int status = 0;
+
+  if (blockcount == old_blockcount) {
+    return 0;
+  } else if (blockcount > old_blockcount) {
+    status = archive_resize_store(archive, old_blockcount, blockcount);
+  } else {
+    status = archive_relocate_tail(archive, blockcount);
+  }
+
+  if (status == 0) {
+    archiveinfo_resize(archive_info, blockcount);
+    status = archive_write_archive_info(archive);
+  }
+
+  if (status == 0 && blockcount < old_blockcount) {
+    status = archive_resize_store(archive, old_blockcount, blockcount);
+  }
+
+  return status;
+}
+
+/**
+ * Erzeugt die beiden speziellen Pfade aus dem allgemeinen Archivpfad.
+ *
+ * @private
+ */
+void archive_initialize_paths (struct Archive* archive, const char* archive_path) {
+  archive->structure_file = malloc((strlen(archive_path) + 10 + 1) * sizeof(char));
+  archive->store_file = malloc((strlen(archive_path) + 6 + 1) * sizeof(char));
+  archive->journal_file = malloc((strlen(archive_path) + 8 + 1) * sizeof(char));
+
+  sprintf(archive->structure_file, "%s.structure", archive_path);
+  sprintf(archive->store_file, "%s.store", archive_path);
+  sprintf(archive->journal_file, "%s.journal", archive_path);
+}
+
+/**
+ * Wartet, bis alles, was bisher in den Store geschrieben wurde, auf der
+ * Platte ist. Erst danach dürfen Struktur oder Journal auf neue Blöcke
+ * verweisen, sonst zeigen sie nach einem Stromausfall auf alte Daten.
+ *
+ * @private
+ */
+int archive_sync_store (struct Archive* archive) {
+  if (archive->store_fd != -1 && fdatasync(archive->store_fd) != 0 && errno != EINVAL) {
+    return ARCHIVE_NOT_WRITEABLE;
+  }
+
+  return 0;
+}
+
+/**
+ * Schreibt die Einträge des Verzeichnisses, in dem path liegt, auf die
+ * Platte, damit ein Umbenennen oder neu angelegte Dateien einen Stromausfall
+ * überstehen. Manche Dateisysteme können das nicht, dann bleibt es beim
+ * Versuch.
+ *
+ * @private
+ */
+void archive_sync_directory (const char* path) {
+  char* directory = strdup(path);
+  char* slash = strrchr(directory, '/');
+
+  if (slash == NULL) {
+    strcpy(directory, ".");
+  } else {
+    slash[slash == directory ? 1 : 0] = 0;
+  }
+
+  int fd = open(directory, O_RDONLY | O_DIRECTORY);
+
+  if (fd != -1) {
+    fsync(fd);
+    close(fd);
+  }
+
+  free(directory);
+}
+
+/**
+ * Schreibt die Strukturdatei neu und leert das Journal.
+ *
+ * Die neue Struktur wird zuerst in eine temporäre Datei geschrieben und dann
+ * umbenannt. Weil sie eine neue Generation bekommt, wird ein Journal, das
+ * danach nicht mehr geleert werden konnte, beim Laden ignoriert. Vorher
+ * müssen der Store und die temporäre Datei auf der Platte sein, danach das
+ * Verzeichnis mit der umbenannten Struktur und dem neuen Journal.
+ *
+ * @private
+ */
+int archive_write_archive_info (struct Archive* archive) {
+  char* temp_file = malloc(strlen(archive->structure_file) + 4 + 1);
+  sprintf(temp_file, "%s.tmp", archive->structure_file);
+
+  int status = archive_sync_store(archive);
+  FILE* structure_file = status == 0 ? fopen(temp_file, "w") : NULL;
+
+  if (structure_file == NULL) {
+    status = ARCHIVE_NOT_WRITEABLE;
+  } else {
+    archive->archive_info->generation++;
+
+    status = archiveinfo_write(archive->archive_info, structure_file);
+    archive->structure_size = ftell(structure_file);
+
+    if (status == 0 && (fflush(structure_file) != 0 || fsync(fileno(structure_file)) != 0)) {
+      status = ARCHIVE_NOT_WRITEABLE;
+    }
+
+    if (fclose(structure_file) != 0 || status != 0 || rename(temp_file, archive->structure_file) != 0) {
+      status = ARCHIVE_NOT_WRITEABLE;
+      remove(temp_file);
+    }
+  }
+
+  free(temp_file);
+
+  if (status == 0) {
+    FILE* journal = fopen(archive->journal_file, "w");
+    archive->journal_size = 0;
+
+    if (journal != NULL) {
+      uint64_t generation = archive->archive_info->generation;
+
+      if (file_write(JOURNAL_MAGIC, sizeof(char), 8, journal) == 0 && file_write(&generation, sizeof(uint64_t), 1, journal) == 0) {
+        archive->journal_size = JOURNAL_HEADER_SIZE;
+      }
+
+      if (fclose(journal) != 0) {
+        archive->journal_size = 0;
+      }
+    }
+
+    archive_sync_directory(archive->structure_file);
+  }
+
+  return status; 
+}
+
+/**
+ * Liest das Journal und spielt es auf die geladene Struktur ab. Ein fehlendes
+ * oder veraltetes Journal wird ignoriert, ein unvollständiger letzter Eintrag
+ * abgeschnitten.
+ *
+ * @private
+ */
+int archive_load_journal (struct Archive* archive) {
+  FILE* journal = fopen(archive->journal_file, "r");
+
+  archive->journal_size = 0;
+
+  if (journal != NULL) {
+    long int size = file_size(journal);
+    char header[JOURNAL_HEADER_SIZE];
+    uint64_t generation;
+
+    if (size >= JOURNAL_HEADER_SIZE && file_read(header, sizeof(char), JOURNAL_HEADER_SIZE, journal) == 0) {
+      memcpy(&generation, header + 8, sizeof(uint64_t));
+
+      if (memcmp(header, JOURNAL_MAGIC, 8) == 0 && generation == archive->archive_info->generation) {
+        uint64_t length = size - JOURNAL_HEADER_SIZE;
+        char* data = malloc(length);
+
+        if (file_read(data, sizeof(char), length, journal) == 0) {
+          uint64_t valid = archiveinfo_replay_journal(archive->archive_info, data, length);
+          archive->journal_size = JOURNAL_HEADER_SIZE + valid;
+
+          if (valid < length && truncate(archive->journal_file, archive->journal_size) != 0) {
+            archive->journal_size = 0;
+          }
+        }
+
+        free(data);
+      }
+    }
+
+    fclose(journal);
+  }
+
+  return 0;
+}
+
+/**
+ * Hängt die Einträge in records an das Journal an. Ist das Journal größer als
+ * die Struktur selbst geworden, wird es in die Struktur übernommen. Die
+ * Einträge sind auf der Platte, wenn die Funktion zurückkehrt.
+ *
+ * @private
+ */
+int archive_append_journal (struct Archive* archive, struct Buffer* records) {
+  if (archive->deferred_journal != NULL) {
+    buffer_append(archive->deferred_journal, records->data, records->length);
+
+    return 0;
+  } else if (archive->journal_size == 0) {
+    return archive_write_archive_info(archive);
+  }
+
+  /* Erst die Blöcke, auf die die Einträge verweisen, dann die Einträge selbst */
+  int status = archive_sync_store(archive);
+  FILE* journal = status == 0 ? fopen(archive->journal_file, "a") : NULL;
+
+  if (journal == NULL) {
+    status = ARCHIVE_NOT_WRITEABLE;
+  } else {
+    if (file_write(records->data, sizeof(char), records->length, journal) != 0 || fflush(journal) != 0 || fdatasync(fileno(journal)) != 0) {
+      status = ARCHIVE_NOT_WRITEABLE;
+    }
+
+    if (fclose(journal) != 0) {
+      status = ARCHIVE_NOT_WRITEABLE;
+    }
+  }
+
+  if (status == 0) {
+    archive->journal_size += records->length;
+
+    if (archive->journal_size > JOURNAL_CHECKPOINT_SIZE && archive->journal_size > archive->structure_size) {
+      status = archive_write_archive_info(archive);
+    }
+  } else {
+    /* Der Stand im Speicher ist weiter als das Journal, also alles schreiben */
+    status = archive_write_archive_info(archive);
+  }
+
+  return status;
+}
+
+/**
+ * Sammelt alle folgenden Journaleinträge im Speicher, bis sie mit
+ * archive_flush_journal geschrieben werden. Was bis dahin hinzugefügt wurde,
+ * geht bei einem Absturz verloren.
+ */
+void archive_defer_journal (struct Archive* archive) {
+  if (archive->deferred_journal == NULL) {
+    archive->deferred_journal = buffer_create();
+  }
+}
+
+/**
+ * Schreibt die gesammelten Journaleinträge auf einmal.
+ */
+int archive_flush_journal (struct Archive* archive) {
+  struct Buffer* records = archive->deferred_journal;
+  int status = 0;
+
+  if (records != NULL && records->length > 0) {
+    archive->deferred_journal = NULL;
+    status = archive_append_journal(archive, records);
+    archive->deferred_journal = records;
+
+    buffer_clear(records);
+  }
+
+  if (status == 0) {
+    archive_punch_holes(archive);
+  } else {
+    buffer_clear(archive->freed_extents);
+  }
+
+  return status;
+}
+
+/**
+ * Hält das Hinzufügen der Datei id im Journal fest.
+ *
+ * @private
+ */
+int archive_journal_add (struct Archive* archive, uint64_t id) {
+  struct Buffer* records = buffer_create();
+  archiveinfo_journal_add(archive->archive_info, records, id);
+
+  int status = archive_append_journal(archive, records);
+  buffer_free(records);
+
+  return status;
+}
+
+/**
+ * Hält das Löschen der Datei id im Journal fest.
+ *
+ * @private
+ */
+int archive_journal_delete (struct Archive* archive, uint64_t id) {
+  struct Buffer* records = buffer_create();
+  archiveinfo_journal_delete(archive->archive_info, records, id);
+
+  int status = archive_append_journal(archive, records);
+  buffer_free(records);
+
+  return status;
+}
+
+/**
+ * Hält die neuen Extents der Datei id im Journal fest.
+ *
+ * @private
+ */
+int archive_journal_extents (struct Archive* archive, uint64_t id) {
+  struct Buffer* records = buffer_create();
+  archiveinfo_journal_extents(archive->archive_info, records, id);
+
+  int status = archive_append_journal(archive, records);
+  buffer_free(records);
+
+  return status;
+}
+
+/**
+ * Vergisst bis zu count Fingerabdrücke der Datei id ab dem Index first,
+ * bevor ihre Bytes dort an Ort und Stelle überschrieben werden. Waren welche
+ * bekannt, kommt das sofort ins Journal, im Stapelbetrieb zusammen mit allem,
+ * was bis dahin gesammelt wurde, damit nach einem Absturz kein Fingerabdruck
+ * zu anderen Bytes gehört.
+ *
+ * @private
+ */
+int archive_forget_hashes (struct Archive* archive, uint64_t id, uint64_t first, uint64_t count) {
+  struct ArchiveInfo* archive_info = archive->archive_info;
+  struct FileInfo* file_info = archiveinfo_file(archive_info, id);
+  uint64_t num_hashes = archiveinfo_num_hashes(archive_info, file_info->size);
+  bool known = false;
+
+  count = first < num_hashes && count > num_hashes - first ? num_hashes - first : count;
+
+  uint64_t i;
+  for (i = first; i < num_hashes && i - first < count && file_info->hashes != NULL && !known; i++) {
+    known = file_info->hashes[i] != 0;
+  }
+
+  if (!known) {
+    return 0;
+  }
+
+  memset(file_info->hashes + first, 0, count * sizeof(uint64_t));
+
+  struct Buffer* deferred = archive->deferred_journal;
+  struct Buffer* records = deferred == NULL ? buffer_create() : deferred;
+
+  archiveinfo_journal_hashes(archive_info, records, id, first, count);
+
+  archive->deferred_journal = NULL;
+  int status = archive_append_journal(archive, records);
+  archive->deferred_journal = deferred;
+
+  if (deferred == NULL) {
+    buffer_free(records);
+  } else {
+    buffer_clear(deferred);
+  }
+
+  return status;
+}
+
+/**
+ * Hält count Fingerabdrücke der Datei id ab dem Index first im Journal fest.
+ *
+ * @private
+ */
+int archive_journal_hashes (struct Archive* archive, uint64_t id, uint64_t first, uint64_t count) {
+  struct Buffer* records = buffer_create();
+  archiveinfo_journal_hashes(archive->archive_info, records, id, first, count);
+
+  int status = archive_append_journal(archive, records);
+  buffer_free(records);
+
+  return status;
+}
+
+/**
+ * Initialisiert einen leeren Datenstore in eine nicht existente Datei.
+ *
+ * @private
+ */
+int archive_initialize_store (struct Archive* archive) {
+  archive->store_fd = open(archive->store_file, O_RDWR | O_CREAT | O_TRUNC, 0666);
+
+  if (archive->store_fd == -1) {
+    return ARCHIVE_NOT_WRITEABLE;
+  }
+
+  return archive_resize_store(archive, 0, archive->archive_info->blockcount);
+}
+
+/**
+ * Bringt den Store von old_blockcount auf blockcount Blöcke. Dazu wird die
+ * Datei nur gekürzt oder verlängert, sodass neue Blöcke ohne Schreiben als
+ * Loch entstehen. Ist preallocate gesetzt, werden sie mit posix_fallocate
+ * reserviert.
+ *
+ * @private
+ */
+int archive_resize_store (struct Archive* archive, uint64_t old_blockcount, uint64_t blockcount) {
+  uint64_t blocksize = archive->archive_info->blocksize;
+  int status = archive_open_store(archive);
+
+  if (status == 0 && ftruncate(archive->store_fd, blockcount * blocksize) != 0) {
+    status = ARCHIVE_NOT_WRITEABLE;
+  }
+
+  if (status == 0 && archive->preallocate && blockcount > old_blockcount) {
+    uint64_t start = old_blockcount * blocksize;
+
+    if (posix_fallocate(archive->store_fd, start, blockcount * blocksize - start) != 0) {
+      status = ARCHIVE_NOT_WRITEABLE;
+    }
+  }
+
+  return status;
+}
+
+/**
+ * Gibt alle belegten Resourcen frei.
+ */
+void archive_free (struct Archive* archive) {
+  archiveinfo_free(archive->archive_info);
+
+  if (archive->deferred_journal != NULL) {
+    buffer_free(archive->deferred_journal);
+  }
+
+  buffer_free(archive->freed_extents);
+
+  if (archive->uring != NULL) {
+    uring_free(archive->uring);
+  }
+
+  if (archive->store_fd != -1) {
+    close(archive->store_fd);
+  }
+
+  free(archive->structure_file);
+  free(archive->store_file);
+  free(archive->journal_file);
+  free(archive);
+}
+
+int cli_create (const char* archive_path, uint64_t blocksize, uint64_t blockcount, bool preallocate, int compression, bool dedup) {
+  int status = 0;
+
+  struct Archive* archive = archive_create();
+  archive->preallocate = preallocate;
+  archive->archive_info->compression = compression;
+  archive->archive_info->dedup = dedup;
+  status = archive_initialize_empty(archive, archive_path, blocksize, blockcount);
+  archive_free(archive);
+
+  switch (status) {
+    case ARCHIVE_NOT_WRITEABLE:
+      printf("Das Archiv ist nicht beschreibbar");
+      return 1;
+    case ARCHIVE_ALREADY_EXISTS:
+      printf("Es existiert bereits ein Archiv mit dem selben Namen");
+      return 3;
+    default:
+      return 0;
+  }
+}
+
+/**
+ * Schreibt eine Meldung nach out, falls out nicht NULL ist.
+ *
+ * @private
+ */
+void cli_message (FILE* out, const char* format, ...) {
+  if (out != NULL) {
+    va_list arguments;
+    va_start(arguments, format);
+    vfprintf(out, format, arguments);
+    va_end(arguments);
+  }
+}
+
+/**
+ * Gibt den Exit-Code von add zum Status status zurück und schreibt die
+ * passende Meldung nach out, falls out nicht NULL ist.
+ */
+int cli_add_status (int status, const char* source_path, const char* target, FILE* out) {
+  switch (status) {
+    case ARCHIVE_NOT_READABLE:
+      cli_message(out, "Das Archiv ist nicht lesbar");
+      return 2;
+    case ARCHIVE_NOT_WRITEABLE:
+      cli_message(out, "Das Archiv ist nicht beschreibbar");
+      return 2;
+    case ARCHIVE_FILE_ALREADY_EXISTS:
+      cli_message(out, "Eine Datei mit dem Namen %s existiert bereits", target);
+      return 11;
+    case ARCHIVE_FILE_TOO_BIG:
+      cli_message(out, "Die Datei %s passt nicht mehr in das Archiv", target);
+      return 12;
+    case FILE_NOT_READABLE:
+      cli_message(out, "Die Datei %s ist nicht lesbar", source_path);
+      return 13;
+    case ARCHIVE_FILE_NOT_FOUND:
+      cli_message(out, "Die Datei %s ist nicht im Archiv", target);
+      return 21;
+    default:
+      return 0;
+  }
+}
+
+int cli_get_status (int status, FILE* out) {
+  switch (status) {
+    case ARCHIVE_NOT_READABLE:
+      cli_message(out, "Das Archiv ist nicht lesbar");
+      return 2;
+    case ARCHIVE_FILE_NOT_FOUND:
+      cli_message(out, "Die gesuchte Datei ist nicht im Archiv");
+      return 21;
+    case FILE_NOT_WRITEABLE:
+      cli_message(out, "Die Ausgabedatei konnte nicht erstellt werden");
+      return 30;
+    default:
+      return 0;
+  }
+}
+
+int cli_del_status (int status, FILE* out) {
+  switch (status) {
+    case ARCHIVE_NOT_READABLE:
+    case ARCHIVE_NOT_WRITEABLE:
+      cli_message(out, "Das Archiv ist nicht lesbar");
+      return 2;
+    case ARCHIVE_FILE_NOT_FOUND:
+      cli_message(out, "Die Datei ist nicht im Archiv");
+      return 21;
+    default:
+      return 0;
+  }
+}
+
+int cli_add (const char* archive_path, const char* source_path, const char* target) {
+  int status = 0;
+
+  struct Archive* archive = archive_create();
+  status = archive_initialize_from_file(archive, archive_path);
+  status == 0 && (status = archive_add_file(archive, target, source_path));
+  archive_free(archive);
+
+  return cli_add_status(status, source_path, target, stdout);
+}
+
+/**
+ * Schreibt den Inhalt von source_path ab dem Byte offset in die Datei target,
+ * mit append an ihr Ende.
+ */
+int cli_write_at (const char* archive_path, const char* target, uint64_t offset, bool append, const char* source_path) {
+  int status = 0;
+
+  struct Archive* archive = archive_create();
+  status = archive_initialize_from_file(archive, archive_path);
+  status == 0 && (status = archive_write_at(archive, target, offset, append, source_path));
+  archive_free(archive);
+
+  return cli_add_status(status, source_path, target, stdout);
+}
+
+/**
+ * Ersetzt die Datei target durch source_path und gibt aus, wie viele Bytes
+ * dabei nicht geschrieben werden mussten.
+ */
+int cli_update (const char* archive_path, const char* target, const char* source_path) {
+  int status = 0;
+  uint64_t skipped = 0;
+
+  struct Archive* archive = archive_create();
+  status = archive_initialize_from_file(archive, archive_path);
+  status == 0 && (status = archive_update_file(archive, target, source_path, &skipped));
+  archive_free(archive);
+
+  if (status == 0) {
+    printf("%lu", skipped);
+  }
+
+  return cli_add_status(status, source_path, target, stdout);
+}
+
+int cli_truncate (const char* archive_path, const char* target, uint64_t size, bool punch_holes) {
+  int status = 0;
+
+  struct Archive* archive = archive_create();
+  archive->punch_holes = punch_holes;
+  status = archive_initialize_from_file(archive, archive_path);
+  status == 0 && (status = archive_truncate_file(archive, target, size));
+  archive_free(archive);
+
+  return cli_add_status(status, target, target, stdout);
+}
+
+int cli_import (const char* archive_path, const char* directory, int num_threads) {
+  int status = 0;
+  char* failed = NULL;
+
+  struct Archive* archive = archive_create();
+
+  /* Der io_uring darf nicht von mehreren Threads gleichzeitig benutzt werden */
+  archive->uring_depth = num_threads > 1 ? 0 : archive->uring_depth;
+
+  status = archive_initialize_from_file(archive, archive_path);
+  status == 0 && (status = archive_import(archive, directory, num_threads, &failed));
+  archive_free(archive);
+
+  int code = cli_add_status(status, failed, failed, stdout);
+  free(failed);
+
+  return code;
+}
+
+/**
+ * Sperrt das Archiv archive_path bis zum Ende des Prozesses für alle anderen,
+ * die es ändern wollen. Gesperrt wird der Store, weil die Strukturdatei beim
+ * Schreiben durch eine neue ersetzt wird. Gibt false zurück, wenn ein anderer
+ * Prozess, z.B. serve, die Sperre schon hält. Ohne Store ist nichts zu
+ * sperren.
+ *
+ * @private
+ */
+bool cli_lock_archive (const char* archive_path) {
+  char* store_file = malloc(strlen(archive_path) + 6 + 1);
+  sprintf(store_file, "%s.store", archive_path);
+
+  int fd = open(store_file, O_RDONLY);
+  free(store_file);
+
+  if (fd != -1 && flock(fd, LOCK_EX | LOCK_NB) != 0) {
+    close(fd);
+    return false;
+  }
+
+  /* Der Deskriptor bleibt offen, damit die Sperre bis zum Ende hält */
+  return true;
+}
+
+/**
+ * Liest eine Dezimalzahl ohne Vorzeichen aus text nach *value, wenn value
+ * nicht NULL ist. Gibt false zurück, wenn text leer ist, etwas anderes
+ * enthält oder die Zahl nicht in 64 Bit passt. strtoull allein nähme auch
+ * "-1" und machte daraus UINT64_MAX.
+ *
+ * @private
+ */
+bool cli_parse_number (const char* text, uint64_t* value) {
+  char* end;
+
+  if (*text < '0' || *text > '9') {
+    return false;
+  }
+
+  errno = 0;
+  uint64_t number = strtoull(text, &end, 10);
+
+  if (*end != 0 || errno != 0) {
+    return false;
+  } else if (value != NULL) {
+    *value = number;
+  }
+
+  return true;
+}
+
+/**
+ * Liest die Optionen von get hinter SOURCE und OUTPUT. Gibt false zurück,
+ * wenn eine unbekannt ist oder ihr Wert keine Zahl ist.
+ *
+ * @private
+ */
+bool cli_get_options (int num_args, char** args, uint64_t* io_size, uint64_t* offset, uint64_t* length) {
+  int i;
+  for (i = 0; i < num_args; i += 2) {
+    uint64_t value;
+
+    if (i + 1 >= num_args || !cli_parse_number(args[i + 1], &value)) {
+      return false;
+    } else if (strcmp(args[i], "--io-size") == 0 && value > 0) {
+      *io_size = value;
+    } else if (strcmp(args[i], "--offset") == 0) {
+      *offset = value;
+    } else if (strcmp(args[i], "--length") == 0) {
+      *length = value;
+    } else {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/**
+ * Schreibt length Bytes ab dem Byte offset der Datei name nach output_path.
+ * Ist das "-", gehen die Daten nach stdout und Fehlermeldungen nach stderr.
+ */
+int cli_get (const char* archive_path, const char* name, const char* output_path, uint64_t io_size, uint64_t offset, uint64_t length) {
+  int status = 0;
+
+  struct Archive* archive = archive_create();
+  archive->io_size = io_size;
+  status = archive_initialize_from_file(archive, archive_path);
+  status == 0 && (status = archive_get_range(archive, name, output_path, offset, length));
+  archive_free(archive);
+
+  return cli_get_status(status, strcmp(output_path, "-") == 0 ? stderr : stdout);
+}
+
+/**
+ * Extrahiert die Dateien names, alle Dateien, auf die pattern passt, oder,
+ * wenn beides fehlt, alle Dateien des Archivs nach directory. Für jede Datei,
+ * die nicht geschrieben werden konnte, wird eine Zeile ausgegeben; der
+ * Exit-Code ist der der ersten davon.
+ */
+int cli_extract (const char* archive_path, const char* directory, const char** names, uint64_t num_names, const char* pattern, int num_threads) {
+  int status = 0;
+  int code = 0;
+
+  struct Archive* archive = archive_create();
+
+  /* Der io_uring darf nicht von mehreren Threads gleichzeitig benutzt werden */
+  archive->uring_depth = num_threads > 1 ? 0 : archive->uring_depth;
+
+  status = archive_initialize_from_file(archive, archive_path);
+
+  if (status != 0) {
+    archive_free(archive);
+    return cli_get_status(status, stdout);
+  }
+
+  struct ArchiveInfo* archive_info = archive->archive_info;
+  archiveinfo_materialize(archive_info);
+
+  uint64_t num_jobs = 0;
+  struct ExtractJob* jobs = malloc((num_names > 0 ? num_names : archive_info->num_ids + 1) * sizeof(struct ExtractJob));
+
+  uint64_t i;
+  if (num_names > 0) {
+    for (i = 0; i < num_names; i++) {
+      jobs[num_jobs].name = names[i];
+      jobs[num_jobs].file_info = archiveinfo_get_file(archive_info, names[i]);
+      num_jobs++;
+    }
+  } else {
+    for (i = 0; i < archive_info->num_ids; i++) {
+      struct FileInfo* file_info = archiveinfo_file(archive_info, i);
+
+      if (file_info != NULL && (pattern == NULL || fnmatch(pattern, file_info->name, FNM_PATHNAME) == 0)) {
+        jobs[num_jobs].name = file_info->name;
+        jobs[num_jobs].file_info = file_info;
+        num_jobs++;
+      }
+    }
+  }
+
+  status = archive_extract(archive, directory, jobs, num_jobs, num_threads);
+
+  if (status != 0) {
+    code = cli_get_status(status, stdout);
+  }
+
+  for (i = 0; i < num_jobs && status == 0; i++) {
+    if (jobs[i].status != 0) {
+      printf("%s: ", jobs[i].name);
+      int job_code = cli_get_status(jobs[i].status, stdout);
+      code = code == 0 ? job_code : code;
+      printf("\n");
+    }
+  }
+
+  free(jobs);
+  archive_free(archive);
+
+  return code;
+}
+
+int cli_del (const char* archive_path, const char* name, bool punch_holes) {
+  int status = 0;
+
+  struct Archive* archive = archive_create();
+  archive->punch_holes = punch_holes;
+  status = archive_initialize_from_file(archive, archive_path);
+  status == 0 && (status = archive_delete_file(archive, name));
+  archive_free(archive);
+
+  return cli_del_status(status, stdout);
+}
+
+int cli_free (const char* archive_path) {
+  int status = 0;
+
+  struct Archive* archive = archive_create();
+  status = archive_initialize_from_file(archive, archive_path);
+
+  if (status == 0) {
+    archive_print_free(archive, stdout);
+  }
+
+  archive_free(archive);
+
+  switch (status) {
+    case ARCHIVE_NOT_READABLE:
+      printf("Das Archiv ist nicht lesbar");
+      return 2;
+    default:
+      return 0;
+  }
+}
+
+int cli_used (const char* archive_path) {
+  int status = 0;
+
+  struct Archive* archive = archive_create();
+  status = archive_initialize_from_file(archive, archive_path);
+
+  if (status == 0) {
+    archive_print_used(archive, stdout);
+  }
+
+  archive_free(archive);
+
+  switch (status) {
+    case ARCHIVE_NOT_READABLE:
+      printf("Das Archiv ist nicht lesbar");
+      return 2;
+    default:
+      return 0;
+  }
+}
+
+int cli_list (const char* archive_path) {
+  int status = 0;
+
+  struct Archive* archive = archive_create();
+  status = archive_initialize_from_file(archive, archive_path);
+  archive_print_list(archive, stdout);
+  archive_free(archive);
+
+  switch (status) {
+    case ARCHIVE_NOT_READABLE:
+      printf("Das Archiv ist nicht lesbar");
+      return 2;
+    default:
+      return 0;
+  }
+}
+
+int cli_defrag (const char* archive_path, const char** names, uint64_t num_names, struct DefragBudget* budget, bool punch_holes) {
+  int status = 0;
+  struct DefragReport report = { 0, 0, 0 };
+
+  struct Archive* archive = archive_create();
+  archive->punch_holes = punch_holes;
+  status = archive_initialize_from_file(archive, archive_path);
+
+  if (status == 0 && num_names > 0) {
+    status = archive_defrag_files(archive, names, num_names, budget, &report);
+  } else if (status == 0) {
+    status = archive_defrag(archive, budget, &report);
+  }
+
+  archive_free(archive);
+
+  switch (status) {
+    case ARCHIVE_NOT_WRITEABLE:
+    case ARCHIVE_NOT_READABLE:
+      printf("Das Archiv ist nicht les-/schreibbar");
+      return 2;
+    case ARCHIVE_FILE_NOT_FOUND:
+      printf("Die Datei ist nicht im Archiv");
+      return 21;
+    default:
+      printf("%lu,%lu,%lu", report.moved_bytes, report.swap_bytes, report.remaining_bytes);
+      return 0;
+  }
+}
+
+int cli_resize (const char* archive_path, uint64_t blockcount, bool preallocate) {
+  int status = 0;
+
+  struct Archive* archive = archive_create();
+  archive->preallocate = preallocate;
+  status = archive_initialize_from_file(archive, archive_path);
+  status == 0 && (status = archive_resize(archive, blockcount));
+  archive_free(archive);
+
+  switch (status) {
+    case ARCHIVE_NOT_WRITEABLE:
+    case ARCHIVE_NOT_READABLE:
+      printf("Das Archiv ist nicht les-/schreibbar");
+      return 2;
+    case ARCHIVE_TOO_SMALL:
+      printf("Die Dateien passen nicht in die neue Größe");
+      return 41;
+    default:
+      return 0;
+  }
+}
+
+int cli_trim (const char* archive_path) {
+  int status = 0;
+  uint64_t bytes = 0;
+
+  struct Archive* archive = archive_create();
+  status = archive_initialize_from_file(archive, archive_path);
+  status == 0 && (status = archive_trim(archive, &bytes));
+  archive_free(archive);
+
+  switch (status) {
+    case ARCHIVE_NOT_WRITEABLE:
+    case ARCHIVE_NOT_READABLE:
+      printf("Das Archiv ist nicht les-/schreibbar");
+      return 2;
+    default:
+      printf("%lu", bytes);
+      return 0;
+  }
+}
+
+/**
+ * Zerlegt line an Leerzeichen und Tabs in höchstens max_words Wörter. Ein
+ * Backslash nimmt das folgende Zeichen wörtlich, sodass auch Namen mit
+ * Leerzeichen möglich sind. line wird dabei überschrieben.
+ *
+ * Gibt die Anzahl der Wörter zurück.
+ *
+ * @private
+ */
+int batch_split (char* line, char** words, int max_words) {
+  int num_words = 0;
+  char* read = line;
+  char* write = line;
+
+  while (*read != 0) {
+    while (*read == ' ' || *read == '\t' || *read == '\r' || *read == '\n') {
+      read++;
+    }
+
+    if (*read == 0) {
+      break;
+    } else if (num_words == max_words) {
+      return max_words + 1;
+    }
+
+    words[num_words++] = write;
+
+    while (*read != 0 && *read != ' ' && *read != '\t' && *read != '\r' && *read != '\n') {
+      if (*read == '\\' && read[1] != 0) {
+        read++;
+      }
+
+      *write++ = *read++;
+    }
+
+    if (*read != 0) {
+      read++;
+    }
+
+    *write++ = 0;
+  }
+
+  return num_words;
+}
+
+/**
+ * Führt einen Befehl aus einer Batch-Datei aus und gibt seinen Exit-Code
+ * zurück.
+ *
+ * @private
+ */
+int batch_run (struct Archive* archive, char** words, int num_words) {
+  const char* command = words[0];
+
+  if (strcmp(command, "add") == 0 && num_words == 3) {
+    return cli_add_status(archive_add_file(archive, words[2], words[1]), words[1], words[2], NULL);
+  } else if (strcmp(command, "get") == 0 && num_words == 3) {
+    return cli_get_status(archive_get_file(archive, words[1], words[2]), NULL);
+  } else if (strcmp(command, "append") == 0 && num_words == 3) {
+    return cli_add_status(archive_write_at(archive, words[1], 0, true, words[2]), words[2], words[1], NULL);
+  } else if (strcmp(command, "write-at") == 0 && num_words == 4 && cli_parse_number(words[2], NULL)) {
+    return cli_add_status(archive_write_at(archive, words[1], strtoull(words[2], NULL, 10), false, words[3]), words[3], words[1], NULL);
+  } else if (strcmp(command, "update") == 0 && num_words == 3) {
+    uint64_t skipped;
+    return cli_add_status(archive_update_file(archive, words[1], words[2], &skipped), words[2], words[1], NULL);
+  } else if (strcmp(command, "truncate") == 0 && num_words == 3 && cli_parse_number(words[2], NULL)) {
+    return cli_add_status(archive_truncate_file(archive, words[1], strtoull(words[2], NULL, 10)), words[1], words[1], NULL);
+  } else if (strcmp(command, "del") == 0 && num_words == 2) {
+    return cli_del_status(archive_delete_file(archive, words[1]), NULL);
+  } else if (strcmp(command, "list") == 0 && num_words == 1) {
+    archive_print_list(archive, stdout);
+  } else if (strcmp(command, "free") == 0 && num_words == 1) {
+    archive_print_free(archive, stdout);
+    printf("\n");
+  } else if (strcmp(command, "used") == 0 && num_words == 1) {
+    archive_print_used(archive, stdout);
+    printf("\n");
+  } else {
+    return 66;
+  }
+
+  return 0;
+}
+
+/**
+ * Führt die Befehle aus input nacheinander auf einem einmal geladenen Archiv
+ * aus. Jede Zeile enthält einen Befehl wie auf der Kommandozeile ohne das
+ * Archiv, also add, get, del, list, free oder used. Nach der Ausgabe jedes
+ * Befehls folgt eine Zeile mit seinem Exit-Code und dem Befehl.
+ *
+ * Die Änderungen werden am Ende und, wenn checkpoint nicht 0 ist, nach jeweils
+ * checkpoint Befehlen auf einmal ins Journal geschrieben. Mit punch_holes
+ * werden danach die bis dahin frei gewordenen Blöcke gesammelt gestanzt.
+ */
+int cli_batch (const char* archive_path, FILE* input, uint64_t checkpoint, bool punch_holes) {
+  int status = 0;
+
+  struct Archive* archive = archive_create();
+  archive->punch_holes = punch_holes;
+  status = archive_initialize_from_file(archive, archive_path);
+
+  if (status == 0) {
+    archive_defer_journal(archive);
+
+    char line[4096];
+    char echo[4096];
+    char* words[5];
+    uint64_t num_commands = 0;
+
+    while (status == 0 && fgets(line, sizeof(line), input) != NULL) {
+      line[strcspn(line, "\r\n")] = 0;
+      strcpy(echo, line);
+
+      int num_words = batch_split(line, words, 4);
+
+      if (num_words == 0 || words[0][0] == '#') {
+        continue;
+      }
+
+      int code = num_words > 4 ? 66 : batch_run(archive, words, num_words);
+      printf("%d %s\n", code, echo);
+
+      num_commands++;
+
+      if (checkpoint > 0 && num_commands % checkpoint == 0) {
+        status = archive_flush_journal(archive);
+      }
+    }
+
+    status == 0 && (status = archive_flush_journal(archive));
+  }
+
+  archive_free(archive);
+
+  switch (status) {
+    case ARCHIVE_NOT_READABLE:
+      printf("Das Archiv ist nicht lesbar");
+      return 2;
+    case ARCHIVE_NOT_WRITEABLE:
+      printf("Das Archiv ist nicht beschreibbar");
+      return 2;
+    default:
+      return 0;
+  }
+}
+
+void help_create () {
+  printf("USAGE: vfs ARCHIVE create BLOCKSIZE BLOCKCOUNT [--preallocate] [--compress | --dedup]");
+}
+
+void help_resize () {
+  printf("USAGE: vfs ARCHIVE resize BLOCKCOUNT [--preallocate]");
+}
+
+void help_add () {
+  printf("USAGE: vfs ARCHIVE add SOURCE|- TARGET");
+}
+
+void help_append () {
+  printf("USAGE: vfs ARCHIVE append TARGET SOURCE|-");
+}
+
+void help_write_at () {
+  printf("USAGE: vfs ARCHIVE write-at TARGET OFFSET SOURCE|-");
+}
+
+void help_update () {
+  printf("USAGE: vfs ARCHIVE update TARGET SOURCE");
+}
+
+void help_truncate () {
+  printf("USAGE: vfs ARCHIVE truncate TARGET SIZE [--punch]");
+}
+
+void help_import () {
+  printf("USAGE: vfs ARCHIVE import DIRECTORY [--threads THREADS]");
+}
+
+void help_get () {
+  printf("USAGE: vfs ARCHIVE get SOURCE OUTPUT|- [--io-size BYTES] [--offset BYTES] [--length BYTES]");
+}
+
+void help_extract () {
+  printf("USAGE: vfs ARCHIVE extract DIRECTORY [--threads THREADS] [--glob PATTERN | NAME...]");
+}
+
+void help_del () {
+  printf("USAGE: vfs ARCHIVE del TARGET [--punch]");
+}
+
+void help_free () {
+  printf("USAGE: vfs ARCHIVE free");
+}
+
+void help_used () {
+  printf("USAGE: vfs ARCHIVE used");
+}
+
+void help_list () {
+  printf("USAGE: vfs ARCHIVE list");
+}
+
+void help_defrag () {
+  printf("USAGE: vfs ARCHIVE defrag [--punch] [--bytes BYTES] [--seconds SECONDS] [NAME...]");
+}
+
+void help_batch () {
+  printf("USAGE: vfs ARCHIVE batch [--punch] [--checkpoint COMMANDS] [FILE]");
+}
+
+void help_trim () {
+  printf("USAGE: vfs ARCHIVE trim");
+}
+
+void help_serve () {
+  printf("USAGE: vfs ARCHIVE serve SOCKET [--threads THREADS]");
+}
+
+void help () {
+  help_create();
+  help_resize();
+  help_add();
+  help_append();
+  help_write_at();
+  help_truncate();
+  help_update();
+  help_import();
+  help_get();
+  help_extract();
+  help_del();
+  help_free();
+  help_used();
+  help_list();
+  help_defrag();
+  help_batch();
+  help_trim();
+  help_serve();
+}
 
 /**
- * Ein High-Level-Interface um mit einem Archiv zu interagieren.
+ * Höchstzahl der Wörter in einer Anfrage an den Server
  */
-struct Archive {
-  char* structure_file;
-  char* store_file;
-  struct ArchiveInfo* archive_info;
-};
+#define PROTOCOL_MAX_WORDS 8
 
 /**
- * Erstellt ein leeres Archiv, das dann mit einer der Initializer-Methoden
- * geladen werden muss.
+ * Höchstlänge eines Wortes in einer Anfrage
  */
-struct Archive* archive_create () {
-  struct Archive* archive = malloc(sizeof(struct Archive));
-  archive->structure_file = NULL;
-  archive->store_file = NULL;
-  archive->archive_info = archiveinfo_create();
-
-  return archive;
-}
-
-int archive_write_archive_info (struct Archive*);
-int archive_initialize_store(struct Archive*);
-void archive_initialize_paths(struct Archive* archive, const char* archive_path);
+#define PROTOCOL_MAX_WORD_LENGTH PATH_MAX
 
 /**
- * Initialisiert ein leeres Archiv.
+ * Schreibt eine Anfrage an den Server. Sie besteht aus der Anzahl der Wörter
+ * und jedem Wort mit vorangestellter Länge, alles als uint32_t. Das erste Wort
+ * ist der absolute Pfad der Strukturdatei, das zweite der Befehl. Bei add
+ * folgen danach noch die Größe als uint64_t und die Daten.
  */
-int archive_initialize_empty (struct Archive* archive, const char* archive_path, uint64_t blocksize, uint64_t blockcount) {
-  archive_initialize_paths(archive, archive_path);
-
-  archiveinfo_initialize_empty(archive->archive_info, blocksize, blockcount);
+bool protocol_write_words (FILE* out, const char** words, uint32_t num_words) {
+  bool success = fwrite(&num_words, sizeof(uint32_t), 1, out) == 1;
 
-  int status = 0;
+  uint32_t i;
+  for (i = 0; i < num_words && success; i++) {
+    uint32_t length = strlen(words[i]);
 
-  if (file_exists(archive->store_file) || file_exists(archive->structure_file)) {
-    status = ARCHIVE_ALREADY_EXISTS;
+    success = fwrite(&length, sizeof(uint32_t), 1, out) == 1 && fwrite(words[i], 1, length, out) == length;
   }
 
-  status == 0 && (status = archive_write_archive_info(archive));
-  status == 0 && (status = archive_initialize_store(archive));
-
-  return status;
+  return success;
 }
 
 /**
- * Lädt ein Archiv aus den zwei Archivdateien.
+ * Liest eine Anfrage, wie protocol_write_words sie schreibt. Die Wörter müssen
+ * mit protocol_free_words freigegeben werden.
+ *
+ * Gibt die Anzahl der Wörter zurück oder -1, wenn keine vollständige Anfrage
+ * mehr kommt.
  */
-int archive_initialize_from_file (struct Archive* archive, const char* archive_path) {
-  archive_initialize_paths(archive, archive_path);
+int protocol_read_words (FILE* in, char** words) {
+  uint32_t num_words;
 
-  int status = 0;
+  if (fread(&num_words, sizeof(uint32_t), 1, in) != 1 || num_words == 0 || num_words > PROTOCOL_MAX_WORDS) {
+    return -1;
+  }
 
-  FILE* file = fopen(archive->structure_file, "r");
+  uint32_t i;
+  for (i = 0; i < num_words; i++) {
+    uint32_t length;
 
-  if (file == NULL || !file_exists(archive->store_file)) {
-    status = ARCHIVE_NOT_READABLE;
-  } else {
-    status = archiveinfo_initialize_from_file(archive->archive_info, file);
+    if (fread(&length, sizeof(uint32_t), 1, in) != 1 || length > PROTOCOL_MAX_WORD_LENGTH) {
+      break;
+    }
 
-    fclose(file);
+    words[i] = malloc(length + 1);
+    words[i][length] = 0;
+
+    if (fread(words[i], 1, length, in) != length) {
+      free(words[i]);
+      break;
+    }
   }
 
-  return status;
+  if (i < num_words) {
+    while (i > 0) {
+      free(words[--i]);
+    }
+
+    return -1;
+  }
+
+  return num_words;
+}
+
+void protocol_free_words (char** words, int num_words) {
+  int i;
+  for (i = 0; i < num_words; i++) {
+    free(words[i]);
+  }
 }
 
 /**
- * Schreibt bytes Bytes der Datei file in die num_files Blöcke, die durch
- * blocks indiziert werden.
+ * Schreibt den Kopf einer Antwort: den Exit-Code als int32_t und die Länge der
+ * folgenden Ausgabe als uint64_t.
  */
-int archive_write_file_to_blocks (struct Archive* archive, FILE* file, uint64_t bytes, uint64_t* blocks, uint64_t num_blocks) {
-  int status = 0;
-  struct ArchiveInfo* archive_info = archive->archive_info;
-  FILE* store = fopen(archive->store_file, "r+");
+bool protocol_write_header (FILE* out, int32_t code, uint64_t length) {
+  return fwrite(&code, sizeof(int32_t), 1, out) == 1 && fwrite(&length, sizeof(uint64_t), 1, out) == 1;
+}
 
-  if (store == NULL) {
-    status = ARCHIVE_NOT_WRITEABLE;
-  } else {
-    char buffer[archive_info->blocksize];
-    uint64_t i;
-    for (i = 0; i < num_blocks; i++) {
-      int chunk_size;
+bool protocol_read_header (FILE* in, int32_t* code, uint64_t* length) {
+  return fread(code, sizeof(int32_t), 1, in) == 1 && fread(length, sizeof(uint64_t), 1, in) == 1;
+}
 
-      if (bytes > archive_info->blocksize) {
-        chunk_size = archive_info->blocksize;
-        bytes -= archive_info->blocksize;
-      } else {
-        chunk_size = bytes;
-      }
+/**
+ * Kopiert length Bytes von in nach out. out darf NULL sein, dann werden die
+ * Bytes nur gelesen.
+ */
+bool protocol_copy (FILE* in, FILE* out, uint64_t length) {
+  char buffer[65536];
 
-      if (file_read(&buffer, 1, chunk_size, file) != 0) {
-        status = FILE_NOT_READABLE;
-        break;
-      } else if (fseek(store, blocks[i] * archive_info->blocksize, SEEK_SET) != 0) {
-        status = ARCHIVE_NOT_WRITEABLE;
-        break;
-      } else if (file_write(&buffer, 1, chunk_size, store) != 0) {
-        status = ARCHIVE_NOT_WRITEABLE;
-        break;
-      }
+  while (length > 0) {
+    size_t chunk = length > sizeof(buffer) ? sizeof(buffer) : length;
+
+    if (fread(buffer, 1, chunk, in) != chunk) {
+      return false;
+    } else if (out != NULL && fwrite(buffer, 1, chunk, out) != chunk) {
+      return false;
     }
 
-    fclose(store);
+    length -= chunk;
   }
 
-  return status;
+  return true;
 }
 
 /**
- * Fügt dem Archiv die Datei unter dem gegebenen Namen hinzu.
+ * Ein Archiv, das über einen Unix-Socket bedient wird
  */
-int archive_add_file (struct Archive* archive, const char* name, const char* path) {
-  int status = 0;
-  struct ArchiveInfo* archive_info = archive->archive_info;
+struct Server {
+  struct Archive* archive;
 
-  if (archiveinfo_has_file(archive_info, name)) {
-    status = ARCHIVE_FILE_ALREADY_EXISTS;
-  } else {
-    FILE* file = fopen(path, "r");
+  /**
+   * Absoluter Pfad der Strukturdatei, mit dem Anfragen für dieses Archiv
+   * kommen
+   */
+  char* structure_path;
 
-    if (file == NULL) {
-      status = FILE_NOT_READABLE;
-    } else {
-      long int size = file_size(file);
+  /**
+   * Lesende Befehle teilen sich die Sperre, schreibende haben sie allein
+   */
+  pthread_rwlock_t lock;
 
-      if (size == -1) {
-        status = FILE_NOT_READABLE;
-      } else {
-        uint64_t num_free = archiveinfo_num_free_blocks(archive_info);
-        uint64_t num_needed = archiveinfo_needed_blocks(archive_info, size);
+  /**
+   * Verbindungen, die auf einen freien Thread warten
+   */
+  pthread_mutex_t queue_lock;
+  pthread_cond_t queue_filled;
+  pthread_cond_t queue_emptied;
+  int queue[64];
+  int queue_start;
+  int queue_length;
+};
 
-        if (num_free < num_needed) {
-          status = ARCHIVE_FILE_TOO_BIG;
-        } else {
-          uint64_t* free_blocks = malloc(num_needed * sizeof(uint64_t));
-          archiveinfo_get_free_blocks(archive_info, free_blocks, num_needed);
-          archiveinfo_add_file(archive_info, name, size, free_blocks, num_needed);
+/**
+ * Pfad des Sockets, damit er beim Beenden entfernt werden kann
+ */
+static const char* server_socket_path = NULL;
 
-          status = archive_write_file_to_blocks(archive, file, size, free_blocks, num_needed);
-          status == 0 && (status = archive_write_archive_info(archive));
+void server_stop (int signal) {
+  (void)signal;
 
-          free(free_blocks);
-        }
-      }
+  unlink(server_socket_path);
+  _exit(0);
+}
 
-      fclose(file);
-    }
-  }
+/**
+ * Schreibt eine Antwort aus einem Exit-Code und dem Inhalt eines memstreams.
+ *
+ * @private
+ */
+bool server_respond (FILE* out, int code, char* data, size_t length) {
+  bool success = protocol_write_header(out, code, length) && fwrite(data, 1, length, out) == length;
+  free(data);
 
-  return status;
+  return success;
 }
 
-int archive_get_file (struct Archive* archive, const char* name, const char* output_path) {
-  int status = 0;
-  struct ArchiveInfo* archive_info = archive->archive_info;
+/**
+ * Beantwortet eine Anfrage. Gibt false zurück, wenn die Verbindung danach
+ * nicht mehr benutzt werden kann.
+ *
+ * @private
+ */
+bool server_handle_request (struct Server* server, FILE* in, FILE* out, char** words, int num_words) {
+  struct Archive* archive = server->archive;
+  const char* command = words[1];
+  char* data = NULL;
+  size_t length = 0;
+  FILE* message = open_memstream(&data, &length);
+  int code = 0;
+
+  if (strcmp(words[0], server->structure_path) != 0) {
+    fprintf(message, "Das Archiv ist nicht lesbar");
+    code = 2;
+  } else if (strcmp(command, "add") == 0 && num_words == 3) {
+    uint64_t size;
+
+    if (fread(&size, sizeof(uint64_t), 1, in) != 1) {
+      fclose(message);
+      free(data);
+
+      return false;
+    }
 
-  if (!archiveinfo_has_file(archive_info, name)) {
-    status = ARCHIVE_FILE_NOT_FOUND;
-  } else {
-    int num_blocks = archiveinfo_get_num_allocated_blocks(archive_info, name);
-    uint64_t* blocks = malloc(num_blocks * sizeof(uint64_t));
-    archiveinfo_get_allocated_blocks(archive_info, name, blocks);
+    /* Ein langsamer Client darf die anderen nicht aufhalten: gelesen wird ohne Sperre */
+    bool received = false;
+    int status = 0;
 
-    FILE* store = fopen(archive->store_file, "r");
+    if (archive->archive_info->dedup) {
+      /* Welche Blöcke neu sind, hängt von den anderen Dateien ab, deshalb erst zwischenspeichern */
+      FILE* spool = tmpfile();
 
-    if (store == NULL) {
-      status = ARCHIVE_NOT_READABLE;
+      if (spool == NULL || !protocol_copy(in, spool, size) || fflush(spool) != 0 || fseeko(spool, 0, SEEK_SET) != 0) {
+        status = FILE_NOT_READABLE;
+      } else {
+        pthread_rwlock_wrlock(&server->lock);
+        status = archive_add_stream(archive, words[2], spool, size);
+        pthread_rwlock_unlock(&server->lock);
+      }
+
+      received = true;
+      spool != NULL && fclose(spool);
     } else {
-      FILE* output = fopen(output_path, "w");
+      struct FileInfo* reserved = NULL;
 
-      if (output == NULL) {
-        status = FILE_NOT_WRITEABLE;
-      } else {
-        uint64_t bytes_left = archiveinfo_get_file_size(archive_info, name);
-        char buffer[archive_info->blocksize];
-        int i;
-        for (i = 0; i < num_blocks; i++) {
-          int position = blocks[i] * archive_info->blocksize;
-          int chunk_size = archive_info->blocksize;
-
-          if (bytes_left > archive_info->blocksize) {
-            chunk_size = archive_info->blocksize;
-            bytes_left -= archive_info->blocksize;
-          } else {
-            chunk_size = bytes_left;
-          }
+      pthread_rwlock_wrlock(&server->lock);
+      status = archive_reserve_file(archive, words[2], size, &reserved);
+      pthread_rwlock_unlock(&server->lock);
 
-          fseek(store, position, SEEK_SET);
-          if (file_read(&buffer, 1, chunk_size, store) != 0) {
-            status = ARCHIVE_NOT_READABLE;
-            break;
-          } else if (file_write(&buffer, 1, chunk_size, output) != 0) {
-            status = FILE_NOT_WRITEABLE;
-            break;
-          }
-        }
+      if (status == 0) {
+        status = archive_write_reserved(archive, reserved, in);
+        received = true;
 
-        fclose (output);
+        pthread_rwlock_wrlock(&server->lock);
+        status = archive_commit_reserved(archive, reserved, status);
+        pthread_rwlock_unlock(&server->lock);
       }
-
-      fclose(store);
     }
 
-    free(blocks);
-  }
+    code = cli_add_status(status, "-", words[2], message);
 
-  return status;
-}
+    /* Bei diesen Fehlern wurden die Daten noch nicht gelesen */
+    if ((status == ARCHIVE_FILE_ALREADY_EXISTS || status == ARCHIVE_FILE_TOO_BIG) && !received && !protocol_copy(in, NULL, size)) {
+      status = FILE_NOT_READABLE;
+    }
 
-int archive_delete_file (struct Archive* archive, const char* name) {
-  int status = 0;
-  struct ArchiveInfo* archive_info = archive->archive_info;
+    if (status != 0 && status != ARCHIVE_FILE_ALREADY_EXISTS && status != ARCHIVE_FILE_TOO_BIG) {
+      fclose(message);
+      server_respond(out, code, data, length);
 
-  if (!archiveinfo_has_file(archive_info, name)) {
-    status = ARCHIVE_FILE_NOT_FOUND;
-  } else {
-    archiveinfo_delete_file(archive_info, name);
-    status = archive_write_archive_info(archive);
-  }
+      return false;
+    }
+  } else if (strcmp(command, "get") == 0 && (num_words == 3 || (num_words == 5 && cli_parse_number(words[3], NULL) && cli_parse_number(words[4], NULL)))) {
+    uint64_t offset = num_words == 5 ? strtoull(words[3], NULL, 10) : 0;
+    uint64_t range_length = num_words == 5 ? strtoull(words[4], NULL, 10) : UINT64_MAX;
 
-  return status;
-}
+    /* Die Daten werden unter der Sperre nur zwischengespeichert und ohne sie an den Client geschickt */
+    FILE* spool = tmpfile();
+    int status = spool == NULL ? ARCHIVE_NOT_READABLE : 0;
 
-uint64_t archive_free_bytes (struct Archive* archive) {
-  return archiveinfo_free_bytes(archive->archive_info);
-}
+    pthread_rwlock_rdlock(&server->lock);
+    struct FileInfo* file_info = archiveinfo_get_file(archive->archive_info, words[2]);
 
-uint64_t archive_used_bytes (struct Archive* archive) {
-  return archiveinfo_used_bytes(archive->archive_info);
-}
+    if (file_info == NULL) {
+      status == 0 && (status = ARCHIVE_FILE_NOT_FOUND);
+    } else {
+      fileinfo_clamp_range(file_info, &offset, &range_length);
+      status == 0 && (status = archive_read_range(archive, file_info, offset, range_length, spool));
+    }
 
-void archive_print_list (struct Archive* archive) {
-  struct ArchiveInfo* archive_info = archive->archive_info;
+    pthread_rwlock_unlock(&server->lock);
 
-  uint64_t i;
-  for (i = 0; i < archive_info->num_files; i++) {
-    struct FileInfo* file_info = archive_info->file_infos[i];
-    uint64_t num_blocks = archiveinfo_get_num_allocated_blocks(archive_info, file_info->name);
-    uint64_t* blocks = malloc(num_blocks * sizeof(uint64_t));
-    archiveinfo_get_allocated_blocks(archive_info, file_info->name, blocks);
+    if (status == 0) {
+      fclose(message);
+      free(data);
 
-    /* Das wird in 2 Aufrufen gemacht, weil für num_blocks sonst komischerweise immer 0 ausgegeben wird */
-    printf("%s,%lu,", file_info->name, file_info->size);
-    printf("%lu", num_blocks);
+      bool success = fflush(spool) == 0 && fseeko(spool, 0, SEEK_SET) == 0 && protocol_write_header(out, 0, range_length) && protocol_copy(spool, out, range_length);
+      fclose(spool);
 
-    uint64_t j;
-    for (j = 0; j < num_blocks; j++) {
-      printf(",%lu", blocks[j]);
+      return success;
     }
 
-    printf("\n");
-
-    free(blocks);
+    spool != NULL && fclose(spool);
+    code = cli_get_status(status, message);
+  } else if (strcmp(command, "del") == 0 && num_words == 3) {
+    pthread_rwlock_wrlock(&server->lock);
+    code = cli_del_status(archive_delete_file(archive, words[2]), message);
+    pthread_rwlock_unlock(&server->lock);
+  } else if (strcmp(command, "list") == 0 && num_words == 2) {
+    pthread_rwlock_rdlock(&server->lock);
+    archive_print_list(archive, message);
+    pthread_rwlock_unlock(&server->lock);
+  } else if (strcmp(command, "free") == 0 && num_words == 2) {
+    pthread_rwlock_rdlock(&server->lock);
+    archive_print_free(archive, message);
+    pthread_rwlock_unlock(&server->lock);
+  } else if (strcmp(command, "used") == 0 && num_words == 2) {
+    pthread_rwlock_rdlock(&server->lock);
+    archive_print_used(archive, message);
+    pthread_rwlock_unlock(&server->lock);
+  } else {
+    fprintf(message, "Der Befehl ist ungültig");
+    code = 66;
   }
+
+  fclose(message);
+
+  return server_respond(out, code, data, length);
 }
 
 /**
- * Vertauscht den Block i mit i + 1.
- * 
+ * Beantwortet Anfragen auf einer Verbindung, bis der Client sie schließt.
+ *
  * @private
  */
-int archive_swap_blocks (struct Archive* archive, FILE* store, uint64_t i) {
-  int status = 0;
-
-  int tmp = archive->archive_info->blocks[i];
-  archive->archive_info->blocks[i] = archive->archive_info->blocks[i + 1];
-  archive->archive_info->blocks[i + 1] = tmp;
-
-  uint64_t blocksize = archive->archive_info->blocksize;
+void server_handle_connection (struct Server* server, int connection) {
+  FILE* in = fdopen(connection, "r");
+  FILE* out = fdopen(dup(connection), "w");
+  char* words[PROTOCOL_MAX_WORDS];
+  bool open = in != NULL && out != NULL;
+
+  while (open) {
+    int num_words = protocol_read_words(in, words);
+
+    if (num_words < 2) {
+      protocol_free_words(words, num_words);
+      break;
+    }
 
-  char buffer[blocksize];
-  char buffer2[blocksize];
+    open = server_handle_request(server, in, out, words, num_words) && fflush(out) == 0;
+    protocol_free_words(words, num_words);
+  }
 
-  if (fseek(store, i * blocksize, SEEK_SET) != 0) {
-    status = ARCHIVE_NOT_READABLE;
-  } else if (file_read(&buffer, 1, blocksize, store) != 0) {
-    status = ARCHIVE_NOT_READABLE;
-  } else if (file_read(&buffer2, 1, blocksize, store) != 0) {
-    status = ARCHIVE_NOT_READABLE;
-  } else if (fseek(store, i * blocksize, SEEK_SET) != 0) {
-    status = ARCHIVE_NOT_READABLE;
-  } else if (file_write(&buffer2, 1, blocksize, store) != 0) {
-    status = ARCHIVE_NOT_WRITEABLE;
-  } else if (file_write(&buffer, 1, blocksize, store) != 0) {
-    status = ARCHIVE_NOT_WRITEABLE;
+  if (in != NULL) {
+    fclose(in);
+  } else {
+    close(connection);
   }
 
-  return status;
+  if (out != NULL) {
+    fclose(out);
+  }
 }
 
 /**
- * Drückt den Block right an die Position left, wobei alle Blöcke dazwischen um
- * 1 nach rechts verschoben werden.
+ * Arbeitet die Warteschlange der Verbindungen ab.
  *
  * @private
  */
-int archive_push_block (struct Archive* archive, FILE* store, uint64_t left, uint64_t right) {
-  int status = 0;
+void* server_worker (void* argument) {
+  struct Server* server = argument;
 
-  if (right > left) {
-    uint64_t i;
-    for (i = right - 1; i >= left && status == 0; i--) {
-      status = archive_swap_blocks(archive, store, i);
-    }
-  }
+  while (true) {
+    pthread_mutex_lock(&server->queue_lock);
 
-  return status;
-}
+    while (server->queue_length == 0) {
+      pthread_cond_wait(&server->queue_filled, &server->queue_lock);
+    }
 
-int archive_defrag (struct Archive* archive) {
-  int status = 0;
-  struct ArchiveInfo* archive_info = archive->archive_info;
-  FILE* store = fopen(archive->store_file, "r+");
+    int connection = server->queue[server->queue_start];
+    server->queue_start = (server->queue_start + 1) % 64;
+    server->queue_length--;
 
-  if (store == NULL) {
-    status = ARCHIVE_NOT_READABLE;
-  } else {
-    uint64_t block_index = 0;
-    uint64_t i;
-    for (i = 0; i < archive_info->num_files; i++) {
-      uint64_t j;
-      for (j = block_index; j < archive_info->blockcount && status == 0; j++) {
-        if (archive_info->blocks[j] == (int64_t)i) {
-          status = archive_push_block(archive, store, block_index, j);
-          block_index++;
-        }
-      }
-    }
+    pthread_cond_signal(&server->queue_emptied);
+    pthread_mutex_unlock(&server->queue_lock);
 
-    status == 0 && (status = archive_write_archive_info(archive));
-    
-    fclose(store);
+    server_handle_connection(server, connection);
   }
 
-  return status;
+  return NULL;
 }
 
 /**
- * Erzeugt die beiden speziellen Pfade aus dem allgemeinen Archivpfad.
- *
- * @private
+ * Gibt den absoluten Pfad der Strukturdatei des Archivs archive_path zurück
+ * oder NULL. Der Pfad muss vom Aufrufer freigegeben werden.
  */
-void archive_initialize_paths (struct Archive* archive, const char* archive_path) {
-  archive->structure_file = malloc((strlen(archive_path) + 10 + 1) * sizeof(char));
-  archive->store_file = malloc((strlen(archive_path) + 6 + 1) * sizeof(char));
+char* server_structure_path (const char* archive_path) {
+  char* structure_file = malloc(strlen(archive_path) + 10 + 1);
+  sprintf(structure_file, "%s.structure", archive_path);
 
-  sprintf(archive->structure_file, "%s.structure", archive_path);
-  sprintf(archive->store_file, "%s.store", archive_path);
+  char* path = realpath(structure_file, NULL);
+  free(structure_file);
+
+  return path;
 }
 
 /**
- * Schreibt die Strukturdatei neu.
- *
- * @private
+ * Lädt das Archiv einmal und beantwortet dann Anfragen über den Unix-Socket
+ * socket_path mit num_threads Threads, bis der Prozess beendet wird.
  */
-int archive_write_archive_info (struct Archive* archive) {
-  int status = 0;
+int cli_serve (const char* archive_path, const char* socket_path, int num_threads) {
+  struct Server server;
+  struct sockaddr_un address;
 
-  FILE* structure_file = fopen(archive->structure_file, "w");
+  server.archive = archive_create();
+  server.structure_path = server_structure_path(archive_path);
 
-  if (structure_file == NULL) {
-    status = ARCHIVE_NOT_WRITEABLE;
-  } else {
-    status = archiveinfo_write(archive->archive_info, structure_file);
+  /* Der io_uring darf nicht von mehreren Threads gleichzeitig benutzt werden */
+  server.archive->uring_depth = 0;
 
-    if (status != 0) {
-      status = ARCHIVE_NOT_WRITEABLE;
-    }
+  int status = archive_initialize_from_file(server.archive, archive_path);
+  status == 0 && (status = archive_open_store(server.archive));
 
-    fclose(structure_file);
+  if (status != 0 || server.structure_path == NULL) {
+    printf("Das Archiv ist nicht lesbar");
+    return 2;
+  } else if (strlen(socket_path) >= sizeof(address.sun_path)) {
+    printf("Der Pfad des Sockets ist zu lang");
+    return 66;
   }
 
-  return status; 
-}
-
-/**
- * Initialisiert einen leeren Datenstore in eine nicht existente Datei.
- *
- * @private
- */
-int archive_initialize_store (struct Archive* archive) {
-  int status = 0;
-
-  FILE* store = fopen(archive->store_file, "w");
-
-  if (store == NULL) {
-    status = ARCHIVE_NOT_WRITEABLE;
-  } else {
-    struct ArchiveInfo* archive_info = archive->archive_info;
-    const char* zero_block[archive_info->blocksize];
-    memset(&zero_block, 0, archive_info->blocksize);
+  archiveinfo_materialize(server.archive->archive_info);
 
-    uint64_t i;
-    for (i = 0; i < archive_info->blockcount; i++) {
-      fwrite(zero_block, sizeof(char), archive_info->blocksize, store);
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, socket_path);
 
-      if (ferror(store) != 0) {
-        status = ARCHIVE_NOT_WRITEABLE;
-      }
-    }
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
 
-    fclose(store);
+  if (listener == -1 || bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(listener, 64) != 0) {
+    printf("Der Socket %s kann nicht geöffnet werden", socket_path);
+    return 4;
   }
 
-  return status;
-}
-
-/**
- * Gibt alle belegten Resourcen frei.
- */
-void archive_free (struct Archive* archive) {
-  archiveinfo_free(archive->archive_info);
-
-  free(archive->structure_file);
-  free(archive->store_file);
-  free(archive);
-}
+  server_socket_path = socket_path;
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGINT, server_stop);
+  signal(SIGTERM, server_stop);
+
+  pthread_rwlock_init(&server.lock, NULL);
+  pthread_mutex_init(&server.queue_lock, NULL);
+  pthread_cond_init(&server.queue_filled, NULL);
+  pthread_cond_init(&server.queue_emptied, NULL);
+  server.queue_start = 0;
+  server.queue_length = 0;
+
+  int i;
+  for (i = 0; i < num_threads; i++) {
+    pthread_t thread;
+    pthread_create(&thread, NULL, server_worker, &server);
+    pthread_detach(thread);
+  }
 
-int cli_create (const char* archive_path, uint64_t blocksize, uint64_t blockcount) {
-  int status = 0;
+  while (true) {
+    int connection = accept(listener, NULL, NULL);
 
-  struct Archive* archive = archive_create();
-  status = archive_initialize_empty(archive, archive_path, blocksize, blockcount);
-  archive_free(archive);
+    if (connection == -1) {
+      continue;
+    }
 
-  switch (status) {
-    case ARCHIVE_NOT_WRITEABLE:
-      printf("Das Archiv ist nicht beschreibbar");
-      return 1;
-    case ARCHIVE_ALREADY_EXISTS:
-      printf("Es existiert bereits ein Archiv mit dem selben Namen");
-      return 3;
-    default:
-      return 0;
-  }
-}
+    pthread_mutex_lock(&server.queue_lock);
 
-int cli_add (const char* archive_path, const char* source_path, const char* target) {
-  int status = 0;
+    while (server.queue_length == 64) {
+      pthread_cond_wait(&server.queue_emptied, &server.queue_lock);
+    }
 
-  struct Archive* archive = archive_create();
-  status = archive_initialize_from_file(archive, archive_path);
-  status == 0 && (status = archive_add_file(archive, target, source_path));
-  archive_free(archive);
+    server.queue[(server.queue_start + server.queue_length) % 64] = connection;
+    server.queue_length++;
 
-  switch (status) {
-    case ARCHIVE_NOT_READABLE:
-      printf("Das Archiv ist nicht lesbar");
-      return 2;
-    case ARCHIVE_FILE_ALREADY_EXISTS:
-      printf("Eine Datei mit dem Namen %s existiert bereits", target);
-      return 11;
-    case ARCHIVE_FILE_TOO_BIG:
-      printf("Die Datei %s passt nicht mehr in das Archiv", target);
-      return 12;
-    case FILE_NOT_READABLE:
-      printf("Die Datei %s ist nicht lesbar", source_path);
-      return 13;
-    default:
-      return 0;
+    pthread_cond_signal(&server.queue_filled);
+    pthread_mutex_unlock(&server.queue_lock);
   }
 }
 
-int cli_get (const char* archive_path, const char* name, const char* output_path) {
-  int status = 0;
+/**
+ * Führt einen Befehl über den Server am Socket socket_path aus, statt das
+ * Archiv selbst zu laden. args beginnt mit dem Befehl. Ausgaben und Exit-Codes
+ * sind dieselben wie ohne Server.
+ */
+int client_run (const char* socket_path, const char* archive_path, int num_args, char** args) {
+  const char* command = args[0];
+  const char* words[5];
+  char range[2][32];
+  struct sockaddr_un address;
+  int num_words = 2;
+  uint64_t io_size = ARCHIVE_IO_SIZE;
+  uint64_t offset = 0;
+  uint64_t range_length = UINT64_MAX;
+
+  if (strcmp(command, "add") == 0 && num_args < 3) {
+    help_add();
+    return 66;
+  } else if (strcmp(command, "get") == 0 && (num_args < 3 || !cli_get_options(num_args - 3, args + 3, &io_size, &offset, &range_length))) {
+    help_get();
+    return 66;
+  } else if (strcmp(command, "del") == 0 && num_args < 2) {
+    help_del();
+    return 66;
+  }
 
-  struct Archive* archive = archive_create();
-  status = archive_initialize_from_file(archive, archive_path);
-  status == 0 && (status = archive_get_file(archive, name, output_path));
-  archive_free(archive);
+  char* structure_path = server_structure_path(archive_path);
 
-  switch (status) {
-    case ARCHIVE_NOT_READABLE:
-      printf("Das Archiv ist nicht lesbar");
-      return 2;
-    case ARCHIVE_FILE_NOT_FOUND:
-      printf("Die gesuchte Datei ist nicht im Archiv");
-      return 21;
-    case FILE_NOT_WRITEABLE:
-      printf("Die Ausgabedatei konnte nicht erstellt werden");
-      return 30;
-    default:
-      return 0;
+  if (structure_path == NULL) {
+    printf("Das Archiv ist nicht lesbar");
+    return 2;
   }
-}
 
-int cli_del (const char* archive_path, const char* name) {
-  int status = 0;
+  words[0] = structure_path;
+  words[1] = command;
 
-  struct Archive* archive = archive_create();
-  status = archive_initialize_from_file(archive, archive_path);
-  status == 0 && (status = archive_delete_file(archive, name));
-  archive_free(archive);
+  if (strcmp(command, "add") == 0) {
+    words[num_words++] = args[2];
+  } else if (strcmp(command, "get") == 0 || strcmp(command, "del") == 0) {
+    words[num_words++] = args[1];
+  }
 
-  switch (status) {
-    case ARCHIVE_NOT_READABLE:
-      printf("Das Archiv ist nicht lesbar");
-      return 2;
-    case ARCHIVE_FILE_NOT_FOUND:
-      printf("Die Datei ist nicht im Archiv");
-      return 21;
-    default:
-      return 0;
+  /* Der Bereich wird nur mitgeschickt, wenn er nicht die ganze Datei ist */
+  if (strcmp(command, "get") == 0 && (offset != 0 || range_length != UINT64_MAX)) {
+    sprintf(range[0], "%lu", offset);
+    sprintf(range[1], "%lu", range_length);
+    words[num_words++] = range[0];
+    words[num_words++] = range[1];
   }
-}
 
-int cli_free (const char* archive_path) {
-  int status = 0;
+  FILE* source = NULL;
+  long int size = 0;
 
-  struct Archive* archive = archive_create();
-  status = archive_initialize_from_file(archive, archive_path);
+  if (strcmp(command, "add") == 0) {
+    source = strcmp(args[1], "-") == 0 ? stdin : fopen(args[1], "r");
+    size = source == NULL ? -1 : file_size(source);
 
-  uint64_t free_bytes = archive_free_bytes(archive);
+    /* Das Protokoll braucht die Größe vorab, Pipes werden deshalb zwischengespeichert */
+    if (source != NULL && size == -1) {
+      FILE* spool = tmpfile();
+      char buffer[65536];
+      size_t count;
 
-  archive_free(archive);
+      while (spool != NULL && (count = fread(buffer, 1, sizeof(buffer), source)) > 0 && fwrite(buffer, 1, count, spool) == count);
 
-  switch (status) {
-    case ARCHIVE_NOT_READABLE:
-      printf("Das Archiv ist nicht lesbar");
-      return 2;
-    default:
-      printf("%lu", free_bytes);
-      return 0;
-  }
-}
+      if (spool != NULL && !ferror(source) && !ferror(spool) && fflush(spool) == 0) {
+        size = ftell(spool);
+        rewind(spool);
+      }
 
-int cli_used (const char* archive_path) {
-  int status = 0;
+      if (source != stdin) {
+        fclose(source);
+      }
 
-  struct Archive* archive = archive_create();
-  status = archive_initialize_from_file(archive, archive_path);
+      source = spool;
+    }
 
-  uint64_t used_bytes = archive_used_bytes(archive);
+    if (size == -1) {
+      free(structure_path);
 
-  archive_free(archive);
+      if (source != NULL) {
+        fclose(source);
+      }
 
-  switch (status) {
-    case ARCHIVE_NOT_READABLE:
-      printf("Das Archiv ist nicht lesbar");
-      return 2;
-    default:
-      printf("%lu", used_bytes);
-      return 0;
+      return cli_add_status(FILE_NOT_READABLE, args[1], args[2], stdout);
+    }
   }
-}
 
-int cli_list (const char* archive_path) {
-  int status = 0;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strncpy(address.sun_path, socket_path, sizeof(address.sun_path) - 1);
 
-  struct Archive* archive = archive_create();
-  status = archive_initialize_from_file(archive, archive_path);
-  archive_print_list(archive);
-  archive_free(archive);
+  int connection = socket(AF_UNIX, SOCK_STREAM, 0);
+  FILE* in = NULL;
+  FILE* out = NULL;
 
-  switch (status) {
-    case ARCHIVE_NOT_READABLE:
-      printf("Das Archiv ist nicht lesbar");
-      return 2;
-    default:
-      return 0;
+  if (connection != -1 && connect(connection, (struct sockaddr*)&address, sizeof(address)) == 0) {
+    in = fdopen(connection, "r");
+    out = fdopen(dup(connection), "w");
   }
-}
 
-int cli_defrag (const char* archive_path) {
-  int status = 0;
+  int32_t code = 0;
+  uint64_t length = 0;
+  uint64_t size64 = size;
 
-  struct Archive* archive = archive_create();
-  status = archive_initialize_from_file(archive, archive_path);
-  status == 0 && (status = archive_defrag(archive));
-  archive_free(archive);
+  bool success = in != NULL && out != NULL && protocol_write_words(out, words, num_words);
+  success = success && (source == NULL || (fwrite(&size64, sizeof(uint64_t), 1, out) == 1 && protocol_copy(source, out, size)));
+  success = success && fflush(out) == 0 && protocol_read_header(in, &code, &length);
 
-  switch (status) {
-    case ARCHIVE_NOT_WRITEABLE:
-    case ARCHIVE_NOT_READABLE:
-      printf("Das Archiv ist nicht les-/schreibbar");
-      return 2;
-    default:
-      return 0;
-  }
-}
+  if (success && strcmp(command, "get") == 0 && code == 0 && strcmp(args[2], "-") == 0) {
+    success = protocol_copy(in, stdout, length);
 
-void help_create () {
-  printf("USAGE: vfs ARCHIVE create BLOCKSIZE BLOCKCOUNT");
-}
+    if (fflush(stdout) != 0) {
+      code = cli_get_status(FILE_NOT_WRITEABLE, stderr);
+    }
+  } else if (success && strcmp(command, "get") == 0 && code == 0) {
+    FILE* output = fopen(args[2], "w");
 
-void help_add () {
-  printf("USAGE: vfs ARCHIVE add SOURCE TARGET");
-}
+    success = protocol_copy(in, output, length);
+    code = output == NULL ? cli_get_status(FILE_NOT_WRITEABLE, stdout) : code;
 
-void help_get () {
-  printf("USAGE: vfs ARCHIVE get SOURCE OUTPUT");
-}
+    if (output != NULL && fclose(output) != 0) {
+      code = cli_get_status(FILE_NOT_WRITEABLE, stdout);
+    }
+  } else if (success) {
+    bool to_stdout = strcmp(command, "get") == 0 && strcmp(args[2], "-") == 0;
+    success = protocol_copy(in, to_stdout ? stderr : stdout, length);
+  }
 
-void help_del () {
-  printf("USAGE: vfs ARCHIVE del TARGET");
-}
+  if (!success) {
+    printf("Der Server ist nicht erreichbar");
+    code = 2;
+  }
 
-void help_free () {
-  printf("USAGE: vfs ARCHIVE free");
-}
+  free(structure_path);
 
-void help_used () {
-  printf("USAGE: vfs ARCHIVE used");
-}
+  if (source != NULL) {
+    fclose(source);
+  }
 
-void help_list () {
-  printf("USAGE: vfs ARCHIVE list");
-}
+  if (in != NULL) {
+    fclose(in);
+  } else if (connection != -1) {
+    close(connection);
+  }
 
-void help_defrag () {
-  printf("USAGE: vfs ARCHIVE defrag");
-}
+  if (out != NULL) {
+    fclose(out);
+  }
 
-void help () {
-  help_create();
-  help_add();
-  help_get();
-  help_del();
-  help_free();
-  help_used();
-  help_list();
-  help_defrag();
+  return code;
 }
 
 int main (int argc, char** argv) {
@@ -1049,6 +9920,37 @@ int main (int argc, char** argv) {
 
   char* archive_path = argv[1];
   char* command = argv[2];
+  char* socket_path = getenv("VFS_SOCKET");
+
+  /* Befehle, die das Archiv ändern und deshalb die Sperre brauchen; serve hält sie, solange es läuft */
+  const char* writing_commands[] = { "create", "resize", "add", "import", "append", "write-at", "update", "truncate", "del", "defrag", "trim", "batch", "serve" };
+  bool writing = false;
+
+  unsigned int i;
+  for (i = 0; i < sizeof(writing_commands) / sizeof(writing_commands[0]); i++) {
+    writing = writing || strcmp(command, writing_commands[i]) == 0;
+  }
+
+  if (socket_path != NULL && *socket_path != 0) {
+    const char* remote_commands[] = { "add", "get", "del", "list", "free", "used" };
+
+    for (i = 0; i < sizeof(remote_commands) / sizeof(remote_commands[0]); i++) {
+      if (strcmp(command, remote_commands[i]) == 0) {
+        return client_run(socket_path, archive_path, argc - 2, argv + 2);
+      }
+    }
+
+    /* Am Server vorbei darf niemand das Archiv ändern */
+    if (writing && strcmp(command, "serve") != 0) {
+      printf("Mit VFS_SOCKET kann %s nicht ausgeführt werden", command);
+      return 2;
+    }
+  }
+
+  if (writing && !cli_lock_archive(archive_path)) {
+    printf("Das Archiv wird gerade von einem anderen Prozess geändert");
+    return 2;
+  }
 
   if (strcmp(command, "create") == 0) {
     if (argc < 5) {
@@ -1063,8 +9965,46 @@ int main (int argc, char** argv) {
       printf("BLOCKSIZE und BLOCKCOUNT müssen echt positiv sein");
       return 66;
     }
-    
-    return cli_create(archive_path, blocksize, blockcount);
+
+    bool preallocate = false;
+    int compression = COMPRESSION_NONE;
+    bool dedup = false;
+
+    int i;
+    for (i = 5; i < argc; i++) {
+      if (strcmp(argv[i], "--preallocate") == 0) {
+        preallocate = true;
+      } else if (strcmp(argv[i], "--compress") == 0) {
+        compression = COMPRESSION_LZ;
+      } else if (strcmp(argv[i], "--dedup") == 0) {
+        dedup = true;
+      } else {
+        help_create();
+        return 66;
+      }
+    }
+
+    if (compression != COMPRESSION_NONE && dedup) {
+      help_create();
+      return 66;
+    }
+
+    return cli_create(archive_path, blocksize, blockcount, preallocate, compression, dedup);
+  } else if (strcmp(command, "resize") == 0) {
+    if (argc < 4) {
+      help_resize();
+      return 66;
+    }
+
+    long int blockcount = strtol(argv[3], NULL, 10);
+    bool preallocate = argc > 4 && strcmp(argv[4], "--preallocate") == 0;
+
+    if (blockcount <= 0) {
+      printf("BLOCKCOUNT muss echt positiv sein");
+      return 66;
+    }
+
+    return cli_resize(archive_path, blockcount, preallocate);
   } else if (strcmp(command, "add") == 0) {
     if (argc < 5) {
       help_add();
@@ -1078,14 +10018,93 @@ int main (int argc, char** argv) {
       return 66;
     }
 
-    return cli_get(archive_path, argv[3], argv[4]);
+    uint64_t io_size = ARCHIVE_IO_SIZE;
+    uint64_t offset = 0;
+    uint64_t length = UINT64_MAX;
+
+    if (!cli_get_options(argc - 5, argv + 5, &io_size, &offset, &length)) {
+      help_get();
+      return 66;
+    }
+
+    return cli_get(archive_path, argv[3], argv[4], io_size, offset, length);
+  } else if (strcmp(command, "import") == 0) {
+    int num_threads = 4;
+
+    if (argc == 6 && strcmp(argv[4], "--threads") == 0) {
+      num_threads = strtol(argv[5], NULL, 10);
+    } else if (argc != 4) {
+      num_threads = 0;
+    }
+
+    if (num_threads <= 0) {
+      help_import();
+      return 66;
+    }
+
+    return cli_import(archive_path, argv[3], num_threads);
+  } else if (strcmp(command, "extract") == 0) {
+    int num_threads = 4;
+    const char* pattern = NULL;
+    int i = 4;
+
+    while (i + 1 < argc && (strcmp(argv[i], "--threads") == 0 || strcmp(argv[i], "--glob") == 0)) {
+      if (strcmp(argv[i], "--threads") == 0) {
+        num_threads = strtol(argv[i + 1], NULL, 10);
+      } else {
+        pattern = argv[i + 1];
+      }
+
+      i += 2;
+    }
+
+    if (argc < 4 || num_threads <= 0 || (pattern != NULL && i < argc)) {
+      help_extract();
+      return 66;
+    }
+
+    return cli_extract(archive_path, argv[3], (const char**)argv + i, argc - i, pattern, num_threads);
+  } else if (strcmp(command, "append") == 0) {
+    if (argc != 5) {
+      help_append();
+      return 66;
+    }
+
+    return cli_write_at(archive_path, argv[3], 0, true, argv[4]);
+  } else if (strcmp(command, "write-at") == 0) {
+    uint64_t offset;
+
+    if (argc != 6 || !cli_parse_number(argv[4], &offset)) {
+      help_write_at();
+      return 66;
+    }
+
+    return cli_write_at(archive_path, argv[3], offset, false, argv[5]);
+  } else if (strcmp(command, "update") == 0) {
+    if (argc != 5) {
+      help_update();
+      return 66;
+    }
+
+    return cli_update(archive_path, argv[3], argv[4]);
+  } else if (strcmp(command, "truncate") == 0) {
+    uint64_t size;
+
+    if (argc < 5 || argc > 6 || !cli_parse_number(argv[4], &size) || (argc == 6 && strcmp(argv[5], "--punch") != 0)) {
+      help_truncate();
+      return 66;
+    }
+
+    return cli_truncate(archive_path, argv[3], size, argc == 6);
   } else if (strcmp(command, "del") == 0) {
     if (argc < 4) {
       help_del();
       return 66;
     }
 
-    return cli_del(archive_path, argv[3]);
+    bool punch_holes = argc > 4 && strcmp(argv[4], "--punch") == 0;
+
+    return cli_del(archive_path, argv[3], punch_holes);
   } else if (strcmp(command, "free") == 0) {
     return cli_free(archive_path);
   } else if (strcmp(command, "used") == 0) {
@@ -1093,7 +10112,77 @@ int main (int argc, char** argv) {
   } else if (strcmp(command, "list") == 0) {
     return cli_list(archive_path);
   } else if (strcmp(command, "defrag") == 0) {
-    return cli_defrag(archive_path);
+    struct DefragBudget budget = { 0, 0 };
+    bool punch_holes = argc > 3 && strcmp(argv[3], "--punch") == 0;
+    int i = punch_holes ? 4 : 3;
+
+    while (i + 1 < argc && (strcmp(argv[i], "--bytes") == 0 || strcmp(argv[i], "--seconds") == 0)) {
+      char* end = "";
+
+      if (strcmp(argv[i], "--bytes") == 0) {
+        end = cli_parse_number(argv[i + 1], &budget.bytes) ? "" : argv[i + 1];
+      } else {
+        budget.seconds = strtod(argv[i + 1], &end);
+      }
+
+      if (*end != 0 || end == argv[i + 1] || budget.seconds < 0) {
+        help_defrag();
+        return 66;
+      }
+
+      i += 2;
+    }
+
+    return cli_defrag(archive_path, (const char**)argv + i, argc - i, &budget, punch_holes);
+  } else if (strcmp(command, "trim") == 0) {
+    return cli_trim(archive_path);
+  } else if (strcmp(command, "serve") == 0) {
+    int num_threads = 4;
+
+    if (argc == 6 && strcmp(argv[4], "--threads") == 0) {
+      num_threads = strtol(argv[5], NULL, 10);
+    } else if (argc != 4) {
+      num_threads = 0;
+    }
+
+    if (num_threads <= 0) {
+      help_serve();
+      return 66;
+    }
+
+    return cli_serve(archive_path, argv[3], num_threads);
+  } else if (strcmp(command, "batch") == 0) {
+    uint64_t checkpoint = 0;
+    bool punch_holes = argc > 3 && strcmp(argv[3], "--punch") == 0;
+    int i = punch_holes ? 4 : 3;
+
+    if (i + 1 < argc && strcmp(argv[i], "--checkpoint") == 0) {
+      if (!cli_parse_number(argv[i + 1], &checkpoint)) {
+        help_batch();
+        return 66;
+      }
+
+      i += 2;
+    }
+
+    if (i + 1 < argc) {
+      help_batch();
+      return 66;
+    } else if (i < argc && strcmp(argv[i], "-") != 0) {
+      FILE* input = fopen(argv[i], "r");
+
+      if (input == NULL) {
+        printf("Die Datei %s ist nicht lesbar", argv[i]);
+        return 13;
+      }
+
+      int code = cli_batch(archive_path, input, checkpoint, punch_holes);
+      fclose(input);
+
+      return code;
+    } else {
+      return cli_batch(archive_path, stdin, checkpoint, punch_holes);
+    }
   } else {
     printf("Der Befehl ist ungültig");
     help();